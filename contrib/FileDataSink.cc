@@ -104,19 +104,25 @@ void FileDataSink::_writer_thread()
 
     bool run = true;
     int nbytes;
-    buffer.reset( new matrix::GenericBuffer() );
-    // buffer->resize(blocksize);
     
     while (run)
     {
         try
         {
-            data_sink.get(*buffer);
-            nbytes = fwrite(buffer->data(), buffer->size(), 1, fout);
-            if (nbytes != buffer->size())
+            // write the queued buffers where they sit in the sink's
+            // ring buffer; wait up to 100 mS for the first.
+            matrix::GenericBuffer *buf = data_sink.get_ref(100000000);
+
+            while (buf)
             {
-                cout << __PRETTY_FUNCTION__ << " wrote " << nbytes
-                << " needed to write " << buffer->size() << endl;
+                nbytes = fwrite(buf->data(), 1, buf->size(), fout);
+                if (nbytes != buf->size())
+                {
+                    cout << __PRETTY_FUNCTION__ << " wrote " << nbytes
+                    << " needed to write " << buf->size() << endl;
+                }
+                data_sink.release_ref();
+                buf = data_sink.get_ref(0);
             }
         }
         catch (MatrixException e)
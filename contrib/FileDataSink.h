@@ -70,8 +70,6 @@ protected:
     matrix::TCondition<bool> _write_thread_started;
     matrix::TCondition<bool> _run;
 
-    std::unique_ptr<matrix::GenericBuffer> buffer;
-
     size_t blocksize;
     std::string filename;
 
@@ -56,9 +56,9 @@ ExAccumulator::ExAccumulator(string name, string km_url) :
     Component(name, km_url),
     input_signal_sink(km_url),
     output_signal_source(km_url, my_instance_name, "output_signal"),
-    poll_thread(this, &ExAccumulator::poll),
-    poll_thread_started(false),
-    decimate_factor(1)
+    decimate_factor(1),
+    count(0),
+    sum(0.0)
 {
     string looking_for;
     yaml_result yn;
@@ -79,6 +79,8 @@ ExAccumulator::ExAccumulator(string name, string km_url) :
     string key = my_full_instance_name + ".decimate";
     keymaster->subscribe(key, new KeymasterMemberCB<ExAccumulator>(this,
                                   &ExAccumulator::decimate_changed));    
+    // a few additions per sample don't warrant a queue and a thread.
+    input_signal_sink.set_handler([this](const double &d) {accumulate(d);});
 }
 
 /// Disconnect and release resources.
@@ -86,25 +88,19 @@ ExAccumulator::~ExAccumulator()
 {
 }
 
-/// Reads 'decimation_factor samples, averages them, and outputs the average
-/// to a linux fifo. An external application reads and displays the result.
-void ExAccumulator::poll()
+/// Sums 'decimate_factor' samples, and outputs their average to a
+/// source. An external application reads and displays the result.
+void ExAccumulator::accumulate(const double &sample)
 {
-    int ctr = 0;
-    poll_thread_started.signal(true);
-    double avg, sum, sample;
-    int i;
-    while (1)
+    sum += sample;
+
+    if (++count >= decimate_factor)
     {
-        sum = 0.0;
-        for (i=0; i<decimate_factor; ++i)
-        {
-            input_signal_sink.get(sample);
-            sum += sample;
-        }
-        avg = sum/decimate_factor;
+        double avg = sum/count;
         output_signal_source.publish(avg);
-    }        
+        sum = 0.0;
+        count = 0;
+    }
 }
 
 void
@@ -133,21 +129,12 @@ bool
 ExAccumulator::_do_start()
 {
     connect();
-    if (!poll_thread.running())
-    {
-        poll_thread.start();
-    }
-    poll_thread_started.wait(true); // should really wait with timeout...
     return true;
 }
 
 bool
 ExAccumulator::_do_stop()
 {
-    if (poll_thread.running())
-    {
-        poll_thread.stop();
-    }
     disconnect();    
     return true;
 }
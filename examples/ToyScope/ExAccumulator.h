@@ -53,8 +53,8 @@ public:
 protected:    
     ExAccumulator(std::string name, std::string km_url);
 
-    /// Run-state loop 
-    void poll();
+    /// Called for each input sample, on the transport's thread
+    void accumulate(const double &sample);
     
     // override various base class methods
     virtual bool _do_start();
@@ -68,9 +68,9 @@ protected:
     matrix::DataSink<double,matrix::select_only>     input_signal_sink;    
     matrix::DataSource<double>     output_signal_source;
 
-    matrix::Thread<ExAccumulator>       poll_thread;
-    matrix::TCondition<bool>            poll_thread_started;
     int decimate_factor;
+    int count;
+    double sum;
      
     
 };
@@ -118,8 +118,8 @@ void ExFFT::poll()
 {
     int ctr = 0;
     poll_thread_started.signal(true);
-    double data;
-    int i;
+    std::vector<double> datain, dataout;
+    int i, n, j;
     fftw_complex *in, *out;
     fftw_plan p;
     
@@ -130,23 +130,28 @@ void ExFFT::poll()
       
     while (1)
     {
-        // spin until N values have been read
-        for (i=0; i<N; ++i)
+        datain.resize(N);
+        dataout.resize(N);
+        // block until N values have been read, taking as many as are
+        // queued each time
+        for (i=0; i<N; i+=n)
+        {
+            n = input_signal_sink.get_n(&datain[i], N - i);
+        }
+        for (j=0; j<N; ++j)
         {
-            double datain;
-            input_signal_sink.get(datain);
             // should probably generate both I/Q values ...
-            in[i][0] = datain;
-            in[i][1] = 0.0;
+            in[j][0] = datain[j];
+            in[j][1] = 0.0;
         }
         // perform the complex-complex FFT
         fftw_execute(p);
         for (i=0; i<N; ++i)
         {
             // calculate the power:
-            double dataout = out[i][0]*out[i][0] + out[i][1]*out[i][1];
-            output_signal_source.publish(dataout);
+            dataout[i] = out[i][0]*out[i][0] + out[i][1]*out[i][1];
         }
+        output_signal_source.publish_n(dataout.data(), N);
         printf("fftcycle\n");            
     }
     
@@ -36,7 +36,8 @@ void SamplingThread::setData(CurveData *p)
 bool SamplingThread::set_keymaster_url(std::string key)
 {
     keymaster.reset(new Keymaster(key));
-    input_signal_sink.reset(new DataSink<GenericBuffer>(key, 1000));
+    // only the newest sample is ever displayed, so keep just that.
+    input_signal_sink.reset(new DataSink<GenericBuffer, select_specified, latestfifo>(key, 1));
     return true;
 }
 
@@ -154,8 +155,10 @@ void SamplingThread::sink_reader_thread()
         bool found;
         try
         {
-            input_signal_sink->flush(-1);
-            input_signal_sink->get(gbuffer);
+            if (!input_signal_sink->get_latest(gbuffer, 100000000))
+            {
+                continue;
+            }
         } catch (MatrixException &e) {  }
 
         found = false;
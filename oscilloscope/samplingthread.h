@@ -33,7 +33,8 @@ private:
     void sink_reader_thread();
 
     std::unique_ptr<matrix::Keymaster> keymaster;
-    std::unique_ptr<matrix::DataSink<matrix::GenericBuffer> > input_signal_sink;
+    std::unique_ptr<matrix::DataSink<matrix::GenericBuffer, matrix::select_specified,
+                                      matrix::latestfifo> > input_signal_sink;
     std::unique_ptr<matrix::data_description> ddesc;
     matrix::GenericBuffer gbuffer;
     matrix::Thread<SamplingThread> sink_thread;
@@ -25,6 +25,7 @@
 #
 ######################################################################
 
+import copy
 import yaml
 import zmq
 import threading
@@ -34,6 +35,31 @@ import inspect
 import weakref
 from time import sleep
 
+# MessagePack is only needed if the KeymasterServer is configured to
+# publish it ('publication_encoding: msgpack').
+try:
+    import msgpack
+except ImportError:
+    msgpack = None
+
+
+def from_msgpack(buf):
+    """Decodes a value published by the KeymasterServer as MessagePack.
+    The server sends scalars as the strings YAML would hold, so each is
+    loaded as YAML to give it the type it would have had.
+
+    """
+    def scalars(v):
+        if isinstance(v, dict):
+            return dict((scalars(k), scalars(x)) for k, x in v.items())
+        if isinstance(v, list):
+            return [scalars(x) for x in v]
+        if isinstance(v, str):
+            return yaml.load(v)
+        return v
+
+    return scalars(msgpack.unpackb(buf))
+
 
 def gen_random_string(rand_len=10, chars=string.ascii_uppercase +
                       string.ascii_lowercase + string.digits):
@@ -62,6 +88,13 @@ class Keymaster(object):
             # main thread communicates to this thread via ZMQ inproc REQ/REP.
             self.pipe_url = "inproc://" + gen_random_string(20)
             self._callbacks = {}
+            # copies of subscribed subtrees, patched with the changes
+            # published below them.
+            self._subtrees = {}
+            # for each subscription, the version its copy is at (None
+            # if the server gives none), and whether the copy is being
+            # fetched, in which case publications are held back.
+            self._sync = {}
             self.end_thread = False
 
         def __del__(self):
@@ -102,16 +135,55 @@ class Keymaster(object):
                                 if key == "":
                                     key = 'Root'
 
+                                # held back until the subtree comes
+                                # (SUBTREE).
+                                self._subtrees.pop(key, None)
+                                self._sync[key] = {'version': None,
+                                                   'syncing': True,
+                                                   'held': []}
                                 sub_sock.setsockopt(zmq.SUBSCRIBE, key)
                                 pipe.send_pyobj(True, zmq.SNDMORE)
                                 pipe.send_pyobj(key)
 
+                            elif msg == self._keymaster().SUBTREE:
+                                key = pipe.recv_pyobj()
+                                fetched = pipe.recv_pyobj()
+                                tree = pipe.recv_pyobj()
+                                version = pipe.recv_pyobj()
+                                notify = pipe.recv_pyobj()
+                                state = self._sync.get(key)
+
+                                # unless unsubscribed meanwhile. If it
+                                # could not be fetched, the copy stays
+                                # as it was.
+                                if state and state['syncing']:
+                                    if fetched:
+                                        self._subtrees.pop(key, None)
+
+                                        if isinstance(tree, dict):
+                                            self._subtrees[key] = tree
+
+                                        state['version'] = version
+
+                                        if notify and key in self._callbacks:
+                                            self._callbacks[key](key, copy.deepcopy(tree))
+
+                                    state['syncing'] = False
+                                    held, state['held'] = state['held'], []
+
+                                    for pub in held:
+                                        self._deliver(key, pub)
+
+                                pipe.send_pyobj(True)
+
                             elif msg == self._keymaster().UNSUBSCRIBE:
                                 key = pipe.recv_pyobj()
 
                                 if key in self._callbacks:
                                     sub_sock.setsockopt(zmq.UNSUBSCRIBE, key)
                                     self._callbacks.pop(key)
+                                    self._subtrees.pop(key, None)
+                                    self._sync.pop(key, None)
                                     pipe.send_pyobj(True, zmq.SNDMORE)
                                     pipe.send_pyobj("'%s' unsubscribed." % key)
                                 else:
@@ -126,6 +198,8 @@ class Keymaster(object):
                                     sub_sock.setsockopt(zmq.UNSUBSCRIBE, key)
 
                                 self._callbacks.clear()
+                                self._subtrees.clear()
+                                self._sync.clear()
                                 pipe.send_pyobj(True, zmq.SNDMORE)
                                 pipe.send_pyobj('Keys cleared: %s' %
                                                 ', '.join(keys_cleared))
@@ -142,10 +216,33 @@ class Keymaster(object):
                             key = msg[0]
 
                             if len(msg) > 1:
-                                if key in self._callbacks:
+                                deleted = len(msg) > 2 and msg[2] == 'DEL'
+
+                                if deleted:
+                                    n = None
+                                elif len(msg) > 3 and msg[3] == 'msgpack':
+                                    if msgpack is None:
+                                        # can't decode it without
+                                        # the msgpack module.
+                                        continue
+
+                                    n = from_msgpack(msg[1])
+                                else:
                                     n = yaml.load(msg[1])
-                                    mci = self._callbacks[key]
-                                    mci(key, n)
+
+                                versions = [int(v) for v in msg[4].split()] \
+                                    if len(msg) > 4 else []
+                                pub = (key, n, deleted, versions)
+                                # The server publishes only the key
+                                # that changed; any subscribed
+                                # ancestor gets its updated subtree.
+                                parts = key.split('.')
+
+                                for i in range(len(parts), 0, -1):
+                                    sub = '.'.join(parts[:i])
+
+                                    if sub in self._callbacks and sub in self._sync:
+                                        self._deliver(sub, pub)
                 pipe.close()
                 sub_sock.close()
 
@@ -158,12 +255,103 @@ class Keymaster(object):
             finally:
                 print "Keymaster: Ending subscriber thread."
 
+        def _deliver(self, sub, pub):
+            """Hands a publication, (key, value, deleted, versions), to
+            the subscription 'sub'. With versions, a change the copy of
+            the subtree already has is dropped, and one that does not
+            follow from it, because some change in between was missed,
+            has the subtree fetched again; publications are held back
+            meanwhile. The versions are the change's, then those of
+            the nodes on its path before it, from the root down.
+
+            """
+            key, n, deleted, versions = pub
+            state = self._sync[sub]
+
+            if state['syncing']:
+                state['held'].append(pub)
+                return
+
+            if state['version'] is not None and versions:
+                if versions[0] <= state['version']:
+                    return
+
+                at = sub.count('.') + 2
+
+                if sub != key and (at >= len(versions) or versions[at] != state['version']):
+                    state['syncing'] = True
+                    state['held'].append(pub)
+                    self._resync(sub)
+                    return
+
+                state['version'] = versions[0]
+
+            if sub == key:
+                self._subtrees.pop(sub, None)
+
+                if isinstance(n, dict):
+                    self._subtrees[sub] = copy.deepcopy(n)
+
+                if not deleted:
+                    self._callbacks[sub](sub, n)
+            else:
+                path = key.split('.')[sub.count('.') + 1:]
+                tree = self._patch(sub, path, n, deleted)
+                self._callbacks[sub](sub, copy.deepcopy(tree))
+
+        def _patch(self, sub, path, val, deleted):
+            """Applies a change at 'path' below the subscribed key 'sub'
+            to the copy of its subtree, and returns the copy. The
+            copy comes from Keymaster._sync_subtree(), so this thread
+            makes no requests of the server. A key that had no subtree
+            then starts out empty.
+
+            """
+            tree = self._subtrees.setdefault(sub, {})
+            node = tree
+
+            for k in path[:-1]:
+                if not isinstance(node.get(k), dict):
+                    node[k] = {}
+                node = node[k]
+
+            if deleted:
+                node.pop(path[-1], None)
+            else:
+                node[path[-1]] = copy.deepcopy(val)
+
+            return tree
+
+        def _resync(self, sub):
+            """Fetches the subtree at 'sub' again, on a thread and a
+            socket of its own, as this thread makes no requests of the
+            server.
+
+            """
+            def fetch():
+                keymaster = self._keymaster()
+
+                if keymaster:
+                    km = keymaster._ctx.socket(zmq.REQ)
+                    km.connect(keymaster._km_url)
+
+                    try:
+                        keymaster._sync_subtree(sub, True, km)
+                    finally:
+                        km.setsockopt(zmq.LINGER, 0)
+                        km.close()
+
+            t = threading.Thread(target=fetch)
+            t.daemon = True
+            t.start()
+
     def __init__(self, url, ctx=None):
         self.SUBSCRIBE = 10
         self.UNSUBSCRIBE = 11
         self.UNSUBSCRIBE_ALL = 12
         self.QUIT = 13
         self.PING = 14
+        self.SUBTREE = 15
         self._km_url = url
         self._km = None
         self._sub_task = None
@@ -202,17 +390,54 @@ class Keymaster(object):
             self._km.connect(self._km_url)
         return self._km
 
-    def _call_keymaster(self, cmd, key, val=None, flag=None):
-        """atomically calls the keymaster."""
-        km = self._keymaster_socket()
+    def _call_keymaster(self, cmd, key, val=None, flag=None, km=None):
+        """atomically calls the keymaster, on socket 'km' if given."""
+        km = km or self._keymaster_socket()
         parts = [p for p in [cmd, key, val, flag] if p]
         km.send_multipart(parts)
 
         if km.poll(5000):
-            response = km.recv()
-            return yaml.load(response)
+            response = yaml.load(km.recv())
+
+            if isinstance(response, dict):
+                return response
+            # not a result: a request the server does not know.
+            return {'key': key, 'result': False, 'err': response, 'node': {}}
         return {'key': key, 'result': False, 'err': 'Time-out when talking to Keymaster.', 'node': {}}
 
+    def _sync_subtree(self, key, notify, km=None):
+        """Fetches the subscribed subtree at 'key', with the version it
+        is at, and hands it to the subscriber thread, which applies to
+        it the publications it held back meanwhile. A server that gives
+        no versions is asked for the subtree alone. If 'notify', the
+        key's callback is given the subtree.
+
+        """
+        fetched, tree, version = False, None, None
+        reply = self._call_keymaster('SNAPSHOT', key, km=km)
+
+        if reply['result']:
+            fetched = True
+            tree = reply['node']['node']
+            version = reply['node']['version']
+        else:
+            reply = self._call_keymaster('GET', key, km=km)
+
+            if reply['result']:
+                fetched = True
+                tree = reply['node']
+
+        pipe = self._ctx.socket(zmq.REQ)
+        pipe.connect(self._sub_task.pipe_url)
+        pipe.send_pyobj(self.SUBTREE, zmq.SNDMORE)
+        pipe.send_pyobj(key, zmq.SNDMORE)
+        pipe.send_pyobj(fetched, zmq.SNDMORE)
+        pipe.send_pyobj(tree, zmq.SNDMORE)
+        pipe.send_pyobj(version, zmq.SNDMORE)
+        pipe.send_pyobj(notify)
+        pipe.recv_pyobj()
+        pipe.close()
+
     def get(self, key):
         """Fetches a yaml node at 'key' from the Keymaster"""
         reply = self._call_keymaster('GET', key)
@@ -226,6 +451,17 @@ class Keymaster(object):
         """Puts a value at 'key' on the Keymaster"""
         return self._call_keymaster('PUT', key, yaml.dump(value), "create" if create else "")['result']
 
+    def put_many(self, batch, create=False):
+        """Puts several values on the Keymaster at once, as one
+        transaction: all are put, or none is. 'batch' is a dict of
+        keychains to values; make it an OrderedDict if the order in
+        which they are put and published matters."""
+        # yaml.dump() would sort the keys; dump the entries one at a
+        # time to keep them in order.
+        val = ''.join(yaml.dump({k: v}, default_flow_style=False)
+                      for k, v in batch.items())
+        return self._call_keymaster('PUT_MANY', 'Root', val, "create" if create else "")['result']
+
     def delete(self, key):
         """Deletes a key from the Keymaster"""
         return self._call_keymaster('DEL', key)
@@ -277,6 +513,12 @@ class Keymaster(object):
 
         rval = pipe.recv_pyobj()
         msg = pipe.recv_pyobj()
+        pipe.close()
+        # Only now is the subtree the subscriber thread applies changes
+        # to fetched, so that no change made after the fetch can be
+        # missed. One made before it, but published after, is dropped
+        # by version; see subscriber_task._deliver().
+        self._sync_subtree(msg, False)
         return (rval, msg)
 
     def unsubscribe(self, key):
@@ -235,9 +235,6 @@ int main(int argc, char **argv)
 
     int nrows = 0;
 
-    GenericBuffer gbuffer;
-    gbuffer.resize(log->log_datasize());
-
     Time::Time_t last_stamp = Time::getUTC();
 
     while (1)
@@ -251,11 +248,14 @@ int main(int argc, char **argv)
 
         if (now - last_stamp < time_out * 5)
         {
-            if (sink.timed_get(gbuffer, time_out))
+            GenericBuffer *gbuffer = sink.get_ref(time_out);
+
+            if (gbuffer)
             {
                 // cout << "got data" << endl;
                 last_stamp = Time::getUTC();
-                log->log_data(gbuffer);
+                log->log_data(*gbuffer);
+                sink.release_ref();
 
                 if (++nrows > max_rows_per_file)
                 {
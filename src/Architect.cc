@@ -201,8 +201,10 @@ namespace matrix
                 components[comp_instance_name].active = true;
                 l.unlock();
                 // component will now be listening to these...
-                keymaster->put(root + comp_instance_name + ".command", "do_init");
-                keymaster->put(root + comp_instance_name + ".mode", "default");
+                YAML::Node batch;
+                batch[root + comp_instance_name + ".command"] = "do_init";
+                batch[root + comp_instance_name + ".mode"] = "default";
+                keymaster->put_many(batch);
             }
         }
         return true;
@@ -273,17 +275,23 @@ namespace matrix
             return false;
         }
         current_mode = mode;
-        // disable all components for mode change
+        // disable all components for mode change, in one request.
         string root = "components.";
+        YAML::Node disable;
         ThreadLock<ComponentMap> l(components);
         l.lock();
         for (auto p = components.begin(); p != components.end(); ++p)
         {
             p->second.active = false;
-            keymaster->put(root + p->first + ".active", false);
+            disable[root + p->first + ".active"] = false;
         }
         l.unlock();
 
+        if (disable.IsMap())
+        {
+            keymaster->put_many(disable);
+        }
+
         auto modeset = active_mode_components.find(mode);
         if (modeset == active_mode_components.end())
         {
@@ -294,15 +302,22 @@ namespace matrix
 
         auto active_components = modeset->second;
         // All components are in Standby, so we just need to set/reset active flag
+        YAML::Node enable;
         l.lock();
         for (auto p = components.begin(); p != components.end(); ++p)
         {
             bool active = active_components.find(p->first) != active_components.end();
             p->second.active = active;
-            keymaster->put(root + p->first + ".active", active);
-            keymaster->put(root + p->first + ".mode", mode);
+            enable[root + p->first + ".active"] = active;
+            enable[root + p->first + ".mode"] = mode;
             result = true;
         }
+        l.unlock();
+
+        if (result)
+        {
+            keymaster->put_many(enable);
+        }
 
         return result;
     }
@@ -167,7 +167,10 @@ namespace matrix
  *
  * This function is given the urn for the keymaster, and a transport
  * key. Using this key it obtains the transport information, which is
- * then used to create the correct TransportServer object for that transport.
+ * then used to create the correct TransportServer object for that
+ * transport. The entries of the transport's 'Specified' list may be
+ * transport names ("tcp", "shm") or URNs ("udpm://eth0;239.192.0.1:XXXXX");
+ * the part before the first ':' selects the factory.
  *
  * @param km_urn: the URN for the keymaster
  *
@@ -201,9 +204,14 @@ namespace matrix
 
         for (i = transports.begin(); i != transports.end(); ++i)
         {
-            if (factories.find(*i) != factories.end())
+            // A transport may be given by name ("udpm") or as a full
+            // URN ("udpm://eth0;239.192.0.1:XXXXX"); either way the
+            // factory is found by the scheme.
+            string scheme = i->substr(0, i->find(':'));
+
+            if (factories.find(scheme) != factories.end())
             {
-                facts.push_back(factories[*i]);
+                facts.push_back(factories[scheme]);
             }
         }
 
@@ -222,12 +230,22 @@ namespace matrix
 
         factory_sig fn = facts.front();
         shared_ptr<TransportServer> ret_val(fn(km_urn, transport_key));
+        mxutils::yaml_result yr;
+
+        if (km.get(transport_key + ".Header", yr))
+        {
+            ret_val->_headers = yr.node.as<bool>();
+        }
+
         return ret_val;
     }
 
     TransportServer::TransportServer(string keymaster_url, string key)
         : _km_url(keymaster_url),
-          _transport_key(key)
+          _transport_key(key),
+          _policy(DROP_OLDEST),
+          _block_timeout(0),
+          _headers(false)
     {
     }
 
@@ -269,6 +287,210 @@ namespace matrix
         return false;
     }
 
+/**
+ * Resolves a data key to a channel. This default keeps one plain
+ * Channel per key, for transports that publish by key only.
+ *
+ * @param key: The data key, "component.data"
+ *
+ * @return The channel, valid for the life of this TransportServer.
+ *
+ */
+
+    TransportServer::channel_t TransportServer::_resolve(string key)
+    {
+        ThreadLock<Mutex> l(_channels_mutex);
+
+        l.lock();
+        unique_ptr<Channel> &ch = _channels[key];
+
+        if (!ch)
+        {
+            ch.reset(new Channel(key));
+        }
+
+        return ch.get();
+    }
+
+/**
+ * Publishes on a resolved channel. This default forwards to the key
+ * based '_publish()'.
+ *
+ */
+
+    bool TransportServer::_publish(channel_t ch, const void *data, size_t size_of_data)
+    {
+        return _publish(ch->key, data, size_of_data);
+    }
+
+/**
+ * Publishes 'n' samples of 'size_of_data' bytes each, packed one
+ * after the other in 'data'. This default publishes them one at a
+ * time; transports that can move a batch at once override it.
+ *
+ * @param ch: The channel to publish on.
+ *
+ * @param data: The first sample.
+ *
+ * @param size_of_data: The size of each sample.
+ *
+ * @param n: The number of samples.
+ *
+ * @return true if all were published, false otherwise.
+ *
+ */
+
+    bool TransportServer::_publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n)
+    {
+        bool rval = true;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            rval = _publish(ch, (const char *)data + i * size_of_data, size_of_data) && rval;
+        }
+
+        return rval;
+    }
+
+/**
+ * Lends the caller a buffer of 'size' bytes to fill in place and
+ * then publish with '_commit()'. This default lends the channel's own
+ * buffer, which saves the caller a copy but not the transport.
+ *
+ * @param ch: The channel the sample will be published on.
+ *
+ * @param size: The size of the buffer needed.
+ *
+ * @return A pointer to the buffer, or NULL if none is available.
+ *
+ */
+
+    void *TransportServer::_loan(channel_t ch, size_t size)
+    {
+        ch->loaned.resize(size);
+        return ch->loaned.data();
+    }
+
+/**
+ * Publishes the buffer obtained by '_loan()'.
+ *
+ * @param ch: The channel the buffer was loaned on.
+ *
+ * @param size: The number of bytes, from the start of the buffer, to
+ * publish. May be less than was loaned.
+ *
+ * @return true if the publish succeeded, false otherwise.
+ *
+ */
+
+    bool TransportServer::_commit(channel_t ch, size_t size)
+    {
+        return _publish(ch, ch->loaned.data(), min(size, ch->loaned.size()));
+    }
+
+/**
+ * Publishes 'n' samples, each with a 'sample_header' in front of
+ * it. The headers and samples are gathered into one buffer (per
+ * thread, and reused), which the transport then publishes as 'n'
+ * samples of 'size_of_data' plus the header's size.
+ *
+ * @param ch: The channel to publish on.
+ *
+ * @param data: The first sample.
+ *
+ * @param size_of_data: The size of each sample.
+ *
+ * @param n: The number of samples.
+ *
+ * @return true if all were published, false otherwise.
+ *
+ */
+
+    bool TransportServer::_publish_with_headers(channel_t ch, const void *data,
+                                                size_t size_of_data, size_t n)
+    {
+        static thread_local vector<unsigned char> framed;
+        size_t stride = sizeof(sample_header) + size_of_data;
+        sample_header h;
+
+        h.seq = ch->header_seq.fetch_add(n);
+        h.published = Time::getUTC();
+        framed.resize(stride * n);
+
+        for (size_t i = 0; i < n; ++i, ++h.seq)
+        {
+            memcpy(framed.data() + i * stride, &h, sizeof h);
+            memcpy(framed.data() + i * stride + sizeof h,
+                   (const char *)data + i * size_of_data, size_of_data);
+        }
+
+        if (n == 1)
+        {
+            return _publish(ch, framed.data(), stride);
+        }
+
+        return _publish_n(ch, framed.data(), stride, n);
+    }
+
+/**
+ * Reports the state of each subscriber. The default is a transport
+ * that can't see its subscribers' queues, and reports none.
+ *
+ * @return A vector of subscriber_stats, one per subscriber.
+ *
+ */
+
+    vector<TransportServer::subscriber_stats> TransportServer::_subscribers()
+    {
+        return vector<subscriber_stats>();
+    }
+
+/**
+ * Reads the transport's optional 'Backpressure' node, setting
+ * '_policy' and '_block_timeout'. Meant to be called by the
+ * constructors of transports that honor a policy.
+ *
+ * @param km: A Keymaster client.
+ *
+ */
+
+    void TransportServer::_configure_backpressure(Keymaster &km)
+    {
+        mxutils::yaml_result yr;
+
+        if (!km.get(_transport_key + ".Backpressure", yr))
+        {
+            return;
+        }
+
+        if (yr.node["Policy"])
+        {
+            string policy = yr.node["Policy"].as<string>();
+
+            if (policy == "drop_oldest")
+            {
+                _policy = DROP_OLDEST;
+            }
+            else if (policy == "drop_newest")
+            {
+                _policy = DROP_NEWEST;
+            }
+            else if (policy == "block")
+            {
+                _policy = BLOCK;
+            }
+            else
+            {
+                throw CreationError("unknown Backpressure policy '" + policy + "'");
+            }
+        }
+
+        if (yr.node["Timeout"])
+        {
+            _block_timeout = (Time::Time_t)(yr.node["Timeout"].as<double>() * Time::TM_ONE_SEC);
+        }
+    }
+
 /**********************************************************************
  * Transport Client
  **********************************************************************/
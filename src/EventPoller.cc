@@ -0,0 +1,505 @@
+/*******************************************************************
+ *  EventPoller.cc - An epoll/eventfd based poller that reports which
+ *  DataSinks, Keymaster keys and file descriptors are ready.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/EventPoller.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+
+using namespace std;
+
+namespace matrix
+{
+    namespace
+    {
+        // Owns an eventfd. Shared between the poller and the notifier
+        // or callback that writes it, so that the descriptor outlives
+        // a write racing with EventPoller::remove().
+        struct event_fd
+        {
+            event_fd()
+                : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+            {
+                if (fd == -1)
+                {
+                    throw MatrixException("EventPoller", string("eventfd: ") + strerror(errno));
+                }
+            }
+
+            ~event_fd()
+            {
+                close(fd);
+            }
+
+            void post()
+            {
+                uint64_t one = 1;
+                ssize_t rval = ::write(fd, &one, sizeof one);
+                (void)rval;
+            }
+
+            void clear()
+            {
+                uint64_t count;
+                ssize_t rval = ::read(fd, &count, sizeof count);
+                (void)rval;
+            }
+
+            int fd;
+        };
+
+        // Installed as a DataSink's fifo notifier. 'armed' is cleared by
+        // the first put after the poller last looked at the sink, so
+        // only that put pays for the write().
+        struct sink_notifier : public matrix::fifo_notifier
+        {
+            sink_notifier(shared_ptr<event_fd> e)
+                : efd(e),
+                  armed(true)
+            {
+            }
+
+            void _call(int n)
+            {
+                if (n > 0 && armed.exchange(false))
+                {
+                    efd->post();
+                }
+            }
+
+            shared_ptr<event_fd> efd;
+            std::atomic<bool> armed;
+        };
+
+        // Subscribed to a Keymaster key. Keeps the last value published.
+        struct km_callback : public matrix::KeymasterCallbackBase
+        {
+            km_callback(shared_ptr<event_fd> e)
+                : efd(e)
+            {
+            }
+
+            YAML::Node value()
+            {
+                ThreadLock<Mutex> l(lock);
+                l.lock();
+                return YAML::Clone(last);
+            }
+
+            void _call(string /* key */, YAML::Node val)
+            {
+                ThreadLock<Mutex> l(lock);
+                l.lock();
+                last = val;
+                l.unlock();
+                efd->post();
+            }
+
+            shared_ptr<event_fd> efd;
+            Mutex lock;
+            YAML::Node last;
+        };
+    }
+
+    struct EventPoller::Impl
+    {
+        enum kind
+        {
+            SINK,
+            KEY,
+            FD
+        };
+
+        struct source
+        {
+            kind k;
+            trigger t;
+            int fd;
+            matrix::DataSinkBase *ds;
+            shared_ptr<sink_notifier> notifier;
+            matrix::Keymaster *km;
+            string key;
+            unique_ptr<km_callback> cb;
+            shared_ptr<event_fd> efd;
+        };
+
+        Impl();
+        ~Impl();
+
+        int add(source *s, int fd, uint32_t events);
+        bool is_ready(source &s, uint32_t events);
+        size_t collect(vector<int> &ready, int timeout_ms);
+
+        int epfd;
+        int next_token;
+        map<int, unique_ptr<source> > sources;
+        // LEVEL sinks returned by the last wait(). They are the only
+        // ones that may still hold data without a pending event.
+        vector<int> pending;
+        vector<epoll_event> events;
+    };
+
+    EventPoller::Impl::Impl()
+        : epfd(epoll_create1(EPOLL_CLOEXEC)),
+          next_token(0),
+          events(16)
+    {
+        if (epfd == -1)
+        {
+            throw MatrixException("EventPoller", string("epoll_create1: ") + strerror(errno));
+        }
+    }
+
+    EventPoller::Impl::~Impl()
+    {
+        close(epfd);
+    }
+
+    int EventPoller::Impl::add(source *s, int fd, uint32_t ev)
+    {
+        unique_ptr<source> src(s);
+        int token = next_token++;
+        epoll_event e;
+
+        memset(&e, 0, sizeof e);
+        e.events = ev;
+        e.data.u32 = token;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) == -1)
+        {
+            throw MatrixException("EventPoller", string("epoll_ctl: ") + strerror(errno));
+        }
+
+        src->fd = fd;
+        sources[token] = std::move(src);
+
+        if (events.size() < sources.size())
+        {
+            events.resize(sources.size());
+        }
+
+        return token;
+    }
+
+    // Consumes the event for 's' and decides whether it is ready. The
+    // sink's notifier is re-armed before its items are looked at, so a
+    // put that lands in between is never missed: it either shows up in
+    // items() or posts the eventfd again.
+    bool EventPoller::Impl::is_ready(source &s, uint32_t ev)
+    {
+        switch (s.k)
+        {
+        case SINK:
+            s.efd->clear();
+            s.notifier->armed.store(true);
+            return s.t == EDGE || s.ds->items() > 0;
+        case KEY:
+            s.efd->clear();
+            return true;
+        case FD:
+        default:
+            return ev != 0;
+        }
+    }
+
+    size_t EventPoller::Impl::collect(vector<int> &ready, int timeout_ms)
+    {
+        int n = epoll_wait(epfd, events.data(), events.size(), timeout_ms);
+
+        for (int i = 0; i < n; ++i)
+        {
+            int token = events[i].data.u32;
+            auto s = sources.find(token);
+
+            if (s != sources.end() && is_ready(*s->second, events[i].events))
+            {
+                if (find(ready.begin(), ready.end(), token) == ready.end())
+                {
+                    ready.push_back(token);
+                }
+            }
+        }
+
+        return ready.size();
+    }
+
+/**
+ * Constructor. Creates the epoll instance.
+ *
+ */
+
+    EventPoller::EventPoller()
+        : _impl(new Impl())
+    {
+    }
+
+/**
+ * Destructor. Detaches from all the sources that are still registered.
+ *
+ */
+
+    EventPoller::~EventPoller()
+    {
+        while (!_impl->sources.empty())
+        {
+            remove(_impl->sources.begin()->first);
+        }
+    }
+
+/**
+ * Adds a DataSink to the poller. The DataSink is added by address as
+ * each DataSink may be of a different type, but may be referenced via
+ * a DataSinkBase pointer.
+ *
+ * @param ds: Address of the DataSink.
+ * @param t: LEVEL to have the sink reported for as long as it has
+ * data, EDGE to have it reported once per arrival of new data.
+ *
+ * @return The token that 'wait()' will report for this DataSink.
+ *
+ */
+
+    int EventPoller::add(matrix::DataSinkBase *ds, trigger t)
+    {
+        Impl::source *s = new Impl::source();
+        s->k = Impl::SINK;
+        s->t = t;
+        s->ds = ds;
+        s->km = nullptr;
+        s->efd.reset(new event_fd());
+        s->notifier.reset(new sink_notifier(s->efd));
+        int token = _impl->add(s, s->efd->fd, EPOLLIN);
+        ds->set_notifier(s->notifier);
+
+        // Data put before the notifier was installed posted nothing.
+        if (ds->items() > 0)
+        {
+            s->notifier->armed.store(false);
+            s->efd->post();
+        }
+
+        return token;
+    }
+
+/**
+ * Subscribes to a Keymaster key. Each value published for the key
+ * makes it ready once; the last value is kept and may be read with
+ * 'keymaster_value()'.
+ *
+ * @param km: The Keymaster client to subscribe through.
+ * @param key: The key to subscribe to.
+ *
+ * @return The token that 'wait()' will report for this key.
+ *
+ */
+
+    int EventPoller::add(matrix::Keymaster *km, std::string key)
+    {
+        Impl::source *s = new Impl::source();
+        s->k = Impl::KEY;
+        s->t = EDGE;
+        s->ds = nullptr;
+        s->km = km;
+        s->key = key;
+        s->efd.reset(new event_fd());
+        s->cb.reset(new km_callback(s->efd));
+        km_callback *cb = s->cb.get();
+        int token = _impl->add(s, s->efd->fd, EPOLLIN);
+
+        if (!km->subscribe(key, cb))
+        {
+            remove(token);
+            throw MatrixException("EventPoller", "could not subscribe to " + key);
+        }
+
+        return token;
+    }
+
+/**
+ * Adds an arbitrary file descriptor. The poller does not take
+ * ownership of it, and does not read it: with LEVEL a readable
+ * descriptor keeps being reported until the caller drains it.
+ *
+ * @param fd: The file descriptor.
+ * @param events: The epoll events of interest, EPOLLIN by default.
+ * @param t: LEVEL or EDGE (EPOLLET).
+ *
+ * @return The token that 'wait()' will report for this descriptor.
+ *
+ */
+
+    int EventPoller::add_fd(int fd, uint32_t events, trigger t)
+    {
+        Impl::source *s = new Impl::source();
+        s->k = Impl::FD;
+        s->t = t;
+        s->ds = nullptr;
+        s->km = nullptr;
+        return _impl->add(s, fd, t == EDGE ? events | EPOLLET : events);
+    }
+
+/**
+ * Removes a source. A DataSink gets a default (do-nothing) notifier
+ * back, and a Keymaster key is unsubscribed.
+ *
+ * @param token: The token returned when the source was added.
+ *
+ * @return true if the token was found, false otherwise.
+ *
+ */
+
+    bool EventPoller::remove(int token)
+    {
+        auto i = _impl->sources.find(token);
+
+        if (i == _impl->sources.end())
+        {
+            return false;
+        }
+
+        Impl::source &s = *i->second;
+        epoll_ctl(_impl->epfd, EPOLL_CTL_DEL, s.fd, nullptr);
+
+        if (s.k == Impl::SINK)
+        {
+            s.ds->set_notifier(shared_ptr<fifo_notifier>(new fifo_notifier()));
+        }
+        else if (s.k == Impl::KEY)
+        {
+            try
+            {
+                s.km->unsubscribe(s.key);
+            }
+            catch (KeymasterException &e)
+            {
+                // The Keymaster may already be gone.
+            }
+        }
+
+        auto &p = _impl->pending;
+        p.erase(std::remove(p.begin(), p.end(), token), p.end());
+        _impl->sources.erase(i);
+        return true;
+    }
+
+/**
+ * Blocks for `usecs` microseconds or until at least one source is
+ * ready, and reports all those that are. Only the sources that have
+ * signalled, and the LEVEL DataSinks reported last time, are looked
+ * at. A wakeup that yields nothing ready (another thread drained the
+ * sink first, say) waits again, for the time remaining only.
+ *
+ * @param ready: Cleared, then filled with the tokens of the ready
+ * sources.
+ * @param usecs: the time to wait, in microseconds. 0 returns at once,
+ * a negative value waits indefinitely.
+ *
+ * @return The number of ready sources; 0 on time-out.
+ *
+ */
+
+    size_t EventPoller::wait(std::vector<int> &ready, int usecs)
+    {
+        Time::Time_t time_to_quit = Time::getUTC() + ((Time::Time_t)usecs) * 1000L;
+        ready.clear();
+
+        // LEVEL sinks that were ready last time and still have data.
+        // They have no event pending, having been consumed already.
+        for (auto token : _impl->pending)
+        {
+            auto s = _impl->sources.find(token);
+
+            if (s != _impl->sources.end() && s->second->ds->items() > 0)
+            {
+                ready.push_back(token);
+            }
+        }
+
+        int timeout_ms = ready.empty() ? (usecs < 0 ? -1 : (usecs + 999) / 1000) : 0;
+
+        while (_impl->collect(ready, timeout_ms) == 0)
+        {
+            if (usecs < 0)
+            {
+                continue;
+            }
+
+            int64_t left = static_cast<int64_t>(time_to_quit - Time::getUTC());
+
+            if (left <= 0)
+            {
+                break;
+            }
+
+            // round up, or the last sub-millisecond would spin.
+            timeout_ms = (left + 999999) / 1000000;
+        }
+
+        _impl->pending.clear();
+
+        for (auto token : ready)
+        {
+            Impl::source &s = *_impl->sources[token];
+
+            if (s.k == Impl::SINK && s.t == LEVEL)
+            {
+                _impl->pending.push_back(token);
+            }
+        }
+
+        return ready.size();
+    }
+
+/**
+ * Returns the last value published for a Keymaster key added with
+ * 'add(km, key)'.
+ *
+ * @param token: The token returned when the key was added.
+ *
+ * @return The last value received, or a null node if none has been
+ * received yet or the token is not that of a Keymaster key.
+ *
+ */
+
+    YAML::Node EventPoller::keymaster_value(int token)
+    {
+        auto s = _impl->sources.find(token);
+
+        if (s == _impl->sources.end() || s->second->k != Impl::KEY)
+        {
+            return YAML::Node();
+        }
+
+        return s->second->cb->value();
+    }
+}
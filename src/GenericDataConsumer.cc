@@ -80,7 +80,6 @@ namespace matrix
     {
         bool run(true);
         Keymaster km(keymaster_url);
-        GenericBuffer data;
         YAML::Node dd;
 
         try
@@ -97,13 +96,18 @@ namespace matrix
 
         while (run)
         {
-            // try to get with a time-out of 5 mS
-            if (_sink.timed_get(data, 5000000))
+            // try to get with a time-out of 5 mS. The buffer is
+            // handled where it sits in the sink's ring buffer.
+            GenericBuffer *data = _sink.get_ref(5000000);
+
+            if (data)
             {
                 if (_handler)
                 {
-                    _handler->exec(dd, data);
+                    _handler->exec(dd, *data);
                 }
+
+                _sink.release_ref();
             }
 
             // continue until _run is false and no heaps were read.
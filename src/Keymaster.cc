@@ -35,6 +35,8 @@
 #include "matrix/netUtils.h"
 #include "matrix/matrix_util.h"
 #include "matrix/yaml_util.h"
+#include "matrix/yaml_msgpack.h"
+#include "matrix/km_tree.h"
 #include "matrix/Time.h"
 #include "matrix/ResourceLock.h"
 
@@ -42,12 +44,14 @@
 #include <cstring>
 #include <sstream>
 #include <map>
+#include <deque>
 #include <vector>
 #include <list>
 #include <iostream>
 #include <sstream>
 #include <exception>
 #include <algorithm>
+#include <atomic>
 #include <memory>
 
 #include <stdlib.h>
@@ -66,6 +70,7 @@ using namespace matrix;
 #define SUBSCRIBE   1
 #define UNSUBSCRIBE 2
 #define QUIT        3
+#define SUBTREE     4
 #define KM_TIMEOUT  5000
 
 struct substring_p
@@ -105,6 +110,177 @@ struct same_transport_p
     string _transport;
 };
 
+/**
+ * Encodes a result from the store as a reply to a Keymaster request:
+ * as MessagePack if the request was, otherwise as YAML text.
+ *
+ */
+
+static string encode_result(const km_tree::result &r, bool binary)
+{
+    if (binary)
+    {
+        yaml_result yr(r.result, YAML::Node(), r.key, r.err);
+        return to_msgpack(yr, km_tree::to_msgpack(r.node));
+    }
+
+    ostringstream rval;
+    rval << r.to_yaml_result();
+    return rval.str();
+}
+
+/**
+ * Receives all the frames of a message, envelope included, as they
+ * are, so that they may be passed on.
+ *
+ */
+
+static void recv_frames(zmq::socket_t &sock, vector<zmq::message_t> &frames)
+{
+    int more = 1;
+    size_t more_size = sizeof(more);
+
+    frames.clear();
+
+    while (more)
+    {
+        frames.emplace_back();
+        sock.recv(&frames.back());
+        sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+    }
+}
+
+/**
+ * Sends frames received by 'recv_frames()'.
+ *
+ */
+
+static void send_frames(zmq::socket_t &sock, vector<zmq::message_t> &frames)
+{
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        sock.send(frames[i], i + 1 < frames.size() ? ZMQ_SNDMORE : 0);
+    }
+}
+
+/**
+ * Tells whether a request, as received on the ROUTER socket, reads
+ * the store or may change it. The command follows the envelope, which
+ * ends with an empty frame.
+ *
+ * @return true for anything other than a GET, a SNAPSHOT or a ping,
+ * so that requests the server does not know are answered by the
+ * writer.
+ *
+ */
+
+static bool is_write_request(const vector<zmq::message_t> &frames)
+{
+    for (size_t i = 0; i + 1 < frames.size(); ++i)
+    {
+        if (frames[i].size() == 0)
+        {
+            const zmq::message_t &f = frames[i + 1];
+            string cmd(static_cast<const char *>(f.data()), f.size());
+            cmd = cmd.substr(0, cmd.find('/'));
+            return !(cmd == "GET" || cmd == "SNAPSHOT" || cmd == "ping");
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Takes a message from a worker backend: the worker's identity, an
+ * empty frame, and then either "READY" or a reply with its client's
+ * envelope. Either way the worker is idle again; a reply is passed on
+ * to the client.
+ *
+ * @param backend: The ROUTER socket the workers connect to.
+ * @param idle: The identities of the idle workers.
+ * @param frontend: The ROUTER socket the clients connect to.
+ *
+ */
+
+static void from_worker(zmq::socket_t &backend, deque<zmq::message_t> &idle,
+                        zmq::socket_t &frontend)
+{
+    vector<zmq::message_t> frames;
+
+    recv_frames(backend, frames);
+
+    if (frames.size() < 3)
+    {
+        return;
+    }
+
+    idle.push_back(std::move(frames[0]));
+    string first(static_cast<const char *>(frames[2].data()), frames[2].size());
+
+    if (!(frames.size() == 3 && first == "READY"))
+    {
+        frames.erase(frames.begin(), frames.begin() + 2);
+        send_frames(frontend, frames);
+    }
+}
+
+/**
+ * Hands queued requests to idle workers, oldest first, one each.
+ *
+ * @param backend: The ROUTER socket the workers connect to.
+ * @param idle: The identities of the idle workers.
+ * @param queue: The requests waiting, envelopes included.
+ *
+ */
+
+static void to_workers(zmq::socket_t &backend, deque<zmq::message_t> &idle,
+                       deque<vector<zmq::message_t> > &queue)
+{
+    while (!idle.empty() && !queue.empty())
+    {
+        zmq::message_t empty;
+
+        backend.send(idle.front(), ZMQ_SNDMORE);
+        backend.send(empty, ZMQ_SNDMORE);
+        send_frames(backend, queue.front());
+        idle.pop_front();
+        queue.pop_front();
+    }
+}
+
+/**
+ * Reads the envelope of a request on a worker's REQ socket: the
+ * client's identity and the empty frame that ends it.
+ *
+ */
+
+static void recv_envelope(zmq::socket_t &sock, vector<zmq::message_t> &envelope)
+{
+    envelope.clear();
+
+    do
+    {
+        envelope.emplace_back();
+        sock.recv(&envelope.back());
+    }
+    while (envelope.back().size() != 0);
+}
+
+/**
+ * Sends a reply, in the envelope its request came in.
+ *
+ */
+
+static void send_reply(zmq::socket_t &sock, vector<zmq::message_t> &envelope, string reply)
+{
+    for (auto &f : envelope)
+    {
+        sock.send(f, ZMQ_SNDMORE);
+    }
+
+    z_send(sock, reply, 0);
+}
+
 /**
  * KmImpl is the private implementation of the KeymasterServer class.
  *
@@ -115,27 +291,40 @@ struct KeymasterServer::KmImpl
     KmImpl(YAML::Node config);
     ~KmImpl();
 
+    // The node is a snapshot from the store, encoded by the
+    // publisher thread. The versions are those of the change.
     struct data_package
     {
         std::string key;
-        std::string val;
+        km_tree::node_ptr node;
+        std::string op;
+        uint64_t version;
+        std::vector<uint64_t> versions;
     };
 
     void server_task();
     void state_manager_task();
+    void reader_task();
+    void writer_task();
+    void request_worker(std::string url);
+    void handle_request(zmq::socket_t &sock);
     void heartbeat_task();
     bool load_config_file(string filename);
-    bool publish(std::string key, bool block = false);
+    bool publish(std::string key, const km_tree::result &r, bool block = false,
+                 bool deleted = false);
+    std::string encode(km_tree::node_ptr n);
     void run();
     void terminate();
 
-    void setup_urls();
+    void setup_urls(YAML::Node config);
     bool using_tcp();
     void bind_server(zmq::socket_t &server_sock, vector<string> &urls);
 
     Thread<KmImpl> _server_thread;
     Thread<KmImpl> _state_manager_thread;
     Thread<KmImpl> _heartbeat_thread;
+    Thread<KmImpl> _writer_thread;
+    std::vector<std::unique_ptr<Thread<KmImpl> > > _reader_threads;
     TCondition<bool> _server_thread_ready;
     TCondition<bool> _state_manager_thread_ready;
 
@@ -145,10 +334,14 @@ struct KeymasterServer::KmImpl
     tsemfifo<data_package> _data_queue;
     Mutex _cache_lock;
     std::string _state_task_url;
+    std::string _readers_url;
+    std::string _writer_url;
     std::string _hostname;
     bool _state_task_quit;
     bool _running;
-    int _clone_interval;
+    bool _binary_pubs;
+    size_t _request_threads;
+    std::atomic<bool> _workers_quit;
 
     // The service URLs. Each interface (STATE or PUBLISH) may have
     // multiple URLs (tcp, inproc, ipc) for possible future
@@ -156,7 +349,11 @@ struct KeymasterServer::KmImpl
     std::vector<std::string> _state_service_urls;
     std::vector<std::string> _publish_service_urls;
 
-    list<YAML::Node> _root_node;    //<? THE keymaster node
+    km_tree _tree;    //<? THE keymaster store
+
+    // called with the key of each GET before it is served; see
+    // KeymasterServer::set_get_hook().
+    std::function<void(std::string)> _get_hook;
 };
 
 /**
@@ -182,16 +379,39 @@ KeymasterServer::KmImpl::KmImpl(YAML::Node config)
     _server_thread(this, &KeymasterServer::KmImpl::server_task),
     _state_manager_thread(this, &KeymasterServer::KmImpl::state_manager_task),
     _heartbeat_thread(this, &KeymasterServer::KmImpl::heartbeat_task),
+    _writer_thread(this, &KeymasterServer::KmImpl::writer_task),
     _server_thread_ready(false),
     _state_manager_thread_ready(false),
     _data_queue(1000),
     _state_task_url(string("inproc://") + gen_random_string(20)),
+    _readers_url(string("inproc://") + gen_random_string(20)),
+    _writer_url(string("inproc://") + gen_random_string(20)),
     _state_task_quit(true),
     _running(true),
-    _clone_interval(0)
+    _binary_pubs(false),
+    _request_threads(4),
+    _workers_quit(false),
+    _tree(config)
 {
-    _root_node.push_front(YAML::Clone(config));
-    setup_urls();
+    setup_urls(config);
+
+    // Publications are YAML text, which every subscriber reads, unless
+    // the configuration asks for MessagePack. Only do that once all
+    // subscribers understand it.
+    YAML::Node pe = config["Keymaster"]["publication_encoding"];
+
+    if (pe && pe.as<string>() == "msgpack")
+    {
+        _binary_pubs = true;
+    }
+
+    // GETs are served by this many threads; PUTs and DELs by one.
+    YAML::Node rt = config["Keymaster"]["request_threads"];
+
+    if (rt && rt.as<int>() > 0)
+    {
+        _request_threads = rt.as<int>();
+    }
 
     if (using_tcp() && !getCanonicalHostname(_hostname))
     {
@@ -257,9 +477,8 @@ void KeymasterServer::KmImpl::run()
     }
 
     // Make sure this is run AFTER the _server_thread (publisher)
-    // because it will put publishing information in the _root_node. All
-    // access to the _root_node should be via the _state_manager_thread
-    // because the _root_node is not thread-safe.
+    // because it will put publishing information in the store, and
+    // publish it.
     if (!_state_manager_thread.running())
     {
         if (_state_manager_thread.start() != 0 || !_state_manager_thread_ready.wait(true, 1000000))
@@ -277,7 +496,7 @@ void KeymasterServer::KmImpl::run()
     }
     // Now that we're running, publish everything, so that any clients
     // already subscribed may be updated.
-    publish("Root", true);
+    publish("", _tree.get(""), true);
 }
 
 /**
@@ -312,18 +531,16 @@ void KeymasterServer::KmImpl::terminate()
 
 /**
  * Sets up and validates all the urls. The URLs are retrieved from the
- * root node.
+ * configuration.
  *
- * @return bool, false if there is a problem, true otherwise.
+ * @param config: The configuration.
  *
  */
 
-void KeymasterServer::KmImpl::setup_urls()
+void KeymasterServer::KmImpl::setup_urls(YAML::Node config)
 {
     vector<string>::const_iterator cvi;
-    vector<string> urls = _root_node.front()["Keymaster"]["URLS"]["Initial"].as<vector<string> >();
-    // TODO: make key optional
-    _clone_interval = _root_node.front()["Keymaster"]["clone_interval"].as<int>();
+    vector<string> urls = config["Keymaster"]["URLS"]["Initial"].as<vector<string> >();
 
     for (cvi = urls.begin(); cvi != urls.end(); ++cvi)
     {
@@ -477,8 +694,21 @@ void KeymasterServer::KmImpl::server_task()
     {
         try
         {
+            string val = dp.node ? encode(dp.node) : "";
+            ostringstream versions;
+
+            versions << dp.version;
+
+            for (auto v : dp.versions)
+            {
+                versions << " " << v;
+            }
+
             z_send(data_publisher, dp.key, ZMQ_SNDMORE);
-            z_send(data_publisher, dp.val, 0);
+            z_send(data_publisher, val, ZMQ_SNDMORE);
+            z_send(data_publisher, dp.op.empty() ? "PUT" : dp.op, ZMQ_SNDMORE);
+            z_send(data_publisher, string(_binary_pubs ? "msgpack" : "yaml"), ZMQ_SNDMORE);
+            z_send(data_publisher, versions.str(), 0);
         }
         catch (zmq::error_t &e)
         {
@@ -495,10 +725,26 @@ void KeymasterServer::KmImpl::server_task()
 }
 
 /**
- * This 0MQ server task implements a REPLY socket (of a REQ/REP pair),
- * whose function is to receive requests for cached data.  This is
- * useful for late joiners, especially for keys that don't change
- * frequently.
+ * This 0MQ server task is the front end of the request service. It
+ * binds a ROUTER socket, which clients' REQ sockets talk to, to the
+ * state service URLs, and hands each request to one of two pools of
+ * worker threads, each behind a ROUTER backend of its own:
+ *
+ *  - GETs and pings go to the readers, 'request_threads' of them. They
+ *    run concurrently, each against a snapshot of the store, so that a
+ *    large GET ("Root", say) holds up nothing but itself.
+ *
+ *  - PUTs, PUT_MANYs and DELs go to a single writer, so that changes,
+ *    and their publication, happen one at a time and in the order
+ *    received.
+ *
+ * The backends balance the load: a worker announces that it is ready
+ * when it starts and with each reply, and a request is only ever given
+ * to a worker that is ready. Requests that find no worker ready are
+ * queued here, in order, so a GET never waits behind another GET in a
+ * busy reader while a reader is free, and a PUT never waits on the
+ * readers at all. Replies come back from the workers with the
+ * clients' envelopes, and are passed on as they are.
  *
  */
 
@@ -506,14 +752,17 @@ void KeymasterServer::KmImpl::state_manager_task()
 
 {
     zmq::context_t &ctx = ZMQContext::Instance()->get_context();
-    zmq::socket_t state_sock(ctx, ZMQ_REP);
+    zmq::socket_t state_sock(ctx, ZMQ_ROUTER);
+    zmq::socket_t readers(ctx, ZMQ_ROUTER);
+    zmq::socket_t writer(ctx, ZMQ_ROUTER);
     zmq::socket_t pipe(ctx, ZMQ_PAIR);  // mostly to tell this task to go away
-    unsigned int put_counter(0), clone_interval(1000);
 
     try
     {
-        // control pipe
+        // control pipe, and the backends the workers connect to.
         pipe.bind(_state_task_url.c_str());
+        readers.bind(_readers_url.c_str());
+        writer.bind(_writer_url.c_str());
     }
     catch (zmq::error_t &e)
     {
@@ -528,8 +777,8 @@ void KeymasterServer::KmImpl::state_manager_task()
     {
         // bind to all state server URLs
         bind_server(state_sock, _state_service_urls);
-        put_yaml_val(_root_node.front(), "KeymasterServer.URLS", _state_service_urls, true);
-        publish("KeymasterServer.URLS");
+        publish("KeymasterServer.URLS",
+                _tree.put("KeymasterServer.URLS", YAML::Node(_state_service_urls), true));
     }
     catch (zmq::error_t &e)
     {
@@ -544,18 +793,18 @@ void KeymasterServer::KmImpl::state_manager_task()
     }
 
 
-    yaml_result rs = put_yaml_val(_root_node.front(),
-                                  "Keymaster.URLS.AsConfigured.State", _state_service_urls, true);
-    yaml_result rp = put_yaml_val(_root_node.front(),
-                                  "Keymaster.URLS.AsConfigured.Pub", _publish_service_urls, true);
+    km_tree::result rs = _tree.put("Keymaster.URLS.AsConfigured.State",
+                                   YAML::Node(_state_service_urls), true);
+    km_tree::result rp = _tree.put("Keymaster.URLS.AsConfigured.Pub",
+                                   YAML::Node(_publish_service_urls), true);
     ostringstream state;
     ostringstream pub;
     mxutils::output_vector(_state_service_urls, state);
     mxutils::output_vector(_publish_service_urls, pub);
     cout << "Keymaster.URLS.AsConfigured.State:" << state.str() << endl;
     cout << "Keymaster.URLS.AsConfigured.Pub:" << pub.str() << endl;
-    publish("Keymaster.URLS.AsConfigured.State", true);
-    publish("Keymaster.URLS.AsConfigured.Pub", true);
+    publish("Keymaster.URLS.AsConfigured.State", rs, true);
+    publish("Keymaster.URLS.AsConfigured.Pub", rp, true);
 
     if (! (rs.result && rp.result))
     {
@@ -565,29 +814,43 @@ void KeymasterServer::KmImpl::state_manager_task()
         return;
     }
 
+    // the workers connect to the backends, which are now bound.
+    _workers_quit = false;
+    _writer_thread.start();
+
+    for (size_t i = 0; i < _request_threads; ++i)
+    {
+        _reader_threads.emplace_back(
+            new Thread<KmImpl>(this, &KeymasterServer::KmImpl::reader_task));
+        _reader_threads.back()->start();
+    }
+
     zmq::pollitem_t items [] =
         {
 #if ZMQ_VERSION_MAJOR > 3
             { (void *)pipe, 0, ZMQ_POLLIN, 0 },
-            { (void *)state_sock, 0, ZMQ_POLLIN, 0 }
+            { (void *)state_sock, 0, ZMQ_POLLIN, 0 },
+            { (void *)readers, 0, ZMQ_POLLIN, 0 },
+            { (void *)writer, 0, ZMQ_POLLIN, 0 }
 #else
             { pipe, 0, ZMQ_POLLIN, 0 },
-            { state_sock, 0, ZMQ_POLLIN, 0 }
+            { state_sock, 0, ZMQ_POLLIN, 0 },
+            { readers, 0, ZMQ_POLLIN, 0 },
+            { writer, 0, ZMQ_POLLIN, 0 }
 #endif
         };
 
     _state_manager_thread_ready.signal(true); // allow 'run()' to move
                                               // on.
+    vector<zmq::message_t> frames;
+    deque<zmq::message_t> idle_readers, idle_writer;
+    deque<vector<zmq::message_t> > reads, writes;
 
-    if (_clone_interval != 0)
-    {
-        clone_interval = _clone_interval;
-    }
     while (1)
     {
         try
         {
-            zmq::poll(&items [0], 2, -1);
+            zmq::poll(&items [0], 4, -1);
 
             if (items[0].revents & ZMQ_POLLIN)
             {
@@ -602,153 +865,357 @@ void KeymasterServer::KmImpl::state_manager_task()
 
             if (items[1].revents & ZMQ_POLLIN)
             {
-                string key;
-                vector<string> frame;
+                recv_frames(state_sock, frames);
+                (is_write_request(frames) ? writes : reads).push_back(std::move(frames));
+            }
 
-                z_recv(state_sock, key);
+            if (items[2].revents & ZMQ_POLLIN)
+            {
+                from_worker(readers, idle_readers, state_sock);
+            }
 
-                // Determine the request.  Currently requests may
-                // be either a "ping" (just to see if the service
-                // is alive); a "LIST" to get information on all
-                // samplers and parameters published.  If none of
-                // the above, the request is assumed to be a key
-                // to a published item.
+            if (items[3].revents & ZMQ_POLLIN)
+            {
+                from_worker(writer, idle_writer, state_sock);
+            }
 
-                if (key.size() == 4 && key == "ping")
-                {
-                    // read any remaining parts
-                    z_recv_multipart(state_sock, frame);
+            to_workers(readers, idle_readers, reads);
+            to_workers(writer, idle_writer, writes);
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- State manager task, main loop: " << e.what() << endl;
+        }
+    }
 
-                    // reply with something
-                    z_send(state_sock, "I'm not dead yet!", 0);
-                }
-                /////////////////// G E T ///////////////////
-                else if (key.size() == 3 && key == "GET")
-                {
-                    z_recv_multipart(state_sock, frame);
+    _workers_quit = true;
 
-                    if (!frame.empty())
-                    {
-                        string keychain = frame[0];
-                        ostringstream rval;
+    for (auto &t : _reader_threads)
+    {
+        t->stop_without_cancel();
+    }
 
-                        if (keychain == "Root")
-                        {
-                            keychain = "";
-                        }
+    _reader_threads.clear();
+    _writer_thread.stop_without_cancel();
 
-                        yaml_result r = get_yaml_node(_root_node.front(), keychain);
-                        rval << r;
-                        z_send(state_sock, rval.str(), 0);
-                    }
-                    else
-                    {
-                        string msg("ERROR: Keychain expected, but not received!");
-                        z_send(state_sock, msg, 0);
-                    }
-                }
-                /////////////////// P U T ///////////////////
-                else if (key.size() == 3 && key == "PUT")
-                {
-                    z_recv_multipart(state_sock, frame);
+    int zero = 0;
+    state_sock.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    state_sock.close();
+    readers.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    readers.close();
+    writer.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    writer.close();
+}
 
-                    if (frame.size() > 1)
-                    {
-                        string keychain = frame[0];
+/**
+ * A reader: serves GETs and pings, as many at a time as there are
+ * readers.
+ *
+ */
 
-                        if (keychain == "Root")
-                        {
-                            keychain = "";
-                        }
+void KeymasterServer::KmImpl::reader_task()
+{
+    request_worker(_readers_url);
+}
+
+/**
+ * The writer: serves PUTs and DELs, one at a time.
+ *
+ */
 
-                        string yaml_string = frame[1];
-                        bool create = false;
+void KeymasterServer::KmImpl::writer_task()
+{
+    request_worker(_writer_url);
+}
 
-                        if (frame.size() > 2 && frame[2] == "create")
-                        {
-                            create = true;
-                        }
+/**
+ * The body of a request worker thread. It connects a REQ socket to
+ * the given backend of the state manager task, says it is ready, and
+ * serves the requests it is given until the state manager task exits.
+ * Each reply also says that it is ready for the next request.
+ *
+ * @param url: The backend's URL.
+ *
+ */
 
-                        yaml_result r;
-                        ostringstream rval;
-                        YAML::Node n = YAML::Load(yaml_string);
+void KeymasterServer::KmImpl::request_worker(string url)
+{
+    zmq::context_t &ctx = ZMQContext::Instance()->get_context();
+    zmq::socket_t sock(ctx, ZMQ_REQ);
 
-                        r = put_yaml_node(_root_node.front(), keychain, n, create);
+    sock.connect(url.c_str());
+    z_send(sock, string("READY"), 0);
 
-                        if (r.result)
-                        {
-                            publish(keychain);
-                        }
+    zmq::pollitem_t items [] =
+        {
+#if ZMQ_VERSION_MAJOR > 3
+            { (void *)sock, 0, ZMQ_POLLIN, 0 }
+#else
+            { sock, 0, ZMQ_POLLIN, 0 }
+#endif
+        };
 
-                        rval << r;
-                        z_send(state_sock, rval.str(), 0);
-
-                        // What follows is here to prevent undue
-                        // memory usage. yaml-cpp has an unbounded
-                        // memory use problem (see
-                        // https://github.com/jbeder/yaml-cpp/issues/232
-                        // ). Cloning the node and dropping the
-                        // original one flushes out the memory. We do
-                        // it at every nth put--as specified by
-                        // `clone_interval`--where n is large enough
-                        // not to impact performance but small enough
-                        // to ensure no runaway memory use.
-
-                        if ((++put_counter % clone_interval) == 0)
-                        {
-                            _root_node.push_front(YAML::Clone(_root_node.front()));
-                            _root_node.pop_back();
-                        }
-                    }
-                    else
-                    {
-                        string msg("ERROR: Keychain and value expected, but not received!");
-                        z_send(state_sock, msg, 0);
-                    }
+    while (!_workers_quit)
+    {
+        try
+        {
+            // wake up now and then to see if it is time to go.
+            zmq::poll(&items [0], 1, 100);
+
+            if (items[0].revents & ZMQ_POLLIN)
+            {
+                handle_request(sock);
+            }
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- Keymaster request worker: " << e.what() << endl;
+        }
+    }
+
+    int zero = 0;
+    sock.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    sock.close();
+}
+
+/**
+ * Reads one request from a worker's REQ socket, serves it, and sends
+ * the reply back in the request's envelope. GETs read a snapshot of the store, so any number of them
+ * may run at once; PUTs and DELs come only to the writer.
+ *
+ * @param sock: The worker's socket, with a request waiting.
+ *
+ */
+
+void KeymasterServer::KmImpl::handle_request(zmq::socket_t &sock)
+{
+    string key;
+    vector<string> frame;
+    vector<zmq::message_t> envelope;
+
+    recv_envelope(sock, envelope);
+    z_recv(sock, key);
+
+    // A request may name its encoding after a slash,
+    // e.g. "GET/msgpack": then the value it carries, if
+    // any, and the reply are MessagePack rather than
+    // YAML text. A server that predates this answers
+    // "Unknown request", which tells the client to fall
+    // back to YAML.
+    bool binary = false;
+    size_t slash = key.find('/');
+
+    if (slash != string::npos && key.compare(slash + 1, string::npos, "msgpack") == 0)
+    {
+        binary = true;
+        key.erase(slash);
+    }
+
+    // Determine the request.  Currently requests may
+    // be either a "ping" (just to see if the service
+    // is alive); a "LIST" to get information on all
+    // samplers and parameters published.  If none of
+    // the above, the request is assumed to be a key
+    // to a published item.
+
+    if (key.size() == 4 && key == "ping")
+    {
+        // read any remaining parts
+        z_recv_multipart(sock, frame);
+
+        // reply with something
+        send_reply(sock, envelope, "I'm not dead yet!");
+    }
+    /////////////////// G E T ///////////////////
+    else if (key.size() == 3 && key == "GET")
+    {
+        z_recv_multipart(sock, frame);
+
+        if (!frame.empty())
+        {
+            string keychain = frame[0];
+
+            if (_get_hook)
+            {
+                _get_hook(keychain);
+            }
+
+            if (keychain == "Root")
+            {
+                keychain = "";
+            }
+
+            km_tree::result r = _tree.get(keychain);
+            send_reply(sock, envelope, encode_result(r, binary));
+        }
+        else
+        {
+            string msg("ERROR: Keychain expected, but not received!");
+            send_reply(sock, envelope, msg);
+        }
+    }
+    ////////////// S N A P S H O T //////////////
+    else if (key == "SNAPSHOT")
+    {
+        // A GET for subscribers: the node, and the version it is at,
+        // as {version: v, node: n}. A missing node is null, at
+        // version 0. The version is what lets a subscriber tell which
+        // publications the node already includes; see publish().
+        z_recv_multipart(sock, frame);
+
+        if (!frame.empty())
+        {
+            string keychain = frame[0] == "Root" ? "" : frame[0];
+            km_tree::result r = _tree.get(keychain);
+            YAML::Node snapshot;
+
+            snapshot["version"] = r.result ? r.node->version : 0;
+            snapshot["node"] = r.result ? km_tree::to_yaml(r.node) : YAML::Node();
+            r = km_tree::result{true, frame[0], "", km_tree::from_yaml(snapshot), 0, {}};
+            send_reply(sock, envelope, encode_result(r, binary));
+        }
+        else
+        {
+            string msg("ERROR: Keychain expected, but not received!");
+            send_reply(sock, envelope, msg);
+        }
+    }
+    /////////////////// P U T ///////////////////
+    else if (key.size() == 3 && key == "PUT")
+    {
+        z_recv_multipart(sock, frame);
+
+        if (frame.size() > 1)
+        {
+            string keychain = frame[0];
+
+            if (keychain == "Root")
+            {
+                keychain = "";
+            }
+
+            bool create = false;
+
+            if (frame.size() > 2 && frame[2] == "create")
+            {
+                create = true;
+            }
+
+            km_tree::result r;
+
+            try
+            {
+                km_tree::node_ptr n = binary
+                    ? km_tree::from_msgpack(frame[1])
+                    : km_tree::from_yaml(YAML::Load(frame[1]));
+                r = _tree.put(keychain, n, create);
+            }
+            catch (std::exception &e)
+            {
+                // malformed value: refuse it, and carry on.
+                r = km_tree::result{false, keychain, e.what(), nullptr, 0, {}};
+            }
+
+            if (r.result)
+            {
+                publish(keychain, r);
+            }
+
+            send_reply(sock, envelope, encode_result(r, binary));
+        }
+        else
+        {
+            string msg("ERROR: Keychain and value expected, but not received!");
+            send_reply(sock, envelope, msg);
+        }
+    }
+    ////////////// P U T _ M A N Y //////////////
+    else if (key == "PUT_MANY")
+    {
+        // ["Root", map of keychains to values, optional "create"];
+        // the keychains are all from the root.
+        z_recv_multipart(sock, frame);
+
+        if (frame.size() > 1)
+        {
+            bool create = frame.size() > 2 && frame[2] == "create";
+            vector<pair<string, km_tree::node_ptr> > batch;
+            vector<km_tree::result> each;
+            km_tree::result r;
+
+            try
+            {
+                km_tree::node_ptr n = binary
+                    ? km_tree::from_msgpack(frame[1])
+                    : km_tree::from_yaml(YAML::Load(frame[1]));
+
+                if (n->type != km_tree::node::MAP)
+                {
+                    throw runtime_error("PUT_MANY expects a map of keychains to values");
                 }
-                /////////////////// D E L ///////////////////
-                else if (key.size() == 3 && key == "DEL")
+
+                for (auto &kv : n->children)
                 {
-                    z_recv_multipart(state_sock, frame);
+                    string keychain = *kv.first == "Root" ? "" : *kv.first;
+                    batch.push_back(make_pair(keychain, kv.second));
+                }
 
-                    if (!frame.empty())
-                    {
-                        string keychain = frame[0];
-                        yaml_result r = delete_yaml_node(_root_node.front(), keychain);
-                        ostringstream rval;
-                        rval << r;
-                        z_send(state_sock, rval.str(), 0);
+                r = _tree.put_many(batch, create, &each);
+            }
+            catch (std::exception &e)
+            {
+                r = km_tree::result{false, "", e.what(), nullptr, 0, {}};
+            }
 
-                        if (r.result)
-                        {
-                            publish(keychain, true);
-                        }
-                    }
-                    else
-                    {
-                        string msg("ERROR: Keychain expected, but not received!");
-                        z_send(state_sock, msg, 0);
-                    }
-                }
-                else
+            // all or nothing was put; each put is a change of its
+            // own, and is published in order.
+            if (r.result)
+            {
+                for (size_t i = 0; i < batch.size(); ++i)
                 {
-                    z_recv_multipart(state_sock, frame);
-                    ostringstream msg;
-                    msg << "Unknown request '" << key;
-                    z_send(state_sock, msg.str(), 0);
+                    publish(batch[i].first, each[i]);
                 }
             }
+
+            send_reply(sock, envelope, encode_result(r, binary));
+        }
+        else
+        {
+            string msg("ERROR: Keychain and values expected, but not received!");
+            send_reply(sock, envelope, msg);
+        }
+    }
+    /////////////////// D E L ///////////////////
+    else if (key.size() == 3 && key == "DEL")
+    {
+        z_recv_multipart(sock, frame);
+
+        if (!frame.empty())
+        {
+            string keychain = frame[0];
+            km_tree::result r = _tree.del(keychain);
+            send_reply(sock, envelope, encode_result(r, binary));
+
+            if (r.result)
+            {
+                publish(keychain, r, true, true);
+            }
         }
-        catch (zmq::error_t &e)
+        else
         {
-            cerr << Time::isoDateTime(Time::getUTC())
-                 << " -- State manager task, main loop: " << e.what() << endl;
+            string msg("ERROR: Keychain expected, but not received!");
+            send_reply(sock, envelope, msg);
         }
     }
-
-    int zero = 0;
-    state_sock.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
-    state_sock.close();
+    else
+    {
+        z_recv_multipart(sock, frame);
+        ostringstream msg;
+        msg << "Unknown request '" << key;
+        send_reply(sock, envelope, msg.str());
+    }
 }
 
 /**
@@ -764,7 +1231,7 @@ void KeymasterServer::KmImpl::heartbeat_task()
     zmq::context_t &ctx = ZMQContext::Instance()->get_context();
     zmq::socket_t sock(ctx, ZMQ_REQ);
     string url, response;
-    string cmd("PUT"), key("Keymaster.heartbeat");
+    string cmd("PUT/msgpack"), key("Keymaster.heartbeat");
     Time::Time_t one_sec(1000000000L);
     Time::Time_t wake_time = Time::getUTC() + one_sec;
 
@@ -781,7 +1248,7 @@ void KeymasterServer::KmImpl::heartbeat_task()
             Time::thread_sleep_until(wake_time);
             Time::Time_t t = wake_time;
             wake_time += one_sec;
-            string val = to_string(t);
+            string val = to_msgpack(YAML::Node(to_string(t)));
             string flag("create");
             z_send(sock, cmd, ZMQ_SNDMORE, KM_TIMEOUT);
             z_send(sock, key, ZMQ_SNDMORE, KM_TIMEOUT);
@@ -793,76 +1260,97 @@ void KeymasterServer::KmImpl::heartbeat_task()
 }
 
 /**
- * Publish data. Whenever a node is modified, we need to of
- * course publish that node. But we also need to publish
- * upstream nodes, because someone may have subscribed to them,
- * and a change to this key means a change to all upstream
- * keys. So if the node is "foo.bar.baz", we publish "foo",
- * "foo.bar", and "foo.bar.baz"
- *
- * @param key: the data key
+ * Publish data. Whenever a node is modified, only that node is
+ * published, under its own key: a PUT on "foo.bar.baz" sends
+ * "foo.bar.baz" and the value of that node alone, so that the cost of
+ * a publication is that of the change, not of the tree it is in.
+ *
+ * The frames are the key, the value, the operation ("PUT" or "DEL";
+ * the value of a deletion is empty), the value's encoding and the
+ * versions. The value is YAML text, which every subscriber reads,
+ * unless the configuration sets 'publication_encoding: msgpack'.
+ * Subscribers that predate that encoding cannot read it, so it is
+ * opt-in; they only read the frames they know of.
+ *
+ * Subscribers to "foo" or "foo.bar" receive it too (subscriptions are
+ * prefix matches), and the client turns it into a delta on their
+ * subtree; see Keymaster::_subscriber_task(). The versions frame is
+ * what lets it do so safely: it holds the version of the change, then
+ * the versions the nodes on its path had before it, from the root
+ * down, all as decimal text separated by spaces (see km_tree). A
+ * subscriber whose copy of "foo" is at the version "foo" had before
+ * the change applies it; one whose copy is newer already has it; and
+ * one whose copy is older has missed a change, and fetches "foo"
+ * again with a SNAPSHOT request.
+ *
+ * @param key: the data key. If empty, the whole tree is published as
+ * "Root".
+ *
+ * @param r: the result of the change, or of a get of the key, whose
+ * node is published as is.
+ *
+ * @param block: if true, wait for room in the publication queue.
+ *
+ * @param deleted: true if the key was deleted.
  *
  * @return true if the data was succesfuly placed in the publication
  * queue, false otherwise.
  *
  */
 
-bool KeymasterServer::KmImpl::publish(std::string key, bool block)
+bool KeymasterServer::KmImpl::publish(std::string key, const km_tree::result &r, bool block,
+                                      bool deleted)
 {
-    bool rval = true;
+    if (!r.result)
+    {
+        return true;
+    }
+
+    data_package dp = {key, r.node, "", r.version, r.versions};
+
+    if (deleted)
+    {
+        dp.node = nullptr;
+        dp.op = "DEL";
+    }
+    else if (!dp.version)
+    {
+        // not a change, but the node as it is: it is at its own
+        // version.
+        dp.version = r.node->version;
+    }
 
     // Publish "Root" if there is no key
-    try
+    if (dp.key.empty())
     {
-        data_package dp = {key, ""};
-        YAML::Node node = _root_node.front();
+        dp.key = "Root";
+    }
 
-        if (dp.key.empty())
-        {
-            ostringstream yr;
-            yr << node;
-            dp.key = "Root";
-            dp.val = yr.str();
-        }
-        else
-        {
-            vector<string> keys;
-            boost::split(keys, dp.key, boost::is_any_of("."));
+    if (block)
+    {
+        _data_queue.put(dp);
+        return true;
+    }
 
-            // Publish with keys
-            for (size_t i = 1; i < keys.size() + 1; ++i)
-            {
-                string key = boost::algorithm::join(vector<string>(keys.begin(), keys.begin() + i), ".");
-                yaml_result r = get_yaml_node(node, key);
+    return _data_queue.try_put(dp);
+}
 
-                if (r.result == true)
-                {
-                    ostringstream yr;
-                    // we just need the node that goes with the key.
-                    yr << r.node;
-                    dp.key = key;
-                    dp.val = yr.str();
+/**
+ * Encodes a node for publication, as MessagePack or as YAML text
+ * according to the configuration.
+ *
+ */
 
-                    if (block)
-                    {
-                        _data_queue.put(dp);
-                    }
-                    else
-                    {
-                        rval = rval and _data_queue.try_put(dp);
-                    }
-                }
-            }
-        }
-    }
-    catch (YAML::Exception &e)
+std::string KeymasterServer::KmImpl::encode(km_tree::node_ptr n)
+{
+    if (_binary_pubs)
     {
-        cerr << Time::isoDateTime(Time::getUTC())
-             << " -- YAML exception in publish: " << e.what() << endl;
-        return false;
+        return km_tree::to_msgpack(n);
     }
 
-    return rval;
+    ostringstream yr;
+    yr << km_tree::to_yaml(n);
+    return yr.str();
 }
 
 /**
@@ -970,6 +1458,21 @@ void KeymasterServer::terminate()
     _impl->terminate();
 }
 
+/**
+ * Gives a function for the worker serving a GET to call, with the
+ * requested key, before it reads the store. This is for tests: a hook
+ * that waits keeps its worker busy for as long as the test needs.
+ * Must be set before 'run()'.
+ *
+ * @param hook: The function.
+ *
+ */
+
+void KeymasterServer::set_get_hook(std::function<void(std::string)> hook)
+{
+    _impl->_get_hook = hook;
+}
+
 /****************************************************************//**
  * \class Keymaster
  *
@@ -999,9 +1502,13 @@ Keymaster::Keymaster(string keymaster_url, bool /* shared */)
     _pipe_url(string("inproc://") + gen_random_string(20)),
     _subscriber_thread(this, &Keymaster::_subscriber_task),
     _subscriber_thread_ready(false),
+    _resync_thread(this, &Keymaster::_resync_task),
+    _resync_thread_ready(false),
+    _resync_fifo(1000),
     _put_thread(this, &Keymaster::_put_task),
     _put_thread_ready(false),
-    _put_thread_run(false)
+    _put_thread_run(false),
+    _encoding(UNKNOWN_ENCODING)
 {
 }
 
@@ -1014,6 +1521,13 @@ Keymaster::~Keymaster()
 {
     int zero = 0;
 
+    // first, as it may be waiting on the subscriber thread.
+    if (_resync_thread.running())
+    {
+        _resync_fifo.release();
+        _resync_thread.stop_without_cancel();
+    }
+
     if (_subscriber_thread.running())
     {
         zmq::socket_t ctrl(ZMQContext::Instance()->get_context(), ZMQ_REQ);
@@ -1044,20 +1558,28 @@ Keymaster::~Keymaster()
  * REQ/REPL pairs.
  *
  * @param cmd: One of the commands recognized by the Keymaster Server:
- * GET, PUT, DEL.
+ * GET, SNAPSHOT, PUT, PUT_MANY, DEL.
  *
  * @param key: A key to a YAML node. In form "key1.key2.key3" which
  * represents a hierarchy of YAML nodes on the Keymaster.
  *
- * @param val: A new value for the node pointet to by 'key'.
+ * @param val: A new value for the node pointet to by 'key', or null
+ * if the command takes none.
  *
  * @param flag: A flag regulating the operation of PUT: if 'create'
  * PUT will create a new node at the specified key if one doesn't
  * already exist. If "", it will return an error if the key does not exist.
  *
+ * The value and the reply are MessagePack if the server understands
+ * it, YAML text otherwise. The first request finds out which: it is
+ * sent as MessagePack, and sent again as YAML if the server does not
+ * answer in kind. Only a GET, PUT or DEL tells: a server that does not
+ * know a PUT_MANY, say, does not know it in either encoding, and the
+ * request simply fails.
+ *
  */
 
-yaml_result Keymaster::_call_keymaster(string cmd, string key, string val, string flag)
+yaml_result Keymaster::_call_keymaster(string cmd, string key, const YAML::Node *val, string flag)
 {
     string response;
     yaml_result yr;
@@ -1073,25 +1595,68 @@ yaml_result Keymaster::_call_keymaster(string cmd, string key, string val, strin
 
         lck.lock();
         shared_ptr<zmq::socket_t> km = _keymaster_socket();
-        // always send a command
-        z_send(*km, cmd, ZMQ_SNDMORE, KM_TIMEOUT);
-        // always send a key
-        z_send(*km, key, val.empty() ? 0: ZMQ_SNDMORE, KM_TIMEOUT);
 
-        if (!val.empty())
+        while (true)
         {
-            z_send(*km, val, flag.empty() ? 0 : ZMQ_SNDMORE, KM_TIMEOUT);
-        }
+            bool binary = _encoding != YAML_ENCODING;
 
-        if (!flag.empty())
-        {
-            z_send(*km, flag, 0, KM_TIMEOUT);
-        }
+            // always send a command
+            z_send(*km, binary ? cmd + "/msgpack" : cmd, ZMQ_SNDMORE, KM_TIMEOUT);
+            // always send a key
+            z_send(*km, key, val ? ZMQ_SNDMORE : 0, KM_TIMEOUT);
+
+            if (val)
+            {
+                ostringstream yaml_val;
+
+                if (!binary)
+                {
+                    yaml_val << *val;
+                }
+
+                z_send(*km, binary ? to_msgpack(*val) : yaml_val.str(),
+                       flag.empty() ? 0 : ZMQ_SNDMORE, KM_TIMEOUT);
+            }
+
+            if (!flag.empty())
+            {
+                z_send(*km, flag, 0, KM_TIMEOUT);
+            }
+
+            // use a reasonable time-out, in case Keymaster is gone.
+            z_recv(*km, response, KM_TIMEOUT);
 
-        // use a reasonable time-out, in case Keymaster is gone.
-        z_recv(*km, response, KM_TIMEOUT);
+            if (!binary)
+            {
+                yr.from_yaml_node(YAML::Load(response));
+                break;
+            }
+
+            if (result_from_msgpack(response, yr))
+            {
+                _encoding = MSGPACK_ENCODING;
+                break;
+            }
+
+            if (_encoding == MSGPACK_ENCODING)
+            {
+                throw KeymasterException("unreadable reply: " + response);
+            }
+
+            // an older server, which did nothing but say so. A
+            // request it knows in YAML shows it; any other may be
+            // unknown to it altogether.
+            if (cmd != "GET" && cmd != "PUT" && cmd != "DEL")
+            {
+                msg << "': " << response;
+                yr.result = false;
+                yr.err = msg.str();
+                break;
+            }
+
+            _encoding = YAML_ENCODING;
+        }
 
-        yr.from_yaml_node(YAML::Load(response));
         _r = yr;
         return yr;
     }
@@ -1148,6 +1713,8 @@ void Keymaster::_handle_keymaster_server_exception()
     _km_->setsockopt(ZMQ_LINGER, &zero, sizeof zero);
     _km_->close();
     _km_.reset();
+    // the server may be a different one when it comes back.
+    _encoding = UNKNOWN_ENCODING;
 }
 
 /**
@@ -1291,14 +1858,49 @@ bool Keymaster::put(std::string key, YAML::Node n, bool create)
 {
     string cmd("PUT"), create_flag("create");
     yaml_result yr;
-    ostringstream val;
 
-    val << n;
-    yr = _call_keymaster(cmd, key, val.str(), create ? create_flag : "");
+    yr = _call_keymaster(cmd, key, &n, create ? create_flag : "");
     n.reset();
     return yr.result;
 }
 
+/**
+ * Puts several values on the Keymaster in one request, as one
+ * transaction: either all are put, or none is. Each changed key is
+ * published once, after all the values are in place, so subscribers
+ * never see a batch half done. This is much cheaper than a 'put()' per
+ * value when there are many of them, e.g. when setting the mode of
+ * every component.
+ *
+ * example:
+ *
+ *      Keymaster km("inproc://keymaster");
+ *      YAML::Node batch;
+ *      batch["components.foo.active"] = true;
+ *      batch["components.foo.mode"] = "default";
+ *      batch["components.bar.active"] = false;
+ *      km.put_many(batch);
+ *
+ * @param batch: A map of keychains to their new values. They are put
+ * in the map's order.
+ *
+ * @param create: If true, the keymaster will create any nodes missing
+ * along each of the keychains, as for 'put()'.
+ *
+ * @return true if all the values were put. If not, nothing was put,
+ * and 'get_last_result()' tells which keychain failed.
+ *
+ */
+
+bool Keymaster::put_many(YAML::Node batch, bool create)
+{
+    string cmd("PUT_MANY"), create_flag("create");
+    yaml_result yr;
+
+    yr = _call_keymaster(cmd, "Root", &batch, create ? create_flag : "");
+    return yr.result;
+}
+
 /**
  * Deletes the node specified by the keychain 'key' from the keymaster.
  *
@@ -1379,8 +1981,16 @@ bool Keymaster::subscribe(string key, KeymasterCallbackBase *f)
         return false;
     }
 
+    // Publisher publishes this as 'Root'. A subscription with an
+    // empty key subscribes to all keys.
+    if (key.empty())
+    {
+        key = "Root";
+    }
+
     // Next, request the subscription by posting a request to the
-    // subscriber thread.
+    // subscriber thread. It holds the publications back until it has
+    // the subtree to apply them to.
     zmq::socket_t pipe(ZMQContext::Instance()->get_context(), ZMQ_REQ);
     pipe.connect(_pipe_url.c_str());
     z_send(pipe, SUBSCRIBE, ZMQ_SNDMORE);
@@ -1388,6 +1998,11 @@ bool Keymaster::subscribe(string key, KeymasterCallbackBase *f)
     z_send(pipe, f, 0);
     int rval;
     z_recv(pipe, rval);
+
+    // Only then is the subtree fetched, so that no change made after
+    // the fetch can be missed. One made before it, but published
+    // after, is dropped by version; see '_deliver()'.
+    _sync_subtree(key, false);
     return rval ? true : false;
 }
 
@@ -1483,6 +2098,11 @@ void Keymaster::_run()
         {
             throw(runtime_error(string("Keymaster: unable to start subscriber thread")));
         }
+
+        if ((_resync_thread.start() != 0) || (!_resync_thread_ready.wait(true, 1000000)))
+        {
+            throw(runtime_error(string("Keymaster: unable to start resync thread")));
+        }
     }
 }
 
@@ -1562,15 +2182,62 @@ void Keymaster::_subscriber_task()
                     z_recv(pipe, key);
                     z_recv(pipe, f_ptr);
 
-                    // Publisher publishes this as 'Root'. A
-                    // subscription with an empty key subscribes to all keys.
-                    if (key.empty())
+                    _callbacks[key] = f_ptr;
+                    _subtrees.erase(key);
+                    // held back until the subtree comes (SUBTREE).
+                    _sync[key] = sync_state{false, true, 0, {}};
+                    sub_sock.setsockopt(ZMQ_SUBSCRIBE, key.c_str(), key.length());
+                    z_send(pipe, 1, 0);
+                }
+                else if (msg == SUBTREE)
+                {
+                    string key;
+                    YAML::Node *tree;
+                    int versioned, notify;
+                    uint64_t version;
+                    z_recv(pipe, key);
+                    z_recv(pipe, tree);
+                    z_recv(pipe, versioned);
+                    z_recv(pipe, version);
+                    z_recv(pipe, notify);
+
+                    map<string, sync_state>::iterator s = _sync.find(key);
+
+                    // unless unsubscribed meanwhile. The sender waits
+                    // for the reply, so 'tree' is still there.
+                    if (s != _sync.end() && s->second.syncing)
                     {
-                        key = "Root";
+                        vector<publication> held;
+
+                        // if it could not be fetched, the copy stays
+                        // as it was.
+                        if (tree)
+                        {
+                            _subtrees.erase(key);
+
+                            if (tree->IsMap())
+                            {
+                                _subtrees[key] = YAML::Clone(*tree);
+                            }
+
+                            s->second.versioned = versioned;
+                            s->second.version = version;
+
+                            if (notify)
+                            {
+                                _callbacks[key]->exec(key, YAML::Clone(*tree));
+                            }
+                        }
+
+                        s->second.syncing = false;
+                        held.swap(s->second.held);
+
+                        for (auto &p : held)
+                        {
+                            _deliver(key, p);
+                        }
                     }
 
-                    _callbacks[key] = f_ptr;
-                    sub_sock.setsockopt(ZMQ_SUBSCRIBE, key.c_str(), key.length());
                     z_send(pipe, 1, 0);
                 }
                 else if (msg == UNSUBSCRIBE)
@@ -1590,6 +2257,9 @@ void Keymaster::_subscriber_task()
                         _callbacks.erase(key);
                     }
 
+                    _subtrees.erase(key);
+                    _sync.erase(key);
+
                     z_send(pipe, 1, 0);
                 }
                 else if (msg == QUIT)
@@ -1609,13 +2279,51 @@ void Keymaster::_subscriber_task()
 
                 if (!val.empty())
                 {
-                    map<string, KeymasterCallbackBase *>::const_iterator mci;
-                    mci = _callbacks.find(key);
+                    // The server publishes only the key that changed,
+                    // but the subscription that brought it here may be
+                    // for any of its ancestors: walk up from the key
+                    // itself, and hand the change to each one found.
+                    bool binary = val.size() > 2 && val[2] == "msgpack";
+                    bool loaded = false;
+                    publication p{key, YAML::Node(), val.size() > 1 && val[1] == "DEL", {}};
+                    string sub = key;
+
+                    if (val.size() > 3)
+                    {
+                        istringstream versions(val[3]);
+                        uint64_t v;
+
+                        while (versions >> v)
+                        {
+                            p.versions.push_back(v);
+                        }
+                    }
 
-                    if (mci != _callbacks.end())
+                    while (true)
                     {
-                        YAML::Node n = YAML::Load(val[0]);
-                        mci->second->exec(mci->first, n);
+                        if (_callbacks.find(sub) != _callbacks.end())
+                        {
+                            if (!loaded)
+                            {
+                                if (!p.deleted)
+                                {
+                                    p.val = binary ? node_from_msgpack(val[0]) : YAML::Load(val[0]);
+                                }
+
+                                loaded = true;
+                            }
+
+                            _deliver(sub, p);
+                        }
+
+                        size_t dot = sub.rfind('.');
+
+                        if (dot == string::npos)
+                        {
+                            break;
+                        }
+
+                        sub.erase(dot);
                     }
                 }
             }
@@ -1641,6 +2349,196 @@ void Keymaster::_subscriber_task()
     sub_sock.close();
 }
 
+/**
+ * The resync thread. It fetches again the subtrees of the
+ * subscriptions that the subscriber thread found to have missed a
+ * change, so that that thread never has to make a request of its own.
+ *
+ */
+
+void Keymaster::_resync_task()
+{
+    string key;
+
+    _resync_thread_ready.signal(true);
+
+    while (_resync_fifo.get(key))
+    {
+        _sync_subtree(key, true);
+    }
+}
+
+/**
+ * Fetches a subscribed subtree, with the version it is at, and hands
+ * it to the subscriber thread, which applies to it the publications
+ * it held back meanwhile. A server that gives no versions is asked
+ * for the subtree alone, and the subscription does without them.
+ *
+ * @param key: The subscribed key.
+ *
+ * @param notify: If true, the key's callback is given the subtree.
+ *
+ */
+
+void Keymaster::_sync_subtree(string key, bool notify)
+{
+    yaml_result yr;
+    YAML::Node tree;
+    bool fetched = false;
+    int versioned = 0;
+    uint64_t version = 0;
+
+    try
+    {
+        yr = _call_keymaster("SNAPSHOT", key);
+
+        if (yr.result)
+        {
+            version = yr.node["version"].as<uint64_t>();
+            tree = yr.node["node"];
+            fetched = true;
+            versioned = 1;
+        }
+        else if (get(key, yr))
+        {
+            tree = yr.node;
+            fetched = true;
+        }
+    }
+    catch (YAML::Exception &e)
+    {
+    }
+
+    zmq::socket_t pipe(ZMQContext::Instance()->get_context(), ZMQ_REQ);
+    pipe.connect(_pipe_url.c_str());
+    z_send(pipe, SUBTREE, ZMQ_SNDMORE);
+    z_send(pipe, key, ZMQ_SNDMORE);
+    z_send(pipe, fetched ? &tree : nullptr, ZMQ_SNDMORE);
+    z_send(pipe, versioned, ZMQ_SNDMORE);
+    z_send(pipe, version, ZMQ_SNDMORE);
+    z_send(pipe, notify ? 1 : 0, 0);
+    int rval;
+    z_recv(pipe, rval);
+}
+
+/**
+ * Hands a publication to a subscription. With versions, a change the
+ * subscription's copy already has is dropped, and one that does not
+ * follow from the copy, because some change in between was missed,
+ * has the subtree fetched again; the publications are held back
+ * meanwhile.
+ *
+ * @param key: The subscribed key, 'p.key' or one of its ancestors.
+ *
+ * @param p: The publication.
+ *
+ */
+
+void Keymaster::_deliver(string key, const publication &p)
+{
+    sync_state &s = _sync[key];
+
+    if (s.syncing)
+    {
+        s.held.push_back(p);
+        return;
+    }
+
+    if (s.versioned && !p.versions.empty())
+    {
+        // after the change's own, the versions of "", then of each
+        // key of the path: that of 'key' is one past its depth.
+        size_t at = count(key.begin(), key.end(), '.') + 2;
+
+        if (p.versions[0] <= s.version)
+        {
+            return;
+        }
+
+        if (key != p.key && (at >= p.versions.size() || p.versions[at] != s.version))
+        {
+            // if it can't be queued the copy stays stale, and the
+            // next change will try again.
+            if (_resync_fifo.try_put(key))
+            {
+                s.syncing = true;
+                s.held.push_back(p);
+            }
+
+            return;
+        }
+
+        s.version = p.versions[0];
+    }
+
+    if (key == p.key)
+    {
+        // the whole subtree was replaced; so is the copy kept for
+        // deltas.
+        _subtrees.erase(key);
+
+        if (!p.deleted)
+        {
+            if (p.val.IsMap())
+            {
+                _subtrees[key] = YAML::Clone(p.val);
+            }
+
+            _callbacks[key]->exec(key, p.val);
+        }
+    }
+    else
+    {
+        _deliver_delta(key, p.key, p.val, p.deleted);
+    }
+}
+
+/**
+ * Hands a change below a subscribed key to that key's callback. If the
+ * callback does not take the delta itself, the change is applied to a
+ * copy of the subscribed subtree kept here, and the callback is given
+ * all of it. The copy comes from '_sync_subtree()', and is kept up to
+ * date from the publications alone: this runs on the subscriber
+ * thread, which makes no requests of the server.
+ *
+ * @param key: The subscribed key.
+ *
+ * @param changed: The key that changed, below 'key'.
+ *
+ * @param val: Its new value, null if it was deleted.
+ *
+ * @param deleted: true if it was deleted.
+ *
+ */
+
+void Keymaster::_deliver_delta(string key, string changed, YAML::Node val, bool deleted)
+{
+    KeymasterCallbackBase *cb = _callbacks[key];
+
+    if (cb->exec_delta(key, changed, val, deleted))
+    {
+        return;
+    }
+
+    // a key that had no subtree when subscribed starts out empty.
+    YAML::Node &tree = _subtrees[key];
+    string path = changed.substr(key.size() + 1);
+
+    if (deleted)
+    {
+        delete_yaml_node(tree, path);
+    }
+    else
+    {
+        // cloned, as the same node may go into the copies of several
+        // subscribed ancestors.
+        put_yaml_node(tree, path, YAML::Clone(val), true);
+    }
+
+    // the callback may hold on to what it is given.
+    cb->exec(key, YAML::Clone(tree));
+}
+
 /**
  * Starts the deferred put thread, if it is not already running.
  *
@@ -30,6 +30,7 @@
 #include "matrix/Keymaster.h"
 #include "matrix/Mutex.h"
 #include "matrix/ThreadLock.h"
+#include "matrix/rcu_ptr.h"
 
 #include <string>
 
@@ -71,22 +72,41 @@ namespace matrix
 
     struct RTTransportServer::Impl
     {
+        // A channel is the list of subscribers to one data key. The
+        // list is replaced, never modified in place, when a client
+        // subscribes or unsubscribes, so publishers may walk it
+        // without taking a lock.
+        struct channel : public TransportServer::Channel
+        {
+            channel(string k)
+                : TransportServer::Channel(k),
+                  subscribers(new vector<DataCallbackBase *>())
+            {
+            }
+
+            rcu_ptr<vector<DataCallbackBase *> > subscribers;
+        };
+
+        typedef map<string, shared_ptr<channel> > channel_map;
+
         Impl(string urn);
         ~Impl();
 
         bool publish(string key, string data);
         bool publish(string key, void const *data, size_t sze);
+        bool publish(channel *c, void const *data, size_t sze);
+        bool publish_n(channel *c, void const *data, size_t sze, size_t n);
+        channel *resolve(string key);
         string get_urn();
         bool subscribe(string key, DataCallbackBase *cb);
         bool unsubscribe(string key, DataCallbackBase *cb);
 
         // This is how the server knows who its subscribers are. The
-        // first template arg is a key, which is in the form
-        // "component.data". So if component 'cat' emits data 'meow', the
-        // key would be "cat.meow". This class needs some way to
-        // populate this map. This is done via the 'subscribe' method.
-        Mutex _client_mutex;
-        multimap<string, DataCallbackBase *> _clients;
+        // key is in the form "component.data". So if component 'cat'
+        // emits data 'meow', the key would be "cat.meow". Channels are
+        // created by 'resolve()' and live as long as the server does,
+        // so a channel pointer, once resolved, stays valid.
+        rcu_ptr<channel_map> _channels;
         string _urn;
     };
 
@@ -97,6 +117,7 @@ namespace matrix
  *
  */
     RTTransportServer::Impl::Impl(string urn)
+        : _channels(new channel_map())
     {
         _urn = urn + "://" + gen_random_string(20);
     }
@@ -110,6 +131,43 @@ namespace matrix
     {
     }
 
+/**
+ * Finds the channel for 'key', creating it if need be.
+ *
+ * @param key: The data key
+ *
+ * @return The channel. It remains valid for the life of the server.
+ *
+ */
+
+    RTTransportServer::Impl::channel *RTTransportServer::Impl::resolve(string key)
+    {
+        {
+            rcu_ptr<channel_map>::reader channels = _channels.read();
+            channel_map::iterator i = channels->find(key);
+
+            if (i != channels->end())
+            {
+                return i->second.get();
+            }
+        }
+
+        channel *c;
+
+        _channels.update([&key, &c](channel_map &channels)
+                         {
+                             shared_ptr<channel> &ch = channels[key];
+
+                             if (!ch)
+                             {
+                                 ch.reset(new channel(key));
+                             }
+
+                             c = ch.get();
+                         });
+        return c;
+    }
+
 /**
  * Published data by key, as a std::string.
  *
@@ -146,22 +204,73 @@ namespace matrix
 
     bool RTTransportServer::Impl::publish(string key, void const *data, size_t sze)
     {
-        bool rval = false;
-        multimap<string, DataCallbackBase *>::iterator client;
-        ThreadLock<Mutex> l(_client_mutex);
+        channel *c = nullptr;
+
+        {
+            rcu_ptr<channel_map>::reader channels = _channels.read();
+            channel_map::iterator i = channels->find(key);
+
+            if (i != channels->end())
+            {
+                c = i->second.get();
+            }
+        }
 
-        l.lock();
+        return c ? publish(c, data, sze) : false;
+    }
 
-        // Find all clients subscribed to the data represented by 'key'.
-        for (client = _clients.equal_range(key).first;
-             client != _clients.equal_range(key).second; ++client)
+/**
+ * Publishes data on an already resolved channel. This takes no lock
+ * and does no key lookup.
+ *
+ * @param c: The channel, as returned by 'resolve()'.
+ *
+ * @param data: A pointer to the data
+ *
+ * @param sze: The size of the data buffer pointed to by 'data'
+ *
+ * @return true if publish succeeded, false if there is no subscriber.
+ *
+ */
+
+    bool RTTransportServer::Impl::publish(channel *c, void const *data, size_t sze)
+    {
+        rcu_ptr<vector<DataCallbackBase *> >::reader clients = c->subscribers.read();
+
+        for (auto client: *clients)
         {
-            // call their callbacks with the data.
-            client->second->exec(key, (void *)data, sze);
-            rval = true;
+            client->exec(c->key, (void *)data, sze);
         }
 
-        return rval;
+        return !clients->empty();
+    }
+
+/**
+ * Publishes a batch of 'n' samples of 'sze' bytes each on a resolved
+ * channel. Each subscriber gets the whole batch in one callback.
+ *
+ * @param c: The channel, as returned by 'resolve()'.
+ *
+ * @param data: A pointer to the first sample
+ *
+ * @param sze: The size of each sample
+ *
+ * @param n: The number of samples
+ *
+ * @return true if publish succeeded, false if there is no subscriber.
+ *
+ */
+
+    bool RTTransportServer::Impl::publish_n(channel *c, void const *data, size_t sze, size_t n)
+    {
+        rcu_ptr<vector<DataCallbackBase *> >::reader clients = c->subscribers.read();
+
+        for (auto client: *clients)
+        {
+            client->exec_n(c->key, (void *)data, sze, n);
+        }
+
+        return !clients->empty();
     }
 
 /**
@@ -198,10 +307,10 @@ namespace matrix
 
     bool RTTransportServer::Impl::subscribe(string key, DataCallbackBase *cb)
     {
-        ThreadLock<Mutex> l(_client_mutex);
-
-        l.lock();
-        _clients.insert(make_pair(key, cb));
+        resolve(key)->subscribers.update([cb](vector<DataCallbackBase *> &clients)
+                                         {
+                                             clients.push_back(cb);
+                                         });
         return true;
     }
 
@@ -224,23 +333,15 @@ namespace matrix
     bool RTTransportServer::Impl::unsubscribe(string key, DataCallbackBase *)
     {
         bool rval = false;
-        multimap<string, DataCallbackBase *>::iterator client;
-        ThreadLock<Mutex> l(_client_mutex);
-
-        l.lock();
 
-        // Many clients may be registered for this data under
-        // 'key'. Look for an exact match of key, cb:
         // Note: We delete all clients for a given key with the rtproc
         // transport because the unsubscribe call here only is
         // called once due to reference counting on the TC. -- JJB
-        for (client = _clients.equal_range(key).first;
-             client != _clients.equal_range(key).second; ++client)
-        {
-            _clients.erase(client);
-            rval = true;
-        }
-
+        resolve(key)->subscribers.update([&rval](vector<DataCallbackBase *> &clients)
+                                         {
+                                             rval = !clients.empty();
+                                             clients.clear();
+                                         });
         return rval;
     }
 
@@ -352,6 +453,45 @@ namespace matrix
         return _impl->publish(key, data);
     }
 
+/**
+ * Returns the channel for 'key'. Publishing on it takes no lock and
+ * does no lookup.
+ *
+ * @param key: The data key.
+ *
+ * @return The channel, valid for the life of the RTTransportServer.
+ *
+ */
+
+    TransportServer::channel_t RTTransportServer::_resolve(string key)
+    {
+        return _impl->resolve(key);
+    }
+
+/**
+ * This private function provides the TransportServer
+ * 'publish(channel_t...)' functionality.
+ *
+ * @param ch: A channel obtained from '_resolve()'.
+ *
+ * @param data: A pointer to the data buffer to publish
+ *
+ * @param size_of_data: The size of the 'data' buffer in bytes.
+ *
+ * @return true on success, false if there is no client subscribed.
+ *
+ */
+
+    bool RTTransportServer::_publish(channel_t ch, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(static_cast<Impl::channel *>(ch), data, size_of_data);
+    }
+
+    bool RTTransportServer::_publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n)
+    {
+        return _impl->publish_n(static_cast<Impl::channel *>(ch), data, size_of_data, n);
+    }
+
 
 
 
@@ -0,0 +1,1131 @@
+/*******************************************************************
+ *  RawTCPDataInterface.cc - A DataInterface transport over plain TCP
+ *  sockets.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/RawTCPDataInterface.h"
+#include "matrix/Keymaster.h"
+#include "matrix/Thread.h"
+#include "matrix/ThreadLock.h"
+#include "matrix/TCondition.h"
+#include "matrix/netUtils.h"
+#include "matrix/Time.h"
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+
+#include <boost/regex.hpp>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <endian.h>
+#include <unistd.h>
+#include <errno.h>
+
+using namespace std;
+using namespace mxutils;
+using namespace matrix;
+
+namespace
+{
+    const size_t RAWTCP_MAX_KEY = 1024;
+
+    // The largest frame body, 'count' samples of 'size' bytes, a
+    // server sends or a client accepts.
+    const uint64_t RAWTCP_MAX_FRAME = (uint64_t)1 << 30;
+
+    // How long, in milliseconds, a send to one client may block
+    // before that client is dropped, unless the transport's
+    // 'SendTimeout' says otherwise.
+    const int RAWTCP_SEND_TIMEOUT = 1000;
+
+    // A data frame, server to client: this header, in network byte
+    // order, then the key, then 'count' samples of 'size' bytes.
+    // 'seq' numbers the first of them among all the samples published
+    // on the key, so that a client can tell how many it missed.
+    struct __attribute__((packed)) rawtcp_frame
+    {
+        uint32_t key_len;
+        uint32_t count;
+        uint64_t size;
+        uint64_t seq;
+    };
+
+    // A control frame, client to server: this header, then the key.
+    struct __attribute__((packed)) rawtcp_control
+    {
+        uint8_t op;
+        uint32_t key_len;
+    };
+
+    enum
+    {
+        RAWTCP_SUBSCRIBE = 1,
+        RAWTCP_UNSUBSCRIBE = 2
+    };
+
+/**
+ * Sends all of the gathered buffers, picking up where the kernel left
+ * off after a partial send.
+ *
+ * @param fd: The socket.
+ * @param iov: The buffers. These are modified.
+ * @param iovcnt: The number of buffers.
+ *
+ * @return true if everything was sent, false on error, including a
+ * send that timed out on a socket with SO_SNDTIMEO set.
+ *
+ */
+
+    bool send_all(int fd, iovec *iov, int iovcnt)
+    {
+        msghdr msg;
+        memset(&msg, 0, sizeof msg);
+
+        while (iovcnt > 0)
+        {
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return false;
+            }
+
+            while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+            {
+                n -= iov->iov_len;
+                ++iov;
+                --iovcnt;
+            }
+
+            if (iovcnt > 0)
+            {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+
+        return true;
+    }
+
+/**
+ * Receives exactly 'len' bytes.
+ *
+ * @return true on success, false if the peer closed the connection
+ * or on error.
+ *
+ */
+
+    bool recv_all(int fd, void *buf, size_t len)
+    {
+        char *p = (char *)buf;
+
+        while (len)
+        {
+            ssize_t n = recv(fd, p, len, MSG_WAITALL);
+
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                return false;
+            }
+
+            p += n;
+            len -= n;
+        }
+
+        return true;
+    }
+
+/**
+ * Extracts the port to listen on from a server transport
+ * specification. 'rawtcp', 'rawtcp://\*' and a port of 'XXXXX' give
+ * 0, for an ephemeral port.
+ *
+ * @return the port, or -1 if the specification is not understood.
+ *
+ */
+
+    int rawtcp_listen_port(const string &urn)
+    {
+        boost::regex p_urn("^rawtcp(://[^:]+(:([0-9]+|X+))?)?$");
+        boost::smatch result;
+
+        if (!boost::regex_match(urn, result, p_urn))
+        {
+            return -1;
+        }
+
+        string port = result[3];
+        return port.empty() || port[0] == 'X' ? 0 : stoi(port);
+    }
+
+/**
+ * Opens a connection to a server. The socket's send time-out is set
+ * to 1 second; on Linux it bounds 'connect()' as well, so that trying
+ * a server that is gone holds no one up for long.
+ *
+ * @param urn: The 'rawtcp://host:port' URN of the server.
+ *
+ * @param err: Set to what went wrong, on failure.
+ *
+ * @return the socket, or -1 on failure.
+ *
+ */
+
+    int rawtcp_dial(const string &urn, string &err)
+    {
+        boost::regex p_urn("^rawtcp://([^:]+):([0-9]+)$");
+        boost::smatch result;
+        addrinfo hints, *res = nullptr;
+        timeval tv = {1, 0};
+
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (!boost::regex_match(urn, result, p_urn)
+            || getaddrinfo(string(result[1]).c_str(), string(result[2]).c_str(), &hints, &res) != 0)
+        {
+            err = "cannot resolve " + urn;
+            return -1;
+        }
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (fd == -1
+            || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) == -1
+            || ::connect(fd, res->ai_addr, res->ai_addrlen) == -1)
+        {
+            err = "unable to connect to " + urn + ": " + strerror(errno);
+
+            if (fd != -1)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        freeaddrinfo(res);
+        return fd;
+    }
+}
+
+namespace matrix
+{
+/**
+ * Creates a RawTCPTransportServer, returning a TransportServer pointer
+ * to it. This is the factory registered for the 'rawtcp' transport.
+ *
+ * @param km_urn: the URN to the keymaster.
+ *
+ * @param key: The key to query the keymaster. This key should point to
+ * a YAML node that contains information about the data source. One of
+ * the sub-keys of this node must be a key 'Specified', which returns a
+ * vector of transports required for this data source.
+ *
+ * @return A TransportServer * pointing to the created RawTCPTransportServer.
+ *
+ */
+
+    TransportServer *RawTCPTransportServer::factory(string km_url, string key)
+    {
+        return new RawTCPTransportServer(km_url, key);
+    }
+
+/**
+ * \class Impl is the private implementation of the RawTCPTransportServer class
+ *
+ */
+
+    struct RawTCPTransportServer::Impl
+    {
+        // One per client. 'send_lock' keeps frames from different
+        // publishing threads from interleaving. 'lock' guards 'keys',
+        // and is never held across a send, so that the I/O thread
+        // can take a subscription while a frame is on its way. 'in'
+        // holds control bytes received but not yet a whole frame;
+        // only the I/O thread touches it.
+        struct connection
+        {
+            connection(int f)
+                : fd(f)
+            {
+            }
+
+            ~connection()
+            {
+                close(fd);
+            }
+
+            int fd;
+            Mutex lock;
+            Mutex send_lock;
+            vector<string> keys;
+            string in;
+        };
+
+        typedef vector<shared_ptr<connection> > connection_list;
+
+        Impl(string urn, int send_timeout);
+        ~Impl();
+
+        bool publish(const string &key, const void *data, size_t sze, size_t n);
+        void io_task();
+        bool control(shared_ptr<connection> c);
+        string get_urn();
+
+        string _urn;
+        int _listen_fd;
+        int _send_timeout;
+        Mutex _connections_mutex;
+        connection_list _connections;
+        // samples published so far on each key, for 'seq'; guarded
+        // by '_connections_mutex'.
+        map<string, uint64_t> _published;
+        std::atomic<bool> _run;
+        Thread<RawTCPTransportServer::Impl> _io_thread;
+        TCondition<bool> _task_ready;
+    };
+
+/**
+ * Opens the listening socket and starts the thread that accepts
+ * clients and reads their subscriptions.
+ *
+ * @param urn: The URN as specified.
+ *
+ * @param send_timeout: How long, in milliseconds, a send to a client
+ * may block before the client is dropped.
+ *
+ */
+
+    RawTCPTransportServer::Impl::Impl(string urn, int send_timeout)
+        : _listen_fd(-1),
+          _send_timeout(send_timeout),
+          _run(true),
+          _io_thread(this, &RawTCPTransportServer::Impl::io_task),
+          _task_ready(false)
+    {
+        int port = rawtcp_listen_port(urn);
+        int one = 1;
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof addr;
+        string hostname;
+
+        if (port < 0)
+        {
+            throw CreationError("not a valid 'rawtcp://*:port' URN", vector<string>(1, urn));
+        }
+
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (_listen_fd == -1
+            || setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1
+            || ::bind(_listen_fd, (sockaddr *)&addr, sizeof addr) == -1
+            || listen(_listen_fd, 16) == -1
+            || getsockname(_listen_fd, (sockaddr *)&addr, &addr_len) == -1)
+        {
+            string err = strerror(errno);
+
+            if (_listen_fd != -1)
+            {
+                close(_listen_fd);
+            }
+
+            throw CreationError("rawtcp socket: " + err, vector<string>(1, urn));
+        }
+
+        if (!getCanonicalHostname(hostname))
+        {
+            close(_listen_fd);
+            throw CreationError("rawtcp: unable to obtain canonical hostname", vector<string>(1, urn));
+        }
+
+        ostringstream u;
+        u << "rawtcp://" << hostname << ":" << ntohs(addr.sin_port);
+        _urn = u.str();
+
+        if (_io_thread.start() != 0 || !_task_ready.wait(true, 1000000))
+        {
+            close(_listen_fd);
+            throw CreationError("rawtcp: failure to start I/O thread", vector<string>(1, urn));
+        }
+    }
+
+    RawTCPTransportServer::Impl::~Impl()
+    {
+        _run.store(false);
+        _io_thread.stop_without_cancel();
+        close(_listen_fd);
+    }
+
+    string RawTCPTransportServer::Impl::get_urn()
+    {
+        return _urn;
+    }
+
+/**
+ * Sends 'n' samples of 'sze' bytes each, as one frame, to every
+ * client subscribed to 'key'. A client whose connection fails, or
+ * that has not taken the frame within the send time-out, is
+ * disconnected and left for the I/O thread to clean up, so that one
+ * stalled client can't hold up the others for long.
+ *
+ * @param key: The data key, "component.data".
+ *
+ * @param data: A pointer to the first sample
+ *
+ * @param sze: The size of each sample
+ *
+ * @param n: The number of samples
+ *
+ * @return true if every subscribed client was sent the frame.
+ *
+ */
+
+    bool RawTCPTransportServer::Impl::publish(const string &key, const void *data, size_t sze, size_t n)
+    {
+        ThreadLock<Mutex> l(_connections_mutex);
+        connection_list conns;
+        rawtcp_frame hdr;
+        bool rval = true;
+
+        if (sze && n > RAWTCP_MAX_FRAME / sze)
+        {
+            return false;
+        }
+
+        hdr.key_len = htonl(key.size());
+        hdr.count = htonl(n);
+        hdr.size = htobe64(sze);
+
+        // work from a copy of the list, so that a slow client doesn't
+        // hold up the I/O thread's accepting. The frame is numbered
+        // whether or not anyone takes it.
+        l.lock();
+        conns = _connections;
+        hdr.seq = htobe64(_published[key]);
+        _published[key] += n;
+        l.unlock();
+
+        for (auto &c: conns)
+        {
+            ThreadLock<Mutex> kl(c->lock);
+            ThreadLock<Mutex> sl(c->send_lock);
+            bool sent = true;
+
+            kl.lock();
+
+            if (find(c->keys.begin(), c->keys.end(), key) == c->keys.end())
+            {
+                continue;
+            }
+
+            kl.unlock();
+
+            iovec iov[3];
+            iov[0].iov_base = &hdr;
+            iov[0].iov_len = sizeof hdr;
+            iov[1].iov_base = (void *)key.data();
+            iov[1].iov_len = key.size();
+            iov[2].iov_base = (void *)data;
+            iov[2].iov_len = n * sze;
+
+            sl.lock();
+
+            if (!send_all(c->fd, iov, 3))
+            {
+                // failed or timed out: the stream is unusable past a
+                // partial frame, so no other frame may follow it.
+                shutdown(c->fd, SHUT_RDWR);
+                sent = false;
+            }
+
+            sl.unlock();
+
+            if (!sent)
+            {
+                kl.lock();
+                c->keys.clear();
+                kl.unlock();
+                rval = false;
+            }
+        }
+
+        return rval;
+    }
+
+/**
+ * Reads what a client has sent, without blocking, and applies each
+ * whole control frame received so far. Called only when poll() says
+ * the client's socket is readable; a frame that arrives in pieces is
+ * kept until the rest comes, so a slow client holds up no one.
+ *
+ * @param c: The client's connection.
+ *
+ * @return false if the connection is closed or broken, or the client
+ * sent something that isn't a control frame.
+ *
+ */
+
+    bool RawTCPTransportServer::Impl::control(shared_ptr<connection> c)
+    {
+        char buf[4096];
+        ssize_t n = recv(c->fd, buf, sizeof buf, MSG_DONTWAIT);
+
+        if (n == 0)
+        {
+            return false;
+        }
+
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+
+        c->in.append(buf, n);
+
+        while (c->in.size() >= sizeof(rawtcp_control))
+        {
+            rawtcp_control ctl;
+            memcpy(&ctl, c->in.data(), sizeof ctl);
+            size_t len = ntohl(ctl.key_len);
+
+            if (len > RAWTCP_MAX_KEY)
+            {
+                return false;
+            }
+
+            if (c->in.size() < sizeof ctl + len)
+            {
+                break;
+            }
+
+            string key = c->in.substr(sizeof ctl, len);
+            c->in.erase(0, sizeof ctl + len);
+
+            ThreadLock<Mutex> l(c->lock);
+            l.lock();
+            auto i = find(c->keys.begin(), c->keys.end(), key);
+
+            if (ctl.op == RAWTCP_SUBSCRIBE && i == c->keys.end())
+            {
+                c->keys.push_back(key);
+            }
+            else if (ctl.op == RAWTCP_UNSUBSCRIBE && i != c->keys.end())
+            {
+                c->keys.erase(i);
+            }
+        }
+
+        return true;
+    }
+
+/**
+ * The I/O thread. Accepts new clients, reads their subscription
+ * requests, and drops clients that go away. Wakes every 100 mS to
+ * see whether it should quit.
+ *
+ */
+
+    void RawTCPTransportServer::Impl::io_task()
+    {
+        vector<pollfd> fds;
+        connection_list conns;
+
+        _task_ready.signal(true);
+
+        while (_run.load())
+        {
+            ThreadLock<Mutex> l(_connections_mutex);
+
+            l.lock();
+            conns = _connections;
+            l.unlock();
+
+            fds.resize(conns.size() + 1);
+            fds[0].fd = _listen_fd;
+            fds[0].events = POLLIN;
+
+            for (size_t i = 0; i < conns.size(); ++i)
+            {
+                fds[i + 1].fd = conns[i]->fd;
+                fds[i + 1].events = POLLIN;
+            }
+
+            if (poll(fds.data(), fds.size(), 100) <= 0)
+            {
+                continue;
+            }
+
+            connection_list gone;
+
+            for (size_t i = 0; i < conns.size(); ++i)
+            {
+                if (fds[i + 1].revents && !control(conns[i]))
+                {
+                    gone.push_back(conns[i]);
+                }
+            }
+
+            l.lock();
+
+            for (auto &c: gone)
+            {
+                _connections.erase(remove(_connections.begin(), _connections.end(), c),
+                                   _connections.end());
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                int fd = accept(_listen_fd, nullptr, nullptr);
+
+                if (fd != -1)
+                {
+                    int one = 1;
+                    timeval tv;
+                    tv.tv_sec = _send_timeout / 1000;
+                    tv.tv_usec = (_send_timeout % 1000) * 1000;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+                    _connections.push_back(make_shared<connection>(fd));
+                }
+            }
+        }
+    }
+
+/**
+ * Constructor for the RawTCPTransportServer. Starts listening and
+ * registers the URN with the Keymaster.
+ *
+ * @param keymaster_url: The keymaster URN.
+ *
+ * @param key: The data transport key that specifies the transport configuration.
+ *
+ */
+
+    RawTCPTransportServer::RawTCPTransportServer(string keymaster_url, string key)
+        : TransportServer(keymaster_url, key)
+    {
+        try
+        {
+            Keymaster km(_km_url);
+            yaml_result yr;
+            int send_timeout = RAWTCP_SEND_TIMEOUT;
+            string urn = km.get_as<vector<string> >(_transport_key + ".Specified").front();
+
+            if (km.get(_transport_key + ".SendTimeout", yr))
+            {
+                send_timeout = yr.node.as<int>();
+            }
+
+            _impl.reset(new Impl(urn, send_timeout));
+            vector<string> urns;
+            urns.push_back(_impl->get_urn());
+            km.put(_transport_key + ".AsConfigured", urns, true);
+        }
+        catch (KeymasterException &e)
+        {
+            throw CreationError(e.what());
+        }
+        catch (YAML::Exception &e)
+        {
+            throw CreationError(e.what());
+        }
+    }
+
+    RawTCPTransportServer::~RawTCPTransportServer()
+    {
+        _impl.reset();
+
+        try
+        {
+            Keymaster km(_km_url);
+            km.del(_transport_key + ".AsConfigured");
+        }
+        catch (KeymasterException &e)
+        {
+            // The KeymasterServer may already be gone. Don't throw
+            // from the destructor.
+        }
+    }
+
+    bool RawTCPTransportServer::_publish(string key, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(key, data, size_of_data, 1);
+    }
+
+    bool RawTCPTransportServer::_publish(string key, string data)
+    {
+        return _impl->publish(key, data.data(), data.size(), 1);
+    }
+
+    bool RawTCPTransportServer::_publish(channel_t ch, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(ch->key, data, size_of_data, 1);
+    }
+
+    bool RawTCPTransportServer::_publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n)
+    {
+        return _impl->publish(ch->key, data, size_of_data, n);
+    }
+
+/**********************************************************************
+ * Transport Client
+ **********************************************************************/
+
+    TransportClient *RawTCPTransportClient::factory(string urn)
+    {
+        return new RawTCPTransportClient(urn);
+    }
+
+    struct RawTCPTransportClient::Impl
+    {
+        Impl()
+            : _fd(-1),
+              _connected(false),
+              _run(false),
+              _reader_thread(this, &RawTCPTransportClient::Impl::reader_task),
+              _task_ready(false)
+        {
+        }
+
+        ~Impl()
+        {
+            disconnect();
+        }
+
+        bool connect(string urn);
+        bool disconnect();
+        bool subscribe(string key, DataCallbackBase *cb);
+        bool unsubscribe(string key);
+        bool send_control(uint8_t op, const string &key);
+        bool reconnect();
+
+        void reader_task();
+
+        string _urn;
+        int _fd;
+        bool _connected;
+        std::atomic<bool> _run;
+        Thread<RawTCPTransportClient::Impl> _reader_thread;
+        TCondition<bool> _task_ready;
+        // guards the sending of control frames, and '_fd', which the
+        // reader thread replaces when it reconnects.
+        Mutex _send_lock;
+        Mutex _subscriber_lock;
+        vector<pair<string, DataCallbackBase *> > _subscribers;
+    };
+
+/**
+ * Connects to the server and starts the reader thread.
+ *
+ * @param urn: The 'rawtcp://host:port' URN of the server.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool RawTCPTransportClient::Impl::connect(string urn)
+    {
+        string err;
+
+        if (_connected)
+        {
+            return false;
+        }
+
+        _fd = rawtcp_dial(urn, err);
+
+        if (_fd == -1)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- RawTCPTransportClient: " << err << endl;
+            return false;
+        }
+
+        _urn = urn;
+        _run.store(true);
+
+        if (_reader_thread.start() != 0 || !_task_ready.wait(true, 1000000))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- RawTCPTransportClient for URN " << urn
+                 << ": failure to start reader thread." << endl;
+            close(_fd);
+            _fd = -1;
+            return false;
+        }
+
+        _connected = true;
+        return true;
+    }
+
+/**
+ * Shutting the socket down wakes the reader thread, which then exits
+ * rather than reconnect.
+ *
+ */
+
+    bool RawTCPTransportClient::Impl::disconnect()
+    {
+        if (_connected)
+        {
+            ThreadLock<Mutex> l(_send_lock);
+
+            _run.store(false);
+            l.lock();
+            shutdown(_fd, SHUT_RDWR);
+            l.unlock();
+            _reader_thread.stop_without_cancel();
+            _task_ready.set_value(false);
+
+            if (_fd != -1)
+            {
+                close(_fd);
+            }
+
+            _fd = -1;
+            _connected = false;
+            return true;
+        }
+
+        return false;
+    }
+
+/**
+ * Sends a control frame. While the reader thread is reconnecting
+ * there is no socket, and nothing is sent: it subscribes again to
+ * every key once it has reconnected.
+ *
+ */
+
+    bool RawTCPTransportClient::Impl::send_control(uint8_t op, const string &key)
+    {
+        ThreadLock<Mutex> l(_send_lock);
+        rawtcp_control ctl;
+        iovec iov[2];
+
+        ctl.op = op;
+        ctl.key_len = htonl(key.size());
+        iov[0].iov_base = &ctl;
+        iov[0].iov_len = sizeof ctl;
+        iov[1].iov_base = (void *)key.data();
+        iov[1].iov_len = key.size();
+
+        l.lock();
+        return _fd == -1 || send_all(_fd, iov, 2);
+    }
+
+/**
+ * Called by the reader thread when the connection to the server
+ * fails: reconnects, retrying with a growing delay, and subscribes
+ * again to every key. What was published meanwhile is lost; the
+ * first frame of each key after that tells how many samples, and the
+ * key's callback is told through 'lost()'.
+ *
+ * @return true once reconnected, false if 'disconnect()' was called.
+ *
+ */
+
+    bool RawTCPTransportClient::Impl::reconnect()
+    {
+        ThreadLock<Mutex> l(_send_lock);
+        Time::Time_t delay = 100000000; // 100 mS, doubled on each try up to 2 S
+
+        l.lock();
+
+        if (!_run.load())
+        {
+            return false;
+        }
+
+        close(_fd);
+        _fd = -1;
+        l.unlock();
+
+        cerr << Time::isoDateTime(Time::getUTC())
+             << " -- RawTCPTransportClient: lost the connection to " << _urn
+             << ", reconnecting." << endl;
+
+        while (_run.load())
+        {
+            string err;
+            int fd = rawtcp_dial(_urn, err);
+
+            if (fd != -1)
+            {
+                ThreadLock<Mutex> sl(_subscriber_lock);
+                vector<string> keys;
+
+                l.lock();
+
+                if (!_run.load())
+                {
+                    close(fd);
+                    return false;
+                }
+
+                _fd = fd;
+                l.unlock();
+
+                sl.lock();
+
+                for (auto &s: _subscribers)
+                {
+                    keys.push_back(s.first);
+                }
+
+                sl.unlock();
+
+                // a failure here shows up as a failed read, and the
+                // reader comes back here.
+                for (auto &k: keys)
+                {
+                    send_control(RAWTCP_SUBSCRIBE, k);
+                }
+
+                return true;
+            }
+
+            // in short steps, so as not to hold up 'disconnect()'.
+            for (Time::Time_t t = 0; t < delay && _run.load(); t += 10000000)
+            {
+                Time::thread_delay(10000000);
+            }
+
+            delay = min(delay * 2, (Time::Time_t)2000000000);
+        }
+
+        return false;
+    }
+
+    bool RawTCPTransportClient::Impl::subscribe(string key, DataCallbackBase *cb)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+
+        if (!_connected || key.empty() || key.size() > RAWTCP_MAX_KEY)
+        {
+            return false;
+        }
+
+        l.lock();
+        auto i = find_if(_subscribers.begin(), _subscribers.end(),
+                         [&key](pair<string, DataCallbackBase *> &s) {return s.first == key;});
+
+        if (i != _subscribers.end())
+        {
+            i->second = cb;
+            return true;
+        }
+
+        _subscribers.push_back(make_pair(key, cb));
+        l.unlock();
+        return send_control(RAWTCP_SUBSCRIBE, key);
+    }
+
+    bool RawTCPTransportClient::Impl::unsubscribe(string key)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+
+        l.lock();
+        auto i = find_if(_subscribers.begin(), _subscribers.end(),
+                         [&key](pair<string, DataCallbackBase *> &s) {return s.first == key;});
+
+        if (i == _subscribers.end())
+        {
+            return false;
+        }
+
+        _subscribers.erase(i);
+        l.unlock();
+        return _connected ? send_control(RAWTCP_UNSUBSCRIBE, key) : true;
+    }
+
+/**
+ * The reader thread. Reads a frame at a time into a buffer that is
+ * kept from one frame to the next, so that a steady stream of large
+ * samples costs no allocations, and hands the samples to the
+ * callback subscribed to the frame's key. If the connection fails,
+ * it reconnects; the samples missed meanwhile are reported to the
+ * callbacks, from the gaps in the frames' sequence numbers.
+ *
+ */
+
+    void RawTCPTransportClient::Impl::reader_task()
+    {
+        vector<char> buf;
+        string key;
+        // the sequence number expected next on each key.
+        map<string, uint64_t> next;
+
+        _task_ready.signal(true);
+
+        for (;;)
+        {
+            rawtcp_frame hdr;
+
+            if (!recv_all(_fd, &hdr, sizeof hdr))
+            {
+                if (reconnect())
+                {
+                    continue;
+                }
+
+                break;
+            }
+
+            size_t key_len = ntohl(hdr.key_len);
+            size_t count = ntohl(hdr.count);
+            size_t sze = be64toh(hdr.size);
+            uint64_t seq = be64toh(hdr.seq);
+
+            // a corrupt or hostile header mustn't make us allocate
+            // without bound.
+            if (key_len > RAWTCP_MAX_KEY || (sze && count > RAWTCP_MAX_FRAME / sze))
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- RawTCPTransportClient: bad frame header." << endl;
+
+                if (reconnect())
+                {
+                    continue;
+                }
+
+                break;
+            }
+
+            key.resize(key_len);
+            buf.resize(count * sze);
+
+            if (!recv_all(_fd, &key[0], key_len) || !recv_all(_fd, buf.data(), buf.size()))
+            {
+                if (reconnect())
+                {
+                    continue;
+                }
+
+                break;
+            }
+
+            ThreadLock<Mutex> l(_subscriber_lock);
+            l.lock();
+
+            for (auto &s: _subscribers)
+            {
+                if (s.first == key)
+                {
+                    auto n = next.find(key);
+
+                    // a number lower than expected means the server
+                    // started over; nothing can be told then.
+                    if (n != next.end() && seq > n->second)
+                    {
+                        s.second->lost(s.first, seq - n->second);
+                    }
+
+                    next[key] = seq + count;
+
+                    if (count == 1)
+                    {
+                        s.second->exec(s.first, buf.data(), sze);
+                    }
+                    else if (count > 1)
+                    {
+                        s.second->exec_n(s.first, buf.data(), sze, count);
+                    }
+
+                    break;
+                }
+            }
+        }
+    }
+
+/**
+ * RawTCPTransportClient constructor.
+ *
+ * @param urn: The fully formed URN of the TransportServer,
+ * 'rawtcp://host:port'.
+ *
+ */
+
+    RawTCPTransportClient::RawTCPTransportClient(string urn)
+        : TransportClient(urn),
+          _impl(new Impl())
+    {
+    }
+
+    RawTCPTransportClient::~RawTCPTransportClient()
+    {
+        _impl->disconnect();
+    }
+
+    bool RawTCPTransportClient::_connect()
+    {
+        return _impl->connect(_urn);
+    }
+
+    bool RawTCPTransportClient::_disconnect()
+    {
+        return _impl->disconnect();
+    }
+
+    bool RawTCPTransportClient::_subscribe(string key, DataCallbackBase *cb)
+    {
+        return _impl->subscribe(key, cb);
+    }
+
+    bool RawTCPTransportClient::_unsubscribe(string key)
+    {
+        return _impl->unsubscribe(key);
+    }
+}
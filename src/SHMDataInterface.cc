@@ -0,0 +1,1573 @@
+/*******************************************************************
+ *  SHMDataInterface.cc - Implementation of a POSIX shared memory
+ *  ring buffer transport.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/SHMDataInterface.h"
+#include "matrix/Keymaster.h"
+#include "matrix/Thread.h"
+#include "matrix/ThreadLock.h"
+#include "matrix/zmq_util.h"
+#include "matrix/Time.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+#include <boost/regex.hpp>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+
+using namespace std;
+using namespace mxutils;
+
+namespace
+{
+    const uint32_t SHM_MAGIC = 0x4853584d; // "MXSH"
+    const uint32_t SHM_VERSION = 5;
+    const size_t SHM_MAX_KEY = 128;
+    const size_t SHM_MAX_READERS = 64;
+    const size_t SHM_DEFAULT_SLOTS = 128;
+    const size_t SHM_DEFAULT_SLOT_SIZE = 65536;
+    const mode_t SHM_DEFAULT_MODE = 0600;
+    const size_t SHM_DEFAULT_LOANS = 4;
+    const size_t CACHE_LINE = 64;
+
+    // The segment is shared between processes, so everything in it
+    // must be address free. Lock-free atomics are.
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                  "shm transport requires lock-free 32 and 64 bit atomics");
+
+    // One of these per attached reader. 'cursor' is the next index
+    // the reader will look at; 'reading' is (index + 1) of the slot
+    // it is reading in place right now, or 0. The producer will not
+    // reuse a slot that a reader is in the middle of reading.
+    // 'dropped' counts the samples this reader lost, whether it was
+    // lapped or the producer discarded them for its sake. Samples lost
+    // to lapping are counted, per key, from the gaps in the slots'
+    // 'number's, so only once a later sample on the key arrives.
+    struct alignas(CACHE_LINE) shm_reader
+    {
+        std::atomic<uint32_t> in_use;
+        std::atomic<int32_t> pid;
+        std::atomic<uint64_t> cursor;
+        std::atomic<uint64_t> reading;
+        std::atomic<uint64_t> dropped;
+    };
+
+    struct shm_header
+    {
+        std::atomic<uint32_t> magic;
+        uint32_t version;
+        uint32_t slots;
+        uint32_t slot_size;
+        uint32_t buffers;                                   // slots + spares
+        uint64_t slot_stride;
+        int32_t owner;                                      // the server's pid
+        alignas(CACHE_LINE) std::atomic<uint64_t> reserve;  // next index to claim
+        alignas(CACHE_LINE) std::atomic<uint32_t> commits;  // futex word
+        std::atomic<uint32_t> waiters;                      // readers asleep on it
+        shm_reader readers[SHM_MAX_READERS];
+    };
+
+    // The ring's slots are indirect: the map that follows the header
+    // gives, for each slot, which of the 'buffers' holds its sample.
+    // The buffers not in the map are spares, which the server lends
+    // out through loan(); a committed loan is swapped into the map in
+    // place of the slot's current buffer, which becomes a spare. A
+    // buffer on loan is thus never in the ring, where readers would
+    // wait for it or the producer overwrite it.
+    //
+    // A slot's 'seq' is 2 * index + 1 while the sample for 'index' is
+    // being written, and 2 * index + 2 once it is committed. A reader
+    // expecting 'index' can thus tell 'not yet written' (smaller),
+    // 'ready' (equal) and 'overwritten' (larger) apart with one load.
+    // A slot normally holds one sample; a batch from publish_n() packs
+    // 'count' samples of 'size' bytes each into it. 'number' numbers
+    // the first of them among all the samples published on the key,
+    // so that a reader can tell how many it missed.
+    struct shm_slot
+    {
+        std::atomic<uint64_t> seq;
+        uint64_t number;
+        uint32_t key_len;
+        uint32_t size;
+        uint32_t count;
+        char key[SHM_MAX_KEY];
+    };
+
+    size_t round_up(size_t v, size_t m)
+    {
+        return ((v + m - 1) / m) * m;
+    }
+
+    const size_t HEADER_SIZE = round_up(sizeof(shm_header), CACHE_LINE);
+    const size_t SLOT_HEADER_SIZE = round_up(sizeof(shm_slot), CACHE_LINE);
+
+    size_t map_size(size_t slots)
+    {
+        return round_up(slots * sizeof(std::atomic<uint32_t>), CACHE_LINE);
+    }
+
+    // Plain (not process private) futexes, since the waiters are in
+    // other processes.
+    void futex_wait(std::atomic<uint32_t> *addr, uint32_t val, Time::Time_t ns)
+    {
+        timespec ts;
+        ts.tv_sec = ns / Time::TM_ONE_SEC;
+        ts.tv_nsec = ns % Time::TM_ONE_SEC;
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, val, &ts, nullptr, 0);
+    }
+
+    void futex_wake(std::atomic<uint32_t> *addr)
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    inline void cpu_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    bool process_exists(int32_t pid)
+    {
+        return !(kill(pid, 0) == -1 && errno == ESRCH);
+    }
+
+/**
+ * Frees a reader entry if the process that holds it no longer exists,
+ * as happens when a client is killed without disconnecting. The pid is
+ * cleared first, with a compare and swap, so that of several processes
+ * reaping at once only one frees the entry, and none frees it after it
+ * has been claimed again.
+ *
+ * @param r: The reader entry.
+ *
+ * @return true if the entry's process is gone (the entry is or is
+ * being freed), false if it is alive or the entry is not yet set up.
+ *
+ */
+
+    bool reap_if_dead(shm_reader &r)
+    {
+        int32_t pid = r.pid.load();
+
+        if (pid <= 0 || process_exists(pid))
+        {
+            return false;
+        }
+
+        if (r.pid.compare_exchange_strong(pid, 0))
+        {
+            r.reading.store(0);
+            r.in_use.store(0);
+        }
+
+        return true;
+    }
+
+/**
+ * \class shm_ring
+ *
+ * The mapping of a shared memory ring, used by both the server (which
+ * creates it) and the client (which attaches to it).
+ *
+ */
+
+    struct shm_ring
+    {
+        shm_ring()
+            : hdr(nullptr),
+              map(nullptr),
+              base(nullptr),
+              length(0)
+        {
+        }
+
+        ~shm_ring()
+        {
+            unmap();
+        }
+
+        bool create(string name, size_t slots, size_t spares, size_t slot_size, mode_t mode);
+        bool open(string name);
+        static bool stale(string name);
+        void unmap();
+
+        std::atomic<uint32_t> &slot_map(uint64_t idx)
+        {
+            return map[idx & (hdr->slots - 1)];
+        }
+
+        shm_slot *slot(uint64_t idx)
+        {
+            return buffer(slot_map(idx).load(std::memory_order_acquire));
+        }
+
+        shm_slot *buffer(uint32_t b)
+        {
+            return (shm_slot *)(base + HEADER_SIZE + map_size(hdr->slots) + b * hdr->slot_stride);
+        }
+
+        unsigned char *payload(shm_slot *s)
+        {
+            return (unsigned char *)s + SLOT_HEADER_SIZE;
+        }
+
+        shm_header *hdr;
+        std::atomic<uint32_t> *map;
+        unsigned char *base;
+        size_t length;
+    };
+
+/**
+ * Tells whether an existing segment was left behind: by a server that
+ * died without unlinking it, or that died before it was set up, or by
+ * a server of another version.
+ *
+ * @param name: The shm_open() name, beginning with '/'.
+ *
+ * @return true if the segment is a matrix ring no one serves, false
+ * if it is in use or is not ours to remove.
+ *
+ */
+
+    bool shm_ring::stale(string name)
+    {
+        struct stat st;
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+        if (fd == -1)
+        {
+            return false;
+        }
+
+        if (fstat(fd, &st) == -1)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        if ((size_t)st.st_size < HEADER_SIZE)
+        {
+            ::close(fd);
+            return true;
+        }
+
+        void *p = mmap(nullptr, HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            return false;
+        }
+
+        shm_header *h = (shm_header *)p;
+        bool rval = h->magic.load() == SHM_MAGIC
+            && (h->version != SHM_VERSION || !process_exists(h->owner));
+        munmap(p, HEADER_SIZE);
+        return rval;
+    }
+
+/**
+ * Creates, sizes and maps a new shared memory segment and initializes
+ * its ring header. The segment is created exclusively; if 'name'
+ * already exists but is stale (see 'stale()') it is removed and
+ * created afresh, so that a server may restart after a crash.
+ *
+ * @param name: The shm_open() name, beginning with '/'.
+ * @param slots: The number of slots, a power of two.
+ * @param spares: The number of spare buffers, to lend out.
+ * @param slot_size: The payload capacity of each slot, in bytes.
+ * @param mode: The segment's permissions, as for open(2).
+ *
+ * @return true on success, false otherwise (errno is preserved).
+ *
+ */
+
+    bool shm_ring::create(string name, size_t slots, size_t spares, size_t slot_size, mode_t mode)
+    {
+        size_t stride = SLOT_HEADER_SIZE + round_up(slot_size, CACHE_LINE);
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, mode);
+
+        if (fd == -1 && errno == EEXIST && stale(name))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- SHMTransportServer: removing stale segment " << name << endl;
+            shm_unlink(name.c_str());
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, mode);
+        }
+
+        if (fd == -1)
+        {
+            return false;
+        }
+
+        length = HEADER_SIZE + map_size(slots) + (slots + spares) * stride;
+
+        if (ftruncate(fd, length) == -1)
+        {
+            int err = errno;
+            ::close(fd);
+            shm_unlink(name.c_str());
+            errno = err;
+            return false;
+        }
+
+        void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            int err = errno;
+            shm_unlink(name.c_str());
+            errno = err;
+            return false;
+        }
+
+        // ftruncate() zero fills, so every slot 'seq' starts as 'not
+        // yet written' and every reader entry as free. Slot 'i' starts
+        // out in buffer 'i'; the rest are spares.
+        base = (unsigned char *)p;
+        hdr = new (base) shm_header;
+        map = (std::atomic<uint32_t> *)(base + HEADER_SIZE);
+
+        for (size_t i = 0; i < slots; ++i)
+        {
+            new (&map[i]) std::atomic<uint32_t>(i);
+        }
+
+        hdr->version = SHM_VERSION;
+        hdr->slots = slots;
+        hdr->slot_size = slot_size;
+        hdr->buffers = slots + spares;
+        hdr->slot_stride = stride;
+        hdr->owner = getpid();
+        hdr->magic.store(SHM_MAGIC, std::memory_order_release);
+        return true;
+    }
+
+/**
+ * Maps an existing shared memory segment created by a server.
+ *
+ * @param name: The shm_open() name, beginning with '/'.
+ *
+ * @return true on success, false if the segment does not exist or is
+ * not a matrix shm ring.
+ *
+ */
+
+    bool shm_ring::open(string name)
+    {
+        struct stat st;
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+
+        if (fd == -1)
+        {
+            return false;
+        }
+
+        if (fstat(fd, &st) == -1 || (size_t)st.st_size < HEADER_SIZE)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            return false;
+        }
+
+        base = (unsigned char *)p;
+        length = st.st_size;
+        hdr = (shm_header *)base;
+
+        if (hdr->magic.load(std::memory_order_acquire) != SHM_MAGIC
+            || hdr->version != SHM_VERSION
+            || length < HEADER_SIZE + map_size(hdr->slots) + hdr->buffers * hdr->slot_stride)
+        {
+            unmap();
+            return false;
+        }
+
+        map = (std::atomic<uint32_t> *)(base + HEADER_SIZE);
+
+        return true;
+    }
+
+    void shm_ring::unmap()
+    {
+        if (base)
+        {
+            munmap(base, length);
+            base = nullptr;
+            hdr = nullptr;
+            map = nullptr;
+            length = 0;
+        }
+    }
+
+/**
+ * Turns a transport specification into a complete shm URN:
+ *
+ *   - 'shm' becomes 'shm://matrix.<20 random alphanumeric characters>'
+ *   - 'shm://foo.XXXXX' has its trailing 'X's replaced by as many
+ *     random alphanumeric characters
+ *   - anything else is returned as is.
+ *
+ */
+
+    string process_shm_urn(string urn)
+    {
+        boost::regex p_xs("X+$");
+        boost::smatch result;
+
+        if (urn == "shm")
+        {
+            return "shm://matrix." + gen_random_string(20);
+        }
+
+        if (boost::regex_search(urn, result, p_xs))
+        {
+            string match = result[0];
+            return boost::regex_replace(urn, p_xs, gen_random_string(match.size()));
+        }
+
+        return urn;
+    }
+
+/**
+ * Converts a 'shm://name' URN into the '/name' form used by shm_open().
+ *
+ */
+
+    string shm_name(string urn)
+    {
+        size_t p = urn.find("://");
+        return "/" + (p == string::npos ? urn : urn.substr(p + 3));
+    }
+}
+
+namespace matrix
+{
+/**
+ * Creates a SHMTransportServer, returning a TransportServer pointer to
+ * it. This is the factory registered for the 'shm' transport.
+ *
+ * @param km_urn: the URN to the keymaster.
+ *
+ * @param key: The key to query the keymaster. This key should point to
+ * a YAML node that contains information about the data source. One of
+ * the sub-keys of this node must be a key 'Specified', which returns a
+ * vector of transports required for this data source.
+ *
+ * @return A TransportServer * pointing to the created SHMTransportServer.
+ *
+ */
+
+    TransportServer *SHMTransportServer::factory(string km_url, string key)
+    {
+        return new SHMTransportServer(km_url, key);
+    }
+
+/**
+ * \class Impl is the private implementation of the SHMTransportServer class
+ *
+ */
+
+    struct SHMTransportServer::Impl
+    {
+        // A channel remembers the spare buffer it has on loan, if any,
+        // and how many samples have been published on its key.
+        struct channel : public TransportServer::Channel
+        {
+            channel(string k)
+                : TransportServer::Channel(k),
+                  loaned(false),
+                  buf(0),
+                  published(0)
+            {
+            }
+
+            bool loaned;
+            uint32_t buf;
+            std::atomic<uint64_t> published;
+        };
+
+        Impl(string urn, size_t slots, size_t slot_size, size_t loans, mode_t mode,
+             backpressure_policy policy, Time::Time_t block_timeout);
+        ~Impl();
+
+        bool publish(channel *c, const void *data, size_t sze);
+        bool publish_n(channel *c, const void *data, size_t sze, size_t n);
+        channel *resolve(string key);
+        void *loan(channel *c, size_t sze);
+        bool commit(channel *c, size_t sze);
+        bool fits(const string &key, size_t sze);
+        shm_slot *claim(uint64_t &idx);
+        void commit(shm_slot *s, uint64_t idx, channel *c, size_t sze, size_t count = 1);
+        void wait_for_readers(uint64_t idx);
+        bool make_room(size_t n);
+        bool take_spare(uint32_t &b);
+        void put_spare(uint32_t b);
+        bool reader_alive(shm_reader &r);
+        void reap_readers();
+        vector<subscriber_stats> subscribers();
+        string get_urn();
+
+        string _urn;
+        string _name;
+        shm_ring _ring;
+        backpressure_policy _policy;
+        Time::Time_t _block_timeout;
+        Mutex _channels_mutex;
+        map<string, unique_ptr<channel> > _channels;
+        Mutex _spares_mutex;
+        vector<uint32_t> _spares;
+    };
+
+/**
+ * Creates and initializes the shared memory ring.
+ *
+ * @param urn: The (possibly partial) URN as specified.
+ * @param slots: The requested number of slots, rounded up to a power of two.
+ * @param slot_size: The largest sample size, in bytes.
+ * @param loans: How many loans may be outstanding at once.
+ * @param mode: The segment's permissions.
+ * @param policy: What to do when a reader falls a ring behind.
+ * @param block_timeout: How long BLOCK waits for room, in ns.
+ *
+ */
+
+    SHMTransportServer::Impl::Impl(string urn, size_t slots, size_t slot_size, size_t loans,
+                                   mode_t mode, backpressure_policy policy,
+                                   Time::Time_t block_timeout)
+        : _urn(process_shm_urn(urn)),
+          _name(shm_name(_urn)),
+          _policy(policy),
+          _block_timeout(block_timeout)
+    {
+        size_t n = 1;
+
+        while (n < slots)
+        {
+            n <<= 1;
+        }
+
+        if (!_ring.create(_name, n, loans, slot_size, mode))
+        {
+            throw CreationError(string("shm segment ") + _name + ": " + strerror(errno),
+                                vector<string>(1, urn));
+        }
+
+        for (size_t i = 0; i < loans; ++i)
+        {
+            _spares.push_back(n + i);
+        }
+    }
+
+/**
+ * Unmaps and unlinks the segment. Clients that still have it mapped
+ * keep their mapping until they disconnect.
+ *
+ */
+
+    SHMTransportServer::Impl::~Impl()
+    {
+        futex_wake(&_ring.hdr->commits);
+        _ring.unmap();
+        shm_unlink(_name.c_str());
+    }
+
+    string SHMTransportServer::Impl::get_urn()
+    {
+        return _urn;
+    }
+
+/**
+ * Waits until no reader is in the middle of reading the sample with
+ * index 'idx' in place. This is only ever a short wait, as readers
+ * hold a slot just for the length of their callback. A reader that
+ * died holding a slot is detected and its entry freed.
+ *
+ * @param idx: The index of the sample about to be overwritten.
+ *
+ */
+
+    void SHMTransportServer::Impl::wait_for_readers(uint64_t idx)
+    {
+        shm_header *hdr = _ring.hdr;
+
+        for (size_t i = 0; i < SHM_MAX_READERS; ++i)
+        {
+            shm_reader &r = hdr->readers[i];
+
+            for (int spins = 0; r.in_use.load() && r.reading.load() == idx + 1; ++spins)
+            {
+                if (spins < 1000)
+                {
+                    cpu_relax();
+                    continue;
+                }
+
+                if (!reader_alive(r))
+                {
+                    break;
+                }
+
+                sched_yield();
+            }
+        }
+    }
+
+/**
+ * Checks whether a reader's process still exists, freeing its entry
+ * if it doesn't.
+ *
+ * @param r: The reader entry.
+ *
+ * @return true if the reader is alive, false if its entry was freed.
+ *
+ */
+
+    bool SHMTransportServer::Impl::reader_alive(shm_reader &r)
+    {
+        return !reap_if_dead(r);
+    }
+
+/**
+ * Frees the entries of all readers whose processes have died. Called
+ * once per trip around the ring, and when reporting on subscribers,
+ * so that the entries of clients killed without disconnecting are
+ * not lost for good.
+ *
+ */
+
+    void SHMTransportServer::Impl::reap_readers()
+    {
+        shm_header *hdr = _ring.hdr;
+
+        for (size_t i = 0; i < SHM_MAX_READERS; ++i)
+        {
+            if (hdr->readers[i].in_use.load())
+            {
+                reap_if_dead(hdr->readers[i]);
+            }
+        }
+    }
+
+/**
+ * Under the DROP_NEWEST and BLOCK policies, checks that the next
+ * slot can be claimed without overwriting a sample some reader has
+ * not read yet. BLOCK waits up to '_block_timeout' for the readers
+ * to make room. If there is no room the 'n' samples about to be
+ * published are counted as dropped by each reader that is full.
+ * Under DROP_OLDEST there is always room.
+ *
+ * @param n: The number of samples that would go in the slot.
+ *
+ * @return true if the slot may be claimed, false if the samples
+ * must be dropped.
+ *
+ */
+
+    bool SHMTransportServer::Impl::make_room(size_t n)
+    {
+        shm_header *hdr = _ring.hdr;
+        Time::Time_t deadline = 0;
+
+        if (_policy == DROP_OLDEST)
+        {
+            return true;
+        }
+
+        for (;;)
+        {
+            uint64_t next = hdr->reserve.load();
+            bool room = true;
+
+            for (size_t i = 0; i < SHM_MAX_READERS; ++i)
+            {
+                shm_reader &r = hdr->readers[i];
+
+                if (r.in_use.load() && next - r.cursor.load() >= hdr->slots && reader_alive(r))
+                {
+                    room = false;
+                }
+            }
+
+            if (room)
+            {
+                return true;
+            }
+
+            if (_policy != BLOCK)
+            {
+                break;
+            }
+
+            Time::Time_t now = Time::getUTC();
+
+            if (deadline == 0)
+            {
+                deadline = now + _block_timeout;
+            }
+
+            if (now >= deadline)
+            {
+                break;
+            }
+
+            sched_yield();
+        }
+
+        uint64_t next = hdr->reserve.load();
+
+        for (size_t i = 0; i < SHM_MAX_READERS; ++i)
+        {
+            shm_reader &r = hdr->readers[i];
+
+            if (r.in_use.load() && next - r.cursor.load() >= hdr->slots)
+            {
+                r.dropped.fetch_add(n);
+            }
+        }
+
+        return false;
+    }
+
+/**
+ * Reports the depth (samples published but not yet read) and the
+ * losses of each attached reader. Readers are identified by pid.
+ *
+ * @return A vector of subscriber_stats, one per reader.
+ *
+ */
+
+    vector<TransportServer::subscriber_stats> SHMTransportServer::Impl::subscribers()
+    {
+        shm_header *hdr = _ring.hdr;
+        vector<subscriber_stats> stats;
+        uint64_t next = hdr->reserve.load();
+
+        reap_readers();
+
+        for (size_t i = 0; i < SHM_MAX_READERS; ++i)
+        {
+            shm_reader &r = hdr->readers[i];
+
+            if (r.in_use.load())
+            {
+                subscriber_stats st;
+                uint64_t cursor = r.cursor.load();
+
+                st.id = to_string(r.pid.load());
+                st.depth = next > cursor ? min<uint64_t>(next - cursor, hdr->slots) : 0;
+                st.dropped = r.dropped.load();
+                stats.push_back(st);
+            }
+        }
+
+        return stats;
+    }
+
+/**
+ * Checks that a sample will fit in a slot, complaining if it won't.
+ *
+ * @param key: The data key, "component.data".
+ *
+ * @param sze: The size of the sample.
+ *
+ * @return true if it fits, false otherwise.
+ *
+ */
+
+    bool SHMTransportServer::Impl::fits(const string &key, size_t sze)
+    {
+        if (sze > _ring.hdr->slot_size || key.size() > SHM_MAX_KEY)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- SHMTransportServer: sample of " << sze << " bytes for '" << key
+                 << "' does not fit a " << _ring.hdr->slot_size << " byte slot." << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+/**
+ * Claims the next slot and marks it as being written, so that readers
+ * will neither read it nor be reading it by the time this returns.
+ *
+ * @param idx: Set to the index of the claimed slot.
+ *
+ * @return The slot.
+ *
+ */
+
+    shm_slot *SHMTransportServer::Impl::claim(uint64_t &idx)
+    {
+        shm_header *hdr = _ring.hdr;
+
+        idx = hdr->reserve.fetch_add(1);
+        shm_slot *s = _ring.slot(idx);
+        s->seq.store(2 * idx + 1);
+
+        if ((idx & (hdr->slots - 1)) == 0)
+        {
+            reap_readers();
+        }
+
+        if (idx >= hdr->slots)
+        {
+            wait_for_readers(idx - hdr->slots);
+        }
+
+        return s;
+    }
+
+/**
+ * Commits a claimed slot whose payload has been filled in, and wakes
+ * any sleeping readers.
+ *
+ * @param s: The slot, as returned by 'claim()'.
+ *
+ * @param idx: Its index.
+ *
+ * @param c: The channel of the data key, "component.data".
+ *
+ * @param sze: The size of each sample in the payload.
+ *
+ * @param count: The number of samples in the payload.
+ *
+ */
+
+    void SHMTransportServer::Impl::commit(shm_slot *s, uint64_t idx, channel *c,
+                                          size_t sze, size_t count)
+    {
+        shm_header *hdr = _ring.hdr;
+
+        s->number = c->published.fetch_add(count);
+        s->key_len = c->key.size();
+        memcpy(s->key, c->key.data(), c->key.size());
+        s->size = sze;
+        s->count = count;
+        s->seq.store(2 * idx + 2, std::memory_order_release);
+
+        hdr->commits.fetch_add(1);
+
+        if (hdr->waiters.load() > 0)
+        {
+            futex_wake(&hdr->commits);
+        }
+    }
+
+/**
+ * Publishes a sample. A slot is claimed, the data are copied in and
+ * the slot is committed.
+ *
+ * @param c: The channel of the data key, "component.data".
+ *
+ * @param data: A pointer to the data
+ *
+ * @param sze: The size of the data buffer pointed to by 'data'
+ *
+ * @return true on success, false if the sample is larger than the
+ * configured 'SlotSize', the key is too long, or the sample was
+ * dropped under the backpressure policy.
+ *
+ */
+
+    bool SHMTransportServer::Impl::publish(channel *c, const void *data, size_t sze)
+    {
+        uint64_t idx;
+
+        if (!fits(c->key, sze) || !make_room(1))
+        {
+            return false;
+        }
+
+        shm_slot *s = claim(idx);
+        memcpy(_ring.payload(s), data, sze);
+        commit(s, idx, c, sze);
+        return true;
+    }
+
+/**
+ * Publishes 'n' samples of 'sze' bytes each, packing as many into
+ * each slot as will fit.
+ *
+ * @param c: The channel of the data key, "component.data".
+ *
+ * @param data: A pointer to the first sample
+ *
+ * @param sze: The size of each sample
+ *
+ * @param n: The number of samples
+ *
+ * @return true on success, false if a sample is larger than the
+ * configured 'SlotSize', the key is too long, or samples were dropped
+ * under the backpressure policy.
+ *
+ */
+
+    bool SHMTransportServer::Impl::publish_n(channel *c, const void *data, size_t sze, size_t n)
+    {
+        if (!fits(c->key, sze))
+        {
+            return false;
+        }
+
+        size_t per_slot = sze ? _ring.hdr->slot_size / sze : n;
+
+        while (n)
+        {
+            uint64_t idx;
+            size_t k = min(n, per_slot);
+
+            if (!make_room(n))
+            {
+                return false;
+            }
+
+            shm_slot *s = claim(idx);
+
+            memcpy(_ring.payload(s), data, k * sze);
+            commit(s, idx, c, sze, k);
+            data = (const char *)data + k * sze;
+            n -= k;
+        }
+
+        return true;
+    }
+
+    SHMTransportServer::Impl::channel *SHMTransportServer::Impl::resolve(string key)
+    {
+        ThreadLock<Mutex> l(_channels_mutex);
+
+        l.lock();
+        unique_ptr<channel> &c = _channels[key];
+
+        if (!c)
+        {
+            c.reset(new channel(key));
+        }
+
+        return c.get();
+    }
+
+/**
+ * Takes a buffer from the spare pool.
+ *
+ * @param b: Set to the buffer taken.
+ *
+ * @return true if there was one, false if all are out on loan.
+ *
+ */
+
+    bool SHMTransportServer::Impl::take_spare(uint32_t &b)
+    {
+        ThreadLock<Mutex> l(_spares_mutex);
+
+        l.lock();
+
+        if (_spares.empty())
+        {
+            return false;
+        }
+
+        b = _spares.back();
+        _spares.pop_back();
+        return true;
+    }
+
+    void SHMTransportServer::Impl::put_spare(uint32_t b)
+    {
+        ThreadLock<Mutex> l(_spares_mutex);
+
+        l.lock();
+        _spares.push_back(b);
+    }
+
+/**
+ * Lends out the payload area of a spare buffer, so that the caller
+ * builds the sample directly in shared memory. The buffer is not in
+ * the ring until it is committed, so neither readers nor the producer
+ * ever wait on a loan, however long it is out.
+ *
+ * @param c: The channel.
+ *
+ * @param sze: The size needed.
+ *
+ * @return A pointer to the buffer's payload, or NULL if 'sze' is
+ * larger than the configured 'SlotSize', or if all of the 'Loans'
+ * buffers are already out on loan.
+ *
+ */
+
+    void *SHMTransportServer::Impl::loan(channel *c, size_t sze)
+    {
+        if (!fits(c->key, sze))
+        {
+            return nullptr;
+        }
+
+        // loaned again without a commit: hand back the same buffer.
+        if (!c->loaned)
+        {
+            if (!take_spare(c->buf))
+            {
+                return nullptr;
+            }
+
+            c->loaned = true;
+        }
+
+        return _ring.payload(_ring.buffer(c->buf));
+    }
+
+/**
+ * Publishes a loaned buffer. The next slot is claimed as for
+ * 'publish()', but instead of copying into it the loaned buffer is
+ * swapped in for the slot's own, which goes back to the spare pool.
+ *
+ * @param c: The channel.
+ *
+ * @param sze: The size of the sample.
+ *
+ * @return true on success, false if there was no loan, or the sample
+ * was dropped under the backpressure policy. In every case the loan
+ * is over.
+ *
+ */
+
+    bool SHMTransportServer::Impl::commit(channel *c, size_t sze)
+    {
+        uint64_t idx;
+
+        if (!c->loaned || sze > _ring.hdr->slot_size)
+        {
+            return false;
+        }
+
+        c->loaned = false;
+
+        if (!make_room(1))
+        {
+            put_spare(c->buf);
+            return false;
+        }
+
+        // claim() marks the slot's current buffer as being written and
+        // waits out its readers; the loaned buffer gets the same mark
+        // before taking its place, so a reader sees one or the other.
+        claim(idx);
+        shm_slot *s = _ring.buffer(c->buf);
+        s->seq.store(2 * idx + 1);
+        uint32_t old = _ring.slot_map(idx).exchange(c->buf);
+        commit(s, idx, c, sze);
+        put_spare(old);
+        return true;
+    }
+
+/**
+ * Constructor for the SHMTransportServer. Creates the ring and
+ * registers its URN with the Keymaster.
+ *
+ * @param keymaster_url: The keymaster URN.
+ *
+ * @param key: The data transport key that specifies the transport configuration.
+ *
+ */
+
+    SHMTransportServer::SHMTransportServer(string keymaster_url, string key)
+        : TransportServer(keymaster_url, key)
+    {
+        try
+        {
+            Keymaster km(_km_url);
+            yaml_result yr;
+            size_t slots = SHM_DEFAULT_SLOTS;
+            size_t slot_size = SHM_DEFAULT_SLOT_SIZE;
+            size_t loans = SHM_DEFAULT_LOANS;
+            mode_t mode = SHM_DEFAULT_MODE;
+            string urn = km.get_as<vector<string> >(_transport_key + ".Specified").front();
+
+            if (km.get(_transport_key + ".Slots", yr))
+            {
+                slots = yr.node.as<size_t>();
+            }
+
+            if (km.get(_transport_key + ".SlotSize", yr))
+            {
+                slot_size = yr.node.as<size_t>();
+            }
+
+            if (km.get(_transport_key + ".Loans", yr))
+            {
+                loans = yr.node.as<size_t>();
+            }
+
+            // octal, as for chmod: "0660"
+            if (km.get(_transport_key + ".Mode", yr))
+            {
+                mode = strtoul(yr.node.as<string>().c_str(), nullptr, 8);
+            }
+
+            _configure_backpressure(km);
+            _impl.reset(new Impl(urn, slots, slot_size, loans, mode, _policy, _block_timeout));
+            vector<string> urns;
+            urns.push_back(_impl->get_urn());
+            km.put(_transport_key + ".AsConfigured", urns, true);
+        }
+        catch (KeymasterException &e)
+        {
+            throw CreationError(e.what());
+        }
+        catch (YAML::Exception &e)
+        {
+            throw CreationError(e.what());
+        }
+    }
+
+    SHMTransportServer::~SHMTransportServer()
+    {
+        _impl.reset();
+
+        try
+        {
+            Keymaster km(_km_url);
+            km.del(_transport_key + ".AsConfigured");
+        }
+        catch (KeymasterException &e)
+        {
+            // The KeymasterServer may already be gone. Don't throw
+            // from the destructor.
+        }
+    }
+
+    bool SHMTransportServer::_publish(string key, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(_impl->resolve(key), data, size_of_data);
+    }
+
+    bool SHMTransportServer::_publish(string key, string data)
+    {
+        return _impl->publish(_impl->resolve(key), data.data(), data.size());
+    }
+
+    bool SHMTransportServer::_publish(channel_t ch, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(static_cast<Impl::channel *>(ch), data, size_of_data);
+    }
+
+    bool SHMTransportServer::_publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n)
+    {
+        return _impl->publish_n(static_cast<Impl::channel *>(ch), data, size_of_data, n);
+    }
+
+    vector<TransportServer::subscriber_stats> SHMTransportServer::_subscribers()
+    {
+        return _impl->subscribers();
+    }
+
+    TransportServer::channel_t SHMTransportServer::_resolve(string key)
+    {
+        return _impl->resolve(key);
+    }
+
+    void *SHMTransportServer::_loan(channel_t ch, size_t size)
+    {
+        return _impl->loan(static_cast<Impl::channel *>(ch), size);
+    }
+
+    bool SHMTransportServer::_commit(channel_t ch, size_t size)
+    {
+        return _impl->commit(static_cast<Impl::channel *>(ch), size);
+    }
+
+/**********************************************************************
+ * Transport Client
+ **********************************************************************/
+
+    TransportClient *SHMTransportClient::factory(string urn)
+    {
+        return new SHMTransportClient(urn);
+    }
+
+    struct SHMTransportClient::Impl
+    {
+        Impl()
+            : _reader(nullptr),
+              _connected(false),
+              _run(false),
+              _reader_thread(this, &SHMTransportClient::Impl::reader_task),
+              _task_ready(false)
+        {
+        }
+
+        ~Impl()
+        {
+            disconnect();
+        }
+
+        bool connect(string urn);
+        bool disconnect();
+        bool subscribe(string key, DataCallbackBase *cb);
+        bool unsubscribe(string key);
+
+        void reader_task();
+        void dispatch(shm_slot *s);
+
+        shm_ring _ring;
+        shm_reader *_reader;
+        bool _connected;
+        std::atomic<bool> _run;
+        Thread<SHMTransportClient::Impl> _reader_thread;
+        TCondition<bool> _task_ready;
+        Mutex _subscriber_lock;
+        vector<pair<string, DataCallbackBase *> > _subscribers;
+        // the 'number' expected next on each subscribed key; guarded
+        // by '_subscriber_lock'.
+        map<string, uint64_t> _next;
+    };
+
+/**
+ * Maps the server's ring, claims a reader entry in it and starts the
+ * reader thread. The reader starts with the next sample published.
+ *
+ * @param urn: The 'shm://' URN of the server.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool SHMTransportClient::Impl::connect(string urn)
+    {
+        if (_connected)
+        {
+            return false;
+        }
+
+        if (!_ring.open(shm_name(urn)))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- SHMTransportClient: unable to map " << urn << endl;
+            return false;
+        }
+
+        shm_header *hdr = _ring.hdr;
+
+        // entries left by clients that died are free for the taking.
+        for (size_t i = 0; i < SHM_MAX_READERS; ++i)
+        {
+            if (hdr->readers[i].in_use.load())
+            {
+                reap_if_dead(hdr->readers[i]);
+            }
+        }
+
+        for (size_t i = 0; i < SHM_MAX_READERS && !_reader; ++i)
+        {
+            uint32_t free_entry = 0;
+
+            if (hdr->readers[i].in_use.compare_exchange_strong(free_entry, 1))
+            {
+                _reader = &hdr->readers[i];
+                _reader->pid.store(getpid());
+                _reader->reading.store(0);
+                _reader->dropped.store(0);
+                _reader->cursor.store(hdr->reserve.load());
+            }
+        }
+
+        if (!_reader)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- SHMTransportClient: no free reader entries in " << urn << endl;
+            _ring.unmap();
+            return false;
+        }
+
+        {
+            ThreadLock<Mutex> l(_subscriber_lock);
+
+            l.lock();
+            _next.clear();
+        }
+
+        _run.store(true);
+
+        if (_reader_thread.start() != 0 || !_task_ready.wait(true, 1000000))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- SHMTransportClient for URN " << urn
+                 << ": failure to start reader thread." << endl;
+            _run.store(false);
+            _reader->in_use.store(0);
+            _reader = nullptr;
+            _ring.unmap();
+            return false;
+        }
+
+        _connected = true;
+        return true;
+    }
+
+    bool SHMTransportClient::Impl::disconnect()
+    {
+        if (_connected)
+        {
+            _run.store(false);
+            futex_wake(&_ring.hdr->commits);
+            _reader_thread.stop_without_cancel();
+            _task_ready.set_value(false);
+            _reader->reading.store(0);
+            _reader->in_use.store(0);
+            _reader = nullptr;
+            _ring.unmap();
+            _connected = false;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool SHMTransportClient::Impl::subscribe(string key, DataCallbackBase *cb)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+
+        if (key.empty() || key.size() > SHM_MAX_KEY)
+        {
+            return false;
+        }
+
+        l.lock();
+        auto i = find_if(_subscribers.begin(), _subscribers.end(),
+                         [&key](pair<string, DataCallbackBase *> &s) {return s.first == key;});
+
+        if (i != _subscribers.end())
+        {
+            i->second = cb;
+        }
+        else
+        {
+            _subscribers.push_back(make_pair(key, cb));
+        }
+
+        return true;
+    }
+
+    bool SHMTransportClient::Impl::unsubscribe(string key)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+
+        l.lock();
+        auto i = find_if(_subscribers.begin(), _subscribers.end(),
+                         [&key](pair<string, DataCallbackBase *> &s) {return s.first == key;});
+
+        if (i != _subscribers.end())
+        {
+            _subscribers.erase(i);
+            _next.erase(key);
+            return true;
+        }
+
+        return false;
+    }
+
+/**
+ * Hands a committed slot, in place, to the callback subscribed to its
+ * key, if any. Samples skipped on the key since the last slot seen
+ * for it are first reported to the callback's 'lost()', and counted
+ * as dropped.
+ *
+ * @param s: The slot.
+ *
+ */
+
+    void SHMTransportClient::Impl::dispatch(shm_slot *s)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+
+        l.lock();
+
+        for (auto i = _subscribers.begin(); i != _subscribers.end(); ++i)
+        {
+            if (i->first.size() == s->key_len && memcmp(i->first.data(), s->key, s->key_len) == 0)
+            {
+                auto n = _next.find(i->first);
+
+                if (n == _next.end())
+                {
+                    n = _next.insert(make_pair(i->first, s->number)).first;
+                }
+
+                // a number lower than expected means the server started
+                // over; nothing can be told then.
+                if (s->number > n->second)
+                {
+                    _reader->dropped.fetch_add(s->number - n->second);
+                    i->second->lost(i->first, s->number - n->second);
+                }
+
+                n->second = s->number + s->count;
+
+                if (s->count == 1)
+                {
+                    i->second->exec(i->first, _ring.payload(s), s->size);
+                }
+                else
+                {
+                    i->second->exec_n(i->first, _ring.payload(s), s->size, s->count);
+                }
+
+                break;
+            }
+        }
+    }
+
+/**
+ * The reader thread. Follows the producer around the ring, reading
+ * each committed slot in place. If it falls a whole ring behind it
+ * skips ahead to the oldest slot still intact; the samples it skipped
+ * are counted by 'dispatch()', on each key, when the next one on the
+ * key is read. When there is nothing to read it sleeps on the
+ * segment's commit futex.
+ *
+ */
+
+    void SHMTransportClient::Impl::reader_task()
+    {
+        shm_header *hdr = _ring.hdr;
+        uint64_t idx = _reader->cursor.load();
+        int spins = 0;
+
+        _task_ready.signal(true);
+
+        while (_run.load())
+        {
+            uint32_t commits = hdr->commits.load();
+            shm_slot *s = _ring.slot(idx);
+            uint64_t seq = s->seq.load(std::memory_order_acquire);
+
+            if (seq == 2 * idx + 2)
+            {
+                // Announce the read, then make sure the slot was not
+                // claimed for reuse in the meantime. The producer does
+                // the converse, so one of us always sees the other.
+                _reader->reading.store(idx + 1);
+
+                // if it was, it is lost, as if lapped.
+                if (s->seq.load() == 2 * idx + 2)
+                {
+                    dispatch(s);
+                }
+
+                _reader->reading.store(0);
+                _reader->cursor.store(++idx);
+                spins = 0;
+            }
+            else if (seq > 2 * idx + 2)
+            {
+                // lapped by the producer.
+                uint64_t oldest = hdr->reserve.load() - hdr->slots + 1;
+                idx = max(idx + 1, oldest);
+                _reader->cursor.store(idx);
+            }
+            else if (hdr->reserve.load() > idx && ++spins < 1000)
+            {
+                // claimed, but the producer is still filling it in.
+                // This is brief: loans are built outside the ring.
+                cpu_relax();
+            }
+            else
+            {
+                spins = 0;
+                hdr->waiters.fetch_add(1);
+                futex_wait(&hdr->commits, commits, 100000000);
+                hdr->waiters.fetch_sub(1);
+            }
+        }
+    }
+
+/**
+ * SHMTransportClient constructor.
+ *
+ * @param urn: The fully formed URN of the TransportServer,
+ * 'shm://<name>'.
+ *
+ */
+
+    SHMTransportClient::SHMTransportClient(string urn)
+        : TransportClient(urn),
+          _impl(new Impl())
+    {
+    }
+
+    SHMTransportClient::~SHMTransportClient()
+    {
+        _impl->disconnect();
+    }
+
+    bool SHMTransportClient::_connect()
+    {
+        return _impl->connect(_urn);
+    }
+
+    bool SHMTransportClient::_disconnect()
+    {
+        return _impl->disconnect();
+    }
+
+    bool SHMTransportClient::_subscribe(string key, DataCallbackBase *cb)
+    {
+        return _impl->subscribe(key, cb);
+    }
+
+    bool SHMTransportClient::_unsubscribe(string key)
+    {
+        return _impl->unsubscribe(key);
+    }
+}
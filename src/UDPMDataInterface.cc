@@ -0,0 +1,763 @@
+/*******************************************************************
+ *  UDPMDataInterface.cc - A DataInterface transport over UDP
+ *  multicast.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/UDPMDataInterface.h"
+#include "matrix/Keymaster.h"
+#include "matrix/Thread.h"
+#include "matrix/ThreadLock.h"
+#include "matrix/TCondition.h"
+#include "matrix/Time.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <random>
+#include <cstring>
+
+#include <boost/regex.hpp>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <endian.h>
+#include <unistd.h>
+#include <errno.h>
+
+using namespace std;
+using namespace mxutils;
+using namespace matrix;
+
+namespace
+{
+    const uint32_t UDPM_MAGIC = 0x4d554d58; // "XMUM"
+    const size_t UDPM_MAX_DATAGRAM = 65507; // largest UDP payload over IPv4
+    const size_t UDPM_MAX_KEY = 255;
+    const int UDPM_RCVBUF = 4 * 1024 * 1024;
+
+    // Every datagram starts with this header, in network byte order,
+    // followed by the key and then 'count' samples of 'size' bytes.
+    // 'seq' numbers samples, per key, so a client can tell how many
+    // went missing from the jump between one datagram and the next.
+    struct __attribute__((packed)) udpm_header
+    {
+        uint32_t magic;
+        uint64_t seq;
+        uint32_t count;
+        uint32_t size;
+        uint8_t key_len;
+    };
+
+    struct udpm_address
+    {
+        string iface;
+        sockaddr_in group;
+    };
+
+/**
+ * Turns a transport specification into a complete udpm URN:
+ *
+ *   - 'udpm' becomes 'udpm://239.192.<random>.<random>:<random port>'
+ *   - a port given as 'XXXXX' is replaced by a random port
+ *   - anything else is returned as is.
+ *
+ */
+
+    string process_udpm_urn(string urn)
+    {
+        static std::mt19937 rng(std::random_device{}());
+        std::uniform_int_distribution<int> octet(1, 254), port(49152, 65535);
+        boost::regex p_xs("X+$");
+        ostringstream r;
+
+        if (urn == "udpm")
+        {
+            r << "udpm://239.192." << octet(rng) << "." << octet(rng) << ":" << port(rng);
+            return r.str();
+        }
+
+        if (boost::regex_search(urn, p_xs))
+        {
+            r << port(rng);
+            return boost::regex_replace(urn, p_xs, r.str());
+        }
+
+        return urn;
+    }
+
+/**
+ * Splits a 'udpm://[interface;]group:port' URN into its parts.
+ *
+ * @param urn: The URN.
+ *
+ * @param addr: Receives the interface (possibly empty) and the group
+ * address.
+ *
+ * @return true if the URN is well formed and names a multicast group.
+ *
+ */
+
+    bool parse_udpm_urn(const string &urn, udpm_address &addr)
+    {
+        boost::regex p_urn("^udpm://(([^;]+);)?([0-9.]+):([0-9]+)$");
+        boost::smatch result;
+
+        if (!boost::regex_match(urn, result, p_urn))
+        {
+            return false;
+        }
+
+        addr.iface = result[2];
+        memset(&addr.group, 0, sizeof addr.group);
+        addr.group.sin_family = AF_INET;
+        addr.group.sin_port = htons(stoi(result[4]));
+
+        return inet_pton(AF_INET, string(result[3]).c_str(), &addr.group.sin_addr) == 1
+            && IN_MULTICAST(ntohl(addr.group.sin_addr.s_addr));
+    }
+
+/**
+ * Fills in the interface part of an ip_mreqn, from either an IPv4
+ * address or an interface name. An empty 'iface' leaves the choice
+ * to the kernel.
+ *
+ * @param iface: The interface.
+ *
+ * @param mr: The ip_mreqn.
+ *
+ * @return true if the interface was recognized.
+ *
+ */
+
+    bool udpm_interface(const string &iface, ip_mreqn &mr)
+    {
+        memset(&mr, 0, sizeof mr);
+
+        if (iface.empty() || inet_pton(AF_INET, iface.c_str(), &mr.imr_address) == 1)
+        {
+            return true;
+        }
+
+        mr.imr_ifindex = if_nametoindex(iface.c_str());
+        return mr.imr_ifindex != 0;
+    }
+}
+
+namespace matrix
+{
+/**
+ * Creates a UDPMTransportServer, returning a TransportServer pointer
+ * to it. This is the factory registered for the 'udpm' transport.
+ *
+ * @param km_urn: the URN to the keymaster.
+ *
+ * @param key: The key to query the keymaster. This key should point to
+ * a YAML node that contains information about the data source. One of
+ * the sub-keys of this node must be a key 'Specified', which returns a
+ * vector of transports required for this data source.
+ *
+ * @return A TransportServer * pointing to the created UDPMTransportServer.
+ *
+ */
+
+    TransportServer *UDPMTransportServer::factory(string km_url, string key)
+    {
+        return new UDPMTransportServer(km_url, key);
+    }
+
+/**
+ * \class Impl is the private implementation of the UDPMTransportServer class
+ *
+ */
+
+    struct UDPMTransportServer::Impl
+    {
+        // A channel keeps its key's sequence number.
+        struct channel : public TransportServer::Channel
+        {
+            channel(string k)
+                : TransportServer::Channel(k),
+                  seq(0)
+            {
+            }
+
+            std::atomic<uint64_t> seq;
+        };
+
+        Impl(string urn, int ttl);
+        ~Impl();
+
+        bool publish(channel *c, const void *data, size_t sze, size_t n);
+        channel *resolve(string key);
+        string get_urn();
+
+        string _urn;
+        udpm_address _addr;
+        int _sock;
+        Mutex _channels_mutex;
+        map<string, unique_ptr<channel> > _channels;
+    };
+
+/**
+ * Opens the socket the server sends from.
+ *
+ * @param urn: The (possibly partial) URN as specified.
+ * @param ttl: The multicast time to live.
+ *
+ */
+
+    UDPMTransportServer::Impl::Impl(string urn, int ttl)
+        : _urn(process_udpm_urn(urn)),
+          _sock(-1)
+    {
+        ip_mreqn mr;
+        int one = 1;
+
+        if (!parse_udpm_urn(_urn, _addr) || !udpm_interface(_addr.iface, mr))
+        {
+            throw CreationError("not a valid 'udpm://[interface;]group:port' URN",
+                                vector<string>(1, urn));
+        }
+
+        _sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (_sock == -1
+            || setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof ttl) == -1
+            || setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof one) == -1
+            || (!_addr.iface.empty()
+                && setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_IF, &mr, sizeof mr) == -1))
+        {
+            string err = strerror(errno);
+
+            if (_sock != -1)
+            {
+                close(_sock);
+            }
+
+            throw CreationError("udpm socket: " + err, vector<string>(1, urn));
+        }
+    }
+
+    UDPMTransportServer::Impl::~Impl()
+    {
+        close(_sock);
+    }
+
+    string UDPMTransportServer::Impl::get_urn()
+    {
+        return _urn;
+    }
+
+/**
+ * Publishes 'n' samples of 'sze' bytes each, packing as many into each
+ * datagram as will fit. The header, key and samples are gathered by
+ * sendmsg() straight from where they are, without a copy.
+ *
+ * @param c: The channel.
+ *
+ * @param data: A pointer to the first sample
+ *
+ * @param sze: The size of each sample
+ *
+ * @param n: The number of samples
+ *
+ * @return true on success, false if a sample or the key is too
+ * large, or a datagram could not be sent.
+ *
+ */
+
+    bool UDPMTransportServer::Impl::publish(channel *c, const void *data, size_t sze, size_t n)
+    {
+        size_t room = UDPM_MAX_DATAGRAM - sizeof(udpm_header) - c->key.size();
+
+        if (c->key.size() > UDPM_MAX_KEY || sze > room)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- UDPMTransportServer: sample of " << sze << " bytes for '" << c->key
+                 << "' does not fit in a datagram." << endl;
+            return false;
+        }
+
+        size_t per_datagram = sze ? room / sze : n;
+        bool rval = true;
+
+        while (n)
+        {
+            size_t k = min(n, per_datagram);
+            udpm_header hdr;
+            iovec iov[3];
+            msghdr msg;
+
+            hdr.magic = htonl(UDPM_MAGIC);
+            hdr.seq = htobe64(c->seq.fetch_add(k));
+            hdr.count = htonl(k);
+            hdr.size = htonl(sze);
+            hdr.key_len = c->key.size();
+
+            iov[0].iov_base = &hdr;
+            iov[0].iov_len = sizeof hdr;
+            iov[1].iov_base = (void *)c->key.data();
+            iov[1].iov_len = c->key.size();
+            iov[2].iov_base = (void *)data;
+            iov[2].iov_len = k * sze;
+
+            memset(&msg, 0, sizeof msg);
+            msg.msg_name = &_addr.group;
+            msg.msg_namelen = sizeof _addr.group;
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 3;
+
+            // a datagram that can't be sent is lost like any other; the
+            // sequence number has moved on, so clients will count it.
+            if (sendmsg(_sock, &msg, 0) == -1)
+            {
+                rval = false;
+            }
+
+            data = (const char *)data + k * sze;
+            n -= k;
+        }
+
+        return rval;
+    }
+
+    UDPMTransportServer::Impl::channel *UDPMTransportServer::Impl::resolve(string key)
+    {
+        ThreadLock<Mutex> l(_channels_mutex);
+
+        l.lock();
+        unique_ptr<channel> &c = _channels[key];
+
+        if (!c)
+        {
+            c.reset(new channel(key));
+        }
+
+        return c.get();
+    }
+
+/**
+ * Constructor for the UDPMTransportServer. Opens the socket and
+ * registers the group's URN with the Keymaster.
+ *
+ * @param keymaster_url: The keymaster URN.
+ *
+ * @param key: The data transport key that specifies the transport configuration.
+ *
+ */
+
+    UDPMTransportServer::UDPMTransportServer(string keymaster_url, string key)
+        : TransportServer(keymaster_url, key)
+    {
+        try
+        {
+            Keymaster km(_km_url);
+            yaml_result yr;
+            int ttl = 1;
+            string urn = km.get_as<vector<string> >(_transport_key + ".Specified").front();
+
+            if (km.get(_transport_key + ".TTL", yr))
+            {
+                ttl = yr.node.as<int>();
+            }
+
+            _impl.reset(new Impl(urn, ttl));
+            vector<string> urns;
+            urns.push_back(_impl->get_urn());
+            km.put(_transport_key + ".AsConfigured", urns, true);
+        }
+        catch (KeymasterException &e)
+        {
+            throw CreationError(e.what());
+        }
+        catch (YAML::Exception &e)
+        {
+            throw CreationError(e.what());
+        }
+    }
+
+    UDPMTransportServer::~UDPMTransportServer()
+    {
+        _impl.reset();
+
+        try
+        {
+            Keymaster km(_km_url);
+            km.del(_transport_key + ".AsConfigured");
+        }
+        catch (KeymasterException &e)
+        {
+            // The KeymasterServer may already be gone. Don't throw
+            // from the destructor.
+        }
+    }
+
+    bool UDPMTransportServer::_publish(string key, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(_impl->resolve(key), data, size_of_data, 1);
+    }
+
+    bool UDPMTransportServer::_publish(string key, string data)
+    {
+        return _impl->publish(_impl->resolve(key), data.data(), data.size(), 1);
+    }
+
+    bool UDPMTransportServer::_publish(channel_t ch, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(static_cast<Impl::channel *>(ch), data, size_of_data, 1);
+    }
+
+    bool UDPMTransportServer::_publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n)
+    {
+        return _impl->publish(static_cast<Impl::channel *>(ch), data, size_of_data, n);
+    }
+
+    TransportServer::channel_t UDPMTransportServer::_resolve(string key)
+    {
+        return _impl->resolve(key);
+    }
+
+/**********************************************************************
+ * Transport Client
+ **********************************************************************/
+
+    TransportClient *UDPMTransportClient::factory(string urn)
+    {
+        return new UDPMTransportClient(urn);
+    }
+
+    struct UDPMTransportClient::Impl
+    {
+        // 'next_seq' is the sequence number expected next for 'key';
+        // it means nothing until the first datagram is seen.
+        struct subscriber
+        {
+            string key;
+            DataCallbackBase *cb;
+            uint64_t next_seq;
+            bool synced;
+        };
+
+        Impl()
+            : _sock(-1),
+              _connected(false),
+              _run(false),
+              _reader_thread(this, &UDPMTransportClient::Impl::reader_task),
+              _task_ready(false)
+        {
+        }
+
+        ~Impl()
+        {
+            disconnect();
+        }
+
+        bool connect(string urn);
+        bool disconnect();
+        bool subscribe(string key, DataCallbackBase *cb);
+        bool unsubscribe(string key);
+
+        void reader_task();
+        void dispatch(char *buf, size_t len);
+
+        int _sock;
+        bool _connected;
+        std::atomic<bool> _run;
+        Thread<UDPMTransportClient::Impl> _reader_thread;
+        TCondition<bool> _task_ready;
+        Mutex _subscriber_lock;
+        vector<subscriber> _subscribers;
+    };
+
+/**
+ * Joins the server's multicast group and starts the receiver thread.
+ *
+ * @param urn: The 'udpm://' URN of the server.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool UDPMTransportClient::Impl::connect(string urn)
+    {
+        udpm_address addr;
+        ip_mreqn mr;
+        int one = 1;
+        int rcvbuf = UDPM_RCVBUF;
+        timeval tv = {0, 100000};
+
+        if (_connected)
+        {
+            return false;
+        }
+
+        if (!parse_udpm_urn(urn, addr) || !udpm_interface(addr.iface, mr))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- UDPMTransportClient: not a valid URN: " << urn << endl;
+            return false;
+        }
+
+        mr.imr_multiaddr = addr.group.sin_addr;
+        _sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        // several clients on one host may listen to the same group, so
+        // the address is shared. Binding to the group address, rather
+        // than INADDR_ANY, keeps out other groups on the same port.
+        if (_sock == -1
+            || setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1
+            || bind(_sock, (sockaddr *)&addr.group, sizeof addr.group) == -1
+            || setsockopt(_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof mr) == -1
+            || setsockopt(_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == -1)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- UDPMTransportClient: unable to join " << urn
+                 << ": " << strerror(errno) << endl;
+
+            if (_sock != -1)
+            {
+                close(_sock);
+                _sock = -1;
+            }
+
+            return false;
+        }
+
+        // a large receive buffer rides out bursts; the kernel may
+        // trim this to its limit, which is fine.
+        setsockopt(_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+        _run.store(true);
+
+        if (_reader_thread.start() != 0 || !_task_ready.wait(true, 1000000))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- UDPMTransportClient for URN " << urn
+                 << ": failure to start receiver thread." << endl;
+            _run.store(false);
+            close(_sock);
+            _sock = -1;
+            return false;
+        }
+
+        _connected = true;
+        return true;
+    }
+
+    bool UDPMTransportClient::Impl::disconnect()
+    {
+        if (_connected)
+        {
+            _run.store(false);
+            _reader_thread.stop_without_cancel();
+            _task_ready.set_value(false);
+            close(_sock);
+            _sock = -1;
+            _connected = false;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool UDPMTransportClient::Impl::subscribe(string key, DataCallbackBase *cb)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+
+        if (key.empty() || key.size() > UDPM_MAX_KEY)
+        {
+            return false;
+        }
+
+        l.lock();
+        auto i = find_if(_subscribers.begin(), _subscribers.end(),
+                         [&key](subscriber &s) {return s.key == key;});
+
+        if (i != _subscribers.end())
+        {
+            i->cb = cb;
+        }
+        else
+        {
+            subscriber s = {key, cb, 0, false};
+            _subscribers.push_back(s);
+        }
+
+        return true;
+    }
+
+    bool UDPMTransportClient::Impl::unsubscribe(string key)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+
+        l.lock();
+        auto i = find_if(_subscribers.begin(), _subscribers.end(),
+                         [&key](subscriber &s) {return s.key == key;});
+
+        if (i != _subscribers.end())
+        {
+            _subscribers.erase(i);
+            return true;
+        }
+
+        return false;
+    }
+
+/**
+ * Hands the samples in a datagram to the callback subscribed to its
+ * key, if any, first reporting any samples that the sequence number
+ * shows to have gone missing since the last datagram for that key.
+ *
+ * @param buf: The datagram.
+ *
+ * @param len: Its length.
+ *
+ */
+
+    void UDPMTransportClient::Impl::dispatch(char *buf, size_t len)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+        udpm_header hdr;
+
+        if (len < sizeof hdr)
+        {
+            return;
+        }
+
+        memcpy(&hdr, buf, sizeof hdr);
+
+        uint64_t seq = be64toh(hdr.seq);
+        size_t count = ntohl(hdr.count);
+        size_t sze = ntohl(hdr.size);
+        char *key = buf + sizeof hdr;
+        char *data = key + hdr.key_len;
+
+        if (ntohl(hdr.magic) != UDPM_MAGIC
+            || len < sizeof hdr + hdr.key_len
+            || (sze && count > (len - sizeof hdr - hdr.key_len) / sze))
+        {
+            return;
+        }
+
+        l.lock();
+
+        for (auto i = _subscribers.begin(); i != _subscribers.end(); ++i)
+        {
+            if (i->key.size() == hdr.key_len && memcmp(i->key.data(), key, hdr.key_len) == 0)
+            {
+                // a sequence number behind the expected one means the
+                // server restarted, or the network reordered; either
+                // way, start counting afresh.
+                if (i->synced && seq > i->next_seq)
+                {
+                    i->cb->lost(i->key, seq - i->next_seq);
+                }
+
+                i->next_seq = seq + count;
+                i->synced = true;
+
+                if (count == 1)
+                {
+                    i->cb->exec(i->key, data, sze);
+                }
+                else if (count > 1)
+                {
+                    i->cb->exec_n(i->key, data, sze, count);
+                }
+
+                break;
+            }
+        }
+    }
+
+/**
+ * The receiver thread. Reads one datagram at a time and dispatches it;
+ * the socket's receive time-out lets it notice when to quit.
+ *
+ */
+
+    void UDPMTransportClient::Impl::reader_task()
+    {
+        vector<char> buf(UDPM_MAX_DATAGRAM + 1);
+
+        _task_ready.signal(true);
+
+        while (_run.load())
+        {
+            ssize_t n = recv(_sock, buf.data(), buf.size(), 0);
+
+            if (n > 0)
+            {
+                dispatch(buf.data(), n);
+            }
+        }
+    }
+
+/**
+ * UDPMTransportClient constructor.
+ *
+ * @param urn: The fully formed URN of the TransportServer,
+ * 'udpm://[interface;]group:port'.
+ *
+ */
+
+    UDPMTransportClient::UDPMTransportClient(string urn)
+        : TransportClient(urn),
+          _impl(new Impl())
+    {
+    }
+
+    UDPMTransportClient::~UDPMTransportClient()
+    {
+        _impl->disconnect();
+    }
+
+    bool UDPMTransportClient::_connect()
+    {
+        return _impl->connect(_urn);
+    }
+
+    bool UDPMTransportClient::_disconnect()
+    {
+        return _impl->disconnect();
+    }
+
+    bool UDPMTransportClient::_subscribe(string key, DataCallbackBase *cb)
+    {
+        return _impl->subscribe(key, cb);
+    }
+
+    bool UDPMTransportClient::_unsubscribe(string key)
+    {
+        return _impl->unsubscribe(key);
+    }
+}
@@ -23,6 +23,9 @@
 
 #include "matrix/ZMQDataInterface.h"
 #include "matrix/RTDataInterface.h"
+#include "matrix/SHMDataInterface.h"
+#include "matrix/UDPMDataInterface.h"
+#include "matrix/RawTCPDataInterface.h"
 #include "matrix/tsemfifo.h"
 #include "matrix/Thread.h"
 #include "matrix/ZMQContext.h"
@@ -34,6 +37,8 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <atomic>
+#include <cstdlib>
 
 #include <boost/regex.hpp>
 #include <boost/algorithm/string.hpp>
@@ -50,6 +55,13 @@ using namespace mxutils;
 #define UNSUBSCRIBE 2
 #define QUIT        3
 
+// A key frame may carry flags after a NUL: "<key>\0<flags>". SUB
+// prefix matching on "<key>" still works, and old clients simply see
+// a key they don't know. KEY_PACKED means the data frame holds a
+// coalesced batch: a {uint32_t count, uint32_t size} header followed
+// by 'count' samples of 'size' bytes.
+#define KEY_PACKED  0x01
+
 namespace matrix
 {
 
@@ -90,7 +102,10 @@ namespace matrix
         {"tcp",      &ZMQTransportServer::factory},
         {"ipc",      &ZMQTransportServer::factory},
         {"inproc",   &ZMQTransportServer::factory},
-        {"rtinproc", &RTTransportServer::factory}
+        {"rtinproc", &RTTransportServer::factory},
+        {"shm",      &SHMTransportServer::factory},
+        {"udpm",     &UDPMTransportServer::factory},
+        {"rawtcp",   &RawTCPTransportServer::factory}
     };
 
 /**
@@ -130,9 +145,152 @@ namespace matrix
         {"tcp",      &ZMQTransportClient::factory},
         {"ipc",      &ZMQTransportClient::factory},
         {"inproc",   &ZMQTransportClient::factory},
-        {"rtinproc", &RTTransportClient::factory}
+        {"rtinproc", &RTTransportClient::factory},
+        {"shm",      &SHMTransportClient::factory},
+        {"udpm",     &UDPMTransportClient::factory},
+        {"rawtcp",   &RawTCPTransportClient::factory}
     };
 
+/**
+ * \class message_pool
+ *
+ * A free list of buffers for messages published with loan() and
+ * commit(). 0MQ owns a buffer from the time its message is sent until
+ * the I/O thread is done with it, at which point 'release()' returns
+ * it here for reuse. The pool counts its owner and each buffer out on
+ * loan as references, so buffers still in flight when the
+ * ZMQTransportServer goes away are freed when they come back.
+ *
+ */
+
+    struct message_pool
+    {
+        message_pool()
+            : _refs(1)
+        {
+        }
+
+        void *get(size_t sze);
+        void put_back(void *buf);
+        void unref();
+
+        // 0MQ's zmq_free_fn; 'hint' is the pool.
+        static void release(void *buf, void *hint);
+
+    private:
+
+        ~message_pool();
+
+        // Each buffer is preceded by a header holding its capacity.
+        static const size_t HEADER = 16;
+        static const size_t MAX_FREE = 16;
+
+        std::atomic<int> _refs;
+        Mutex _mutex;
+        vector<void *> _free;
+    };
+
+    message_pool::~message_pool()
+    {
+        for (auto b: _free)
+        {
+            ::free((char *)b - HEADER);
+        }
+    }
+
+/**
+ * Gets a buffer of at least 'sze' bytes, reusing a free one if
+ * possible.
+ *
+ */
+
+    void *message_pool::get(size_t sze)
+    {
+        ThreadLock<Mutex> l(_mutex);
+        void *buf = nullptr;
+
+        l.lock();
+
+        for (auto i = _free.begin(); i != _free.end(); ++i)
+        {
+            if (*(size_t *)((char *)*i - HEADER) >= sze)
+            {
+                buf = *i;
+                _free.erase(i);
+                break;
+            }
+        }
+
+        l.unlock();
+
+        if (!buf)
+        {
+            char *p = (char *)malloc(HEADER + sze);
+
+            if (!p)
+            {
+                return nullptr;
+            }
+
+            *(size_t *)p = sze;
+            buf = p + HEADER;
+        }
+
+        ++_refs;
+        return buf;
+    }
+
+/**
+ * Returns a buffer to the free list, or frees it if the list is full.
+ *
+ */
+
+    void message_pool::put_back(void *buf)
+    {
+        ThreadLock<Mutex> l(_mutex);
+
+        l.lock();
+
+        if (_free.size() < MAX_FREE)
+        {
+            _free.push_back(buf);
+        }
+        else
+        {
+            ::free((char *)buf - HEADER);
+        }
+    }
+
+    void message_pool::unref()
+    {
+        if (--_refs == 0)
+        {
+            delete this;
+        }
+    }
+
+    void message_pool::release(void *buf, void *hint)
+    {
+        message_pool *pool = (message_pool *)hint;
+
+        pool->put_back(buf);
+        pool->unref();
+    }
+
+// DROP_NEWEST and BLOCK need an XPUB socket, which may be told to
+// refuse a message rather than drop it (ZMQ_XPUB_NODROP, 0MQ 4.1).
+// An XPUB socket also queues the subscriptions it receives for the
+// application to read; 'send_key()' reads and discards them.
+    static int pub_socket_type(TransportServer::backpressure_policy policy)
+    {
+#ifdef ZMQ_XPUB_NODROP
+        bool nodrop = true;
+#else
+        bool nodrop = false;
+#endif
+        return nodrop && policy != TransportServer::DROP_OLDEST ? ZMQ_XPUB : ZMQ_PUB;
+    }
+
 /**
  * \class PubImpl is the private implementation of the ZMQTransportServer class.
  *
@@ -140,18 +298,74 @@ namespace matrix
 
     struct ZMQTransportServer::PubImpl
     {
-        PubImpl(vector<string> urls);
+        // A channel remembers the pool buffer it has on loan, if any,
+        // and, when coalescing, the samples waiting to go out.
+        struct channel : public TransportServer::Channel
+        {
+            channel(string k)
+                : TransportServer::Channel(k),
+                  buf(nullptr),
+                  size(0),
+                  packed_key(k + '\0' + (char)KEY_PACKED),
+                  pending_size(0),
+                  pending_count(0),
+                  pending_since(0)
+            {
+            }
+
+            void *buf;
+            size_t size;
+
+            const string packed_key;
+            vector<char> pending;
+            size_t pending_size;
+            size_t pending_count;
+            Time::Time_t pending_since;
+        };
+
+        PubImpl(vector<string> urls, backpressure_policy policy, Time::Time_t block_timeout);
         ~PubImpl();
 
-        bool publish(string key, string data);
-        bool publish(string key, void const *data, size_t sze);
+        bool publish(const string &key, string data);
+        bool publish(const string &key, void const *data, size_t sze);
+        bool publish(channel *c, void const *data, size_t sze);
+        bool publish_n(const string &key, void const *data, size_t sze, size_t n);
+        bool publish_n(channel *c, void const *data, size_t sze, size_t n);
+        channel *resolve(string key);
+        void *loan(channel *c, size_t sze);
+        bool commit(channel *c, size_t sze);
         vector<string> get_urls();
+        bool send_key(const char *key, size_t len);
+        vector<subscriber_stats> subscribers();
+
+        void set_coalescing(size_t max_samples, Time::Time_t max_latency);
+        bool coalesce(channel *c, void const *data, size_t sze, size_t n);
+        bool flush(channel *c);
+        void flush_task();
 
         string _hostname;
         vector<string> _publish_service_urls;
 
         zmq::context_t &_ctx;
         zmq::socket_t _pub_skt;
+
+        message_pool *_pool;
+        Mutex _channels_mutex;
+        map<string, unique_ptr<channel> > _channels;
+
+        // samples refused under the DROP_NEWEST or BLOCK policies.
+        bool _nodrop;
+        std::atomic<size_t> _dropped;
+
+        // coalescing. '_socket_mutex' is only taken when '_coalesce'
+        // is set, since only then does a second thread (the flusher)
+        // use the socket.
+        bool _coalesce;
+        size_t _max_samples;
+        Time::Time_t _max_latency;
+        Mutex _socket_mutex;
+        Thread<PubImpl> _flusher;
+        TCondition<bool> _flusher_quit;
     };
 
 /**
@@ -162,14 +376,44 @@ namespace matrix
  * @param urns: The desired URNs, as a vector of strings. If
  * only the transport is given, ephemeral URLs will be generated.
  *
+ * @param policy: The backpressure policy. DROP_NEWEST and BLOCK need
+ * an XPUB socket that can refuse messages (0MQ 4.1 or later); with
+ * older versions, or DROP_OLDEST, 0MQ drops silently as always.
+ *
+ * @param block_timeout: How long BLOCK waits for room, in ns.
+ *
  */
 
-    ZMQTransportServer::PubImpl::PubImpl(vector<string> urns)
+    ZMQTransportServer::PubImpl::PubImpl(vector<string> urns, backpressure_policy policy,
+                                         Time::Time_t block_timeout)
         :
         _ctx(ZMQContext::Instance()->get_context()),
-        _pub_skt(_ctx, ZMQ_PUB)
+        _pub_skt(_ctx, pub_socket_type(policy)),
+        _pool(new message_pool()),
+        _nodrop(pub_socket_type(policy) == ZMQ_XPUB),
+        _dropped(0),
+        _coalesce(false),
+        _max_samples(1),
+        _max_latency(0),
+        _flusher(this, &ZMQTransportServer::PubImpl::flush_task),
+        _flusher_quit(false)
 
     {
+        if (_nodrop)
+        {
+            int timeout = policy == BLOCK ? max<int>(block_timeout / 1000000, 1) : 0;
+#ifdef ZMQ_XPUB_NODROP
+            int one = 1;
+            _pub_skt.setsockopt(ZMQ_XPUB_NODROP, &one, sizeof one);
+#endif
+            _pub_skt.setsockopt(ZMQ_SNDTIMEO, &timeout, sizeof timeout);
+        }
+        else if (policy != DROP_OLDEST)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQTransportServer: this 0MQ cannot refuse messages;"
+                 << " Backpressure policy ignored." << endl;
+        }
 
         // process the urns.
         _publish_service_urls.clear();
@@ -256,9 +500,26 @@ namespace matrix
     ZMQTransportServer::PubImpl::~PubImpl()
 
     {
+        if (_coalesce)
+        {
+            _flusher_quit.signal(true);
+            _flusher.stop_without_cancel();
+        }
+
         int zero = 0;
         _pub_skt.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
         _pub_skt.close();
+
+        // buffers loaned but never committed go back to the pool.
+        for (auto &c: _channels)
+        {
+            if (c.second->buf)
+            {
+                message_pool::release(c.second->buf, _pool);
+            }
+        }
+
+        _pool->unref();
     }
 
 /**
@@ -274,6 +535,75 @@ namespace matrix
         return _publish_service_urls;
     }
 
+/**
+ * Sends the key frame that starts a message. Under the DROP_NEWEST
+ * and BLOCK policies 0MQ refuses it, once it has waited for as long
+ * as it is allowed to, if some subscriber's queue is full; the sample
+ * is then dropped and counted. The rest of a message is never
+ * refused once the key frame is accepted.
+ *
+ * The XPUB socket those policies use also hands us each subscription
+ * and unsubscription it receives. Nothing else reads them, so they
+ * are read and discarded here first, or they would pile up in the
+ * socket for as long as it lives.
+ *
+ * @param key: The key frame's bytes.
+ *
+ * @param len: Their length.
+ *
+ * @return true if the key was sent, false if the sample is dropped.
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::send_key(const char *key, size_t len)
+    {
+        if (_nodrop)
+        {
+            zmq::message_t sub;
+
+            while (_pub_skt.recv(&sub, ZMQ_DONTWAIT))
+            {
+            }
+        }
+
+        zmq::message_t msg(len);
+        memcpy(msg.data(), key, len);
+
+        if (_pub_skt.send(msg, ZMQ_SNDMORE))
+        {
+            return true;
+        }
+
+        ++_dropped;
+        return false;
+    }
+
+/**
+ * Reports the samples refused under the DROP_NEWEST or BLOCK
+ * policies. 0MQ does not expose its per-peer queues, so this is a
+ * single entry, '*', covering all subscribers, with no depth. Nothing
+ * is reported when 0MQ drops silently.
+ *
+ * @return A vector of at most one subscriber_stats.
+ *
+ */
+
+    vector<TransportServer::subscriber_stats> ZMQTransportServer::PubImpl::subscribers()
+    {
+        vector<subscriber_stats> stats;
+
+        if (_nodrop)
+        {
+            subscriber_stats st;
+            st.id = "*";
+            st.depth = 0;
+            st.dropped = _dropped.load();
+            stats.push_back(st);
+        }
+
+        return stats;
+    }
+
 /**
  * Publishes the data, as represented by a string.
  *
@@ -283,7 +613,7 @@ namespace matrix
  *
  */
 
-    bool ZMQTransportServer::PubImpl::publish(string key, string data)
+    bool ZMQTransportServer::PubImpl::publish(const string &key, string data)
     {
         return publish(key, data.data(), data.size());
     }
@@ -299,14 +629,338 @@ namespace matrix
  *
  */
 
-    bool ZMQTransportServer::PubImpl::publish(string key, void const *data, size_t sze)
+    bool ZMQTransportServer::PubImpl::publish(const string &key, void const *data, size_t sze)
+    {
+        bool rval = true;
+
+        if (_coalesce)
+        {
+            return coalesce(resolve(key), data, sze, 1);
+        }
+
+        try
+        {
+            if ((rval = send_key(key.data(), key.size())))
+            {
+                z_send(_pub_skt, (const char *)data, sze, 0, 0);
+            }
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQ exception in publisher: "
+                 << e.what() << endl;
+            rval = false;
+        }
+
+        return rval;
+    }
+
+/**
+ * Publishes 'n' samples of 'sze' bytes each as one multi-part
+ * message: the key frame followed by one frame per sample. A client
+ * receives the message whole and delivers it as one batch.
+ *
+ * @param key: The published key to the data.
+ *
+ * @param data: A pointer to the first sample
+ *
+ * @param sze: The size of each sample
+ *
+ * @param n: The number of samples
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::publish_n(const string &key, void const *data, size_t sze, size_t n)
+    {
+        bool rval = true;
+
+        if (n == 0)
+        {
+            return true;
+        }
+
+        if (_coalesce)
+        {
+            return coalesce(resolve(key), data, sze, n);
+        }
+
+        try
+        {
+            if (!send_key(key.data(), key.size()))
+            {
+                return false;
+            }
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                zmq::message_t msg(sze);
+                memcpy(msg.data(), (const char *)data + i * sze, sze);
+                _pub_skt.send(msg, i < n - 1 ? ZMQ_SNDMORE : 0);
+            }
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQ exception in publisher: "
+                 << e.what() << endl;
+            rval = false;
+        }
+
+        return rval;
+    }
+
+/**
+ * Publishes one sample on a resolved channel.
+ *
+ * @param c: The channel.
+ *
+ * @param data: A void pointer to the buffer containing the data
+ *
+ * @param sze: The size of the data buffer
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::publish(channel *c, void const *data, size_t sze)
+    {
+        if (_coalesce)
+        {
+            return coalesce(c, data, sze, 1);
+        }
+
+        return publish(c->key, data, sze);
+    }
+
+/**
+ * Publishes 'n' samples of 'sze' bytes each on a resolved channel.
+ *
+ * @param c: The channel.
+ *
+ * @param data: A pointer to the first sample
+ *
+ * @param sze: The size of each sample
+ *
+ * @param n: The number of samples
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::publish_n(channel *c, void const *data, size_t sze, size_t n)
+    {
+        if (_coalesce && n > 0)
+        {
+            return coalesce(c, data, sze, n);
+        }
+
+        return publish_n(c->key, data, sze, n);
+    }
+
+    ZMQTransportServer::PubImpl::channel *ZMQTransportServer::PubImpl::resolve(string key)
+    {
+        ThreadLock<Mutex> l(_channels_mutex);
+
+        l.lock();
+        unique_ptr<channel> &c = _channels[key];
+
+        if (!c)
+        {
+            c.reset(new channel(key));
+        }
+
+        return c.get();
+    }
+
+/**
+ * Lends out a pooled message buffer. On commit the buffer itself
+ * becomes the data frame, so the sample is not copied again before
+ * it goes out on the wire.
+ *
+ * @param c: The channel.
+ *
+ * @param sze: The size needed.
+ *
+ * @return A pointer to the buffer, or NULL if none could be allocated.
+ *
+ */
+
+    void *ZMQTransportServer::PubImpl::loan(channel *c, size_t sze)
+    {
+        // loaned again without a commit: reuse the buffer if it's big enough.
+        if (c->buf && c->size < sze)
+        {
+            message_pool::release(c->buf, _pool);
+            c->buf = nullptr;
+        }
+
+        if (!c->buf)
+        {
+            c->buf = _pool->get(sze);
+            c->size = sze;
+        }
+
+        return c->buf;
+    }
+
+/**
+ * Sends the loaned buffer as the data frame, handing it over to 0MQ,
+ * which returns it to the pool once it has been sent.
+ *
+ * @param c: The channel.
+ *
+ * @param sze: The number of bytes to send.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::commit(channel *c, size_t sze)
+    {
+        bool rval = true;
+
+        if (!c->buf || sze > c->size)
+        {
+            return false;
+        }
+
+        // coalescing copies the sample into the channel's batch anyway,
+        // so the buffer can go straight back to the pool.
+        if (_coalesce)
+        {
+            rval = coalesce(c, c->buf, sze, 1);
+            message_pool::release(c->buf, _pool);
+            c->buf = nullptr;
+            return rval;
+        }
+
+        // the message owns the buffer from here on, even if the send fails.
+        zmq::message_t msg(c->buf, sze, &message_pool::release, _pool);
+        c->buf = nullptr;
+
+        try
+        {
+            if ((rval = send_key(c->key.data(), c->key.size())))
+            {
+                _pub_skt.send(msg, 0);
+            }
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQ exception in publisher: "
+                 << e.what() << endl;
+            rval = false;
+        }
+
+        return rval;
+    }
+
+/**
+ * Turns on coalescing: from here on samples are packed per key into
+ * one data frame, which goes out when it holds 'max_samples' samples
+ * or when its oldest sample is 'max_latency' old, whichever comes
+ * first. Called once, before anything is published.
+ *
+ * @param max_samples: The most samples packed into one frame.
+ *
+ * @param max_latency: The longest a sample may wait, in nanoseconds.
+ *
+ */
+
+    void ZMQTransportServer::PubImpl::set_coalescing(size_t max_samples, Time::Time_t max_latency)
+    {
+        if (_coalesce || max_samples < 2)
+        {
+            return;
+        }
+
+        _max_samples = max_samples;
+        _max_latency = max_latency;
+        _coalesce = true;
+        _flusher.start();
+    }
+
+/**
+ * Appends samples to the channel's pending batch, sending the batch
+ * each time it fills. A sample of a different size than those already
+ * pending sends the pending batch first, since a packed frame holds
+ * samples of one size only.
+ *
+ * @param c: The channel.
+ *
+ * @param data: A pointer to the first sample
+ *
+ * @param sze: The size of each sample
+ *
+ * @param n: The number of samples
+ *
+ * @return true if every send succeeded, false otherwise.
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::coalesce(channel *c, void const *data, size_t sze, size_t n)
+    {
+        ThreadLock<Mutex> l(_socket_mutex);
+        char const *p = (char const *)data;
+        bool rval = true;
+
+        l.lock();
+
+        if (c->pending_count && c->pending_size != sze)
+        {
+            rval = flush(c);
+        }
+
+        while (n)
+        {
+            if (c->pending_count == 0)
+            {
+                c->pending.resize(2 * sizeof(uint32_t));
+                c->pending_size = sze;
+                c->pending_since = Time::getUTC();
+            }
+
+            size_t k = min(n, _max_samples - c->pending_count);
+            c->pending.insert(c->pending.end(), p, p + k * sze);
+            c->pending_count += k;
+            p += k * sze;
+            n -= k;
+
+            if (c->pending_count >= _max_samples)
+            {
+                rval = flush(c) && rval;
+            }
+        }
+
+        return rval;
+    }
+
+/**
+ * Sends the channel's pending batch, if any, as one packed frame.
+ * Called with '_socket_mutex' held.
+ *
+ * @param c: The channel.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::flush(channel *c)
     {
         bool rval = true;
 
+        if (c->pending_count == 0)
+        {
+            return true;
+        }
+
+        uint32_t hdr[2] = {(uint32_t)c->pending_count, (uint32_t)c->pending_size};
+        memcpy(c->pending.data(), hdr, sizeof hdr);
+
         try
         {
-            z_send(_pub_skt, key, ZMQ_SNDMORE, 0);
-            z_send(_pub_skt, (const char *)data, sze, 0, 0);
+            if ((rval = send_key(c->packed_key.data(), c->packed_key.size())))
+            {
+                z_send(_pub_skt, c->pending.data(), c->pending.size(), 0, 0);
+            }
         }
         catch (zmq::error_t &e)
         {
@@ -316,9 +970,44 @@ namespace matrix
             rval = false;
         }
 
+        c->pending.clear();
+        c->pending_count = 0;
         return rval;
     }
 
+/**
+ * Sends any batch that has waited longer than the maximum latency.
+ * Wakes at half that interval, so no sample waits much more than the
+ * maximum. Sends everything that is left when told to quit.
+ *
+ */
+
+    void ZMQTransportServer::PubImpl::flush_task()
+    {
+        int period = max<int>(_max_latency / 2000, 100);
+        bool quit = false;
+
+        while (!quit)
+        {
+            quit = _flusher_quit.wait(true, period);
+
+            ThreadLock<Mutex> sl(_socket_mutex), cl(_channels_mutex);
+            Time::Time_t now = Time::getUTC();
+
+            sl.lock();
+            cl.lock();
+
+            for (auto &i: _channels)
+            {
+                channel *c = i.second.get();
+
+                if (c->pending_count && (quit || now - c->pending_since >= _max_latency))
+                {
+                    flush(c);
+                }
+            }
+        }
+    }
 
     ZMQTransportServer::ZMQTransportServer(string keymaster_url, string key)
         : TransportServer(keymaster_url, key)
@@ -330,7 +1019,29 @@ namespace matrix
             urns = km.get_as<vector<string> >(_transport_key + ".Specified");
 
             // will throw CreationError if it fails.
-            _impl.reset(new PubImpl(urns));
+            _configure_backpressure(km);
+            _impl.reset(new PubImpl(urns, _policy, _block_timeout));
+
+            // optional coalescing of samples into fewer, larger messages.
+            yaml_result yr;
+
+            if (km.get(_transport_key + ".Coalesce", yr))
+            {
+                size_t max_samples = 64;
+                double max_latency = 0.001;
+
+                if (yr.node["MaxSamples"])
+                {
+                    max_samples = yr.node["MaxSamples"].as<size_t>();
+                }
+
+                if (yr.node["MaxLatency"])
+                {
+                    max_latency = yr.node["MaxLatency"].as<double>();
+                }
+
+                _impl->set_coalescing(max_samples, (Time::Time_t)(max_latency * 1e9));
+            }
 
             // register the AsConfigured urns:
             urns = _impl->get_urls();
@@ -340,6 +1051,10 @@ namespace matrix
         {
             throw CreationError(e.what());
         }
+        catch (YAML::Exception &e)
+        {
+            throw CreationError(e.what());
+        }
     }
 
     ZMQTransportServer::~ZMQTransportServer()
@@ -370,6 +1085,36 @@ namespace matrix
         return _impl->publish(key, data);
     }
 
+    bool ZMQTransportServer::_publish(channel_t ch, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(static_cast<PubImpl::channel *>(ch), data, size_of_data);
+    }
+
+    bool ZMQTransportServer::_publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n)
+    {
+        return _impl->publish_n(static_cast<PubImpl::channel *>(ch), data, size_of_data, n);
+    }
+
+    vector<TransportServer::subscriber_stats> ZMQTransportServer::_subscribers()
+    {
+        return _impl->subscribers();
+    }
+
+    TransportServer::channel_t ZMQTransportServer::_resolve(string key)
+    {
+        return _impl->resolve(key);
+    }
+
+    void *ZMQTransportServer::_loan(channel_t ch, size_t size)
+    {
+        return _impl->loan(static_cast<PubImpl::channel *>(ch), size);
+    }
+
+    bool ZMQTransportServer::_commit(channel_t ch, size_t size)
+    {
+        return _impl->commit(static_cast<PubImpl::channel *>(ch), size);
+    }
+
 /**********************************************************************
  * Transport Client
  **********************************************************************/
@@ -402,7 +1147,10 @@ namespace matrix
         bool _connected;
         Thread<ZMQTransportClient::Impl> _sub_thread;
         TCondition<bool> _task_ready;
-        std::map<std::string, DataCallbackBase *> _subscribers;
+        // a client has only a few keys, so a flat vector searched
+        // linearly beats a map, and needs no string per lookup.
+        typedef std::pair<std::string, DataCallbackBase *> subscriber;
+        std::vector<subscriber> _subscribers;
     };
 
     bool ZMQTransportClient::Impl::connect(string urn)
@@ -492,6 +1240,9 @@ namespace matrix
         zmq::socket_t sub_sock(_ctx, ZMQ_SUB);
         zmq::socket_t pipe(_ctx, ZMQ_REP);
         vector<string>::const_iterator cvi;
+        zmq::message_t key_msg, msg; // reused for every sample
+        vector<char> batch;
+        vector<size_t> sizes;
         bool invalid_context = false;
 
         sub_sock.connect(_data_urn.c_str());
@@ -536,7 +1287,18 @@ namespace matrix
                         }
                         else
                         {
-                            _subscribers[key] = f_ptr;
+                            auto sub = find_if(_subscribers.begin(), _subscribers.end(),
+                                               [&key](const subscriber &s) {return s.first == key;});
+
+                            if (sub == _subscribers.end())
+                            {
+                                _subscribers.push_back(subscriber(key, f_ptr));
+                            }
+                            else
+                            {
+                                sub->second = f_ptr;
+                            }
+
                             sub_sock.setsockopt(ZMQ_SUBSCRIBE, key.c_str(), key.length());
                             z_send(pipe, 1, 0);
                         }
@@ -554,10 +1316,9 @@ namespace matrix
                         {
                             sub_sock.setsockopt(ZMQ_UNSUBSCRIBE, key.c_str(), key.length());
 
-                            if (_subscribers.find(key) != _subscribers.end())
-                            {
-                                _subscribers.erase(key);
-                            }
+                            _subscribers.erase(remove_if(_subscribers.begin(), _subscribers.end(),
+                                                         [&key](const subscriber &s) {return s.first == key;}),
+                                               _subscribers.end());
 
                             z_send(pipe, 1, 0);
                         }
@@ -572,42 +1333,141 @@ namespace matrix
                 // The subscribed data is handled here
                 if (items[1].revents & ZMQ_POLLIN)
                 {
-                    string key;
-                    zmq::message_t msg; // the data
                     int more;
                     size_t more_size = sizeof(more);
-                    map<string, DataCallbackBase *>::const_iterator mci;
                     DataCallbackBase *f = NULL;
+                    string const *key = NULL;
+                    int flags = 0;
 
-                    // get the key
-                    z_recv(sub_sock, key);
-                    mci = _subscribers.find(key);
+                    // match the key frame's bytes directly against the
+                    // subscribed keys; anything after a NUL is flags.
+                    sub_sock.recv(&key_msg);
+                    char const *kp = (char const *)key_msg.data();
+                    size_t klen = key_msg.size();
+                    char const *nul = (char const *)memchr(kp, '\0', klen);
 
-                    // get callback registered to this key
-                    if (mci != _subscribers.end())
+                    if (nul)
                     {
-                        f = mci->second;
+                        flags = nul + 1 < kp + klen ? nul[1] : 0;
+                        klen = nul - kp;
                     }
 
-                    // repeat for every possible frame containing
-                    // data. The use case is for just one data frame;
-                    // this will work for this, but if there are more
-                    // than one data frames it will also work. Every
-                    // subsequent data frame will call the same
-                    // callback however.
+                    for (auto &sub: _subscribers)
+                    {
+                        if (sub.first.size() == klen && memcmp(sub.first.data(), kp, klen) == 0)
+                        {
+                            key = &sub.first;
+                            f = sub.second;
+                            break;
+                        }
+                    }
+
+                    // The usual case is one data frame. A batch from
+                    // 'publish_n()' comes as several data frames of the
+                    // same size; these are gathered and handed to the
+                    // callback in one 'exec_n()'.
                     sub_sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
 
-                    while (more)
+                    if (more)
                     {
                         sub_sock.recv(&msg);
+                        sub_sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
 
-                        // execute only if we found a callback.
-                        if (f)
+                        if (!more && (flags & KEY_PACKED))
                         {
-                            f->exec(key, msg.data(), msg.size());
+                            // a coalesced batch: unpack it in place.
+                            uint32_t hdr[2] = {0, 0};
+
+                            if (msg.size() >= sizeof hdr)
+                            {
+                                memcpy(hdr, msg.data(), sizeof hdr);
+                            }
+
+                            char *p = (char *)msg.data() + sizeof hdr;
+
+                            if (f && hdr[0] && msg.size() >= sizeof hdr + (size_t)hdr[0] * hdr[1])
+                            {
+                                if (f->wants_owner())
+                                {
+                                    // the views share the message; 'msg'
+                                    // is left empty for the next recv. A
+                                    // small message's data moves with it.
+                                    std::shared_ptr<zmq::message_t> owner(new zmq::message_t());
+                                    owner->move(&msg);
+                                    p = (char *)owner->data() + sizeof hdr;
+                                    f->exec_shared_n(*key, owner, p, hdr[1], hdr[0]);
+                                }
+                                else if (hdr[0] == 1)
+                                {
+                                    f->exec(*key, p, hdr[1]);
+                                }
+                                else
+                                {
+                                    f->exec_n(*key, p, hdr[1], hdr[0]);
+                                }
+                            }
+
+                            continue;
                         }
 
-                        sub_sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+                        if (!more)
+                        {
+                            // execute only if we found a callback.
+                            if (f && f->wants_owner())
+                            {
+                                std::shared_ptr<zmq::message_t> owner(new zmq::message_t());
+                                owner->move(&msg);
+                                f->exec_shared(*key, owner, owner->data(), owner->size());
+                            }
+                            else if (f)
+                            {
+                                f->exec(*key, msg.data(), msg.size());
+                            }
+
+                            continue;
+                        }
+
+                        // nobody wants this batch; just drain it.
+                        if (!f)
+                        {
+                            while (more)
+                            {
+                                sub_sock.recv(&msg);
+                                sub_sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+                            }
+
+                            continue;
+                        }
+
+                        size_t sze = msg.size();
+                        bool uniform = true;
+
+                        sizes.assign(1, sze);
+                        batch.assign((char *)msg.data(), (char *)msg.data() + sze);
+
+                        while (more)
+                        {
+                            sub_sock.recv(&msg);
+                            uniform = uniform && msg.size() == sze;
+                            sizes.push_back(msg.size());
+                            batch.insert(batch.end(), (char *)msg.data(), (char *)msg.data() + msg.size());
+                            sub_sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+                        }
+
+                        if (uniform)
+                        {
+                            f->exec_n(*key, batch.data(), sze, sizes.size());
+                        }
+                        else
+                        {
+                            size_t offset = 0;
+
+                            for (auto z: sizes)
+                            {
+                                f->exec(*key, batch.data() + offset, z);
+                                offset += z;
+                            }
+                        }
                     }
                 }
             }
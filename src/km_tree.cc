@@ -0,0 +1,687 @@
+/*******************************************************************
+ *  km_tree.cc - The Keymaster's store: a tree of keys and values with
+ *  interned keys and shared, immutable nodes.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/km_tree.h"
+#include "matrix/yaml_msgpack.h"
+
+#include <boost/algorithm/string.hpp>
+
+#include <unordered_map>
+
+using namespace std;
+using namespace mxutils;
+
+namespace matrix
+{
+    namespace
+    {
+        typedef km_tree::node node;
+        typedef km_tree::node_ptr node_ptr;
+        typedef km_tree::key_t key_t;
+        typedef msgpack::packer<msgpack::sbuffer> packer_t;
+
+        const size_t NOT_FOUND = (size_t)-1;
+
+        // The interned keys. Each is shared by the maps that use it,
+        // and freed, and dropped from here, with the last of them. The
+        // table itself is never freed, as keys may outlive any static
+        // destruction order.
+        struct interned_keys
+        {
+            mutex lock;
+            unordered_map<string, weak_ptr<const string> > keys;
+        };
+
+        interned_keys &interned()
+        {
+            static interned_keys *k = new interned_keys;
+            return *k;
+        }
+
+        void release_key(const string *s)
+        {
+            interned_keys &k = interned();
+
+            {
+                lock_guard<mutex> l(k.lock);
+                auto i = k.keys.find(*s);
+
+                // the entry may already be for a newer copy of the key.
+                if (i != k.keys.end() && i->second.expired())
+                {
+                    k.keys.erase(i);
+                }
+            }
+
+            delete s;
+        }
+
+        key_t intern(const string &s)
+        {
+            interned_keys &k = interned();
+            lock_guard<mutex> l(k.lock);
+            weak_ptr<const string> &w = k.keys[s];
+            key_t p = w.lock();
+
+            if (!p)
+            {
+                p = key_t(new string(s), release_key);
+                w = p;
+            }
+
+            return p;
+        }
+
+        // Returns the interned key for 's', or null if there is none,
+        // in which case no map has 's' as a key. It is only good for
+        // comparing with keys held by the nodes of a tree the caller
+        // holds: those keys stay alive, so if the key is freed once
+        // 'p' goes, none of them has its address.
+        const string *find_key(const string &s)
+        {
+            interned_keys &k = interned();
+            key_t p;
+
+            {
+                lock_guard<mutex> l(k.lock);
+                auto i = k.keys.find(s);
+
+                if (i != k.keys.end())
+                {
+                    p = i->second.lock();
+                }
+            }
+
+            // 'p' may be the last owner; its deleter takes the lock,
+            // so it must go after the lock is released.
+            return p.get();
+        }
+
+        node_ptr null_node()
+        {
+            static node_ptr n = make_shared<node>(node{node::NUL, "", {}, 0});
+            return n;
+        }
+
+        size_t find_child(const node &n, const string *k)
+        {
+            if (n.type == node::MAP && k)
+            {
+                for (size_t i = 0; i < n.children.size(); ++i)
+                {
+                    if (n.children[i].first.get() == k)
+                    {
+                        return i;
+                    }
+                }
+            }
+
+            return NOT_FOUND;
+        }
+
+        // Follows 'keys' down from 'n' as far as they go. Returns the
+        // number of keys followed, and sets 'n' to the node reached.
+        size_t walk(node_ptr &n, const vector<string> &keys)
+        {
+            size_t i;
+
+            for (i = 0; i < keys.size(); ++i)
+            {
+                size_t at = find_child(*n, find_key(keys[i]));
+
+                if (at == NOT_FOUND)
+                {
+                    break;
+                }
+
+                n = n->children[at].second;
+            }
+
+            return i;
+        }
+
+        // The versions of the nodes from 'n' down along 'keys', 'n'
+        // included; 0 for those missing.
+        vector<uint64_t> versions_along(node_ptr n, const vector<string> &keys)
+        {
+            vector<uint64_t> v(1, n ? n->version : 0);
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                size_t at = n ? find_child(*n, find_key(keys[i])) : NOT_FOUND;
+                n = at == NOT_FOUND ? nullptr : n->children[at].second;
+                v.push_back(n ? n->version : 0);
+            }
+
+            return v;
+        }
+
+        // 'val', stamped with 'version'. The copy is shallow.
+        node_ptr stamped(const node_ptr &val, uint64_t version)
+        {
+            shared_ptr<node> n = make_shared<node>(*val);
+            n->version = version;
+            return n;
+        }
+
+        // Returns a copy of map (or null, or missing) node 'n' with
+        // 'val' at 'keys[i..]', creating maps along the way as
+        // needed. If 'val' is null the last key is removed instead. The
+        // nodes off the path are shared with 'n'; those on it are
+        // stamped with 'version'.
+        node_ptr replace(const node_ptr &n, const vector<string> &keys, size_t i,
+                         const node_ptr &val, uint64_t version)
+        {
+            shared_ptr<node> m = make_shared<node>();
+            key_t k = intern(keys[i]);
+            size_t at = NOT_FOUND;
+
+            m->type = node::MAP;
+            m->version = version;
+
+            if (n && n->type == node::MAP)
+            {
+                m->children = n->children;
+                at = find_child(*m, k.get());
+            }
+
+            node_ptr child;
+
+            if (i + 1 < keys.size())
+            {
+                child = replace(at == NOT_FOUND ? nullptr : m->children[at].second,
+                                keys, i + 1, val, version);
+            }
+            else if (!val)
+            {
+                if (at != NOT_FOUND)
+                {
+                    m->children.erase(m->children.begin() + at);
+                }
+
+                return m;
+            }
+            else
+            {
+                child = val;
+            }
+
+            if (at == NOT_FOUND)
+            {
+                m->children.push_back(make_pair(k, child));
+            }
+            else
+            {
+                m->children[at].second = child;
+            }
+
+            return m;
+        }
+
+        km_tree::result make_result(const vector<string> &keys, size_t good, const node_ptr &n)
+        {
+            km_tree::result r;
+            vector<string> good_keys(keys.begin(), keys.begin() + good);
+
+            r.result = good == keys.size();
+            r.key = boost::algorithm::join(good_keys, ".");
+            r.err = r.result ? "" : "No such key: " + keys[good];
+            r.node = n;
+            return r;
+        }
+
+        // Puts 'val' at 'keychain' in the tree rooted at 'root', which
+        // is replaced by the new root if the put succeeds. The change
+        // is numbered 'version'.
+        km_tree::result put_into(node_ptr &root, const string &keychain, node_ptr val,
+                                 bool create, uint64_t version)
+        {
+            vector<string> keys;
+            node_ptr n = root;
+
+            val = stamped(val ? val : null_node(), version);
+
+            if (keychain.empty())
+            {
+                km_tree::result r{true, "", "", val, version, {root->version}};
+                root = val;
+                return r;
+            }
+
+            boost::split(keys, keychain, boost::is_any_of("."));
+            size_t good = walk(n, keys);
+
+            if (good < keys.size() && (!create || (n->type != node::MAP && n->type != node::NUL)))
+            {
+                return make_result(keys, good, n);
+            }
+
+            km_tree::result r = make_result(keys, keys.size(), val);
+            r.version = version;
+            r.versions = versions_along(root, keys);
+            root = replace(root, keys, 0, val, version);
+            return r;
+        }
+
+        void pack_string(packer_t &pk, const string &s)
+        {
+            pk.pack_str(s.size());
+            pk.pack_str_body(s.data(), s.size());
+        }
+
+        void pack(packer_t &pk, const node_ptr &n)
+        {
+            if (!n)
+            {
+                pk.pack_nil();
+                return;
+            }
+
+            switch (n->type)
+            {
+            case node::SCALAR:
+                pack_string(pk, n->scalar);
+                break;
+            case node::SEQUENCE:
+                pk.pack_array(n->children.size());
+
+                for (auto &c : n->children)
+                {
+                    pack(pk, c.second);
+                }
+
+                break;
+            case node::MAP:
+                pk.pack_map(n->children.size());
+
+                for (auto &c : n->children)
+                {
+                    pack_string(pk, *c.first);
+                    pack(pk, c.second);
+                }
+
+                break;
+            default:
+                pk.pack_nil();
+                break;
+            }
+        }
+
+        node_ptr unpack(const msgpack::object &o)
+        {
+            shared_ptr<node> n = make_shared<node>();
+            string s;
+
+            if (msgpack_scalar(o, s))
+            {
+                n->type = node::SCALAR;
+                n->scalar = s;
+                return n;
+            }
+
+            switch (o.type)
+            {
+            case msgpack::type::ARRAY:
+                n->type = node::SEQUENCE;
+
+                for (uint32_t i = 0; i < o.via.array.size; ++i)
+                {
+                    n->children.push_back(make_pair(nullptr, unpack(o.via.array.ptr[i])));
+                }
+
+                return n;
+            case msgpack::type::MAP:
+                n->type = node::MAP;
+
+                for (uint32_t i = 0; i < o.via.map.size; ++i)
+                {
+                    const msgpack::object_kv &kv = o.via.map.ptr[i];
+
+                    if (!msgpack_scalar(kv.key, s))
+                    {
+                        // a key that is itself a map or array: write
+                        // it out, as YAML would.
+                        s = YAML::Dump(km_tree::to_yaml(unpack(kv.key)));
+                    }
+
+                    n->children.push_back(make_pair(intern(s), unpack(kv.val)));
+                }
+
+                return n;
+            default:
+                return null_node();
+            }
+        }
+    }
+
+/**
+ * Converts a result to the `yaml_result` get_yaml_node() and friends
+ * would have given.
+ *
+ */
+
+    yaml_result km_tree::result::to_yaml_result() const
+    {
+        return yaml_result(result, km_tree::to_yaml(node), key, err);
+    }
+
+/**
+ * Constructor.
+ *
+ * @param n: The initial contents, e.g. the Keymaster's configuration
+ * file.
+ *
+ */
+
+    km_tree::km_tree(YAML::Node n)
+        : _tree(from_yaml(n)),
+          _version(0)
+    {
+    }
+
+    km_tree::node_ptr km_tree::_root() const
+    {
+        lock_guard<mutex> l(_lock);
+        return _tree;
+    }
+
+/**
+ * Gets the node at a keychain.
+ *
+ * @param keychain: The keys leading to the node, separated by
+ * periods. If empty, the whole tree.
+ *
+ * @return A result. If the keychain was found, 'result' is true and
+ * 'node' is the node. If not, 'result' is false, 'key' and 'node' are
+ * the last ones found, and 'err' names the first key not found.
+ *
+ */
+
+    km_tree::result km_tree::get(std::string keychain) const
+    {
+        node_ptr n = _root();
+        vector<string> keys;
+
+        if (keychain.empty())
+        {
+            return result{true, "", "", n, 0, {}};
+        }
+
+        boost::split(keys, keychain, boost::is_any_of("."));
+        size_t good = walk(n, keys);
+        return make_result(keys, good, n);
+    }
+
+/**
+ * Puts a value at a keychain.
+ *
+ * @param keychain: The keys leading to the node, separated by
+ * periods. If empty, the whole tree is replaced.
+ *
+ * @param val: The new value.
+ *
+ * @param create: If true, missing keys along the way are created.
+ * Null nodes along the way become maps; scalars and sequences cannot
+ * have keys, and make the put fail.
+ *
+ * @return A result, as for 'get()'. On success 'node' is 'val', as
+ * put, and 'version' and 'versions' describe the change.
+ *
+ */
+
+    km_tree::result km_tree::put(std::string keychain, YAML::Node val, bool create)
+    {
+        return put(keychain, from_yaml(val), create);
+    }
+
+    km_tree::result km_tree::put(std::string keychain, node_ptr val, bool create)
+    {
+        lock_guard<mutex> l(_lock);
+        result r = put_into(_tree, keychain, val, create, _version + 1);
+
+        if (r.result)
+        {
+            ++_version;
+        }
+
+        return r;
+    }
+
+/**
+ * Puts several values at once, as one transaction: either all of them
+ * are put, or, if any one fails, none is. The puts are made in order,
+ * so a later one may rely on keys an earlier one created, and readers
+ * never see the tree with only some of them made.
+ *
+ * @param batch: The keychains and their new values.
+ *
+ * @param create: As for 'put()', for every keychain.
+ *
+ * @param each: If given, and all the puts succeed, it is set to the
+ * result of each, in order. Each put is a change of its own, with
+ * its own version.
+ *
+ * @return The result of the last put, if all succeeded; otherwise
+ * that of the first that failed.
+ *
+ */
+
+    km_tree::result km_tree::put_many(const std::vector<std::pair<std::string, node_ptr> > &batch,
+                                      bool create, std::vector<result> *each)
+    {
+        lock_guard<mutex> l(_lock);
+        node_ptr root = _tree;
+        result r{true, "", "", root, 0, {}};
+        vector<result> results;
+
+        for (auto &kv : batch)
+        {
+            r = put_into(root, kv.first, kv.second, create, _version + results.size() + 1);
+
+            if (!r.result)
+            {
+                return r;
+            }
+
+            results.push_back(r);
+        }
+
+        _tree = root;
+        _version += results.size();
+
+        if (each)
+        {
+            each->swap(results);
+        }
+
+        return r;
+    }
+
+/**
+ * Deletes the node at a keychain.
+ *
+ * @param keychain: The keys leading to the node, separated by periods.
+ *
+ * @return A result, as for 'get()'. On success 'key' and 'node' are
+ * those of the parent of the deleted node, and 'version' and
+ * 'versions' describe the change, as for 'put()'.
+ *
+ */
+
+    km_tree::result km_tree::del(std::string keychain)
+    {
+        lock_guard<mutex> l(_lock);
+        vector<string> keys;
+        node_ptr n = _tree;
+
+        boost::split(keys, keychain, boost::is_any_of("."));
+        size_t good = walk(n, keys);
+
+        if (good < keys.size())
+        {
+            return make_result(keys, good, n);
+        }
+
+        vector<uint64_t> versions = versions_along(_tree, keys);
+
+        _tree = replace(_tree, keys, 0, nullptr, ++_version);
+        keys.pop_back();
+        n = _tree;
+        walk(n, keys);
+
+        result r = make_result(keys, keys.size(), n);
+        r.version = _version;
+        r.versions = versions;
+        return r;
+    }
+
+/**
+ * Converts a YAML node to a tree node.
+ *
+ */
+
+    km_tree::node_ptr km_tree::from_yaml(const YAML::Node &y)
+    {
+        shared_ptr<node> n = make_shared<node>();
+
+        switch (y.Type())
+        {
+        case YAML::NodeType::Scalar:
+            n->type = node::SCALAR;
+            n->scalar = y.Scalar();
+            return n;
+        case YAML::NodeType::Sequence:
+            n->type = node::SEQUENCE;
+
+            for (YAML::const_iterator i = y.begin(); i != y.end(); ++i)
+            {
+                n->children.push_back(make_pair(nullptr, from_yaml(*i)));
+            }
+
+            return n;
+        case YAML::NodeType::Map:
+            n->type = node::MAP;
+
+            for (YAML::const_iterator i = y.begin(); i != y.end(); ++i)
+            {
+                string k = i->first.IsScalar() ? i->first.Scalar() : YAML::Dump(i->first);
+                n->children.push_back(make_pair(intern(k), from_yaml(i->second)));
+            }
+
+            return n;
+        default:
+            return null_node();
+        }
+    }
+
+/**
+ * Converts a tree node to a YAML node. The YAML node is a copy, which
+ * the caller may change.
+ *
+ */
+
+    YAML::Node km_tree::to_yaml(const node_ptr &n)
+    {
+        if (!n)
+        {
+            return YAML::Node();
+        }
+
+        switch (n->type)
+        {
+        case node::SCALAR:
+            return YAML::Node(n->scalar);
+        case node::SEQUENCE:
+        {
+            YAML::Node y(YAML::NodeType::Sequence);
+
+            for (auto &c : n->children)
+            {
+                y.push_back(to_yaml(c.second));
+            }
+
+            return y;
+        }
+        case node::MAP:
+        {
+            YAML::Node y(YAML::NodeType::Map);
+
+            for (auto &c : n->children)
+            {
+                y[*c.first] = to_yaml(c.second);
+            }
+
+            return y;
+        }
+        default:
+            return YAML::Node();
+        }
+    }
+
+/**
+ * Decodes a tree node from MessagePack, as sent by the Keymaster
+ * client (see to_msgpack() in yaml_msgpack.h), without going through
+ * YAML. Throws msgpack::unpack_error if 'buf' is not MessagePack.
+ *
+ */
+
+    km_tree::node_ptr km_tree::from_msgpack(const std::string &buf)
+    {
+        msgpack::object_handle oh = msgpack::unpack(buf.data(), buf.size());
+        return unpack(oh.get());
+    }
+
+/**
+ * Encodes a tree node as MessagePack, as the Keymaster client expects
+ * it (see node_from_msgpack() in yaml_msgpack.h), without going
+ * through YAML.
+ *
+ */
+
+    std::string km_tree::to_msgpack(const node_ptr &n)
+    {
+        msgpack::sbuffer sb;
+        packer_t pk(sb);
+
+        pack(pk, n);
+        return string(sb.data(), sb.size());
+    }
+
+/**
+ * The number of distinct keys interned, across all trees. A key is
+ * counted for as long as some node uses it.
+ *
+ */
+
+    size_t km_tree::key_count()
+    {
+        interned_keys &k = interned();
+        lock_guard<mutex> l(k.lock);
+        return k.keys.size();
+    }
+}
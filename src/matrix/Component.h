@@ -275,6 +275,16 @@ namespace matrix
         ConnectionKey q(current_mode, my_instance_name, sinkname);
         if (find_data_connection(q))
         {
+            mxutils::yaml_result yr;
+
+            // statistics are on for all of a component's sinks, as for
+            // its sources, with 'Stats: true' in its node.
+            if (keymaster->get("components." + my_instance_name + ".Stats", yr)
+                && yr.node.as<bool>())
+            {
+                sink.set_stats_key("components." + my_instance_name + ".stats.Sinks." + sinkname);
+            }
+
             sink.connect(std::get<0>(q), std::get<1>(q), std::get<2>(q));
         }
         return true;
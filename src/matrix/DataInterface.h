@@ -46,15 +46,21 @@
 
 #include "matrix/Mutex.h"
 #include "matrix/ThreadLock.h"
+#include "matrix/Time.h"
 
 #include <string>
 #include <memory>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
 #include <exception>
 #include <yaml-cpp/yaml.h>
 #include <boost/algorithm/string.hpp>
 
 namespace matrix
 {
+    class Keymaster;
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcomment"
 /**
@@ -124,6 +130,11 @@ namespace matrix
             _copy(gb);
         }
 
+        GenericBuffer(GenericBuffer &&gb)
+            : _buffer(std::move(gb._buffer))
+        {
+        }
+
         void resize(size_t size)
         {
             _buffer.resize(size);
@@ -139,12 +150,26 @@ namespace matrix
             return _buffer.data();
         }
 
+        const unsigned char *data() const
+        {
+            return _buffer.data();
+        }
+
         const GenericBuffer &operator=(const GenericBuffer &rhs)
         {
             _copy(rhs);
             return *this;
         }
 
+        // Swaps rather than frees: 'rhs' is left with this buffer's
+        // old memory, so that a buffer moved into a slot of a fifo
+        // comes back with one that can be refilled without allocating.
+        GenericBuffer &operator=(GenericBuffer &&rhs)
+        {
+            _buffer.swap(rhs._buffer);
+            return *this;
+        }
+
     private:
         void _copy(const GenericBuffer &gb)
         {
@@ -159,6 +184,109 @@ namespace matrix
         std::vector<unsigned char> _buffer;
     };
 
+/**
+ * \class data_view
+ *
+ * A read-only view of one value as received, an array of T whose
+ * length is set by the sender, which keeps the memory it points to
+ * alive for as long as any copy of the view exists. A
+ * DataSink<data_view<T> > delivers these: with a transport that can
+ * hand over its receive buffer (zmq's 'inproc', 'ipc' and 'tcp') the
+ * view points straight into the received message, so that variable
+ * length spectra are consumed without being copied. Otherwise the
+ * value is copied once, into memory the view owns.
+ *
+ *     DataSink<data_view<float> > sink(km_urn);
+ *     data_view<float> spectrum;
+ *     sink.get(spectrum);
+ *
+ *     for (auto v : spectrum) ...
+ *
+ * The memory is released when the last view onto it is reset,
+ * reassigned or destroyed.
+ *
+ */
+
+    template <typename T>
+    class data_view
+    {
+    public:
+        typedef T value_type;
+        typedef const T *const_iterator;
+
+        data_view()
+            : _data(nullptr),
+              _size(0)
+        {
+        }
+
+        data_view(std::shared_ptr<const void> owner, const void *data, size_t bytes)
+            : _owner(owner),
+              _data((const T *)data),
+              _size(bytes / sizeof(T))
+        {
+        }
+
+        const T *data() const
+        {
+            return _data;
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+        size_t size_bytes() const
+        {
+            return _size * sizeof(T);
+        }
+
+        bool empty() const
+        {
+            return _size == 0;
+        }
+
+        const T &operator[](size_t i) const
+        {
+            return _data[i];
+        }
+
+        const_iterator begin() const
+        {
+            return _data;
+        }
+
+        const_iterator end() const
+        {
+            return _data + _size;
+        }
+
+        void reset()
+        {
+            _owner.reset();
+            _data = nullptr;
+            _size = 0;
+        }
+
+        /// true if 'bytes' is a whole number of T's
+        static bool whole(size_t bytes)
+        {
+            return bytes % sizeof(T) == 0;
+        }
+
+        /// true if 'data' may be read as T's where it is
+        static bool aligned(const void *data)
+        {
+            return (uintptr_t)data % alignof(T) == 0;
+        }
+
+    private:
+        std::shared_ptr<const void> _owner;
+        const T *_data;
+        size_t _size;
+    };
+
     struct data_description
     {
         enum types
@@ -219,6 +347,61 @@ namespace matrix
         *((T *)(buf + offset)) = val;
     }
 
+/**
+ * \class sample_header
+ *
+ * Prefixed to every value by a TransportServer whose configuration
+ * asks for it, and taken off again by the DataSink, which keeps the
+ * last one and statistics of them (see 'DataSink::sample_stats()').
+ * The user's payload is unchanged. Like the payloads, it is in the
+ * host's byte order.
+ *
+ */
+
+    struct sample_header
+    {
+        uint64_t seq;             // per data key, one more for each value
+        Time::Time_t published;   // Time::getUTC() when published
+    };
+
+/**
+ * \class header_stats
+ *
+ * What a DataSink has learned from the sample_headers of the values
+ * it has received since it connected. Latencies are from publication
+ * to receipt by the DataSink's transport, in nanoseconds, and so do
+ * not include any time spent waiting in the DataSink's own ring
+ * buffer. 'gaps' counts the values missing from the sequence: those
+ * lost by the transport, or refused by its backpressure policy.
+ *
+ */
+
+    struct header_stats
+    {
+        header_stats()
+            : received(0),
+              gaps(0),
+              last_latency(0),
+              max_latency(0),
+              total_latency(0)
+        {
+            last.seq = 0;
+            last.published = 0;
+        }
+
+        Time::Time_t mean_latency() const
+        {
+            return received ? total_latency / received : 0;
+        }
+
+        size_t received;
+        size_t gaps;
+        Time::Time_t last_latency;
+        Time::Time_t max_latency;
+        Time::Time_t total_latency;
+        sample_header last;
+    };
+
 /**********************************************************************
  * Callback classes
  **********************************************************************/
@@ -231,14 +414,68 @@ namespace matrix
  * published, it is received by the Keymaster client object, which then
  * calls the provided pointer to an object of this type.
  *
+ * 'exec_n()' delivers a batch of 'n' values of 'sze' bytes each,
+ * packed one after another in 'vals'. Callbacks that can take a batch
+ * at once override '_call_n()'; by default each value is handed to
+ * '_call()' in turn.
+ *
+ * 'lost()' is called by transports that can tell when values for
+ * 'key' never arrived (e.g. from gaps in sequence numbers), with the
+ * number missed. By default it is ignored.
+ *
+ * A callback that can make use of the transport's receive buffer
+ * beyond the call (a DataSink<data_view<T> >) says so with
+ * 'wants_owner()'. A transport that is able to may then pass the
+ * buffer's ownership along with the values, in 'exec_shared()' or
+ * 'exec_shared_n()'. By default these are the same as 'exec()' and
+ * 'exec_n()'.
+ *
  */
 
     struct DataCallbackBase
     {
-        void operator()(std::string key, void *val, size_t sze) {_call(key, val, sze);}
-        void exec(std::string key, void *val, size_t sze)       {_call(key, val, sze);}
+        void operator()(const std::string &key, void *val, size_t sze) {_call(key, val, sze);}
+        void exec(const std::string &key, void *val, size_t sze)       {_call(key, val, sze);}
+        void exec_n(const std::string &key, void *vals, size_t sze, size_t n) {_call_n(key, vals, sze, n);}
+        void exec_shared(const std::string &key, std::shared_ptr<const void> owner,
+                         void *val, size_t sze) {_call_shared(key, owner, val, sze, 1);}
+        void exec_shared_n(const std::string &key, std::shared_ptr<const void> owner,
+                           void *vals, size_t sze, size_t n) {_call_shared(key, owner, vals, sze, n);}
+        bool wants_owner() {return _wants_owner();}
+        void lost(const std::string &key, size_t n) {_lost(key, n);}
     private:
-        virtual void _call(std::string key, void *val, size_t szed) = 0;
+        virtual void _call(const std::string &key, void *val, size_t szed) = 0;
+
+    protected:
+        virtual void _call_n(const std::string &key, void *vals, size_t sze, size_t n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                _call(key, (char *)vals + i * sze, sze);
+            }
+        }
+
+        virtual void _call_shared(const std::string &key, std::shared_ptr<const void>,
+                                  void *vals, size_t sze, size_t n)
+        {
+            if (n == 1)
+            {
+                _call(key, vals, sze);
+            }
+            else
+            {
+                _call_n(key, vals, sze, n);
+            }
+        }
+
+        virtual bool _wants_owner()
+        {
+            return false;
+        }
+
+        virtual void _lost(const std::string &, size_t)
+        {
+        }
     };
 
 #pragma GCC diagnostic push
@@ -254,7 +491,7 @@ namespace matrix
  *     class foo()
  *     {
  *     public:
- *         void bar(std::string, void *, size_t) {...}
+ *         void bar(const std::string &, void *, size_t) {...}
  *
  *     private:
  *         DataMemberCB<foo> my_cb;
@@ -277,11 +514,19 @@ namespace matrix
     class DataMemberCB : public DataCallbackBase
     {
     public:
-        typedef void (T::*ActionMethod)(std::string, void *, size_t);
-
-        DataMemberCB(T *obj, ActionMethod cb) :
+        typedef void (T::*ActionMethod)(const std::string &, void *, size_t);
+        typedef void (T::*BatchMethod)(const std::string &, void *, size_t, size_t);
+        typedef void (T::*LostMethod)(const std::string &, size_t);
+        typedef void (T::*SharedMethod)(const std::string &, std::shared_ptr<const void>,
+                                        void *, size_t, size_t);
+
+        DataMemberCB(T *obj, ActionMethod cb, BatchMethod batch_cb = nullptr,
+                     LostMethod lost_cb = nullptr, SharedMethod shared_cb = nullptr) :
             _object(obj),
-            _faction(cb)
+            _faction(cb),
+            _fbatch(batch_cb),
+            _flost(lost_cb),
+            _fshared(shared_cb)
         {
         }
 
@@ -289,7 +534,7 @@ namespace matrix
         ///
         /// Invoke a call to the user provided callback
         ///
-        void _call(std::string key, void *buf, size_t len)
+        void _call(const std::string &key, void *buf, size_t len)
         {
             if (_object && _faction)
             {
@@ -297,8 +542,59 @@ namespace matrix
             }
         }
 
+        ///
+        /// Invoke the user provided batch callback, if there is one.
+        ///
+        void _call_n(const std::string &key, void *bufs, size_t len, size_t n)
+        {
+            if (_object && _fbatch)
+            {
+                (_object->*_fbatch)(key, bufs, len, n);
+            }
+            else
+            {
+                DataCallbackBase::_call_n(key, bufs, len, n);
+            }
+        }
+
+        ///
+        /// Report values lost in transit, if the user wants to know.
+        ///
+        void _lost(const std::string &key, size_t n)
+        {
+            if (_object && _flost)
+            {
+                (_object->*_flost)(key, n);
+            }
+        }
+
+        ///
+        /// Hand the values, and their owner, to the user provided
+        /// callback, if there is one.
+        ///
+        void _call_shared(const std::string &key, std::shared_ptr<const void> owner,
+                          void *bufs, size_t len, size_t n)
+        {
+            if (_object && _fshared)
+            {
+                (_object->*_fshared)(key, owner, bufs, len, n);
+            }
+            else
+            {
+                DataCallbackBase::_call_shared(key, owner, bufs, len, n);
+            }
+        }
+
+        bool _wants_owner()
+        {
+            return _object && _fshared;
+        }
+
         T  *_object;
         ActionMethod _faction;
+        BatchMethod _fbatch;
+        LostMethod _flost;
+        SharedMethod _fshared;
     };
 
 /**
@@ -495,22 +791,105 @@ namespace matrix
   *     // 2) implement the new class
   *            ...
   *
+  *     Transports that can publish faster given a pre-resolved key may
+  *     also override '_resolve()' to return their own subclass of
+  *     TransportServer::Channel, and the '_publish()' overload that
+  *     takes it. The defaults fall back on the key based '_publish()'.
+  *     Likewise '_loan()' and '_commit()' may be overridden to hand
+  *     out buffers owned by the transport; the defaults lend a buffer
+  *     kept in the channel and publish it on commit.
+  *
   *     // 3) Add the new factory
   *     vector<string> transports = {'my_transport'};
   *     TransportServer::add_factory(transports, TransportServer *(*)(string, string));
   *
+  * A transport may also be told what to do when a subscriber can't
+  * keep up, rather than losing its data silently:
+  *
+  *      nettask:
+  *        Transports:
+  *          A:
+  *            Specified: [shm]
+  *            Backpressure:
+  *              Policy: block     # drop_oldest (default), drop_newest or block
+  *              Timeout: 0.01     # seconds; how long 'block' waits
+  *
+  * With 'drop_newest' a sample that would overrun a subscriber is
+  * discarded and publish() returns false, so the producer knows. With
+  * 'block' publish() first waits up to 'Timeout' for room. Transports
+  * that support a policy read it with '_configure_backpressure()', and
+  * report each subscriber's queue depth and losses via
+  * '_subscribers()'; the defaults report nothing.
+  *
+  * Any transport may also be asked to prefix each value with a
+  * 'sample_header', carrying its publication time and a sequence
+  * number, so that DataSinks can measure latency and see values lost
+  * on the way:
+  *
+  *      nettask:
+  *        Transports:
+  *          A:
+  *            Specified: [tcp]
+  *            Header: true
+  *
+  * The header is added here, in TransportServer, and removed by the
+  * DataSink; the transports themselves carry it as part of the value.
+  *
   */
 #pragma GCC diagnostic pop
 
     class TransportServer
     {
     public:
+
+        /// A data key resolved once, up front, by 'resolve()'. Publishing
+        /// on a channel spares the transport the per-sample key copy
+        /// and lookup. Channels are owned by the TransportServer and
+        /// remain valid for as long as it exists.
+        struct Channel
+        {
+            Channel(std::string k) : key(k), header_seq(0), lent(nullptr) {}
+            virtual ~Channel() {}
+
+            const std::string key;
+            std::vector<unsigned char> loaned; // default loan()/commit() buffer
+            std::atomic<uint64_t> header_seq;  // next sample_header::seq
+            unsigned char *lent;               // what '_loan()' returned
+        };
+
+        typedef Channel *channel_t;
+
+        /// What a transport does with a sample that would overrun a
+        /// subscriber that has fallen behind.
+        enum backpressure_policy
+        {
+            DROP_OLDEST,   // overwrite what the subscriber hasn't read yet
+            DROP_NEWEST,   // discard the new sample, publish() returns false
+            BLOCK          // wait for room, then as DROP_NEWEST
+        };
+
+        /// One subscriber's state, as far as the transport can see it.
+        struct subscriber_stats
+        {
+            std::string id;       // transport specific, e.g. a pid
+            size_t depth;         // samples published but not yet read
+            size_t dropped;       // samples the subscriber has lost
+        };
+
         TransportServer(std::string keymaster_url, std::string key);
         virtual ~TransportServer();
 
         bool bind(std::vector<std::string> urns);
+        channel_t resolve(std::string key);
         bool publish(std::string key, const void *data, size_t size_of_data);
         bool publish(std::string key, std::string data);
+        bool publish(channel_t ch, const void *data, size_t size_of_data);
+        bool publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n);
+        void *loan(channel_t ch, size_t size);
+        bool commit(channel_t ch, size_t size);
+        std::vector<subscriber_stats> subscribers();
+        backpressure_policy policy() {return _policy;}
+        bool headers() {return _headers;}
 
         // exception type for this class.
         class CreationError : public std::exception
@@ -550,21 +929,37 @@ namespace matrix
         virtual bool _bind(std::vector<std::string> urns);
         virtual bool _publish(std::string key, const void *data, size_t size_of_data);
         virtual bool _publish(std::string key, std::string data);
+        virtual channel_t _resolve(std::string key);
+        virtual bool _publish(channel_t ch, const void *data, size_t size_of_data);
+        virtual bool _publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n);
+        virtual void *_loan(channel_t ch, size_t size);
+        virtual bool _commit(channel_t ch, size_t size);
+        virtual std::vector<subscriber_stats> _subscribers();
 
         bool _register_urn(std::vector<std::string> urns);
         bool _unregister_urn();
+        void _configure_backpressure(Keymaster &km);
 
         std::string _km_url;
         std::string _transport_key;
+        backpressure_policy _policy;
+        Time::Time_t _block_timeout;
 
     private:
 
+        bool _publish_with_headers(channel_t ch, const void *data, size_t size_of_data, size_t n);
+
+        bool _headers;
+
         static std::shared_ptr<TransportServer> create(std::string km_urn, std::string transport_key);
 
         typedef std::map<std::string, factory_sig> factory_map_t;
         static factory_map_t factories;
         static matrix::Mutex factories_mutex;
 
+        matrix::Mutex _channels_mutex;
+        std::map<std::string, std::unique_ptr<Channel> > _channels;
+
         typedef std::map<std::string, std::shared_ptr<TransportServer> > transport_map_t;
         typedef matrix::Protected<std::map<std::string, transport_map_t> > component_map_t;
         static component_map_t transports;
@@ -577,14 +972,81 @@ namespace matrix
 
     inline bool TransportServer::publish(std::string key, const void *data, size_t size_of_data)
     {
+        if (_headers)
+        {
+            return _publish_with_headers(_resolve(key), data, size_of_data, 1);
+        }
+
         return _publish(key, data, size_of_data);
     }
 
     inline bool TransportServer::publish(std::string key, std::string data)
     {
+        if (_headers)
+        {
+            return _publish_with_headers(_resolve(key), data.data(), data.size(), 1);
+        }
+
         return _publish(key, data);
     }
 
+    inline TransportServer::channel_t TransportServer::resolve(std::string key)
+    {
+        return _resolve(key);
+    }
+
+    inline bool TransportServer::publish(channel_t ch, const void *data, size_t size_of_data)
+    {
+        if (_headers)
+        {
+            return _publish_with_headers(ch, data, size_of_data, 1);
+        }
+
+        return _publish(ch, data, size_of_data);
+    }
+
+    inline bool TransportServer::publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n)
+    {
+        if (_headers)
+        {
+            return _publish_with_headers(ch, data, size_of_data, n);
+        }
+
+        return _publish_n(ch, data, size_of_data, n);
+    }
+
+    // With headers, the transport lends room for one in front of the
+    // caller's buffer, and it is filled in on commit.
+    inline void *TransportServer::loan(channel_t ch, size_t size)
+    {
+        if (_headers)
+        {
+            ch->lent = (unsigned char *)_loan(ch, size + sizeof(sample_header));
+            return ch->lent ? ch->lent + sizeof(sample_header) : nullptr;
+        }
+
+        return _loan(ch, size);
+    }
+
+    inline bool TransportServer::commit(channel_t ch, size_t size)
+    {
+        if (_headers && ch->lent)
+        {
+            sample_header h;
+            h.seq = ch->header_seq++;
+            h.published = Time::getUTC();
+            memcpy(ch->lent, &h, sizeof h);
+            return _commit(ch, size + sizeof h);
+        }
+
+        return _commit(ch, size);
+    }
+
+    inline std::vector<TransportServer::subscriber_stats> TransportServer::subscribers()
+    {
+        return _subscribers();
+    }
+
 /**********************************************************************
  * Transport Client
  **********************************************************************/
@@ -30,9 +30,14 @@
 
 #include "matrix/Time.h"
 #include "matrix/tsemfifo.h"
+#include "matrix/spscfifo.h"
+#include "matrix/latestfifo.h"
 #include "matrix/DataInterface.h"
+#include "matrix/stats.h"
 
 #include <sstream>
+#include <atomic>
+#include <functional>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcomment"
@@ -254,7 +259,11 @@ namespace matrix
  * \class poller
  *
  * Allows a thread to be notified when any or all of given DataSinks
- * is/are ready to be read.
+ * is/are ready to be read. Every wakeup looks at all the DataSinks;
+ * a thread multiplexing many of them, or also waiting on Keymaster
+ * keys or file descriptors, should use EventPoller instead, which
+ * reports which sources are ready. Several DataSinks of the same type
+ * may instead be merged into one time-ordered stream by a MergedSink.
  *
  * example:
  *
@@ -355,12 +364,15 @@ namespace matrix
 
             while (!std::any_of(_queues.begin(), _queues.end(), [](DataSinkBase *i) {return i->items() > 0;}))
             {
-                _item_placed.wait_locked_with_timeout(usecs);
+                Time::Time_t now = Time::getUTC();
 
-                if (Time::getUTC() >= time_to_quit)
+                if (now >= time_to_quit)
                 {
                     return false;
                 }
+
+                // wait only for what is left of the time-out.
+                _item_placed.wait_locked_with_timeout((time_to_quit - now + 999) / 1000);
             }
 
             return true;
@@ -385,12 +397,15 @@ namespace matrix
 
             while (!std::all_of(_queues.begin(), _queues.end(), [](DataSinkBase *i) {return i->items() > 0;}))
             {
-                _item_placed.wait_locked_with_timeout(usecs);
+                Time::Time_t now = Time::getUTC();
 
-                if (Time::getUTC() >= time_to_quit)
+                if (now >= time_to_quit)
                 {
                     return false;
                 }
+
+                // wait only for what is left of the time-out.
+                _item_placed.wait_locked_with_timeout((time_to_quit - now + 999) / 1000);
             }
 
             return true;
@@ -425,6 +440,42 @@ namespace matrix
  *
  * Other policies may be used.
  *
+ * An optional third parameter, the ring buffer class template,
+ * selects the queue between the transport and the caller. The
+ * default, tsemfifo, may be used by any number of threads. If only
+ * one thread ever calls the 'get()' family, 'spscfifo' is a lock-free
+ * alternative that avoids a mutex and two semaphores per value:
+ *
+ *     DataSink<double, select_specified, spscfifo> ds(km_urn, 1024);
+ *
+ * Note that a non-blocking DataSink using spscfifo drops the newest
+ * values when it overflows, rather than the oldest.
+ *
+ * For a consumer that only wants the freshest data, like a live
+ * display, 'latestfifo' keeps the newest N values, overwriting the
+ * oldest in constant time, and adds 'get_latest()':
+ *
+ *     DataSink<GenericBuffer, select_specified, latestfifo> ds(km_urn, 1);
+ *
+ * Values overwritten or skipped over are counted in 'lost_items()'.
+ * If the source's transport is configured to send sample_headers,
+ * 'sample_stats()' also tells how stale values are on arrival and how
+ * many went missing upstream.
+ *
+ * Variable length arrays, such as spectra, may be received as
+ * 'data_view's, which keep the transport's receive buffer alive
+ * rather than copy out of it where the transport allows:
+ *
+ *     DataSink<data_view<float> > ds(km_urn);
+ *
+ * A consumer that only does a little work per value may instead have
+ * the values handed straight to it, on the transport's thread, with
+ * 'set_handler()', bypassing the ring buffer altogether:
+ *
+ *     DataSink<double> ds(km_urn);
+ *     ds.set_handler([&](const double &v) {sum += v;});
+ *     ds.connect("producer", "output");
+ *
  * On connection the DataSink picks a transport client (which will be
  * created automatically if it doesn't already exist) by using the URN
  * obtained from the keymaster for the component, data, and transport
@@ -466,8 +517,8 @@ namespace matrix
 #pragma GCC diagnostic pop
     /**
      * General implementation for all types T. This is used by the
-     * transport to provide the data to the tsemfifo belonging to a
-     * specific DataSink.
+     * transport to provide the data to the ring buffer (a tsemfifo<T>
+     * or an spscfifo<T>) belonging to a specific DataSink.
      *
      * @param data: The data buffer
      * @param sze: The size in bytes of the buffer
@@ -478,9 +529,11 @@ namespace matrix
      *
      */
 
-    template <typename T>
-    int _data_handler(void *data, size_t sze, matrix::tsemfifo<T> &ringbuf, bool blocking)
+    template <typename Q>
+    int _data_handler(void *data, size_t sze, Q &ringbuf, bool blocking)
     {
+        typedef typename Q::value_type T;
+
         if (sizeof(T) != sze)
         {
             std::ostringstream msg;
@@ -490,7 +543,8 @@ namespace matrix
         }
         if (blocking)
         {
-            return ringbuf.put(*(T*)data);
+            ringbuf.put(*(T*)data);
+            return 0;
         }
         else
         {
@@ -499,14 +553,51 @@ namespace matrix
     }
 
     /**
-     * std::string specialization for _data_handler, wich is used by
+     * The batch counterpart of '_data_handler()': places 'n' values,
+     * packed one after another in 'data', into the DataSink's
+     * ring buffer in one operation.
+     *
+     * @param data: The data buffer
+     * @param sze: The size in bytes of each value
+     * @param n: The number of values
+     * @param ringbuf: the ringbuf to place the values into.
+     *
+     * @return The number of entries flushed from the buffer to make
+     * room for these. Ideally this is 0.
+     *
+     */
+
+    template <typename Q>
+    int _data_handler_n(void *data, size_t sze, size_t n, Q &ringbuf, bool blocking)
+    {
+        typedef typename Q::value_type T;
+
+        if (sizeof(T) != sze)
+        {
+            std::ostringstream msg;
+            msg << "size mismatch error. sizeof(T) == " << sizeof(T)
+                << " and given data buffer size is " << sze;
+            throw matrix::MatrixException("DataSink::_data_handler_n()", msg.str());
+        }
+
+        if (blocking)
+        {
+            ringbuf.put_n((T *)data, n);
+            return 0;
+        }
+        else
+        {
+            return ringbuf.put_n_no_block((T *)data, n);
+        }
+    }
+
+    /**
+     * std::string overload of _data_handler, wich is used by
      * the transport to provide the data to the DataSink's
-     * tsemfifo. Using std::strings has some implications: When the
-     * string is placed into the fifo, it's operator=() will be used
-     * to transfer the data. This means whatever previous buffer the
-     * string inside the fifo was using will be deleted, and a pointer
-     * to a new buffer given to it (by std::string, in this
-     * function). This means memory allocation and deallocation.
+     * ring buffer. The data is assigned straight into the string in
+     * the ring buffer's slot, which reuses that string's memory if it
+     * is large enough, so it is copied once and usually allocates
+     * nothing.
      *
      * @param data: The data buffer
      * @param sze: The size in bytes of the buffer
@@ -517,34 +608,62 @@ namespace matrix
      *
      */
 
-    template <>
-    inline int _data_handler<std::string>(void *data, size_t sze, matrix::tsemfifo<std::string> &ringbuf, bool blocking)
+    template <template <typename> class Q>
+    int _data_handler(void *data, size_t sze, Q<std::string> &ringbuf, bool blocking)
+    {
+        auto fill = [data, sze](std::string &slot)
+        {
+            slot.assign((char *)data, sze);
+        };
+
+        if (blocking)
+        {
+            ringbuf.emplace(fill);
+            return 0;
+        }
+        else
+        {
+            return ringbuf.emplace_no_block(fill);
+        }
+    }
+
+    /**
+     * std::string overload of _data_handler_n. Each value
+     * becomes its own string; see '_data_handler()' above.
+     *
+     */
+
+    template <template <typename> class Q>
+    int _data_handler_n(void *data, size_t sze, size_t n, Q<std::string> &ringbuf, bool blocking)
     {
-        std::string val(sze, 0);
-        std::memmove((char *)val.data(), data, sze);
+        auto fill = [data, sze](std::string &slot, size_t i)
+        {
+            slot.assign((char *)data + i * sze, sze);
+        };
+
         if (blocking)
         {
-            return ringbuf.put(val);
+            ringbuf.emplace_n(n, fill);
+            return 0;
         }
         else
         {
-            return ringbuf.put_no_block(val);
+            return ringbuf.emplace_n_no_block(n, fill);
         }
     }
 
     /**
-     * matrix::GenericBuffer specialization for _data_handler, wich is used by
+     * matrix::GenericBuffer overload of _data_handler, wich is used by
      * the transport to provide the data to the DataSink's
-     * tsemfifo. matrix::GenericBuffer provides a dynamically
+     * ring buffer. matrix::GenericBuffer provides a dynamically
      * resizable buffer. In a DataSource, it is useful for matching
      * the expected size of a DataSink, and when used in a DataSync,
      * useful for matching the incoming size from a
-     * DataSource. GenericBuffers will only resize themselves when the
+     * DataSource. The data is copied straight into the GenericBuffer
+     * in the ring buffer's slot, which only resizes itself when the
      * incoming data size does not match the previously allocated
-     * size. In that case a new buffer of the right size will be
-     * allocated. Otherwise data is copied to the buffers without any
-     * allocation or deallocation or transfer of buffer, as with
-     * std::string.
+     * size. Otherwise data is copied without any allocation or
+     * deallocation or transfer of buffer.
      *
      * @param data: The data buffer
      * @param sze: The size in bytes of the buffer
@@ -555,33 +674,305 @@ namespace matrix
      *
      */
 
-    template <>
-    inline int _data_handler<matrix::GenericBuffer>(void *data, size_t sze,
-                                                    matrix::tsemfifo<matrix::GenericBuffer> &ringbuf, bool blocking)
+    template <template <typename> class Q>
+    int _data_handler(void *data, size_t sze, Q<matrix::GenericBuffer> &ringbuf, bool blocking)
     {
-        matrix::GenericBuffer buf;
+        auto fill = [data, sze](matrix::GenericBuffer &slot)
+        {
+            if (slot.size() != sze)
+            {
+                slot.resize(sze);
+            }
+
+            std::memcpy(slot.data(), data, sze);
+        };
 
-        if (buf.size() != sze)
+        if (blocking)
         {
-            buf.resize(sze);
+            ringbuf.emplace(fill);
+            return 0;
         }
+        else
+        {
+            return ringbuf.emplace_no_block(fill);
+        }
+    }
+
+    /**
+     * matrix::GenericBuffer overload of _data_handler_n. Each
+     * value becomes its own GenericBuffer of 'sze' bytes.
+     *
+     */
+
+    template <template <typename> class Q>
+    int _data_handler_n(void *data, size_t sze, size_t n, Q<matrix::GenericBuffer> &ringbuf,
+                        bool blocking)
+    {
+        auto fill = [data, sze](matrix::GenericBuffer &slot, size_t i)
+        {
+            if (slot.size() != sze)
+            {
+                slot.resize(sze);
+            }
+
+            std::memcpy(slot.data(), (unsigned char *)data + i * sze, sze);
+        };
 
-        // TBF? A copy could be eliminated here if tsemfifo had a
-        // 'get_next_no_block()' and a 'put()' (with empty parameter list),
-        // wich would handle the semaphores properly to mark it as put,
-        // to get the next available slot and copy it directly to this.
-        std::memmove((unsigned char *)buf.data(), data, sze);
         if (blocking)
         {
-            return ringbuf.put(buf);
+            ringbuf.emplace_n(n, fill);
+            return 0;
         }
         else
         {
-            return ringbuf.put_no_block(buf);
+            return ringbuf.emplace_n_no_block(n, fill);
+        }
+    }
+
+    /**
+     * Used in place of '_data_handler_n()' by a DataSink that has a
+     * handler set (see 'DataSink::set_handler()'): runs the handler
+     * on each of the 'n' values, on the calling (transport) thread,
+     * with a reference straight into the transport's buffer.
+     *
+     * @param data: The data buffer
+     * @param sze: The size in bytes of each value
+     * @param n: The number of values
+     * @param handler: The handler to run.
+     * @param scratch: Unused here; see the overloads below.
+     *
+     */
+
+    template <typename T>
+    void _data_dispatch(void *data, size_t sze, size_t n,
+                        std::function<void (const T &)> &handler, T & /* scratch */)
+    {
+        if (sizeof(T) != sze)
+        {
+            std::ostringstream msg;
+            msg << "size mismatch error. sizeof(T) == " << sizeof(T)
+                << " and given data buffer size is " << sze;
+            throw matrix::MatrixException("DataSink::_data_dispatch()", msg.str());
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            handler(((const T *)data)[i]);
         }
     }
 
-    template <typename T, typename U = select_specified>
+    /**
+     * std::string overload of _data_dispatch. Each value is
+     * assigned into 'scratch', which keeps its memory from one value
+     * to the next, and the handler is given that.
+     *
+     */
+
+    inline void _data_dispatch(void *data, size_t sze, size_t n,
+                               std::function<void (const std::string &)> &handler,
+                               std::string &scratch)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            scratch.assign((char *)data + i * sze, sze);
+            handler(scratch);
+        }
+    }
+
+    /**
+     * matrix::GenericBuffer overload of _data_dispatch. As for
+     * std::string, the values pass through 'scratch', which is only
+     * resized when the incoming size changes.
+     *
+     */
+
+    inline void _data_dispatch(void *data, size_t sze, size_t n,
+                               std::function<void (const matrix::GenericBuffer &)> &handler,
+                               matrix::GenericBuffer &scratch)
+    {
+        if (scratch.size() != sze)
+        {
+            scratch.resize(sze);
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            std::memcpy(scratch.data(), (unsigned char *)data + i * sze, sze);
+            handler(scratch);
+        }
+    }
+
+    /**
+     * Copies 'len' bytes into memory owned by the returned pointer,
+     * for a data_view to keep.
+     *
+     */
+
+    inline std::shared_ptr<const void> _data_view_copy(const void *data, size_t len)
+    {
+        std::shared_ptr<char> p(new char[len ? len : 1], std::default_delete<char[]>());
+        std::memcpy(p.get(), data, len);
+        return p;
+    }
+
+    /**
+     * Places 'n' views, one onto each of the values packed in 'data',
+     * into a DataSink's ring buffer. The views share 'owner', which
+     * keeps 'data' valid. If the values can't be read as U's where
+     * they lie (misaligned) they are copied first.
+     *
+     * @param owner: What keeps 'data' alive.
+     * @param data: The data buffer
+     * @param sze: The size in bytes of each value
+     * @param n: The number of values
+     * @param ringbuf: the ringbuf to place the views into.
+     *
+     * @return The number of entries flushed from the buffer to make
+     * room for these. Ideally this is 0.
+     *
+     */
+
+    template <typename U, template <typename> class Q>
+    int _data_handler_view(std::shared_ptr<const void> owner, const void *data, size_t sze,
+                           size_t n, Q<matrix::data_view<U> > &ringbuf, bool blocking)
+    {
+        if (!matrix::data_view<U>::whole(sze))
+        {
+            std::ostringstream msg;
+            msg << "size mismatch error. sizeof(T) == " << sizeof(U)
+                << " does not divide given data buffer size " << sze;
+            throw matrix::MatrixException("DataSink::_data_handler_view()", msg.str());
+        }
+
+        if (!matrix::data_view<U>::aligned(data))
+        {
+            owner = _data_view_copy(data, sze * n);
+            data = owner.get();
+        }
+
+        auto fill = [&owner, data, sze](matrix::data_view<U> &slot, size_t i)
+        {
+            slot = matrix::data_view<U>(owner, (const char *)data + i * sze, sze);
+        };
+
+        if (blocking)
+        {
+            ringbuf.emplace_n(n, fill);
+            return 0;
+        }
+        else
+        {
+            return ringbuf.emplace_n_no_block(n, fill);
+        }
+    }
+
+    /**
+     * Any other ring buffer can't hold on to the transport's buffer;
+     * the values are copied in as usual.
+     *
+     */
+
+    template <typename Q>
+    int _data_handler_view(std::shared_ptr<const void>, const void *data, size_t sze,
+                           size_t n, Q &ringbuf, bool blocking)
+    {
+        if (n == 1)
+        {
+            return _data_handler((void *)data, sze, ringbuf, blocking);
+        }
+        else
+        {
+            return _data_handler_n((void *)data, sze, n, ringbuf, blocking);
+        }
+    }
+
+    /**
+     * matrix::data_view overloads of _data_handler and
+     * _data_handler_n, for transports that don't hand over their
+     * buffer: the values are copied, all 'n' of them into one block
+     * of memory which their views then share.
+     *
+     */
+
+    template <typename U, template <typename> class Q>
+    int _data_handler_n(void *data, size_t sze, size_t n, Q<matrix::data_view<U> > &ringbuf,
+                        bool blocking)
+    {
+        std::shared_ptr<const void> owner = _data_view_copy(data, sze * n);
+        return _data_handler_view(owner, owner.get(), sze, n, ringbuf, blocking);
+    }
+
+    template <typename U, template <typename> class Q>
+    int _data_handler(void *data, size_t sze, Q<matrix::data_view<U> > &ringbuf, bool blocking)
+    {
+        return _data_handler_n(data, sze, 1, ringbuf, blocking);
+    }
+
+    /**
+     * The counterpart of '_data_handler_view()' for a DataSink in
+     * callback mode.
+     *
+     */
+
+    template <typename U>
+    void _data_dispatch_view(std::shared_ptr<const void> owner, const void *data, size_t sze,
+                             size_t n, std::function<void (const matrix::data_view<U> &)> &handler,
+                             matrix::data_view<U> & /* scratch */)
+    {
+        if (!matrix::data_view<U>::whole(sze))
+        {
+            std::ostringstream msg;
+            msg << "size mismatch error. sizeof(T) == " << sizeof(U)
+                << " does not divide given data buffer size " << sze;
+            throw matrix::MatrixException("DataSink::_data_dispatch_view()", msg.str());
+        }
+
+        if (!matrix::data_view<U>::aligned(data))
+        {
+            owner = _data_view_copy(data, sze * n);
+            data = owner.get();
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            handler(matrix::data_view<U>(owner, (const char *)data + i * sze, sze));
+        }
+    }
+
+    template <typename T>
+    void _data_dispatch_view(std::shared_ptr<const void>, const void *data, size_t sze,
+                             size_t n, std::function<void (const T &)> &handler, T &scratch)
+    {
+        _data_dispatch((void *)data, sze, n, handler, scratch);
+    }
+
+    /**
+     * matrix::data_view overload of _data_dispatch. The views handed
+     * to the handler own a copy of the values, so the handler may keep
+     * them.
+     *
+     */
+
+    template <typename U>
+    void _data_dispatch(void *data, size_t sze, size_t n,
+                        std::function<void (const matrix::data_view<U> &)> &handler,
+                        matrix::data_view<U> &scratch)
+    {
+        std::shared_ptr<const void> owner = _data_view_copy(data, sze * n);
+        _data_dispatch_view(owner, owner.get(), sze, n, handler, scratch);
+    }
+
+    template <typename T>
+    struct is_data_view : std::false_type
+    {
+    };
+
+    template <typename U>
+    struct is_data_view<matrix::data_view<U> > : std::true_type
+    {
+    };
+
+    template <typename T, typename U = select_specified, template <typename> class Q = tsemfifo>
     class DataSink : public matrix::DataSinkBase
     {
     public:
@@ -591,10 +982,22 @@ namespace matrix
         void get(T &);
         bool try_get(T &);
         bool timed_get(T &, Time::Time_t);
+        size_t get_n(T *, size_t max, Time::Time_t time_out = -1);
+        T *get_ref(Time::Time_t time_out);
+        void release_ref();
+        bool get_latest(T &, Time::Time_t time_out);
         size_t items();
         size_t lost_items();
+        bool headers() {return _headers;}
+        matrix::header_stats sample_stats();
+        const matrix::sample_header &handler_header() {return _handler_header;}
         size_t flush(int items);
         void set_notifier(std::shared_ptr<matrix::fifo_notifier> n);
+        void set_wait_strategy(matrix::wait_strategy w);
+
+        typedef std::function<void (const T &)> handler_t;
+        void set_handler(handler_t h);
+        void set_stats_key(std::string key);
 
         void connect(std::string component_name, std::string data_name,
                      std::string transport = "");
@@ -609,11 +1012,22 @@ namespace matrix
         void _reconnect(std::string component_name, std::string data_name,
                         std::string transport = "");
         void _disconnect();
-        void _data_handler(std::string key, void *data, size_t sze);
+        void _data_handler(const std::string &key, void *data, size_t sze);
+        void _data_handler_n(const std::string &key, void *data, size_t sze, size_t n);
+        void _lost_handler(const std::string &key, size_t n);
+        void _shared_handler(const std::string &key, std::shared_ptr<const void> owner,
+                             void *data, size_t sze, size_t n);
+        void _deliver(std::shared_ptr<const void> *owner, void *data, size_t sze, size_t n);
+        void _deliver_with_headers(std::shared_ptr<const void> *owner, void *data, size_t sze,
+                                   size_t n);
+        bool _read_headers_config();
+        void _got(size_t n);
+        void _queued();
+        YAML::Node _report();
         std::string _get_as_configured_key(std::string component_name, std::string data_name);
 
         bool _connected;
-        size_t _lost_data;
+        std::atomic<size_t> _lost_data;
         std::string _km_urn;
         std::string _key;
         std::string _asconf_key;
@@ -624,9 +1038,22 @@ namespace matrix
         std::string _transport;
 
         std::shared_ptr<matrix::TransportClient> _tc;
-        matrix::tsemfifo<T> _ringbuf;
+        Q<T> _ringbuf;
         matrix::DataMemberCB<DataSink> _cb;
         bool _blocking;
+        handler_t _handler;
+        T _scratch;
+        bool _headers;
+        matrix::Mutex _stats_mutex;
+        matrix::header_stats _stats;
+        matrix::sample_header _handler_header;
+        std::string _stats_key;
+        int _stats_id;
+        std::atomic<uint64_t> _received;
+        matrix::queue_probe _probe;
+        matrix::latency_histogram _queue_wait;
+        matrix::latency_histogram _transport_latency;
+        matrix::rate_meter _rate;
     };
 
 /**
@@ -636,13 +1063,19 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    DataSink<T, U>::DataSink(std::string km_urn, size_t ringbuf_size, bool blocking)
+    template <typename T, typename U, template <typename> class Q>
+    DataSink<T, U, Q>::DataSink(std::string km_urn, size_t ringbuf_size, bool blocking)
         : _connected(false),
+          _lost_data(0),
           _km_urn(km_urn),
           _ringbuf(ringbuf_size),
-          _cb(this, &DataSink::_data_handler),
-          _blocking(blocking)
+          _cb(this, &DataSink::_data_handler, &DataSink::_data_handler_n, &DataSink::_lost_handler,
+              is_data_view<T>::value ? &DataSink::_shared_handler : nullptr),
+          _blocking(blocking),
+          _headers(false),
+          _handler_header(),
+          _stats_id(-1),
+          _received(0)
     {
     }
 
@@ -651,8 +1084,8 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    DataSink<T, U>::~DataSink() throw()
+    template <typename T, typename U, template <typename> class Q>
+    DataSink<T, U, Q>::~DataSink() throw()
     {
         std::string now = Time::isoDateTime(Time::getUTC()) + " -- ";
 
@@ -680,8 +1113,8 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    void DataSink<T, U>::_check_connected()
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_check_connected()
     {
         if (!_connected)
         {
@@ -698,12 +1131,186 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    void DataSink<T, U>::_data_handler(std::string key, void *data, size_t sze)
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_data_handler(const std::string &key, void *data, size_t sze)
     {
         if (key == _key)
         {
-            _lost_data += matrix::_data_handler<T>(data, sze, _ringbuf, _blocking);
+            _deliver(nullptr, data, sze, 1);
+        }
+    }
+
+/**
+ * Handles a batch of values from the DataSource.
+ *
+ * @param key: The key to the data source
+ * @param data: The values, one after another
+ * @param sze: The size, in bytes, of each value.
+ * @param n: The number of values.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_data_handler_n(const std::string &key, void *data, size_t sze, size_t n)
+    {
+        if (key == _key)
+        {
+            _deliver(nullptr, data, sze, n);
+        }
+    }
+
+/**
+ * Handles values whose transport hands over the buffer they arrived
+ * in, along with the values. Only a DataSink<data_view<U> > asks for
+ * this; its views then point straight into that buffer.
+ *
+ * @param key: The key to the data source
+ * @param owner: Keeps the buffer alive.
+ * @param data: The values, one after another
+ * @param sze: The size, in bytes, of each value.
+ * @param n: The number of values.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_shared_handler(const std::string &key, std::shared_ptr<const void> owner,
+                                            void *data, size_t sze, size_t n)
+    {
+        if (key == _key)
+        {
+            _deliver(&owner, data, sze, n);
+        }
+    }
+
+/**
+ * Hands 'n' values of 'sze' bytes, packed in 'data', to the handler
+ * if there is one, or to the ring buffer. If the source sends
+ * sample_headers they are first taken off.
+ *
+ * @param owner: What keeps 'data' alive, if the transport passed
+ * that on; nullptr otherwise.
+ * @param data: The values, one after another
+ * @param sze: The size, in bytes, of each value.
+ * @param n: The number of values.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_deliver(std::shared_ptr<const void> *owner, void *data, size_t sze, size_t n)
+    {
+        _received.fetch_add(n, std::memory_order_relaxed);
+
+        if (_headers)
+        {
+            _deliver_with_headers(owner, data, sze, n);
+        }
+        else if (owner && _handler)
+        {
+            matrix::_data_dispatch_view(*owner, data, sze, n, _handler, _scratch);
+        }
+        else if (owner)
+        {
+            _lost_data += matrix::_data_handler_view(*owner, data, sze, n, _ringbuf, _blocking);
+            _queued();
+        }
+        else if (_handler)
+        {
+            matrix::_data_dispatch(data, sze, n, _handler, _scratch);
+        }
+        else if (n == 1)
+        {
+            _lost_data += matrix::_data_handler(data, sze, _ringbuf, _blocking);
+            _queued();
+        }
+        else
+        {
+            _lost_data += matrix::_data_handler_n(data, sze, n, _ringbuf, _blocking);
+            _queued();
+        }
+    }
+
+/**
+ * Takes the sample_header off each of 'n' values, updating the
+ * statistics kept for 'sample_stats()', and delivers what follows
+ * it. A value shorter than a header is discarded.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_deliver_with_headers(std::shared_ptr<const void> *owner, void *data,
+                                                  size_t sze, size_t n)
+    {
+        const size_t hsze = sizeof(matrix::sample_header);
+        Time::Time_t now = Time::getUTC();
+
+        if (sze < hsze)
+        {
+            return;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            char *p = (char *)data + i * sze;
+            matrix::sample_header h;
+            std::memcpy(&h, p, hsze);
+            _handler_header = h;
+
+            {
+                matrix::ThreadLock<matrix::Mutex> l(_stats_mutex);
+                l.lock();
+
+                // a sequence number that goes backwards means the source
+                // started over; only a jump forward is a loss.
+                if (_stats.received && h.seq > _stats.last.seq + 1)
+                {
+                    _stats.gaps += h.seq - _stats.last.seq - 1;
+                }
+
+                _stats.last = h;
+                _stats.last_latency = now > h.published ? now - h.published : 0;
+                _stats.max_latency = std::max(_stats.max_latency, _stats.last_latency);
+                _stats.total_latency += _stats.last_latency;
+                ++_stats.received;
+                _transport_latency.record(_stats.last_latency);
+            }
+
+            if (owner && _handler)
+            {
+                matrix::_data_dispatch_view(*owner, p + hsze, sze - hsze, 1, _handler, _scratch);
+            }
+            else if (owner)
+            {
+                _lost_data += matrix::_data_handler_view(*owner, p + hsze, sze - hsze, 1,
+                                                         _ringbuf, _blocking);
+                _queued();
+            }
+            else if (_handler)
+            {
+                matrix::_data_dispatch(p + hsze, sze - hsze, 1, _handler, _scratch);
+            }
+            else
+            {
+                _lost_data += matrix::_data_handler(p + hsze, sze - hsze, _ringbuf, _blocking);
+                _queued();
+            }
+        }
+    }
+
+/**
+ * Counts values the transport reports as lost on the way here, so
+ * that 'lost_items()' covers them as well as fifo overruns.
+ *
+ * @param key: The key to the data source
+ * @param n: The number of values lost.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_lost_handler(const std::string &key, size_t n)
+    {
+        if (key == _key)
+        {
+            _lost_data += n;
         }
     }
 
@@ -715,11 +1322,12 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    void DataSink<T, U>::get(T &val)
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::get(T &val)
     {
         _check_connected();
         _ringbuf.get(val);
+        _got(1);
     }
 
 /**
@@ -735,11 +1343,13 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    bool DataSink<T, U>::try_get(T &val)
+    template <typename T, typename U, template <typename> class Q>
+    bool DataSink<T, U, Q>::try_get(T &val)
     {
         _check_connected();
-        return _ringbuf.try_get(val);
+        bool rval = _ringbuf.try_get(val);
+        _got(rval ? 1 : 0);
+        return rval;
     }
 
 /**
@@ -752,11 +1362,110 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    bool DataSink<T, U>::timed_get(T &val, Time::Time_t time_out)
+    template <typename T, typename U, template <typename> class Q>
+    bool DataSink<T, U, Q>::timed_get(T &val, Time::Time_t time_out)
+    {
+        _check_connected();
+        bool rval = _ringbuf.timed_get(val, time_out);
+        _got(rval ? 1 : 0);
+        return rval;
+    }
+
+/**
+ * Gets up to 'max' values at once. This waits once, for the first
+ * value, and then takes whatever else is already queued, up to 'max',
+ * which is much cheaper than as many calls to 'get()'.
+ *
+ *     double vals[100];
+ *     size_t n = sink.get_n(vals, 100);
+ *
+ * @param vals: Where the values are placed. Must have room for 'max'
+ * values.
+ *
+ * @param max: The most values to get.
+ *
+ * @param time_out: the time-out for the first value, in nanoseconds
+ * (relative). If negative (the default) wait indefinitely, if 0 don't
+ * wait.
+ *
+ * @return The number of values placed in 'vals', 0 if the wait timed out.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    size_t DataSink<T, U, Q>::get_n(T *vals, size_t max, Time::Time_t time_out)
+    {
+        _check_connected();
+        size_t n = _ringbuf.get_n(vals, max, time_out);
+        _got(n);
+        return n;
+    }
+
+/**
+ * Gets the next value in place, in the ring buffer, rather than
+ * copying it out. This is worth doing for large values, like a
+ * DataSink<GenericBuffer> carrying big samples. The value must be
+ * given back with 'release_ref()' before the next 'get_ref()':
+ *
+ *     GenericBuffer *buf = sink.get_ref(100000000);
+ *
+ *     if (buf)
+ *     {
+ *         write_it(buf->data(), buf->size());
+ *         sink.release_ref();
+ *     }
+ *
+ * @param time_out: the time-out, in nanoseconds (relative). If 0
+ * don't wait.
+ *
+ * @return A pointer to the value, or nullptr if the wait timed out.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    T *DataSink<T, U, Q>::get_ref(Time::Time_t time_out)
+    {
+        _check_connected();
+        return _ringbuf.get_ref(time_out);
+    }
+
+/**
+ * Releases the value obtained with 'get_ref()', making room for
+ * another.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::release_ref()
     {
+        _ringbuf.release_ref();
+        _got(1);
+    }
+
+/**
+ * Gets the newest value, discarding any older ones still queued. The
+ * discarded values are added to 'lost_items()'. This is meant for a
+ * DataSink using a latestfifo, but works with any ring buffer.
+ *
+ * @param val: The data from the data source
+ *
+ * @param time_out: the time-out, in nanoseconds (relative). If 0
+ * don't wait; if negative wait indefinitely.
+ *
+ * @return 'true' if 'val' was set, 'false' if the wait timed out.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    bool DataSink<T, U, Q>::get_latest(T &val, Time::Time_t time_out)
+    {
+        size_t skipped;
+
         _check_connected();
-        return _ringbuf.timed_get(val, time_out);
+        bool rval = _ringbuf.get_latest(val, time_out, skipped);
+        _lost_data += skipped;
+        _got(rval ? skipped + 1 : 0);
+        return rval;
     }
 
 /**
@@ -790,8 +1499,8 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    void DataSink<T, U>::connect(std::string component_name,
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::connect(std::string component_name,
                                  std::string data_name, std::string transport)
     {
         U tss(_km_urn, transport);
@@ -808,10 +1517,24 @@ namespace matrix
         _key = component_name + "." + data_name;
         _asconf_key = _get_as_configured_key(component_name, data_name);
         _lost_data = 0L;
+        _headers = _read_headers_config();
+        {
+            matrix::ThreadLock<matrix::Mutex> l(_stats_mutex);
+            l.lock();
+            _stats = matrix::header_stats();
+        }
+        _received = 0;
+        _probe.reset();
         _tc = TransportClient::get_transport(_urn);
         _tc->connect(_urn);
         _tc->subscribe(_key, &_cb);
         _connected = true;
+
+        if (!_stats_key.empty())
+        {
+            _stats_id = matrix::stats_reporter::add(_km_urn, _stats_key,
+                                                    [this]() {return _report();});
+        }
     }
 
 /**
@@ -827,8 +1550,8 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    std::string DataSink<T, U>::_get_as_configured_key(std::string component_name, std::string data_name)
+    template <typename T, typename U, template <typename> class Q>
+    std::string DataSink<T, U, Q>::_get_as_configured_key(std::string component_name, std::string data_name)
     {
         Keymaster km(_km_urn);
         // This will be something like 'foo_component.bar_data' and will be
@@ -838,6 +1561,30 @@ namespace matrix
         return "components." + component_name + ".Transports." + transport + ".AsConfigured";
     }
 
+/**
+ * Looks up whether the source's transport prefixes its values with a
+ * sample_header ('Header: true' in its configuration). The transport's
+ * key is that of its 'AsConfigured' section, found by 'connect()'.
+ *
+ * @return true if it does, false otherwise.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    bool DataSink<T, U, Q>::_read_headers_config()
+    {
+        Keymaster km(_km_urn);
+        mxutils::yaml_result yr;
+        std::string transport_key = _asconf_key.substr(0, _asconf_key.rfind(".AsConfigured"));
+
+        if (km.get(transport_key + ".Header", yr))
+        {
+            return yr.node.as<bool>();
+        }
+
+        return false;
+    }
+
 /**
  * Disconnects from the data source. This essentially means that the
  * DataSink unsubscribes from the TransportClient, which may or may
@@ -850,9 +1597,15 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    void DataSink<T, U>::disconnect()
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::disconnect()
     {
+        if (_stats_id >= 0)
+        {
+            matrix::stats_reporter::remove(_stats_id);
+            _stats_id = -1;
+        }
+
         if (_connected)
         {
             _tc->unsubscribe(_key);
@@ -871,8 +1624,8 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    size_t DataSink<T, U>::items()
+    template <typename T, typename U, template <typename> class Q>
+    size_t DataSink<T, U, Q>::items()
     {
         return (size_t)_ringbuf.size();
     }
@@ -889,12 +1642,32 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    size_t DataSink<T, U>::lost_items()
+    template <typename T, typename U, template <typename> class Q>
+    size_t DataSink<T, U, Q>::lost_items()
     {
         return _lost_data;
     }
 
+/**
+ * Returns what has been learned from the sample_headers received
+ * since connecting: the last header, the latency from publication to
+ * receipt, and the number of values missing from the sequence. These
+ * are only kept if the source's transport sends headers (see
+ * 'headers()'); values the transport itself loses are counted in
+ * 'gaps', not in 'lost_items()'.
+ *
+ * @return A copy of the statistics.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    matrix::header_stats DataSink<T, U, Q>::sample_stats()
+    {
+        matrix::ThreadLock<matrix::Mutex> l(_stats_mutex);
+        l.lock();
+        return _stats;
+    }
+
 /**
  * Flushes a requested number of items out of the receive queue,
  * starting with the oldest values. These values are dropped.
@@ -908,9 +1681,11 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    size_t DataSink<T, U>::flush(int items)
+    template <typename T, typename U, template <typename> class Q>
+    size_t DataSink<T, U, Q>::flush(int items)
     {
+        // the value being followed may be among those dropped.
+        _probe.reset();
         return (size_t)_ringbuf.flush(items);
     }
 
@@ -924,12 +1699,152 @@ namespace matrix
  *
  */
 
-    template <typename T, typename U>
-    void DataSink<T, U>::set_notifier(std::shared_ptr<matrix::fifo_notifier> n)
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::set_notifier(std::shared_ptr<matrix::fifo_notifier> n)
     {
         _ringbuf.set_notifier(n);
     }
 
+/**
+ * Sets how 'get()', 'timed_get()', 'get_n()', 'get_ref()' and
+ * 'get_latest()' wait for data: by blocking (the default), by
+ * spinning a bounded number of times before blocking, or by busy
+ * polling. A real-time consumer may spend a core this way to be woken
+ * within a microsecond or so of a value's arrival, rather than after
+ * a futex wakeup:
+ *
+ *     DataSink<double> sink(km_urn, 100);
+ *     sink.set_wait_strategy(wait_strategy::busy_poll());
+ *     pin_this_thread(3);   // in the consuming thread
+ *
+ * This should be called before the consumer starts getting.
+ *
+ * @param w: The wait_strategy, see matrix::wait_strategy.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::set_wait_strategy(matrix::wait_strategy w)
+    {
+        _ringbuf.set_wait_strategy(w);
+    }
+
+/**
+ * Puts the DataSink in callback mode: instead of being queued in the
+ * ring buffer for 'get()', each value is handed to 'h' as it arrives,
+ * on the transport's delivery thread. This saves a copy, a queue and a
+ * context switch per value, but 'h' holds up the transport while it
+ * runs, so it should be short; a handler that has more to do may pass
+ * the value on to a thread of its own.
+ *
+ * For POD types 'h' receives a reference into the transport's own
+ * buffer, valid only for the duration of the call. std::string and
+ * GenericBuffer values are first copied into a buffer kept by the
+ * DataSink for the purpose. If the source sends sample_headers (see
+ * 'headers()'), 'handler_header()' returns the one that came with the
+ * value, for the duration of the call.
+ *
+ * The handler must be set (or cleared, by passing an empty handler)
+ * while the DataSink is not connected.
+ *
+ * @param h: The handler, a 'void (const T &)' callable.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::set_handler(handler_t h)
+    {
+        if (_connected)
+        {
+            throw MatrixException("DataSink", "set_handler() called on a connected DataSink.");
+        }
+
+        _handler = h;
+    }
+
+/**
+ * Gives the key under which this DataSink's statistics are put to the
+ * Keymaster, from the next 'connect()' on. Component::connect_sink()
+ * sets 'components.<component>.stats.Sinks.<sink name>' if the
+ * component has 'Stats: true' in its node, as for its DataSources;
+ * otherwise a DataSink reports nothing unless given a key. The
+ * statistics are:
+ *
+ *     received: 120000      # values, since connecting
+ *     rate: 1000.2          # values per second
+ *     depth: 3              # 'items()'
+ *     lost: 0               # 'lost_items()'
+ *     queue_wait: {count: 12, p50_us: 40.2, p99_us: 310, max_us: 350}
+ *
+ * and, if the source sends sample_headers, 'transport_latency' (from
+ * publication to receipt, as for 'sample_stats()') and 'gaps'.
+ * 'queue_wait' follows one value at a time through the ring buffer
+ * (see matrix::queue_probe), so its count is that of the values
+ * followed, not of all the values.
+ *
+ * @param key: The key. An empty key stops the reports.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::set_stats_key(std::string key)
+    {
+        _stats_key = key;
+    }
+
+/**
+ * Counts 'n' values taken from the ring buffer, for the queue wait
+ * estimate.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_got(size_t n)
+    {
+        _probe.got(n, _queue_wait);
+    }
+
+/**
+ * Called after values were put in the ring buffer; starts following
+ * the last of them if none is being followed.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    void DataSink<T, U, Q>::_queued()
+    {
+        if (_probe.idle())
+        {
+            _probe.put(_ringbuf.size());
+        }
+    }
+
+/**
+ * Reports the statistics; called by the stats_reporter.
+ *
+ */
+
+    template <typename T, typename U, template <typename> class Q>
+    YAML::Node DataSink<T, U, Q>::_report()
+    {
+        YAML::Node n;
+        uint64_t received = _received.load(std::memory_order_relaxed);
+
+        n["received"] = received;
+        n["rate"] = _rate(received);
+        n["depth"] = (size_t)_ringbuf.size();
+        n["lost"] = (size_t)_lost_data;
+        n["queue_wait"] = matrix::latency_histogram::to_yaml(_queue_wait.take());
+
+        if (_headers)
+        {
+            n["transport_latency"] = matrix::latency_histogram::to_yaml(_transport_latency.take());
+            n["gaps"] = sample_stats().gaps;
+        }
+
+        return n;
+    }
+
 /**
   * Reconnects a sink to its source. Given a KeymasterHeartbeatCB, it
   * can verify that the Keymaster is still alive. If so, it checks to
@@ -31,6 +31,7 @@
 
 #include "matrix/Keymaster.h"
 #include "matrix/DataInterface.h"
+#include "matrix/stats.h"
 
 #include <vector>
 #include <msgpack.hpp>
@@ -78,6 +79,27 @@ namespace matrix
  * then translate to a 't->put("log", data)', where 't' is the correct
  * transport specified in the configuration.
  *
+ * A DataSource may count the values it publishes and those the
+ * transport refuses, and time each publish call. These are put to
+ * the Keymaster every 'stats_reporter::interval()':
+ *
+ *     published: 120000
+ *     refused: 0
+ *     rate: 1000.2
+ *     publish_time: {count: 1000, p50_us: 1.9, p99_us: 6.8, max_us: 31}
+ *
+ * This is off unless asked for, with 'set_stats_key()', or for all of
+ * a component's sources (and, through Component::connect_sink(), its
+ * sinks) with 'Stats: true' in its node:
+ *
+ *     components:
+ *       nettask:
+ *         Stats: true
+ *
+ * in which case they go under
+ * 'components.<component>.stats.Sources.<data name>'. When it is off
+ * a publish costs no more than the transport's publish.
+ *
  */
 
     template<typename T>
@@ -89,14 +111,34 @@ namespace matrix
         ~DataSource() throw();
 
         bool publish(T &);
+        bool publish_n(const T *, size_t n);
+
+        T *loan();
+        void *loan(size_t size);
+        bool commit();
+        bool commit(size_t size);
+
+        std::vector<matrix::TransportServer::subscriber_stats> subscribers();
+        void set_stats_key(std::string key);
 
     private:
+        Time::Time_t _start();
+        bool _counted(bool ok, size_t n, Time::Time_t start);
+        YAML::Node _report();
+
         std::string _km_urn;
         std::string _component_name;
         std::string _transport_name;
         std::string _data_name;
         std::string _key;
         std::shared_ptr<matrix::TransportServer> _ts;
+        matrix::TransportServer::channel_t _channel;
+        std::atomic<uint64_t> _published;
+        std::atomic<uint64_t> _refused;
+        matrix::latency_histogram _publish_time;
+        matrix::rate_meter _rate;
+        bool _stats;
+        int _stats_id;
     };
 
 /**
@@ -117,8 +159,13 @@ namespace matrix
             _km_urn(km_urn),
             _component_name(component_name),
             _data_name(data_name),
-            _key(component_name + "." + data_name)
+            _key(component_name + "." + data_name),
+            _published(0),
+            _refused(0),
+            _stats(false),
+            _stats_id(-1)
     {
+        mxutils::yaml_result yr;
         matrix::Keymaster km(km_urn);
         // obtain the transport name associated with this data source and
         // get a pointer to that transport
@@ -127,11 +174,20 @@ namespace matrix
                                                  + ".Sources."
                                                  + data_name);
         _ts = matrix::TransportServer::get_transport(km_urn, _component_name, _transport_name);
+        // resolve the key once; publishing on the channel saves a key
+        // copy and lookup on every sample.
+        _channel = _ts->resolve(_key);
+
+        if (km.get("components." + component_name + ".Stats", yr) && yr.node.as<bool>())
+        {
+            set_stats_key("components." + component_name + ".stats.Sources." + data_name);
+        }
     }
 
     template<typename T>
     DataSource<T>::~DataSource() throw()
     {
+        set_stats_key("");
         _ts.reset();
         matrix::TransportServer::release_transport(_component_name, _transport_name);
     }
@@ -149,7 +205,196 @@ namespace matrix
     template<typename T>
     bool DataSource<T>::publish(T &val)
     {
-        return _ts->publish(_key, &val, sizeof val);
+        Time::Time_t start = _start();
+        return _counted(_ts->publish(_channel, &val, sizeof val), 1, start);
+    }
+
+/**
+ * Publishes 'n' values of type 'T' in one call. Transports that
+ * support it move the whole batch at once, and sinks receive it as a
+ * batch. As with 'publish()', 'T' must be a contiguous type.
+ *
+ * @param vals: The first of 'n' values.
+ *
+ * @param n: The number of values.
+ *
+ * @return true if the publish succeeds, false otherwise.
+ *
+ */
+
+    template<typename T>
+    bool DataSource<T>::publish_n(const T *vals, size_t n)
+    {
+        Time::Time_t start = _start();
+        return _counted(_ts->publish_n(_channel, vals, sizeof(T), n), n, start);
+    }
+
+/**
+ * Borrows a buffer for one 'T' from the transport, to be filled in
+ * place and published with 'commit()'. Depending on the transport
+ * this may be a shared memory buffer or a pooled message buffer,
+ * so that the sample is never copied on the way out. Only one loan
+ * may be outstanding at a time, and it must be committed. As with
+ * 'publish()', 'T' must be a contiguous type.
+ *
+ *     double *d = src.loan();
+ *
+ *     if (d)
+ *     {
+ *         *d = 3.14159;
+ *         src.commit();
+ *     }
+ *
+ * @return A pointer to the loaned 'T', or NULL if the transport cannot
+ * provide one.
+ *
+ */
+
+    template<typename T>
+    T *DataSource<T>::loan()
+    {
+        return (T *)_ts->loan(_channel, sizeof(T));
+    }
+
+/**
+ * Borrows a buffer of 'size' bytes. This is the form to use for
+ * variable sized data, such as matrix::GenericBuffer payloads.
+ *
+ * @param size: The size of the buffer needed, in bytes.
+ *
+ * @return A pointer to the buffer, or NULL if the transport cannot
+ * provide one.
+ *
+ */
+
+    template<typename T>
+    void *DataSource<T>::loan(size_t size)
+    {
+        return _ts->loan(_channel, size);
+    }
+
+/**
+ * Publishes the 'T' obtained from 'loan()'.
+ *
+ * @return true if the publish succeeds, false otherwise.
+ *
+ */
+
+    template<typename T>
+    bool DataSource<T>::commit()
+    {
+        Time::Time_t start = _start();
+        return _counted(_ts->commit(_channel, sizeof(T)), 1, start);
+    }
+
+/**
+ * Publishes the first 'size' bytes of the buffer obtained from
+ * 'loan(size_t)'.
+ *
+ * @param size: The number of bytes to publish, no more than were
+ * loaned.
+ *
+ * @return true if the publish succeeds, false otherwise.
+ *
+ */
+
+    template<typename T>
+    bool DataSource<T>::commit(size_t size)
+    {
+        Time::Time_t start = _start();
+        return _counted(_ts->commit(_channel, size), 1, start);
+    }
+
+/**
+ * Reports the queue depth and losses of each subscriber to this
+ * source's transport, as far as the transport can tell. A producer
+ * may use these to slow down before samples are lost.
+ *
+ * @return A vector of subscriber_stats, possibly empty.
+ *
+ */
+
+    template<typename T>
+    std::vector<matrix::TransportServer::subscriber_stats> DataSource<T>::subscribers()
+    {
+        return _ts->subscribers();
+    }
+
+/**
+ * Turns the statistics on, reporting them under 'key', or off if 'key'
+ * is empty. This should be done before publishing begins, as the
+ * publishing thread checks it without a lock.
+ *
+ * @param key: The key. An empty key stops the reports.
+ *
+ */
+
+    template<typename T>
+    void DataSource<T>::set_stats_key(std::string key)
+    {
+        if (_stats_id >= 0)
+        {
+            matrix::stats_reporter::remove(_stats_id);
+            _stats_id = -1;
+        }
+
+        _stats = !key.empty();
+
+        if (_stats)
+        {
+            _stats_id = matrix::stats_reporter::add(_km_urn, key, [this]() {return _report();});
+        }
+    }
+
+/**
+ * The start time of a publish call, if it is to be timed.
+ *
+ */
+
+    template<typename T>
+    Time::Time_t DataSource<T>::_start()
+    {
+        return _stats ? Time::getUTC() : 0;
+    }
+
+/**
+ * Counts 'n' values as published, or as refused if 'ok' is false, and
+ * records how long the publish call that started at 'start' took.
+ * Does nothing if the statistics are off.
+ *
+ * @return 'ok'
+ *
+ */
+
+    template<typename T>
+    bool DataSource<T>::_counted(bool ok, size_t n, Time::Time_t start)
+    {
+        if (!_stats)
+        {
+            return ok;
+        }
+
+        _publish_time.record(Time::getUTC() - start);
+        (ok ? _published : _refused).fetch_add(n, std::memory_order_relaxed);
+        return ok;
+    }
+
+/**
+ * Reports the statistics; called by the stats_reporter.
+ *
+ */
+
+    template<typename T>
+    YAML::Node DataSource<T>::_report()
+    {
+        YAML::Node n;
+        uint64_t published = _published.load(std::memory_order_relaxed);
+
+        n["published"] = published;
+        n["refused"] = _refused.load(std::memory_order_relaxed);
+        n["rate"] = _rate(published);
+        n["publish_time"] = matrix::latency_histogram::to_yaml(_publish_time.take());
+        return n;
     }
 
 /**
@@ -164,7 +409,22 @@ namespace matrix
     template<>
     inline bool DataSource<std::string>::publish(std::string &val)
     {
-        return _ts->publish(_key, val);
+        Time::Time_t start = _start();
+        return _counted(_ts->publish(_channel, val.data(), val.size()), 1, start);
+    }
+
+    template<>
+    inline bool DataSource<std::string>::publish_n(const std::string *vals, size_t n)
+    {
+        Time::Time_t start = _start();
+        bool rval = true;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            rval = _ts->publish(_channel, vals[i].data(), vals[i].size()) && rval;
+        }
+
+        return _counted(rval, n, start);
     }
 
 /**
@@ -180,7 +440,22 @@ namespace matrix
     template<>
     inline bool DataSource<matrix::GenericBuffer>::publish(matrix::GenericBuffer &val)
     {
-        return _ts->publish(_key, val.data(), val.size());
+        Time::Time_t start = _start();
+        return _counted(_ts->publish(_channel, val.data(), val.size()), 1, start);
+    }
+
+    template<>
+    inline bool DataSource<matrix::GenericBuffer>::publish_n(const matrix::GenericBuffer *vals, size_t n)
+    {
+        Time::Time_t start = _start();
+        bool rval = true;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            rval = _ts->publish(_channel, vals[i].data(), vals[i].size()) && rval;
+        }
+
+        return _counted(rval, n, start);
     }
 
 
@@ -197,7 +472,22 @@ namespace matrix
     template<>
     inline bool DataSource<msgpack::sbuffer>::publish(msgpack::sbuffer &val)
     {
-        return _ts->publish(_key, val.data(), val.size());
+        Time::Time_t start = _start();
+        return _counted(_ts->publish(_channel, val.data(), val.size()), 1, start);
+    }
+
+    template<>
+    inline bool DataSource<msgpack::sbuffer>::publish_n(const msgpack::sbuffer *vals, size_t n)
+    {
+        Time::Time_t start = _start();
+        bool rval = true;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            rval = _ts->publish(_channel, vals[i].data(), vals[i].size()) && rval;
+        }
+
+        return _counted(rval, n, start);
     }
 
 }
@@ -0,0 +1,125 @@
+/*******************************************************************
+ *  EventPoller.h - An epoll/eventfd based poller that reports which
+ *  DataSinks, Keymaster keys and file descriptors are ready.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_EVENTPOLLER_H_)
+#define _EVENTPOLLER_H_
+
+#include "matrix/DataSink.h"
+#include "matrix/Keymaster.h"
+
+#include <sys/epoll.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace matrix
+{
+/**
+ * \class EventPoller
+ *
+ * Allows a thread to wait on many event sources at once and to learn
+ * exactly which of them are ready, without looking at the others. The
+ * sources may be DataSinks, Keymaster keys, or any file descriptor
+ * that epoll() accepts (sockets, pipes, timerfds...).
+ *
+ * Each DataSink gets its own eventfd, which its ring buffer's notifier
+ * writes only when the poller has consumed the previous event, so a
+ * busy producer costs one write() per wakeup of the poller, not one per
+ * value. A Keymaster key is subscribed to with a callback that keeps
+ * the last value published and writes its eventfd.
+ *
+ * Every source added is given an integer token. 'wait()' fills a
+ * vector with the tokens of the sources that are ready:
+ *
+ *      DataSink<int> x(...);
+ *      DataSink<double> y(...);
+ *      EventPoller p;
+ *      int x_tok = p.add(&x);
+ *      int y_tok = p.add(&y, EventPoller::EDGE);
+ *      int s_tok = p.add(km, "components.foo.state");
+ *      vector<int> ready;
+ *
+ *      while (run)
+ *      {
+ *          p.wait(ready, 5000);  // 5 mS
+ *
+ *          for (auto tok : ready)
+ *          {
+ *              if (tok == x_tok) ...
+ *              else if (tok == s_tok) cout << p.keymaster_value(s_tok);
+ *          }
+ *      }
+ *
+ * A LEVEL source (the default) is reported by every 'wait()' for as
+ * long as it has data. An EDGE source is reported only once each time
+ * new data arrives after it was last reported, which suits a consumer
+ * that drains a sink only partially. Keymaster keys are always EDGE:
+ * each publication is reported once.
+ *
+ * A DataSink has only one notifier, so it may be added to only one
+ * poller (EventPoller or poller) at a time. Likewise the Keymaster
+ * client accepts one callback per key. An EventPoller is meant to be
+ * used by one thread; 'add()' and 'remove()' must not be called while
+ * another thread is in 'wait()'. The DataSinks and Keymaster clients
+ * added must outlive the poller, or be removed from it first.
+ *
+ */
+
+    class EventPoller
+    {
+    public:
+
+        enum trigger
+        {
+            LEVEL,
+            EDGE
+        };
+
+        EventPoller();
+        ~EventPoller();
+
+        int add(matrix::DataSinkBase *ds, trigger t = LEVEL);
+        int add(matrix::Keymaster *km, std::string key);
+        int add_fd(int fd, uint32_t events = EPOLLIN, trigger t = LEVEL);
+        bool remove(int token);
+
+        size_t wait(std::vector<int> &ready, int usecs);
+        YAML::Node keymaster_value(int token);
+
+    private:
+
+        EventPoller(const EventPoller &);
+        EventPoller &operator=(const EventPoller &);
+
+        struct Impl;
+        std::unique_ptr<Impl> _impl;
+    };
+
+}
+
+#endif
@@ -40,6 +40,8 @@
 #include <stdexcept>
 #include <sstream>
 #include <tuple>
+#include <cstdint>
+#include <functional>
 
 #include <boost/shared_ptr.hpp>
 #include <yaml-cpp/yaml.h>
@@ -67,6 +69,8 @@ namespace matrix
 
         void terminate();
 
+        void set_get_hook(std::function<void(std::string)> hook);
+
     private:
 
         struct KmImpl;
@@ -91,6 +95,16 @@ namespace matrix
  * published, it is received by the Keymaster client object, which then
  * calls the provided pointer to an object of this type.
  *
+ * The KeymasterServer publishes only the key that changed. When that
+ * is below the subscribed key, e.g. "foo.bar.baz" for a subscription to
+ * "foo", the client first offers the change as a delta, through
+ * 'exec_delta()'. A subclass that can apply a delta itself overrides
+ * '_call_delta()' and returns true; that is the cheap path. Otherwise
+ * the client patches its own copy of the subscribed subtree and calls
+ * '_call()' with all of it, as before. If the client finds it has
+ * missed a change, it fetches the subtree again, and calls '_call()'
+ * with all of it whether or not the subclass takes deltas.
+ *
  */
 
     struct KeymasterCallbackBase
@@ -105,8 +119,35 @@ namespace matrix
             _call(key, val);
         }
 
+        bool exec_delta(std::string key, std::string changed, YAML::Node val, bool deleted)
+        {
+            return _call_delta(key, changed, val, deleted);
+        }
+
     private:
         virtual void _call(std::string key, YAML::Node val) = 0;
+
+/**
+ * Handles a change below the subscribed key.
+ *
+ * @param key: The subscribed key.
+ *
+ * @param changed: The full key of the node that changed.
+ *
+ * @param val: The new value of that node; null if it was deleted.
+ *
+ * @param deleted: true if the node was deleted.
+ *
+ * @return true if the change was handled, false to have '_call()'
+ * called with the whole updated subtree instead.
+ *
+ */
+
+        virtual bool _call_delta(std::string /* key */, std::string /* changed */,
+                                 YAML::Node /* val */, bool /* deleted */)
+        {
+            return false;
+        }
     };
 
 /**
@@ -219,6 +260,8 @@ namespace matrix
 
         bool put(std::string key, YAML::Node n, bool create = false);
 
+        bool put_many(YAML::Node batch, bool create = false);
+
         void put_nb(std::string key, std::string val, bool create = true);
 
         bool del(std::string key);
@@ -237,8 +280,40 @@ namespace matrix
 
     private:
 
+        // A publication, as the subscriber thread reads it. The
+        // versions are those of the versions frame: the change's, and
+        // those of the nodes on its path before it. A server that
+        // predates them sends none.
+        struct publication
+        {
+            std::string key;
+            YAML::Node val;
+            bool deleted;
+            std::vector<uint64_t> versions;
+        };
+
+        // What the subscriber thread knows of a subscription: whether
+        // the server gives versions, which one its copy of the subtree
+        // is at, and whether that copy is being fetched, in which case
+        // the publications are held back until it arrives.
+        struct sync_state
+        {
+            bool versioned;
+            bool syncing;
+            uint64_t version;
+            std::vector<publication> held;
+        };
+
         void _subscriber_task();
 
+        void _resync_task();
+
+        void _sync_subtree(std::string key, bool notify);
+
+        void _deliver(std::string key, const publication &p);
+
+        void _deliver_delta(std::string key, std::string changed, YAML::Node val, bool deleted);
+
         void _put_task();
 
         void _run();
@@ -248,7 +323,8 @@ namespace matrix
         void _handle_keymaster_server_exception();
 
         ::mxutils::yaml_result _call_keymaster(std::string cmd, std::string key,
-                                             std::string val = "", std::string flag = "");
+                                               const YAML::Node *val = nullptr,
+                                               std::string flag = "");
 
         std::shared_ptr<zmq::socket_t> _keymaster_socket();
 
@@ -259,13 +335,25 @@ namespace matrix
         std::vector<std::string> _km_pub_urls;
 
         std::map<std::string, matrix::KeymasterCallbackBase *> _callbacks;
+        std::map<std::string, YAML::Node> _subtrees;
+        std::map<std::string, sync_state> _sync;
         matrix::Thread<Keymaster> _subscriber_thread;
         matrix::TCondition<bool> _subscriber_thread_ready;
+        matrix::Thread<Keymaster> _resync_thread;
+        matrix::TCondition<bool> _resync_thread_ready;
+        matrix::tsemfifo<std::string> _resync_fifo;
         matrix::Thread<Keymaster> _put_thread;
         matrix::TCondition<bool> _put_thread_ready;
         bool _put_thread_run;
         matrix::tsemfifo<std::tuple<std::string, std::string, bool> > _put_fifo;
         matrix::Mutex _shared_lock;
+
+        enum
+        {
+            UNKNOWN_ENCODING,
+            MSGPACK_ENCODING,
+            YAML_ENCODING
+        } _encoding;
     };
 
     template<typename T>
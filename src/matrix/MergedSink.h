@@ -0,0 +1,454 @@
+/*******************************************************************
+ *  MergedSink.h - Merges several data sources of the same type into
+ *  one stream, ordered by publication time.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_MERGEDSINK_H_)
+#define _MERGEDSINK_H_
+
+#include "matrix/DataSink.h"
+#include "matrix/TCondition.h"
+#include "matrix/Time.h"
+
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace matrix
+{
+/**
+ * \class MergedSink
+ *
+ * Subscribes to any number of data sources of the same type and hands
+ * their values to one consumer as a single stream, in order of
+ * publication time. This replaces a loop over several DataSinks with a
+ * 'poller' and 'try_get()', and the lock traffic on as many queues that
+ * goes with it: all inputs feed one queue, from the transports' own
+ * threads (each input is a DataSink in callback mode, see
+ * 'DataSink::set_handler()').
+ *
+ * Each input is added by a 'connect()', just as a DataSink is
+ * connected, so that Component::connect_sink() adds one for each sink
+ * name given to it:
+ *
+ *     MergedSink<double> in(keymaster_url, 100, 2000000); // 2 mS window
+ *
+ *     connect_sink(in, "antenna_1");
+ *     connect_sink(in, "antenna_2");
+ *     ...
+ *     double val;
+ *     size_t which;
+ *
+ *     while (in.timed_get(val, 100000000, &which))
+ *     {
+ *         // 'val' came from input 'which': 0 for antenna_1...
+ *     }
+ *
+ * Values are ordered by the timestamp in their sample_header, so the
+ * sources' transports should send them ('Header: true', see
+ * TransportServer). Values from a source without headers are stamped
+ * on arrival instead.
+ *
+ * The merge has a bounded reorder window: each value is held until it
+ * has been queued for 'window' nanoseconds, and whatever is then the
+ * oldest value is released. A value that arrives more than 'window'
+ * after a newer one from another input was released is delivered at
+ * once, out of order, and counted by 'late_items()'. The window is
+ * measured on the local clock, from arrival, so clock differences
+ * between the sources' hosts do not hold values back.
+ *
+ * The queue holds at most 'size' values; when it is full the oldest
+ * is released at once regardless of the window, and if the consumer
+ * does not keep up the oldest is dropped and counted by
+ * 'lost_items()'.
+ *
+ * As with a DataSink, there should be one consumer.
+ *
+ */
+
+    template <typename T, typename U = select_specified>
+    class MergedSink
+    {
+    public:
+
+        typedef DataSink<T, U> input_t;
+
+        MergedSink(std::string km_urn, size_t size = 100, Time::Time_t window = 1000000);
+        ~MergedSink() throw();
+
+        void get(T &val, size_t *input = nullptr);
+        bool try_get(T &val, size_t *input = nullptr);
+        bool timed_get(T &val, Time::Time_t time_out, size_t *input = nullptr);
+
+        size_t items();
+        size_t lost_items();
+        size_t late_items();
+        size_t inputs() {return _inputs.size();}
+        input_t &input(size_t i) {return *_inputs.at(i);}
+
+        void set_stats_key(std::string key) {_stats_key = key;}
+        void connect(std::string component_name, std::string data_name,
+                     std::string transport = "");
+        void disconnect();
+        bool connected() {return !_inputs.empty();}
+
+    private:
+
+        MergedSink(const MergedSink &);
+        MergedSink &operator=(const MergedSink &);
+
+        struct entry
+        {
+            Time::Time_t published;
+            uint64_t order;
+            Time::Time_t arrived;
+            size_t input;
+            T value;
+        };
+
+        // std::push_heap() and friends make a max-heap; this puts the
+        // oldest value on top.
+        struct later
+        {
+            bool operator()(const entry &a, const entry &b) const
+            {
+                return a.published > b.published
+                    || (a.published == b.published && a.order > b.order);
+            }
+        };
+
+        void _add(input_t &in, size_t input, const T &val);
+        bool _take(T &val, size_t *input, Time::Time_t time_out);
+
+        std::string _km_urn;
+        size_t _size;
+        Time::Time_t _window;
+        std::string _stats_key;
+        std::vector<std::unique_ptr<input_t> > _inputs;
+        matrix::TCondition<bool> _queued;
+        std::vector<entry> _heap;
+        uint64_t _order;
+        Time::Time_t _last_released;
+        size_t _lost;
+        size_t _late;
+    };
+
+/**
+ * Constructor for MergedSink.
+ *
+ * @param km_urn: Access to the keymaster.
+ *
+ * @param size: The most values held, from all inputs together.
+ *
+ * @param window: The reorder window, in nanoseconds: how long each
+ * value is held, waiting for older ones from other inputs.
+ *
+ */
+
+    template <typename T, typename U>
+    MergedSink<T, U>::MergedSink(std::string km_urn, size_t size, Time::Time_t window)
+        : _km_urn(km_urn),
+          _size(size ? size : 1),
+          _window(window),
+          _queued(false),
+          _order(0),
+          _last_released(0),
+          _lost(0),
+          _late(0)
+    {
+        _heap.reserve(_size);
+    }
+
+    template <typename T, typename U>
+    MergedSink<T, U>::~MergedSink() throw()
+    {
+        disconnect();
+    }
+
+/**
+ * Adds an input, connected to the given data source. The input's
+ * number, passed back by the gets, is the number of inputs added
+ * before it.
+ *
+ * @param component_name: The name of the component where the data
+ * source originates.
+ *
+ * @param data_name: The name of the data on the component.
+ *
+ * @param transport: The transport to use, as for DataSink::connect().
+ *
+ */
+
+    template <typename T, typename U>
+    void MergedSink<T, U>::connect(std::string component_name, std::string data_name,
+                                   std::string transport)
+    {
+        size_t n = _inputs.size();
+        std::unique_ptr<input_t> in(new input_t(_km_urn));
+        input_t *ds = in.get();
+
+        // the handler gets its input directly: '_inputs' may grow while
+        // other inputs deliver.
+        in->set_handler([this, ds, n](const T &val) {_add(*ds, n, val);});
+
+        if (!_stats_key.empty())
+        {
+            in->set_stats_key(_stats_key);
+        }
+
+        in->connect(component_name, data_name, transport);
+        _inputs.push_back(std::move(in));
+    }
+
+/**
+ * Disconnects and removes all the inputs, and drops any values still
+ * queued.
+ *
+ */
+
+    template <typename T, typename U>
+    void MergedSink<T, U>::disconnect()
+    {
+        for (auto &in : _inputs)
+        {
+            in->disconnect();
+        }
+
+        _inputs.clear();
+        _queued.lock();
+        _heap.clear();
+        _queued.unlock();
+    }
+
+/**
+ * The inputs' handler: queues a value, stamped with its publication
+ * time, and wakes the consumer. Runs on the input's transport thread.
+ *
+ */
+
+    template <typename T, typename U>
+    void MergedSink<T, U>::_add(input_t &in, size_t input, const T &val)
+    {
+        Time::Time_t now = Time::getUTC();
+        Time::Time_t published = in.headers() ? in.handler_header().published : now;
+
+        _queued.lock();
+
+        if (_heap.size() == _size)
+        {
+            std::pop_heap(_heap.begin(), _heap.end(), later());
+            _heap.pop_back();
+            ++_lost;
+        }
+
+        if (published < _last_released)
+        {
+            ++_late;
+        }
+
+        _heap.push_back(entry{published, _order++, now, input, val});
+        std::push_heap(_heap.begin(), _heap.end(), later());
+        _queued.signal();
+        _queued.unlock();
+    }
+
+/**
+ * Waits for the oldest value to have been held for the reorder
+ * window, or for the queue to fill, and takes it.
+ *
+ * @param val: The value.
+ *
+ * @param input: If not null, set to the number of the input it came
+ * from.
+ *
+ * @param time_out: nanoseconds to wait. If 0, don't wait; if
+ * negative, wait indefinitely.
+ *
+ * @return true if 'val' was set, false if the wait timed out.
+ *
+ */
+
+    template <typename T, typename U>
+    bool MergedSink<T, U>::_take(T &val, size_t *input, Time::Time_t time_out)
+    {
+        bool forever = static_cast<int64_t>(time_out) < 0;
+        Time::Time_t deadline = Time::getUTC() + time_out;
+        bool rval = false;
+
+        _queued.lock();
+
+        while (true)
+        {
+            Time::Time_t now = Time::getUTC();
+            Time::Time_t until = forever ? now + Time::TM_ONE_SEC : deadline;
+
+            if (!_heap.empty())
+            {
+                Time::Time_t ready_at = _heap.front().arrived + _window;
+
+                if (ready_at <= now || _heap.size() == _size)
+                {
+                    std::pop_heap(_heap.begin(), _heap.end(), later());
+                    entry &e = _heap.back();
+                    val = std::move(e.value);
+
+                    if (input)
+                    {
+                        *input = e.input;
+                    }
+
+                    _last_released = std::max(_last_released, e.published);
+                    _heap.pop_back();
+                    rval = true;
+                    break;
+                }
+
+                until = std::min(until, ready_at);
+            }
+
+            if (!forever && now >= deadline)
+            {
+                break;
+            }
+
+            Time::Time_t usecs = (until - now) / 1000 + 1;
+            _queued.wait_locked_with_timeout(usecs > INT_MAX ? INT_MAX : (int)usecs);
+        }
+
+        _queued.unlock();
+        return rval;
+    }
+
+/**
+ * Gets the next value in time order, waiting as long as it takes.
+ *
+ * @param val: The value.
+ *
+ * @param input: If not null, set to the number of the input it came
+ * from.
+ *
+ */
+
+    template <typename T, typename U>
+    void MergedSink<T, U>::get(T &val, size_t *input)
+    {
+        _take(val, input, -1);
+    }
+
+/**
+ * Gets the next value in time order if one is ready, without waiting.
+ *
+ * @param val: The value.
+ *
+ * @param input: If not null, set to the number of the input it came
+ * from.
+ *
+ * @return true if 'val' was set, false otherwise.
+ *
+ */
+
+    template <typename T, typename U>
+    bool MergedSink<T, U>::try_get(T &val, size_t *input)
+    {
+        return _take(val, input, 0);
+    }
+
+/**
+ * Gets the next value in time order, waiting up to 'time_out' for one
+ * to be ready.
+ *
+ * @param val: The value.
+ *
+ * @param time_out: the time-out, in nanoseconds (relative).
+ *
+ * @param input: If not null, set to the number of the input it came
+ * from.
+ *
+ * @return true if 'val' was set, false if the wait timed out.
+ *
+ */
+
+    template <typename T, typename U>
+    bool MergedSink<T, U>::timed_get(T &val, Time::Time_t time_out, size_t *input)
+    {
+        return _take(val, input, time_out);
+    }
+
+/**
+ * Returns the number of values queued, ready or not.
+ *
+ */
+
+    template <typename T, typename U>
+    size_t MergedSink<T, U>::items()
+    {
+        _queued.lock();
+        size_t n = _heap.size();
+        _queued.unlock();
+        return n;
+    }
+
+/**
+ * Returns the number of values dropped because the queue was full,
+ * plus those the inputs' transports lost.
+ *
+ */
+
+    template <typename T, typename U>
+    size_t MergedSink<T, U>::lost_items()
+    {
+        size_t n = 0;
+
+        for (auto &in : _inputs)
+        {
+            n += in->lost_items();
+        }
+
+        _queued.lock();
+        n += _lost;
+        _queued.unlock();
+        return n;
+    }
+
+/**
+ * Returns the number of values that arrived too late to be put in
+ * order, and were delivered out of order.
+ *
+ */
+
+    template <typename T, typename U>
+    size_t MergedSink<T, U>::late_items()
+    {
+        _queued.lock();
+        size_t n = _late;
+        _queued.unlock();
+        return n;
+    }
+}
+
+#endif
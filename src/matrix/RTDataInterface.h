@@ -61,6 +61,9 @@ namespace matrix
 
         bool _publish(std::string key, const void *data, size_t size_of_data);
         bool _publish(std::string key, std::string data);
+        channel_t _resolve(std::string key);
+        bool _publish(channel_t ch, const void *data, size_t size_of_data);
+        bool _publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n);
 
         struct Impl;
         std::shared_ptr<Impl> _impl;
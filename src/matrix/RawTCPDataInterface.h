@@ -0,0 +1,131 @@
+/*******************************************************************
+ *  RawTCPDataInterface.h - A DataInterface transport over plain TCP
+ *  sockets, for bulk streams of large samples.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_RAWTCPDATAINTERFACE_H_)
+#define _RAWTCPDATAINTERFACE_H_
+
+#include "matrix/DataInterface.h"
+#include <string>
+
+namespace matrix
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcomment"
+/**
+ * \class RawTCPTransportServer
+ *
+ * Publishes data over plain TCP connections, one per client, with a
+ * minimal length-prefixed framing. Each frame is written with a
+ * single vectored sendmsg() straight from the caller's buffer, so a
+ * multi-megabyte sample is neither copied nor split into messages on
+ * its way to the socket. Clients tell the server which keys they
+ * want, and only those are sent to them.
+ *
+ * The transport is selected like any other:
+ *
+ *     nettask:
+ *       Transports:
+ *         A:
+ *           Specified: [rawtcp]
+ *
+ * 'rawtcp' (or 'rawtcp://\*' or 'rawtcp://\*:XXXXX') listens on an
+ * ephemeral port; 'rawtcp://\*:5555' listens on port 5555. The
+ * 'AsConfigured' URN is 'rawtcp://<canonical hostname>:<port>'.
+ *
+ * Delivery is lossless as long as clients keep up: one that falls
+ * behind slows the producer down, through TCP's own flow control, but
+ * only for so long. A client that hasn't taken a frame within
+ * 'SendTimeout' milliseconds (1000 by default) is disconnected:
+ *
+ *           Specified: [rawtcp]
+ *           SendTimeout: 250
+ *
+ * The client then reconnects, and the samples it missed are counted
+ * as lost by its DataSink.
+ *
+ * A frame carries at most 1 GiB of samples.
+ *
+ */
+#pragma GCC diagnostic pop
+
+    class RawTCPTransportServer : public matrix::TransportServer
+    {
+    public:
+
+        RawTCPTransportServer(std::string keymaster_url, std::string key);
+        virtual ~RawTCPTransportServer();
+
+    private:
+
+        bool _publish(std::string key, const void *data, size_t size_of_data);
+        bool _publish(std::string key, std::string data);
+        bool _publish(channel_t ch, const void *data, size_t size_of_data);
+        bool _publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n);
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportServer;
+        static matrix::TransportServer *factory(std::string, std::string);
+    };
+
+/**
+ * \class RawTCPTransportClient
+ *
+ * Connects to a RawTCPTransportServer, subscribes to keys on it, and
+ * runs a reader thread that hands each frame's samples to the
+ * subscribed DataSink's callback. If the connection drops, the reader
+ * thread reconnects to the same URN and subscribes again, and reports
+ * the samples missed meanwhile to the callbacks through 'lost()'.
+ *
+ */
+
+    class RawTCPTransportClient : public matrix::TransportClient
+    {
+    public:
+
+        RawTCPTransportClient(std::string urn);
+        virtual ~RawTCPTransportClient();
+
+    private:
+
+        bool _connect();
+        bool _disconnect();
+        bool _subscribe(std::string key, matrix::DataCallbackBase *cb);
+        bool _unsubscribe(std::string key);
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportClient;
+        static matrix::TransportClient *factory(std::string);
+    };
+
+}
+
+#endif
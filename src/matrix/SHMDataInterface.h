@@ -0,0 +1,147 @@
+/*******************************************************************
+ *  SHMDataInterface.h - A DataInterface transport over a POSIX
+ *  shared memory ring buffer, for cross-process data on one host.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_SHMDATAINTERFACE_H_)
+#define _SHMDATAINTERFACE_H_
+
+#include "matrix/DataInterface.h"
+#include <string>
+
+namespace matrix
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcomment"
+/**
+ * \class SHMTransportServer
+ *
+ * Publishes data into a POSIX shared memory segment organized as a
+ * single-producer, multiple-consumer ring of fixed size slots. Clients
+ * in other processes on the same host map the segment and read each
+ * sample in place, so there is no socket copy and no kernel round
+ * trip per sample. Readers that are sleeping are woken with a futex
+ * on the segment's commit counter.
+ *
+ * The transport is configured as any other:
+ *
+ *     nettask:
+ *       Transports:
+ *         A:
+ *           Specified: [shm]
+ *           Slots: 128
+ *           SlotSize: 65536
+ *           Mode: "0600"
+ *           Loans: 4
+ *
+ * 'Slots' (rounded up to a power of two), 'SlotSize' (the largest
+ * sample, in bytes, that may be published) and 'Mode' (the segment's
+ * permissions, in octal; "0660" lets the owner's group read it too)
+ * are optional and default to the values shown. As with ipc and
+ * inproc, the transport may be given as a partial URN
+ * ('shm://matrix.nettask.XXXXX') whose trailing 'X's are replaced by
+ * random characters. A segment of that name left behind by a server
+ * that died is removed and created afresh; one still in use is an
+ * error. The reader entries of clients that died are likewise freed.
+ *
+ * DataSource::loan() hands out a spare buffer in the segment, which
+ * commit() swaps into the ring, so a sample built that way is never
+ * copied at all on the publishing side. The spares are kept out of
+ * the ring while on loan, so a slow loan holds up no reader. 'Loans'
+ * is how many may be out at once (across all of the transport's data
+ * sources). A loan is the data source's until it commits it, however
+ * long that takes; loaning again before then gives back the same
+ * buffer, so a source holds at most one.
+ *
+ * By default the ring never blocks the producer. A reader that falls
+ * a full ring behind loses the oldest samples, which it then skips
+ * over; how many were lost on a key is reported, as for rawtcp, to
+ * the DataSink's 'lost_items()' once the next sample on the key is
+ * read. The 'drop_newest' and 'block' Backpressure policies (see
+ * TransportServer) instead keep unread samples intact. subscribers()
+ * reports each reader, by pid, with its depth and losses.
+ *
+ */
+#pragma GCC diagnostic pop
+
+    class SHMTransportServer : public matrix::TransportServer
+    {
+    public:
+
+        SHMTransportServer(std::string keymaster_url, std::string key);
+        virtual ~SHMTransportServer();
+
+    private:
+
+        bool _publish(std::string key, const void *data, size_t size_of_data);
+        bool _publish(std::string key, std::string data);
+        bool _publish(channel_t ch, const void *data, size_t size_of_data);
+        bool _publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n);
+        channel_t _resolve(std::string key);
+        void *_loan(channel_t ch, size_t size);
+        bool _commit(channel_t ch, size_t size);
+        std::vector<subscriber_stats> _subscribers();
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportServer;
+        static matrix::TransportServer *factory(std::string, std::string);
+    };
+
+/**
+ * \class SHMTransportClient
+ *
+ * Maps the shared memory ring of an SHMTransportServer and runs a
+ * reader thread that hands each matching sample, in place, to the
+ * subscribed DataSink's callback.
+ *
+ */
+
+    class SHMTransportClient : public matrix::TransportClient
+    {
+    public:
+
+        SHMTransportClient(std::string urn);
+        virtual ~SHMTransportClient();
+
+    private:
+
+        bool _connect();
+        bool _disconnect();
+        bool _subscribe(std::string key, matrix::DataCallbackBase *cb);
+        bool _unsubscribe(std::string key);
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportClient;
+        static matrix::TransportClient *factory(std::string);
+    };
+
+}
+
+#endif
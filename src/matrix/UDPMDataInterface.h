@@ -0,0 +1,127 @@
+/*******************************************************************
+ *  UDPMDataInterface.h - A DataInterface transport over UDP
+ *  multicast, for one-to-many fan-out on a LAN.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_UDPMDATAINTERFACE_H_)
+#define _UDPMDATAINTERFACE_H_
+
+#include "matrix/DataInterface.h"
+#include <string>
+
+namespace matrix
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcomment"
+/**
+ * \class UDPMTransportServer
+ *
+ * Publishes data as UDP datagrams sent to a multicast group. Every
+ * subscriber on the LAN joins the group and the network does the
+ * copying, so publishing costs the same whether one client or fifty
+ * are listening.
+ *
+ * The transport is configured as any other:
+ *
+ *     nettask:
+ *       Transports:
+ *         A:
+ *           Specified: [udpm://eth0;239.192.10.1:5555]
+ *           TTL: 1
+ *
+ * As with 0MQ's pgm transports the URN is 'udpm://[interface;]group:port'.
+ * The interface (a name or an IPv4 address) is optional; if given,
+ * the server sends and clients listen on it. A bare 'udpm' picks a
+ * random group in 239.192.0.0/16 and a random port, and a port given
+ * as 'XXXXX' is chosen at random. 'TTL', the multicast time to live,
+ * is optional and defaults to 1, which keeps the data on the local
+ * subnet.
+ *
+ * Each datagram carries the key, a per-key sequence number and one or
+ * more samples; a batch from publish_n() is packed into as few
+ * datagrams as possible. Delivery is not reliable: a client that sees
+ * a gap in a key's sequence numbers reports the missing samples to
+ * the DataSink, where they show up in 'lost_items()'. A sample must
+ * fit in one datagram (64 kB, less the header and key).
+ *
+ */
+#pragma GCC diagnostic pop
+
+    class UDPMTransportServer : public matrix::TransportServer
+    {
+    public:
+
+        UDPMTransportServer(std::string keymaster_url, std::string key);
+        virtual ~UDPMTransportServer();
+
+    private:
+
+        bool _publish(std::string key, const void *data, size_t size_of_data);
+        bool _publish(std::string key, std::string data);
+        bool _publish(channel_t ch, const void *data, size_t size_of_data);
+        bool _publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n);
+        channel_t _resolve(std::string key);
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportServer;
+        static matrix::TransportServer *factory(std::string, std::string);
+    };
+
+/**
+ * \class UDPMTransportClient
+ *
+ * Joins the multicast group of a UDPMTransportServer and runs a
+ * receiver thread that hands each sample to the subscribed DataSink's
+ * callback, checking the sequence numbers as it goes.
+ *
+ */
+
+    class UDPMTransportClient : public matrix::TransportClient
+    {
+    public:
+
+        UDPMTransportClient(std::string urn);
+        virtual ~UDPMTransportClient();
+
+    private:
+
+        bool _connect();
+        bool _disconnect();
+        bool _subscribe(std::string key, matrix::DataCallbackBase *cb);
+        bool _unsubscribe(std::string key);
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportClient;
+        static matrix::TransportClient *factory(std::string);
+    };
+
+}
+
+#endif
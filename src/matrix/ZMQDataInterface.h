@@ -29,6 +29,33 @@
 namespace matrix
 {
 
+/**
+ * \class ZMQTransportServer
+ *
+ * Publishes data over a 0MQ PUB socket bound to tcp, ipc and/or inproc
+ * URNs. Each sample normally goes out as its own message. For many
+ * small samples a transport may instead coalesce them:
+ *
+ *     Transports:
+ *       A:
+ *         Specified: [inproc, tcp]
+ *         Coalesce:
+ *           MaxSamples: 64
+ *           MaxLatency: 0.001
+ *
+ * Samples of one key are then packed into a single message that goes
+ * out when it holds 'MaxSamples' samples, or when its oldest sample
+ * has waited 'MaxLatency' seconds. The client unpacks the message and
+ * hands its samples to the sink as one batch. Both keys are optional
+ * and default to the values shown.
+ *
+ * The 'drop_newest' and 'block' Backpressure policies (see
+ * TransportServer) need 0MQ 4.1 or later. 0MQ does not expose the
+ * queues of individual subscribers, so subscribers() reports only the
+ * total number of samples refused.
+ *
+ */
+
     class ZMQTransportServer : public matrix::TransportServer
     {
     public:
@@ -38,6 +65,12 @@ namespace matrix
     private:
         bool _publish(std::string key, const void *data, size_t size_of_data);
         bool _publish(std::string key, std::string data);
+        bool _publish(channel_t ch, const void *data, size_t size_of_data);
+        bool _publish_n(channel_t ch, const void *data, size_t size_of_data, size_t n);
+        channel_t _resolve(std::string key);
+        void *_loan(channel_t ch, size_t size);
+        bool _commit(channel_t ch, size_t size);
+        std::vector<subscriber_stats> _subscribers();
 
         struct PubImpl;
         std::shared_ptr<PubImpl> _impl;
@@ -0,0 +1,156 @@
+/*******************************************************************
+ *  km_tree.h - The Keymaster's store: a tree of keys and values with
+ *  interned keys and shared, immutable nodes.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_KM_TREE_H_)
+#define _KM_TREE_H_
+
+#include "matrix/yaml_util.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+namespace matrix
+{
+/**
+ * \class km_tree
+ *
+ * The KeymasterServer's store. It holds the same tree a YAML::Node
+ * would (maps, sequences, scalars and nulls, addressed by keychains
+ * such as "components.nettask.source"), but is built for the
+ * Keymaster's traffic rather than for parsing documents:
+ *
+ *  - Nodes are immutable and shared. A 'put()' or 'del()' copies only
+ *    the nodes on the path from the root to the change, and the old
+ *    ones are freed as soon as nothing refers to them, so memory stays
+ *    flat without any periodic copy of the whole tree.
+ *
+ *  - Since nodes never change, a node taken from the tree is a
+ *    snapshot, and may be read and encoded on another thread while the
+ *    tree moves on.
+ *
+ *  - Keys are interned: every map key is a pointer to one shared copy
+ *    of its string, so lookups compare pointers and a key repeated
+ *    across the tree is stored once. A key is freed with the last
+ *    node that uses it, so keys that come and go (per session or per
+ *    request, say) do not pile up.
+ *
+ *  - Every change is numbered, and the nodes on its path carry its
+ *    number as their 'version': a node's version is that of the last
+ *    change at or below it. A result says what the versions along the
+ *    path were before the change, so that whoever follows a subtree
+ *    change by change can tell whether it has missed one.
+ *
+ * YAML and MessagePack are only used at the edges, to convert values
+ * coming in and going out. Gets, puts and deletes give results as
+ * get_yaml_node(), put_yaml_node() and delete_yaml_node() do for a
+ * YAML::Node, so that clients see no difference.
+ *
+ * All the member functions are thread-safe.
+ *
+ *     km_tree tree(YAML::LoadFile("config.yaml"));
+ *
+ *     tree.put("components.foo.ID", YAML::Node(1234), true);
+ *     km_tree::result r = tree.get("components.foo");
+ *     YAML::Node n = km_tree::to_yaml(r.node);
+ *
+ */
+
+    class km_tree
+    {
+    public:
+
+        struct node;
+        typedef std::shared_ptr<const node> node_ptr;
+        typedef std::shared_ptr<const std::string> key_t;
+
+        struct node
+        {
+            enum kind
+            {
+                NUL,
+                SCALAR,
+                SEQUENCE,
+                MAP
+            };
+
+            kind type;
+            std::string scalar;
+            // map entries in insertion order; the keys of a
+            // sequence's items are null.
+            std::vector<std::pair<key_t, node_ptr> > children;
+            // the last change at or below this node; 0 if none since
+            // the tree was loaded.
+            uint64_t version;
+        };
+
+        struct result
+        {
+            bool result;
+            std::string key;
+            std::string err;
+            node_ptr node;
+            // for a change: its version, and the versions the nodes on
+            // its path had before it, from the root down to the node
+            // changed (0 where there was none).
+            uint64_t version;
+            std::vector<uint64_t> versions;
+
+            mxutils::yaml_result to_yaml_result() const;
+        };
+
+        km_tree(YAML::Node n = YAML::Node());
+
+        result get(std::string keychain) const;
+        result put(std::string keychain, YAML::Node val, bool create = false);
+        result put(std::string keychain, node_ptr val, bool create = false);
+        result put_many(const std::vector<std::pair<std::string, node_ptr> > &batch,
+                        bool create = false, std::vector<result> *each = nullptr);
+        result del(std::string keychain);
+
+        static node_ptr from_yaml(const YAML::Node &n);
+        static YAML::Node to_yaml(const node_ptr &n);
+        static node_ptr from_msgpack(const std::string &buf);
+        static std::string to_msgpack(const node_ptr &n);
+        static size_t key_count();
+
+    private:
+
+        node_ptr _root() const;
+
+        node_ptr _tree;
+        uint64_t _version;
+        mutable std::mutex _lock;
+    };
+}
+
+#endif
@@ -0,0 +1,889 @@
+/*******************************************************************
+ *  latestfifo.h - A FIFO that keeps only the newest N values,
+ *  overwriting the oldest when full.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_MATRIX_LATESTFIFO_H_)
+#define _MATRIX_LATESTFIFO_H_
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <climits>
+#include <cstdlib>
+#include <stdint.h>
+#include "matrix/tsemfifo.h"
+#include "matrix/TCondition.h"
+#include "matrix/Time.h"
+
+namespace matrix
+{
+/**
+ * \class latestfifo
+ *
+ * A FIFO for consumers that only care about the newest data, such as
+ * a live display. It holds at most 'size' values; a put into a full
+ * latestfifo never blocks and never fails, but overwrites the oldest
+ * value, in constant time. With a size of 1 it holds just the latest
+ * value.
+ *
+ * It has the same interface as tsemfifo, and so may be used as a
+ * DataSink's ring buffer:
+ *
+ *     DataSink<GenericBuffer, select_specified, latestfifo> sink(km_urn, 1);
+ *
+ * Its 'get_latest()' takes the newest value and discards any older
+ * ones, reporting how many it discarded. The non-blocking puts
+ * (put_no_block() and friends) return the number of values
+ * overwritten; the plain puts, which would block on a full tsemfifo,
+ * overwrite too but can't say so. So a DataSink using a latestfifo
+ * should be non-blocking (the default) for 'lost_items()' to be
+ * accurate.
+ *
+ * The values are kept in a pool of 'size' + 1 slots that are filled
+ * in place and never moved: the queue itself is a ring of slot
+ * numbers. Overwriting the oldest value just recycles its slot, and
+ * 'get_ref()' can hand out a slot that the producer will leave alone
+ * until 'release_ref()', even while it keeps overwriting the rest.
+ *
+ * A single lock guards the FIFO; no semaphores are involved, and the
+ * consumer is signalled only when the FIFO goes from empty to not
+ * empty. With 'set_wait_strategy()' the consumer may spin for a while
+ * before waiting for that signal, or never wait (see
+ * matrix::wait_strategy).
+ *
+ */
+
+    template<typename T>
+    class latestfifo
+    {
+    public:
+
+        typedef T value_type;
+
+        enum
+        {
+            FIFO_SIZE = 100
+        };
+
+        latestfifo(size_t size = FIFO_SIZE);
+
+        ~latestfifo();
+
+        void release();
+
+        void flush();
+
+        unsigned int flush(int items);
+
+        bool put(T &obj);
+
+        bool put(T &&obj);
+
+        bool try_put(T &obj);
+
+        bool try_put(T &&obj);
+
+        bool timed_put(T &obj, Time::Time_t time_out);
+
+        unsigned int put_no_block(T &obj);
+
+        unsigned int put_no_block(T &&obj);
+
+        size_t put_n(T *objs, size_t n);
+
+        size_t try_put_n(T *objs, size_t n);
+
+        unsigned int put_n_no_block(T *objs, size_t n);
+
+        template<typename F>
+        bool emplace(F fill);
+
+        template<typename F>
+        bool try_emplace(F fill);
+
+        template<typename F>
+        unsigned int emplace_no_block(F fill);
+
+        template<typename F>
+        size_t emplace_n(size_t n, F fill);
+
+        template<typename F>
+        size_t try_emplace_n(size_t n, F fill);
+
+        template<typename F>
+        unsigned int emplace_n_no_block(size_t n, F fill);
+
+        bool get(T &obj);
+
+        bool try_get(T &obj);
+
+        bool timed_get(T &obj, Time::Time_t time_out);
+
+        size_t get_n(T *objs, size_t max, Time::Time_t time_out = -1);
+
+        bool get_latest(T &obj, Time::Time_t time_out, size_t &skipped);
+
+        T *get_ref(Time::Time_t time_out);
+
+        void release_ref();
+
+        unsigned int size();
+
+        unsigned int capacity();
+
+        void set_notifier(std::shared_ptr<fifo_notifier>);
+
+        void set_wait_strategy(wait_strategy w);
+
+    private:
+
+        latestfifo(const latestfifo &);
+
+        latestfifo &operator=(latestfifo const &);
+
+        template<typename F>
+        unsigned int _emplace_n(size_t n, F &fill);
+
+        bool _wait(Time::Time_t time_out);
+
+        size_t _take();
+
+        enum
+        {
+            NO_SLOT = -1
+        };
+
+        std::vector<T> _pool;
+        std::vector<size_t> _ring;
+        std::vector<size_t> _free;
+        size_t _buf_len;
+        size_t _head;
+        size_t _objects;
+        size_t _held;
+        bool _released;
+        matrix::TCondition<bool> _ready;
+        std::shared_ptr<matrix::fifo_notifier> _notifier;
+        wait_strategy _waits;
+    };
+
+/**
+ * Construct a latestfifo.
+ *
+ * @param size The capacity of the FIFO. Once it holds this many
+ * values, each new one overwrites the oldest.
+ *
+ */
+
+    template<class T>
+    matrix::latestfifo<T>::latestfifo(size_t size)
+        : _buf_len(size ? size : 1),
+          _head(0),
+          _objects(0),
+          _held(NO_SLOT),
+          _released(false),
+          _ready(false),
+          _notifier(new fifo_notifier())
+    {
+        _pool.resize(_buf_len + 1);
+        _ring.resize(_buf_len);
+
+        for (size_t i = 0; i < _pool.size(); ++i)
+        {
+            _free.push_back(i);
+        }
+    }
+
+/**
+ * Destructor for latestfifo. Releases any waiting threads.
+ *
+ */
+
+    template<class T>
+    matrix::latestfifo<T>::~latestfifo()
+    {
+        release();
+    }
+
+/**
+ * This private function places 'n' new values in the FIFO under one
+ * lock, calling 'fill(slot, i)' to write the i'th one in place. When
+ * the FIFO is full the oldest value's slot is reused for the new one.
+ *
+ * @param n: How many.
+ *
+ * @param fill: A callable taking (T &, size_t).
+ *
+ * @return The number of old values overwritten.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    unsigned int matrix::latestfifo<T>::_emplace_n(size_t n, F &fill)
+    {
+        unsigned int overwritten = 0;
+        size_t first = 0;
+
+        // Of a batch larger than the FIFO only the newest values would
+        // survive; don't bother writing the others.
+        if (n > _buf_len)
+        {
+            first = n - _buf_len;
+            overwritten = first;
+        }
+
+        _ready.lock();
+
+        for (size_t i = first; i < n; ++i)
+        {
+            size_t slot;
+
+            if (_objects == _buf_len)
+            {
+                slot = _ring[_head];
+                _head = (_head + 1) % _buf_len;
+                --_objects;
+                ++overwritten;
+            }
+            else
+            {
+                slot = _free.back();
+                _free.pop_back();
+            }
+
+            fill(_pool[slot], i);
+            _ring[(_head + _objects) % _buf_len] = slot;
+            ++_objects;
+        }
+
+        _notifier->exec(_objects);
+
+        if (!_ready.value())
+        {
+            _ready.set_value(true, false);
+            _ready.signal();
+        }
+
+        _ready.unlock();
+        return overwritten;
+    }
+
+/**
+ * This private helper waits for the FIFO to be not empty, and
+ * returns with the lock held whatever the outcome. It first spins as
+ * the wait strategy directs, on the condition's value without the
+ * lock.
+ *
+ * @param time_out: nanoseconds to wait. If 0, don't wait; if
+ * negative, wait indefinitely.
+ *
+ * @return true if there is something to get, false if the wait timed
+ * out or the FIFO was released.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::_wait(Time::Time_t time_out)
+    {
+        bool spun = time_out != 0
+            && _waits.spin([this]() {return __atomic_load_n(&_ready.value(), __ATOMIC_ACQUIRE);},
+                           time_out);
+
+        if (time_out == 0 || spun || _waits.how == wait_strategy::BUSY_POLL)
+        {
+            _ready.lock();
+        }
+        else if (static_cast<int64_t>(time_out) < 0)
+        {
+            _ready.wait_with_lock(true);
+        }
+        else
+        {
+            Time::Time_t usecs = time_out / 1000;
+            _ready.wait_with_lock(true, usecs > INT_MAX ? INT_MAX : (int)usecs);
+        }
+
+        return _objects && !_released;
+    }
+
+/**
+ * This private helper removes the oldest value's slot number from the
+ * ring, with the lock held, and returns it. The caller must then put
+ * the slot back on '_free' (or hold it for get_ref()).
+ *
+ */
+
+    template<class T>
+    size_t matrix::latestfifo<T>::_take()
+    {
+        size_t slot = _ring[_head];
+
+        _head = (_head + 1) % _buf_len;
+
+        if (--_objects == 0)
+        {
+            _ready.set_value(false, false);
+        }
+
+        return slot;
+    }
+
+/**
+ * Empties the queue, and clears a previous release().
+ *
+ */
+
+    template<class T>
+    void matrix::latestfifo<T>::flush()
+    {
+        flush(_buf_len);
+        _ready.lock();
+        _released = false;
+        _ready.set_value(_objects > 0, false);
+        _ready.unlock();
+    }
+
+/**
+ * Flushes 'items' items out of the queue.
+ *
+ * @param items: The number of items to drop, oldest first. If 'items'
+ * equals or exceeds the number of elements in the queue, all will be
+ * dropped. If 'items' is negative, all but abs(items) will be dropped.
+ *
+ * @return The number of items remaining in the queue.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::latestfifo<T>::flush(int items)
+    {
+        _ready.lock();
+
+        size_t nitems = static_cast<size_t>(abs(items));
+
+        if (items < 0)
+        {
+            nitems = nitems < _objects ? _objects - nitems : 0;
+        }
+
+        if (nitems > _objects)
+        {
+            nitems = _objects;
+        }
+
+        for (size_t i = 0; i < nitems; ++i)
+        {
+            _free.push_back(_take());
+        }
+
+        unsigned int remaining = _objects;
+        _ready.unlock();
+        return remaining;
+    }
+
+/**
+ * Puts a new value at the tail of the FIFO, overwriting the oldest
+ * value if the FIFO is full. Never blocks.
+ *
+ * @param obj: Object to put (copy) into the buffer.
+ *
+ * @return true.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::put(T &obj)
+    {
+        return emplace([&obj](T &slot) { slot = obj; });
+    }
+
+/**
+ * As put(T &), but moves 'obj' into the buffer.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::put(T &&obj)
+    {
+        return emplace([&obj](T &slot) { slot = std::move(obj); });
+    }
+
+/**
+ * As put(T &): a latestfifo is never too full to take a value.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::try_put(T &obj)
+    {
+        return put(obj);
+    }
+
+/**
+ * As put(T &&): a latestfifo is never too full to take a value.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::try_put(T &&obj)
+    {
+        return put(std::move(obj));
+    }
+
+/**
+ * As put(T &): a latestfifo never needs to wait for room.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::timed_put(T &obj, Time::Time_t)
+    {
+        return put(obj);
+    }
+
+/**
+ * Puts a new value at the tail of the FIFO, overwriting the oldest
+ * value if the FIFO is full.
+ *
+ * @param obj: object to place into the FIFO
+ *
+ * @return The number of values overwritten, 0 or 1.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::latestfifo<T>::put_no_block(T &obj)
+    {
+        return emplace_no_block([&obj](T &slot) { slot = obj; });
+    }
+
+/**
+ * As put_no_block(T &), but moves 'obj' into the buffer.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::latestfifo<T>::put_no_block(T &&obj)
+    {
+        return emplace_no_block([&obj](T &slot) { slot = std::move(obj); });
+    }
+
+/**
+ * Puts 'n' objects at the tail of the FIFO, overwriting the oldest
+ * values as needed.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return 'n'.
+ *
+ */
+
+    template<class T>
+    size_t matrix::latestfifo<T>::put_n(T *objs, size_t n)
+    {
+        return emplace_n(n, [objs](T &slot, size_t i) { slot = objs[i]; });
+    }
+
+/**
+ * As put_n().
+ *
+ */
+
+    template<class T>
+    size_t matrix::latestfifo<T>::try_put_n(T *objs, size_t n)
+    {
+        return put_n(objs, n);
+    }
+
+/**
+ * Puts 'n' objects at the tail of the FIFO, overwriting the oldest
+ * values as needed. If 'n' exceeds the FIFO's capacity only the
+ * newest objects are kept.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return The number of objects, old or new, dropped.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::latestfifo<T>::put_n_no_block(T *objs, size_t n)
+    {
+        return emplace_n_no_block(n, [objs](T &slot, size_t i) { slot = objs[i]; });
+    }
+
+/**
+ * Places a new value at the tail of the FIFO by calling 'fill(slot)'
+ * on the slot itself, overwriting the oldest value if the FIFO is
+ * full. See tsemfifo::emplace().
+ *
+ * @param fill: A callable taking a T &.
+ *
+ * @return true.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    bool matrix::latestfifo<T>::emplace(F fill)
+    {
+        emplace_no_block(fill);
+        return true;
+    }
+
+/**
+ * As emplace().
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    bool matrix::latestfifo<T>::try_emplace(F fill)
+    {
+        return emplace(fill);
+    }
+
+/**
+ * As emplace(), but returns the number of values overwritten, 0 or 1.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    unsigned int matrix::latestfifo<T>::emplace_no_block(F fill)
+    {
+        auto f = [&fill](T &slot, size_t) { fill(slot); };
+        return _emplace_n(1, f);
+    }
+
+/**
+ * The batch form of emplace(): places 'n' new values, calling
+ * 'fill(slot, i)' to write the i'th one.
+ *
+ * @return 'n'.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    size_t matrix::latestfifo<T>::emplace_n(size_t n, F fill)
+    {
+        _emplace_n(n, fill);
+        return n;
+    }
+
+/**
+ * As emplace_n().
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    size_t matrix::latestfifo<T>::try_emplace_n(size_t n, F fill)
+    {
+        return emplace_n(n, fill);
+    }
+
+/**
+ * As emplace_n(), but returns the number of values, old or new,
+ * dropped.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    unsigned int matrix::latestfifo<T>::emplace_n_no_block(size_t n, F fill)
+    {
+        return _emplace_n(n, fill);
+    }
+
+/**
+ * Gets the oldest value in the FIFO, blocking until there is one.
+ *
+ * @param obj: object to which FIFO object will be copied to.
+ *
+ * @return true if get() succeeded, false if the FIFO was released.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::get(T &obj)
+    {
+        return get_n(&obj, 1, -1) == 1;
+    }
+
+/**
+ * Gets the oldest value in the FIFO without blocking.
+ *
+ * @param obj: object to which FIFO object will be copied to.
+ *
+ * @return true if there was a value, false if the FIFO was empty.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::try_get(T &obj)
+    {
+        return get_n(&obj, 1, 0) == 1;
+    }
+
+/**
+ * Gets the oldest value in the FIFO, waiting at most 'time_out'
+ * nanoseconds for one.
+ *
+ * @param obj: object to which FIFO object will be copied to.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty.
+ *
+ * @return true if there was a value, false if the FIFO stayed empty.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::timed_get(T &obj, Time::Time_t time_out)
+    {
+        return get_n(&obj, 1, time_out) == 1;
+    }
+
+/**
+ * Gets up to 'max' values, oldest first. Waits for the first one as
+ * specified by 'time_out', then takes as many more as are already
+ * there, up to 'max', without waiting.
+ *
+ * @param objs: where the FIFO objects are copied to. Must have room
+ * for 'max' objects.
+ *
+ * @param max: The most objects to get.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If negative (the default), wait indefinitely; if
+ * 0, don't wait at all.
+ *
+ * @return The number of objects copied to 'objs'. 0 means the wait
+ * timed out, or the FIFO was released.
+ *
+ */
+
+    template<class T>
+    size_t matrix::latestfifo<T>::get_n(T *objs, size_t max, Time::Time_t time_out)
+    {
+        size_t k = 0;
+
+        if (max && _wait(time_out))
+        {
+            for (; k < max && _objects; ++k)
+            {
+                size_t slot = _take();
+                objs[k] = std::move(_pool[slot]);
+                _free.push_back(slot);
+            }
+        }
+
+        _ready.unlock();
+        return k;
+    }
+
+/**
+ * Gets the newest value in the FIFO, discarding any older ones. This
+ * is what a display that only shows the current value wants:
+ *
+ *     size_t skipped;
+ *
+ *     if (fifo.get_latest(val, 100000000, skipped))
+ *     {
+ *         show(val);
+ *     }
+ *
+ * @param obj: object to which the newest value will be copied to.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If negative, wait indefinitely; if 0, don't wait
+ * at all.
+ *
+ * @param skipped: Set to the number of older values discarded.
+ *
+ * @return true if there was a value, false if the wait timed out or
+ * the FIFO was released.
+ *
+ */
+
+    template<class T>
+    bool matrix::latestfifo<T>::get_latest(T &obj, Time::Time_t time_out, size_t &skipped)
+    {
+        bool rval = false;
+
+        skipped = 0;
+
+        if (_wait(time_out))
+        {
+            skipped = _objects - 1;
+
+            for (size_t i = 0; i < skipped; ++i)
+            {
+                _free.push_back(_take());
+            }
+
+            size_t slot = _take();
+            obj = std::move(_pool[slot]);
+            _free.push_back(slot);
+            rval = true;
+        }
+
+        _ready.unlock();
+        return rval;
+    }
+
+/**
+ * Takes the oldest value in the FIFO without copying it out: returns
+ * a pointer to it in its slot, which is not reused until
+ * release_ref() is called. See tsemfifo::get_ref().
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If 0, don't wait at all.
+ *
+ * @return A pointer to the value, or nullptr if the wait timed out.
+ *
+ */
+
+    template<class T>
+    T *matrix::latestfifo<T>::get_ref(Time::Time_t time_out)
+    {
+        T *obj = nullptr;
+
+        if (_wait(time_out))
+        {
+            _held = _take();
+            obj = &_pool[_held];
+        }
+
+        _ready.unlock();
+        return obj;
+    }
+
+/**
+ * Gives back the slot of the value taken by get_ref().
+ *
+ */
+
+    template<class T>
+    void matrix::latestfifo<T>::release_ref()
+    {
+        _ready.lock();
+
+        if (_held != (size_t)NO_SLOT)
+        {
+            _free.push_back(_held);
+            _held = NO_SLOT;
+        }
+
+        _ready.unlock();
+    }
+
+/**
+ * Releases any thread waiting in get(). It returns as if it had timed
+ * out. The queue should not be used after this call unless the next
+ * call is flush().
+ *
+ */
+
+    template<class T>
+    void matrix::latestfifo<T>::release()
+    {
+        _ready.lock();
+        _released = true;
+        _ready.set_value(true, false);
+        _ready.broadcast();
+        _ready.unlock();
+    }
+
+/**
+ * Returns the number of objects in the FIFO.
+ *
+ * @return The number of objects in the FIFO.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::latestfifo<T>::size()
+    {
+        _ready.lock();
+        unsigned int o = _objects;
+        _ready.unlock();
+        return o;
+    }
+
+/**
+ * Returns the maximum size of the FIFO, in objects of type T.
+ *
+ * @return The maximum number of objects that the FIFO can hold.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::latestfifo<T>::capacity()
+    {
+        return _buf_len;
+    }
+
+/**
+ * Sets a functor to be called after each put, with the number of
+ * objects then in the FIFO.
+ *
+ * @param n: A `std::shared_ptr` pointing to a `fifo_notifier` derived functor.
+ *
+ */
+
+    template<class T>
+    void matrix::latestfifo<T>::set_notifier(std::shared_ptr<matrix::fifo_notifier> n)
+    {
+        _ready.lock();
+        _notifier = n;
+        _ready.unlock();
+    }
+
+/**
+ * Sets how the consumer waits when the FIFO is empty. This should be
+ * done before the consumer starts, as the strategy is read without the
+ * lock.
+ *
+ * @param w: The wait_strategy. The default is wait_strategy::block().
+ *
+ */
+
+    template<class T>
+    void matrix::latestfifo<T>::set_wait_strategy(wait_strategy w)
+    {
+        _waits = w;
+    }
+};
+
+#endif  // _MATRIX_LATESTFIFO_H_
@@ -0,0 +1,209 @@
+/*******************************************************************
+ ** rcu_ptr.h - A read-copy-update pointer for data that is read
+ *  often and changed rarely.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *
+ *******************************************************************/
+
+#if !defined(_MATRIX_RCU_PTR_H_)
+#define _MATRIX_RCU_PTR_H_
+
+#include "matrix/Mutex.h"
+#include "matrix/ThreadLock.h"
+
+#include <atomic>
+#include <sched.h>
+
+/****************************************************************//**
+ * \class rcu_ptr
+ *
+ *  Holds a pointer to a T that many threads read and few threads
+ *  change. Readers take no lock: they register in one of two reader
+ *  counts, use the object, and leave. Writers are serialized by a
+ *  mutex, apply their change to a copy of the object, swap the copy
+ *  in, and wait for readers of the old object to leave before
+ *  deleting it.
+ *
+ *  Typical use::
+ *
+ *      rcu_ptr<vector<int> > v(new vector<int>());
+ *
+ *      // reader, any thread:
+ *      {
+ *          rcu_ptr<vector<int> >::reader r = v.read();
+ *
+ *          for (auto i: *r) ...
+ *      }
+ *
+ *      // writer, any thread:
+ *      v.update([](vector<int> &c) {c.push_back(5);});
+ *
+ *  A reader must not call update() on the same rcu_ptr while holding
+ *  a reader object, since the writer would wait on itself.
+ *
+ *******************************************************************/
+
+namespace matrix
+{
+    template <typename T>
+    class rcu_ptr
+    {
+    public:
+
+        class reader
+        {
+        public:
+
+            reader(reader &&other)
+                : _owner(other._owner),
+                  _slot(other._slot),
+                  _p(other._p)
+            {
+                other._owner = nullptr;
+            }
+
+            ~reader()
+            {
+                if (_owner)
+                {
+                    _owner->_readers[_slot].fetch_sub(1, std::memory_order_release);
+                }
+            }
+
+            T *get() const
+            {
+                return _p;
+            }
+
+            T *operator->() const
+            {
+                return _p;
+            }
+
+            T &operator*() const
+            {
+                return *_p;
+            }
+
+        private:
+
+            reader(rcu_ptr const *owner)
+                : _owner(owner)
+            {
+                // Register in the count for the current epoch. If the
+                // epoch moved on in between, a writer may already be
+                // waiting on that count; back out and try again.
+                for (;;)
+                {
+                    unsigned int e = _owner->_epoch.load();
+                    _slot = e & 1;
+                    _owner->_readers[_slot].fetch_add(1);
+
+                    if (_owner->_epoch.load() == e)
+                    {
+                        break;
+                    }
+
+                    _owner->_readers[_slot].fetch_sub(1);
+                }
+
+                _p = _owner->_ptr.load(std::memory_order_acquire);
+            }
+
+            reader(reader const &);
+            reader &operator=(reader const &);
+
+            rcu_ptr const *_owner;
+            unsigned int _slot;
+            T *_p;
+
+            friend class rcu_ptr;
+        };
+
+        rcu_ptr(T *p = nullptr)
+            : _ptr(p),
+              _epoch(0)
+        {
+            _readers[0].store(0);
+            _readers[1].store(0);
+        }
+
+        ~rcu_ptr()
+        {
+            delete _ptr.load();
+        }
+
+        /// Returns a reader for the current object. The object stays
+        /// valid until the reader goes out of scope.
+        reader read() const
+        {
+            return reader(this);
+        }
+
+        /// Copies the current object (or default constructs one if
+        /// there is none), applies 'f' to the copy, publishes it, and
+        /// deletes the old object once no reader can still see it.
+        template <typename F>
+        void update(F f)
+        {
+            ThreadLock<Mutex> l(_writer_mutex);
+
+            l.lock();
+            T *old = _ptr.load();
+            T *p = old ? new T(*old) : new T();
+            f(*p);
+            _ptr.store(p);
+            synchronize();
+            delete old;
+        }
+
+    private:
+
+        /// Flips the epoch and waits for the readers that registered
+        /// under the old one to leave. Called with '_writer_mutex' held.
+        void synchronize()
+        {
+            unsigned int e = _epoch.fetch_add(1);
+
+            for (int spins = 0; _readers[e & 1].load(std::memory_order_acquire) != 0; ++spins)
+            {
+                if (spins > 100)
+                {
+                    sched_yield();
+                }
+            }
+        }
+
+        rcu_ptr(rcu_ptr const &);
+        rcu_ptr &operator=(rcu_ptr const &);
+
+        std::atomic<T *> _ptr;
+        mutable std::atomic<unsigned int> _epoch;
+        mutable std::atomic<int> _readers[2];
+        Mutex _writer_mutex;
+    };
+}
+
+#endif
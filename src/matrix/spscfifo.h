@@ -0,0 +1,1038 @@
+/*******************************************************************
+ *  spscfifo.h - A lock-free single producer, single consumer FIFO
+ *  with the same interface as tsemfifo.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_MATRIX_SPSCFIFO_H_)
+#define _MATRIX_SPSCFIFO_H_
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <climits>
+#include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "matrix/tsemfifo.h"
+#include "matrix/Mutex.h"
+#include "matrix/ThreadLock.h"
+#include "matrix/Time.h"
+
+namespace matrix
+{
+/**
+ * \class spscfifo
+ *
+ * A lock-free ring buffer for exactly one producer thread and one
+ * consumer thread, such as a transport's receive thread feeding a
+ * component's thread through a DataSink. It has the same interface
+ * as tsemfifo, so either may be used as a DataSink's ring buffer:
+ *
+ *     DataSink<double, select_specified, spscfifo> sink(km_urn, 100);
+ *
+ * Puts and gets that find room or data cost a couple of atomic loads
+ * and stores on the producer's and consumer's own cache lines; no
+ * lock is taken and no system call is made. Only a thread that must
+ * wait, on a full FIFO in put() or an empty one in get(), sleeps on
+ * a futex, and the other side enters the kernel to wake it only if
+ * someone is actually sleeping. With 'set_wait_strategy()' the
+ * consumer may spin for a while before sleeping, or never sleep (see
+ * matrix::wait_strategy).
+ *
+ * The storage is rounded up to a power of two so that indices can be
+ * masked rather than divided, but the FIFO still holds no more than
+ * the requested number of objects.
+ *
+ * Because the producer may not touch the consumer's end of the
+ * buffer, the non-blocking puts (put_no_block(), put_n_no_block())
+ * drop the *new* objects that don't fit, rather than the oldest ones
+ * as tsemfifo does. Either way the return value is the number
+ * dropped.
+ *
+ * 'flush()' and 'flush(int)' are consumer operations, as are
+ * 'get()' and its relatives. Nothing here is safe for more than one
+ * producer or more than one consumer; use tsemfifo for that.
+ *
+ */
+
+    template<typename T>
+    class spscfifo
+    {
+    public:
+
+        typedef T value_type;
+
+        enum
+        {
+            FIFO_SIZE = 100,
+            CACHE_LINE = 64
+        };
+
+        spscfifo(size_t size = FIFO_SIZE);
+
+        ~spscfifo();
+
+        void release();
+
+        void flush();
+
+        unsigned int flush(int items);
+
+        bool put(T &obj);
+
+        bool put(T &&obj);
+
+        bool try_put(T &obj);
+
+        bool try_put(T &&obj);
+
+        bool timed_put(T &obj, Time::Time_t time_out);
+
+        unsigned int put_no_block(T &obj);
+
+        unsigned int put_no_block(T &&obj);
+
+        size_t put_n(T *objs, size_t n);
+
+        size_t try_put_n(T *objs, size_t n);
+
+        unsigned int put_n_no_block(T *objs, size_t n);
+
+        template<typename F>
+        bool emplace(F fill);
+
+        template<typename F>
+        bool try_emplace(F fill);
+
+        template<typename F>
+        unsigned int emplace_no_block(F fill);
+
+        template<typename F>
+        size_t emplace_n(size_t n, F fill);
+
+        template<typename F>
+        size_t try_emplace_n(size_t n, F fill);
+
+        template<typename F>
+        unsigned int emplace_n_no_block(size_t n, F fill);
+
+        bool get(T &obj);
+
+        bool try_get(T &obj);
+
+        bool timed_get(T &obj, Time::Time_t time_out);
+
+        size_t get_n(T *objs, size_t max, Time::Time_t time_out = -1);
+
+        bool get_latest(T &obj, Time::Time_t time_out, size_t &skipped);
+
+        T *get_ref(Time::Time_t time_out);
+
+        void release_ref();
+
+        unsigned int size();
+
+        unsigned int capacity();
+
+        void set_notifier(std::shared_ptr<fifo_notifier>);
+
+        void set_wait_strategy(wait_strategy w);
+
+    private:
+
+        spscfifo(const spscfifo &);
+
+        spscfifo &operator=(spscfifo const &);
+
+        size_t _room(size_t want = 1);
+
+        size_t _available(size_t want = 1);
+
+        template<typename F>
+        size_t _emplace_n(size_t n, F &fill);
+
+        size_t _get_n(T *objs, size_t n);
+
+        bool _wait_for_room(Time::Time_t time_out);
+
+        bool _wait_for_data(Time::Time_t time_out);
+
+        bool _wait(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiters,
+                   bool consumer, Time::Time_t time_out);
+
+        void _wake(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiters);
+
+        std::vector<T> _buffer;
+        size_t _mask;
+        size_t _buf_len;
+
+        // The padding keeps the producer's and the consumer's fields on
+        // separate cache lines. (alignas() would do, but 'new' does not
+        // honor it before C++17.)
+        char _pad0[CACHE_LINE];
+
+        // Written by the producer. '_head_cache' is the producer's
+        // last look at '_head', refreshed only when the FIFO seems full.
+        std::atomic<size_t> _tail;
+        size_t _head_cache;
+        char _pad1[CACHE_LINE];
+
+        // Written by the consumer. '_tail_cache' likewise.
+        std::atomic<size_t> _head;
+        size_t _tail_cache;
+        char _pad2[CACHE_LINE];
+
+        // Futex words, bumped only when the other side is asleep.
+        std::atomic<uint32_t> _put_seq;
+        std::atomic<uint32_t> _get_seq;
+        std::atomic<uint32_t> _consumers_waiting;
+        std::atomic<uint32_t> _producers_waiting;
+        std::atomic<bool> _released;
+
+        std::atomic<fifo_notifier *> _notifier;
+        std::vector<std::shared_ptr<fifo_notifier> > _notifiers;
+        matrix::Mutex _notifier_mutex;
+        wait_strategy _waits;
+    };
+
+/**
+ * Construct an spscfifo.
+ *
+ * @param size The capacity of the FIFO. If this capacity is reached,
+ * `put()` will block, or `try_put()` will return false.
+ *
+ */
+
+    template<class T>
+    matrix::spscfifo<T>::spscfifo(size_t size)
+        : _buf_len(size ? size : 1),
+          _tail(0),
+          _head_cache(0),
+          _head(0),
+          _tail_cache(0),
+          _put_seq(0),
+          _get_seq(0),
+          _consumers_waiting(0),
+          _producers_waiting(0),
+          _released(false)
+    {
+        size_t len = 1;
+
+        while (len < _buf_len)
+        {
+            len <<= 1;
+        }
+
+        _buffer.resize(len);
+        _mask = len - 1;
+        _notifiers.push_back(std::shared_ptr<fifo_notifier>(new fifo_notifier()));
+        _notifier.store(_notifiers.back().get());
+    }
+
+/**
+ * Destructor for spscfifo. Releases any waiting threads.
+ *
+ */
+
+    template<class T>
+    matrix::spscfifo<T>::~spscfifo()
+    {
+        release();
+    }
+
+/**
+ * The number of free slots, as seen by the producer. The consumer's
+ * '_head' is read only if the cached copy shows fewer than 'want'.
+ *
+ */
+
+    template<class T>
+    size_t matrix::spscfifo<T>::_room(size_t want)
+    {
+        size_t t = _tail.load(std::memory_order_relaxed);
+
+        if (_buf_len - (t - _head_cache) < want)
+        {
+            _head_cache = _head.load(std::memory_order_acquire);
+        }
+
+        return _buf_len - (t - _head_cache);
+    }
+
+/**
+ * The number of objects waiting, as seen by the consumer. The
+ * producer's '_tail' is read only if the cached copy shows fewer
+ * than 'want'.
+ *
+ */
+
+    template<class T>
+    size_t matrix::spscfifo<T>::_available(size_t want)
+    {
+        size_t h = _head.load(std::memory_order_relaxed);
+
+        if (_tail_cache - h < want)
+        {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+        }
+
+        return _tail_cache - h;
+    }
+
+/**
+ * Writes as many of 'n' new values into the FIFO as there is room
+ * for, calling 'fill(slot, i)' for the i'th one, publishes them with
+ * one store, and wakes the consumer if it is asleep.
+ *
+ * @param n: How many.
+ *
+ * @param fill: A callable taking (T &, size_t).
+ *
+ * @return The number put.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    size_t matrix::spscfifo<T>::_emplace_n(size_t n, F &fill)
+    {
+        size_t room = _room(n);
+        size_t k = n < room ? n : room;
+
+        if (k == 0)
+        {
+            return 0;
+        }
+
+        size_t t = _tail.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < k; ++i)
+        {
+            fill(_buffer[(t + i) & _mask], i);
+        }
+
+        _tail.store(t + k, std::memory_order_release);
+        _wake(_put_seq, _consumers_waiting);
+        _notifier.load(std::memory_order_acquire)->exec(t + k - _head.load(std::memory_order_relaxed));
+        return k;
+    }
+
+/**
+ * Copies up to 'n' waiting objects out of the FIFO, frees their
+ * slots with one store, and wakes the producer if it is asleep.
+ *
+ * @param objs: where the FIFO objects are copied to.
+ *
+ * @param n: The most to get.
+ *
+ * @return The number gotten.
+ *
+ */
+
+    template<class T>
+    size_t matrix::spscfifo<T>::_get_n(T *objs, size_t n)
+    {
+        size_t avail = _available(n);
+        size_t k = n < avail ? n : avail;
+
+        if (k == 0)
+        {
+            return 0;
+        }
+
+        size_t h = _head.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < k; ++i)
+        {
+            objs[i] = std::move(_buffer[(h + i) & _mask]);
+        }
+
+        _head.store(h + k, std::memory_order_release);
+        _wake(_get_seq, _producers_waiting);
+        return k;
+    }
+
+/**
+ * Sleeps on the futex word 'seq' until the other side bumps it, the
+ * FIFO is released, or 'time_out' expires. 'waiters' tells the other
+ * side that a wake is needed; it is raised before the FIFO is checked
+ * one last time, so that a put or get that lands in between is not
+ * missed. A consumer first spins as its wait_strategy directs.
+ *
+ * @param seq: '_put_seq' for a consumer, '_get_seq' for a producer.
+ *
+ * @param waiters: the matching waiter count.
+ *
+ * @param consumer: true if waiting for data, false if for room.
+ *
+ * @param time_out: nanoseconds to wait, negative to wait indefinitely.
+ *
+ * @return true if there is now data (or room), false if not.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::_wait(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiters,
+                                    bool consumer, Time::Time_t time_out)
+    {
+        Time::Time_t deadline = Time::getUTC() + time_out;
+
+        if (consumer && _waits.spin([this]() {return _available() || _released.load();}, time_out))
+        {
+            return !_released.load();
+        }
+
+        while (!_released.load())
+        {
+            if (consumer ? _available() : _room())
+            {
+                return true;
+            }
+
+            waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint32_t s = seq.load();
+
+            if (!(consumer ? _available() : _room()) && !_released.load())
+            {
+                timespec ts, *tsp = nullptr;
+
+                if (static_cast<int64_t>(time_out) >= 0)
+                {
+                    int64_t left = deadline - Time::getUTC();
+
+                    if (left <= 0)
+                    {
+                        waiters.fetch_sub(1);
+                        return false;
+                    }
+
+                    ts.tv_sec = left / Time::TM_ONE_SEC;
+                    ts.tv_nsec = left % Time::TM_ONE_SEC;
+                    tsp = &ts;
+                }
+
+                syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq),
+                        FUTEX_WAIT_PRIVATE, s, tsp, nullptr, 0);
+            }
+
+            waiters.fetch_sub(1);
+        }
+
+        return false;
+    }
+
+/**
+ * Wakes the other side if it is asleep on 'seq'. The fence orders the
+ * caller's store to '_head' or '_tail' ahead of the load of 'waiters',
+ * pairing with the increment in '_wait()'.
+ *
+ */
+
+    template<class T>
+    void matrix::spscfifo<T>::_wake(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiters)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (waiters.load(std::memory_order_relaxed))
+        {
+            seq.fetch_add(1);
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&seq),
+                    FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    template<class T>
+    bool matrix::spscfifo<T>::_wait_for_room(Time::Time_t time_out)
+    {
+        return _wait(_get_seq, _producers_waiting, false, time_out);
+    }
+
+    template<class T>
+    bool matrix::spscfifo<T>::_wait_for_data(Time::Time_t time_out)
+    {
+        return _wait(_put_seq, _consumers_waiting, true, time_out);
+    }
+
+/**
+ * Empties the queue, and clears a previous release().
+ *
+ */
+
+    template<class T>
+    void matrix::spscfifo<T>::flush()
+    {
+        _released.store(false);
+        flush(_buf_len);
+    }
+
+/**
+ * Flushes 'items' items out of the queue.
+ *
+ * @param items: The number of items to drop, oldest first. If 'items'
+ * equals or exceeds the number of elements in the queue, all will be
+ * dropped. If 'items' is negative, all but abs(items) will be dropped.
+ *
+ * @return The number of items remaining in the queue.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::spscfifo<T>::flush(int items)
+    {
+        size_t objects = _available(_buf_len);
+        size_t nitems = static_cast<size_t>(abs(items));
+
+        if (items < 0)
+        {
+            nitems = nitems < objects ? objects - nitems : 0;
+        }
+
+        if (nitems > objects)
+        {
+            nitems = objects;
+        }
+
+        if (nitems)
+        {
+            _head.store(_head.load(std::memory_order_relaxed) + nitems, std::memory_order_release);
+            _wake(_get_seq, _producers_waiting);
+        }
+
+        return objects - nitems;
+    }
+
+/**
+ * Puts a new value at the tail of the FIFO, blocking while the FIFO
+ * is full.
+ *
+ * @param obj: Object to put (copy) into the buffer.
+ *
+ * @return true if the put succeeds, false if the FIFO was released
+ * while waiting.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::put(T &obj)
+    {
+        return emplace([&obj](T &slot) { slot = obj; });
+    }
+
+/**
+ * As put(T &), but moves 'obj' into the buffer.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::put(T &&obj)
+    {
+        return emplace([&obj](T &slot) { slot = std::move(obj); });
+    }
+
+/**
+ * Places a new value at the tail of the FIFO by calling 'fill(slot)'
+ * on the slot itself, blocking while the FIFO is full. See
+ * tsemfifo::emplace().
+ *
+ * @param fill: A callable taking a T &.
+ *
+ * @return true if the put succeeds, false if the FIFO was released
+ * while waiting.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    bool matrix::spscfifo<T>::emplace(F fill)
+    {
+        return emplace_n(1, [&fill](T &slot, size_t) { fill(slot); }) == 1;
+    }
+
+/**
+ * Puts a new value at the tail of the FIFO if there is room, without
+ * blocking.
+ *
+ * @param obj: Object to put (copy) into the buffer.
+ *
+ * @return true on success, false if the FIFO is full.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::try_put(T &obj)
+    {
+        return try_emplace([&obj](T &slot) { slot = obj; });
+    }
+
+/**
+ * As try_put(T &), but moves 'obj' into the buffer. 'obj' is left
+ * alone if the FIFO is full.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::try_put(T &&obj)
+    {
+        return try_emplace([&obj](T &slot) { slot = std::move(obj); });
+    }
+
+/**
+ * The non-blocking form of emplace().
+ *
+ * @param fill: A callable taking a T &.
+ *
+ * @return true on success, false if the FIFO is full.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    bool matrix::spscfifo<T>::try_emplace(F fill)
+    {
+        auto f = [&fill](T &slot, size_t) { fill(slot); };
+        return _emplace_n(1, f) == 1;
+    }
+
+/**
+ * Puts a new value at the tail of the FIFO, waiting at most
+ * 'time_out' nanoseconds for room.
+ *
+ * @param obj: Object to put (copy) into the buffer.
+ *
+ * @param time_out: Time to wait for the FIFO to become not full, in
+ * nano seconds.
+ *
+ * @return true on success, false if the FIFO stayed full.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::timed_put(T &obj, Time::Time_t time_out)
+    {
+        return _wait_for_room(time_out) && try_put(obj);
+    }
+
+/**
+ * Puts a new value without blocking. If the FIFO is full the value is
+ * dropped.
+ *
+ * @param obj: object to place into the FIFO
+ *
+ * @return The number of objects dropped, 0 or 1.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::spscfifo<T>::put_no_block(T &obj)
+    {
+        return try_put(obj) ? 0 : 1;
+    }
+
+/**
+ * As put_no_block(T &), but moves 'obj' into the buffer.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::spscfifo<T>::put_no_block(T &&obj)
+    {
+        return try_put(std::move(obj)) ? 0 : 1;
+    }
+
+/**
+ * The emplace() counterpart of put_no_block(). If the FIFO is full
+ * 'fill' is not called and the value is dropped.
+ *
+ * @param fill: A callable taking a T &.
+ *
+ * @return The number of values dropped, 0 or 1.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    unsigned int matrix::spscfifo<T>::emplace_no_block(F fill)
+    {
+        return try_emplace(fill) ? 0 : 1;
+    }
+
+/**
+ * Puts 'n' objects at the tail of the FIFO, blocking as needed until
+ * all are in.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return The number of objects put. This is 'n' unless the FIFO was
+ * released while waiting.
+ *
+ */
+
+    template<class T>
+    size_t matrix::spscfifo<T>::put_n(T *objs, size_t n)
+    {
+        return emplace_n(n, [objs](T &slot, size_t i) { slot = objs[i]; });
+    }
+
+/**
+ * The batch form of emplace(): places 'n' new values, calling
+ * 'fill(slot, i)' to write the i'th one, blocking as needed until
+ * all are in.
+ *
+ * @param n: How many.
+ *
+ * @param fill: A callable taking (T &, size_t).
+ *
+ * @return The number of values put. This is 'n' unless the FIFO was
+ * released while waiting.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    size_t matrix::spscfifo<T>::emplace_n(size_t n, F fill)
+    {
+        size_t done = 0;
+        auto f = [&fill, &done](T &slot, size_t i) { fill(slot, done + i); };
+
+        while (done < n)
+        {
+            done += _emplace_n(n - done, f);
+
+            if (done < n && !_wait_for_room(-1))
+            {
+                break;
+            }
+        }
+
+        return done;
+    }
+
+/**
+ * Puts as many of 'n' objects as there is room for, without blocking.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return The number of objects put, counting from the first.
+ *
+ */
+
+    template<class T>
+    size_t matrix::spscfifo<T>::try_put_n(T *objs, size_t n)
+    {
+        return try_emplace_n(n, [objs](T &slot, size_t i) { slot = objs[i]; });
+    }
+
+/**
+ * Places as many of 'n' new values as there is room for, without
+ * blocking. See emplace_n().
+ *
+ * @return The number of values put, counting from the first.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    size_t matrix::spscfifo<T>::try_emplace_n(size_t n, F fill)
+    {
+        return _emplace_n(n, fill);
+    }
+
+/**
+ * Puts 'n' objects without blocking, dropping those that don't fit.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return The number of objects dropped.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::spscfifo<T>::put_n_no_block(T *objs, size_t n)
+    {
+        return n - try_put_n(objs, n);
+    }
+
+/**
+ * The emplace() counterpart of put_n_no_block(). See emplace_n().
+ *
+ * @return The number of values dropped.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    unsigned int matrix::spscfifo<T>::emplace_n_no_block(size_t n, F fill)
+    {
+        return n - _emplace_n(n, fill);
+    }
+
+/**
+ * Gets a value out of the head of the FIFO, blocking until there is
+ * one.
+ *
+ * @param obj: object to which FIFO object will be copied to.
+ *
+ * @return true if get() succeeded, false if the FIFO was released.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::get(T &obj)
+    {
+        return get_n(&obj, 1, -1) == 1;
+    }
+
+/**
+ * Gets a value out of the head of the FIFO without blocking.
+ *
+ * @param obj: object to which FIFO object will be copied to.
+ *
+ * @return true if there was a value, false if the FIFO was empty.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::try_get(T &obj)
+    {
+        return _get_n(&obj, 1) == 1;
+    }
+
+/**
+ * Gets a value out of the head of the FIFO, waiting at most
+ * 'time_out' nanoseconds for one.
+ *
+ * @param obj: object to which FIFO object will be copied to.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty.
+ *
+ * @return true if there was a value, false if the FIFO stayed empty.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::timed_get(T &obj, Time::Time_t time_out)
+    {
+        return get_n(&obj, 1, time_out) == 1;
+    }
+
+/**
+ * Gets up to 'max' values out of the head of the FIFO. Waits for the
+ * first one as specified by 'time_out', then takes as many more as
+ * are already there, up to 'max', without waiting.
+ *
+ * @param objs: where the FIFO objects are copied to. Must have room
+ * for 'max' objects.
+ *
+ * @param max: The most objects to get.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If negative (the default), wait indefinitely; if
+ * 0, don't wait at all.
+ *
+ * @return The number of objects copied to 'objs'. 0 means the wait
+ * timed out, or the FIFO was released.
+ *
+ */
+
+    template<class T>
+    size_t matrix::spscfifo<T>::get_n(T *objs, size_t max, Time::Time_t time_out)
+    {
+        if (max == 0)
+        {
+            return 0;
+        }
+
+        if (time_out != 0 && !_wait_for_data(time_out))
+        {
+            return 0;
+        }
+
+        return _get_n(objs, max);
+    }
+
+/**
+ * Gets the newest value in the FIFO, discarding any older ones. See
+ * tsemfifo::get_latest().
+ *
+ * @param obj: object to which the newest value will be copied to.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If 0, don't wait at all.
+ *
+ * @param skipped: Set to the number of older values discarded.
+ *
+ * @return true if there was a value, false if the FIFO stayed empty.
+ *
+ */
+
+    template<class T>
+    bool matrix::spscfifo<T>::get_latest(T &obj, Time::Time_t time_out, size_t &skipped)
+    {
+        skipped = 0;
+
+        if (!_available() && (time_out == 0 || !_wait_for_data(time_out)))
+        {
+            return false;
+        }
+
+        size_t h = _head.load(std::memory_order_relaxed);
+
+        skipped = _available(_buf_len) - 1;
+        obj = std::move(_buffer[(h + skipped) & _mask]);
+        _head.store(h + skipped + 1, std::memory_order_release);
+        _wake(_get_seq, _producers_waiting);
+        return true;
+    }
+
+/**
+ * Returns a pointer to the value at the head of the FIFO, in its
+ * slot, without copying it out. The value stays in the FIFO until
+ * release_ref() is called, and the producer can't overwrite it. See
+ * tsemfifo::get_ref().
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If 0, don't wait at all.
+ *
+ * @return A pointer to the value, or nullptr if the wait timed out.
+ *
+ */
+
+    template<class T>
+    T *matrix::spscfifo<T>::get_ref(Time::Time_t time_out)
+    {
+        if (!_available() && (time_out == 0 || !_wait_for_data(time_out)))
+        {
+            return nullptr;
+        }
+
+        return &_buffer[_head.load(std::memory_order_relaxed) & _mask];
+    }
+
+/**
+ * Removes the value returned by get_ref() from the FIFO, freeing its
+ * slot.
+ *
+ */
+
+    template<class T>
+    void matrix::spscfifo<T>::release_ref()
+    {
+        flush(1);
+    }
+
+/**
+ * Releases any thread waiting in get() or put(). They return as if
+ * they had failed. The queue should not be used after this call
+ * unless the next call is flush().
+ *
+ */
+
+    template<class T>
+    void matrix::spscfifo<T>::release()
+    {
+        _released.store(true);
+        _put_seq.fetch_add(1);
+        _get_seq.fetch_add(1);
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_put_seq),
+                FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_get_seq),
+                FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+/**
+ * Returns the number of objects in the FIFO.
+ *
+ * @return The number of objects in the FIFO.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::spscfifo<T>::size()
+    {
+        size_t h = _head.load(std::memory_order_acquire);
+        return _tail.load(std::memory_order_acquire) - h;
+    }
+
+/**
+ * Returns the maximum size of the FIFO, in objects of type T.
+ *
+ * @return The maximum number of objects that the FIFO can hold.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::spscfifo<T>::capacity()
+    {
+        return _buf_len;
+    }
+
+/**
+ * Sets a functor to be called by the producer after each put, with
+ * the number of objects then in the FIFO. Replaced notifiers are kept
+ * until the FIFO is destroyed, since the producer may still be
+ * calling one when it is replaced.
+ *
+ * @param n: A `std::shared_ptr` pointing to a `fifo_notifier` derived functor.
+ *
+ */
+
+    template<class T>
+    void matrix::spscfifo<T>::set_notifier(std::shared_ptr<matrix::fifo_notifier> n)
+    {
+        matrix::ThreadLock<matrix::Mutex> l(_notifier_mutex);
+        l.lock();
+        _notifiers.push_back(n);
+        _notifier.store(n.get(), std::memory_order_release);
+    }
+
+/**
+ * Sets how the consumer waits when the FIFO is empty. Like the other
+ * consumer operations, this belongs to the consumer's thread, and
+ * should be done before it starts getting.
+ *
+ * @param w: The wait_strategy. The default is wait_strategy::block().
+ *
+ */
+
+    template<class T>
+    void matrix::spscfifo<T>::set_wait_strategy(wait_strategy w)
+    {
+        _waits = w;
+    }
+};
+
+#endif  // _MATRIX_SPSCFIFO_H_
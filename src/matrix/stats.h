@@ -0,0 +1,255 @@
+/*******************************************************************
+ *  stats.h - Low overhead counters and latency histograms for the
+ *  DataSources and DataSinks, and a reporter that publishes them to
+ *  the Keymaster.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_MATRIX_STATS_H_)
+#define _MATRIX_STATS_H_
+
+#include "matrix/Time.h"
+
+#include <yaml-cpp/yaml.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace matrix
+{
+/**
+ * \class latency_histogram
+ *
+ * An HDR-style histogram of durations in nanoseconds. Values below 16
+ * get a bucket each; above that each power of two is split into 16
+ * buckets, so any value is placed within about 6% of itself, from
+ * nanoseconds to centuries, in 976 counters. 'record()' is one relaxed
+ * atomic increment and may be called from any number of threads.
+ *
+ * 'take()' summarizes what was recorded since the last 'take()', and
+ * starts over. It is meant to be called from one thread, periodically.
+ *
+ */
+
+    class latency_histogram
+    {
+    public:
+
+        enum
+        {
+            SUB_BITS = 4,
+            SUB_BUCKETS = 1 << SUB_BITS,
+            BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS
+        };
+
+        struct summary
+        {
+            uint64_t count;
+            Time::Time_t p50;
+            Time::Time_t p99;
+            Time::Time_t max;
+        };
+
+        latency_histogram()
+        {
+            for (size_t i = 0; i < BUCKETS; ++i)
+            {
+                _counts[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        void record(Time::Time_t ns)
+        {
+            _counts[_index(ns)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        summary take();
+
+        static YAML::Node to_yaml(const summary &s);
+
+    private:
+
+        static size_t _index(uint64_t v)
+        {
+            if (v < SUB_BUCKETS)
+            {
+                return v;
+            }
+
+            size_t e = 63 - __builtin_clzll(v);
+            return (e - SUB_BITS + 1) * SUB_BUCKETS + ((v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+        }
+
+        static uint64_t _value(size_t i);
+
+        std::atomic<uint64_t> _counts[BUCKETS];
+    };
+
+/**
+ * \class queue_probe
+ *
+ * Estimates how long values wait in a queue, by following one of them
+ * at a time: after a put the producer, if no value is being followed,
+ * notes the time and how many values are ahead of and including the
+ * one just put; the consumer counts down as it takes values, and
+ * records the wait when the count reaches zero. This costs one atomic
+ * load per put and per get in the common case, and assumes one
+ * consumer. A producer whose queue depth is costly to read may check
+ * 'idle()' first. Values dropped from a full queue make the estimate high,
+ * so it is best read alongside the drop count.
+ *
+ */
+
+    class queue_probe
+    {
+    public:
+
+        queue_probe()
+            : _left(0),
+              _since(0)
+        {
+        }
+
+        bool idle()
+        {
+            return _left.load(std::memory_order_relaxed) == 0;
+        }
+
+        void put(size_t depth)
+        {
+            int64_t idle = 0;
+
+            if (depth && _left.load(std::memory_order_relaxed) == 0
+                && _left.compare_exchange_strong(idle, -1, std::memory_order_acquire))
+            {
+                _since.store(Time::getUTC(), std::memory_order_relaxed);
+                _left.store(depth, std::memory_order_release);
+            }
+        }
+
+        void got(size_t n, latency_histogram &h)
+        {
+            int64_t left = _left.load(std::memory_order_acquire);
+
+            if (left > 0 && n)
+            {
+                left -= n;
+
+                if (left <= 0)
+                {
+                    h.record(Time::getUTC() - _since.load(std::memory_order_relaxed));
+                    left = 0;
+                }
+
+                _left.store(left, std::memory_order_release);
+            }
+        }
+
+        void reset()
+        {
+            _left.store(0, std::memory_order_release);
+        }
+
+    private:
+
+        std::atomic<int64_t> _left;
+        std::atomic<Time::Time_t> _since;
+    };
+
+/**
+ * \class rate_meter
+ *
+ * Turns successive readings of a counter into a rate, in counts per
+ * second since the previous reading. Meant for a report function,
+ * which is only ever called from one thread.
+ *
+ */
+
+    class rate_meter
+    {
+    public:
+
+        rate_meter()
+            : _count(0),
+              _when(Time::getUTC())
+        {
+        }
+
+        double operator()(uint64_t count)
+        {
+            Time::Time_t now = Time::getUTC();
+            double secs = (double)(now - _when) / 1e9;
+            // a counter that went backwards was reset.
+            uint64_t delta = count >= _count ? count - _count : count;
+            double rate = secs > 0.0 ? (double)delta / secs : 0.0;
+            _count = count;
+            _when = now;
+            return rate;
+        }
+
+    private:
+
+        uint64_t _count;
+        Time::Time_t _when;
+    };
+
+/**
+ * \class stats_reporter
+ *
+ * Publishes statistics to the Keymaster, from a thread of its own,
+ * every 'interval()' (one second by default). Each DataSource and
+ * DataSink whose statistics are on (see their 'set_stats_key()') adds
+ * a function that reports them as a YAML node, and the key to put it
+ * under, normally:
+ * 'components.<component>.stats.Sources.<name>' and
+ * 'components.<component>.stats.Sinks.<name>' respectively.
+ *
+ * A function is only ever called from the reporter's thread, and is
+ * never called again once 'remove()' has returned. The thread runs
+ * for as long as there is anything to report.
+ *
+ *     int id = stats_reporter::add(km_urn, "components.foo.stats.bar",
+ *                                  [&]() {return my_stats();});
+ *     ...
+ *     stats_reporter::remove(id);
+ *
+ */
+
+    class stats_reporter
+    {
+    public:
+
+        typedef std::function<YAML::Node ()> report_fn;
+
+        static int add(std::string km_urn, std::string key, report_fn f);
+        static void remove(int id);
+        static void set_interval(Time::Time_t interval);
+        static Time::Time_t interval();
+    };
+
+}
+
+#endif
@@ -31,14 +31,17 @@
 
 #include <semaphore.h>
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <vector>
 #include <memory>
+#include <utility>
 #include "matrix/TCondition.h"
 #include "matrix/Mutex.h"
 #include "matrix/ThreadLock.h"
 #include "matrix/Time.h"
+#include "matrix/wait_strategy.h"
 
 namespace matrix
 {
@@ -97,6 +100,17 @@ namespace matrix
  *  For a post that blocks, use `put()` instead of `try_put()`, and for
  *  a get that doesn't block use `try_get()` instead of `get()`.
  *
+ *  Several objects may be moved in one call with `put_n()`,
+ *  `try_put_n()`, `put_n_no_block()` and `get_n()`. These wait at most
+ *  once, and take the lock once, per batch:
+ *
+ *     int data[20];
+ *     size_t n = fifo.get_n(data, 20, 1000000); // up to 20, wait <= 1 ms
+ *
+ *  By default a consumer that finds the FIFO empty sleeps on a
+ *  semaphore. `set_wait_strategy()` lets it spin for a while first, or
+ *  busy poll, instead (see matrix::wait_strategy).
+ *
  */
 
     template<typename T>
@@ -104,6 +118,8 @@ namespace matrix
     {
     public:
 
+        typedef T value_type;
+
         class Exception
         {
         public:
@@ -148,18 +164,56 @@ namespace matrix
 
         bool put(T &obj);
 
+        bool put(T &&obj);
+
         bool try_put(T &obj);
 
+        bool try_put(T &&obj);
+
         bool timed_put(T &obj, Time::Time_t time_out);
 
         unsigned int put_no_block(T &obj);
 
+        unsigned int put_no_block(T &&obj);
+
+        size_t put_n(T *objs, size_t n);
+
+        size_t try_put_n(T *objs, size_t n);
+
+        unsigned int put_n_no_block(T *objs, size_t n);
+
+        template<typename F>
+        bool emplace(F fill);
+
+        template<typename F>
+        bool try_emplace(F fill);
+
+        template<typename F>
+        unsigned int emplace_no_block(F fill);
+
+        template<typename F>
+        size_t emplace_n(size_t n, F fill);
+
+        template<typename F>
+        size_t try_emplace_n(size_t n, F fill);
+
+        template<typename F>
+        unsigned int emplace_n_no_block(size_t n, F fill);
+
         bool get(T &obj);
 
         bool try_get(T &obj);
 
         bool timed_get(T &obj, Time::Time_t time_out);
 
+        size_t get_n(T *objs, size_t max, Time::Time_t time_out = -1);
+
+        bool get_latest(T &obj, Time::Time_t time_out, size_t &skipped);
+
+        T *get_ref(Time::Time_t time_out);
+
+        void release_ref();
+
         bool wait_for_empty(int milliseconds = -1);
 
         unsigned int size();
@@ -170,6 +224,8 @@ namespace matrix
 
         void set_notifier(std::shared_ptr<fifo_notifier>);
 
+        void set_wait_strategy(wait_strategy w);
+
     private:
 
         tsemfifo(const tsemfifo &);
@@ -182,7 +238,16 @@ namespace matrix
 
         void _get(T &obj);
 
-        void _put(T &obj);
+        size_t _trywait_n(sem_t *sem, size_t n);
+
+        bool _wait_full(Time::Time_t time_out);
+
+        bool _spin_full(Time::Time_t time_out);
+
+        void _get_n(T *objs, size_t n);
+
+        template<typename F>
+        void _emplace_n(size_t n, F &fill);
 
         std::vector<T> _buffer;
         unsigned int _head;
@@ -195,6 +260,7 @@ namespace matrix
         matrix::TCondition<bool> _empty;
         std::shared_ptr<matrix::fifo_notifier> _notifier;
         matrix::Mutex _critical_section;
+        wait_strategy _waits;
     };
 
 /**
@@ -418,30 +484,29 @@ namespace matrix
     }
 
 /**
- * This private function actually does the work of updating the FIFO
- * with a new value, once the public put() or try_put() functions have
- * determined there is enough room for the value.
+ * This private function actually does the work of placing 'n' new
+ * values in the FIFO under one lock, once the caller has taken 'n'
+ * counts of '_empty_sem'. Each value is written in place, by calling
+ * 'fill(slot, i)' on the slot for the i'th value.
  *
- * @param obj: Object to put (copy) into the buffer.
+ * @param n: How many.
+ *
+ * @param fill: A callable taking (T &, size_t).
  *
  */
 
     template<class T>
-    void matrix::tsemfifo<T>::_put(T &obj)
+    template<typename F>
+    void matrix::tsemfifo<T>::_emplace_n(size_t n, F &fill)
     {
         matrix::ThreadLock<matrix::Mutex> l(_critical_section);
 
-
         l.lock();
-        _buffer[_tail] = obj;
 
-        if (_tail < (_buf_len - 1))
-        {
-            ++_tail;
-        }
-        else
+        for (size_t i = 0; i < n; ++i)
         {
-            _tail = 0;
+            fill(_buffer[_tail], i);
+            _tail = (_tail < (_buf_len - 1)) ? _tail + 1 : 0;
         }
 
         if (!_objects)                   // Was empty, now has something.
@@ -449,15 +514,18 @@ namespace matrix
             _empty.set_value(false);
         }
 
-        ++_objects;
+        _objects += n;
         _notifier->exec(_objects);
         l.unlock();
 
-        if (sem_post(&_full_sem) == -1)
+        for (size_t i = 0; i < n; ++i)
         {
-            Exception e;
-            e.what(errno, "tsemfifo<T>::_put()");
-            throw e;
+            if (sem_post(&_full_sem) == -1)
+            {
+                Exception e;
+                e.what(errno, "tsemfifo<T>::_emplace_n()");
+                throw e;
+            }
         }
     }
 
@@ -473,6 +541,50 @@ namespace matrix
 
     template<class T>
     bool matrix::tsemfifo<T>::put(T &obj)
+    {
+        return emplace([&obj](T &slot) { slot = obj; });
+    }
+
+/**
+ * As put(T &), but moves 'obj' into the buffer instead of copying
+ * it. What is left in 'obj' depends on T's move assignment; for a
+ * GenericBuffer it is the slot's previous buffer, ready for reuse.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::put(T &&obj)
+    {
+        return emplace([&obj](T &slot) { slot = std::move(obj); });
+    }
+
+/**
+ * Places a new value at the tail of the FIFO by writing it directly
+ * into the slot, blocking if the buffer is full. The slot still holds
+ * whatever value last passed through it, so a T that owns memory
+ * (std::string, GenericBuffer) can usually be refilled without an
+ * allocation, and the value is copied only once, from its source
+ * into the FIFO:
+ *
+ *     fifo.emplace([&](GenericBuffer &slot)
+ *                  {
+ *                      slot.resize(size);
+ *                      memcpy(slot.data(), data, size);
+ *                  });
+ *
+ * 'fill' is called with the FIFO locked, so it should not do more
+ * than fill in the slot.
+ *
+ * @param fill: A callable taking a T &.
+ *
+ * @return true if the put succeeds, false if the FIFO was released
+ * while waiting.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    bool matrix::tsemfifo<T>::emplace(F fill)
     {
         int r;
 
@@ -483,7 +595,7 @@ namespace matrix
             if (r == -1 && errno != EINTR)
             {
                 Exception e;
-                e.what(errno, "tsemfifo<T>::put()");
+                e.what(errno, "tsemfifo<T>::emplace()");
                 throw e;
             }
         }
@@ -494,7 +606,8 @@ namespace matrix
             return false;
         }
 
-        _put(obj);
+        auto f = [&fill](T &slot, size_t) { fill(slot); };
+        _emplace_n(1, f);
         return true;
     }
 
@@ -515,6 +628,35 @@ namespace matrix
 
     template<class T>
     bool matrix::tsemfifo<T>::try_put(T &obj)
+    {
+        return try_emplace([&obj](T &slot) { slot = obj; });
+    }
+
+/**
+ * As try_put(T &), but moves 'obj' into the buffer. 'obj' is left
+ * alone if the FIFO is full.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::try_put(T &&obj)
+    {
+        return try_emplace([&obj](T &slot) { slot = std::move(obj); });
+    }
+
+/**
+ * The non-blocking form of emplace(): if the buffer is full it
+ * returns false at once, without calling 'fill'.
+ *
+ * @param fill: A callable taking a T &.
+ *
+ * @return true on success, false if the queue is full.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    bool matrix::tsemfifo<T>::try_emplace(F fill)
     {
         if (sem_trywait(&_empty_sem) == -1)
         {
@@ -524,12 +666,13 @@ namespace matrix
             }
 
             Exception e;
-            e.what(errno, "tsemfifo<T>::try_put()");
+            e.what(errno, "tsemfifo<T>::try_emplace()");
 
             throw e;
         }
 
-        _put(obj);
+        auto f = [&fill](T &slot, size_t) { fill(slot); };
+        _emplace_n(1, f);
         return true;
     }
 
@@ -569,7 +712,8 @@ namespace matrix
             throw e;
         }
 
-        _put(obj);
+        auto f = [&obj](T &slot, size_t) { slot = obj; };
+        _emplace_n(1, f);
         return true;
     }
 
@@ -583,14 +727,49 @@ namespace matrix
 
     template<class T>
     unsigned int matrix::tsemfifo<T>::put_no_block(T &obj)
+    {
+        return emplace_no_block([&obj](T &slot) { slot = obj; });
+    }
+
+/**
+ * As put_no_block(T &), but moves 'obj' into the buffer.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::tsemfifo<T>::put_no_block(T &&obj)
+    {
+        return emplace_no_block([&obj](T &slot) { slot = std::move(obj); });
+    }
+
+/**
+ * The emplace() counterpart of put_no_block(): does not block, and
+ * bumps off the oldest entry if the fifo is full.
+ *
+ * @param fill: A callable taking a T &.
+ *
+ * @return The number of objects dropped. Normally this is the number
+ * of old ones bumped off; but if the consumer holds the only free
+ * slot (see get_ref()) the new value is dropped instead, and counted.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    unsigned int matrix::tsemfifo<T>::emplace_no_block(F fill)
     {
         unsigned int flushed(0);
 
-        // try_put() will fail and return 'false' if the fifo is full. In
-        // that case, flush the oldest ojbect, and this should provide
-        // enough room to put the object.
-        while (!try_put(obj))
+        // try_emplace() will fail and return 'false' if the fifo is
+        // full. In that case, flush the oldest ojbect, and this should
+        // provide enough room to put the object.
+        while (!try_emplace(fill))
         {
+            if (size() == 0)
+            {
+                return flushed + 1;
+            }
+
             flush(1);
             ++flushed;
         }
@@ -598,6 +777,217 @@ namespace matrix
         return flushed;
     }
 
+/**
+ * This private helper decrements 'sem' up to 'n' times without
+ * blocking. sem_trywait() is an atomic operation that does not enter
+ * the kernel, so this is cheap.
+ *
+ * @param sem: The semaphore, '_full_sem' or '_empty_sem'.
+ *
+ * @param n: The most to take.
+ *
+ * @return The number actually taken.
+ *
+ */
+
+    template<class T>
+    size_t matrix::tsemfifo<T>::_trywait_n(sem_t *sem, size_t n)
+    {
+        size_t i;
+
+        for (i = 0; i < n; ++i)
+        {
+            if (sem_trywait(sem) == -1)
+            {
+                if (errno == EAGAIN)
+                {
+                    break;
+                }
+
+                Exception e;
+                e.what(errno, "tsemfifo<T>::_trywait_n()");
+                throw e;
+            }
+        }
+
+        return i;
+    }
+
+/**
+ * Puts 'n' objects at the tail of the FIFO, blocking as needed until
+ * all are in. Each time it must wait, it waits for one free slot and
+ * then takes as many more as are free without waiting.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return The number of objects put. This is 'n' unless the FIFO was
+ * released while waiting.
+ *
+ */
+
+    template<class T>
+    size_t matrix::tsemfifo<T>::put_n(T *objs, size_t n)
+    {
+        return emplace_n(n, [objs](T &slot, size_t i) { slot = objs[i]; });
+    }
+
+/**
+ * The batch form of emplace(): places 'n' new values, calling
+ * 'fill(slot, i)' to write the i'th one, blocking as needed until
+ * all are in.
+ *
+ * @param n: How many.
+ *
+ * @param fill: A callable taking (T &, size_t).
+ *
+ * @return The number of values put. This is 'n' unless the FIFO was
+ * released while waiting.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    size_t matrix::tsemfifo<T>::emplace_n(size_t n, F fill)
+    {
+        size_t done = 0;
+
+        while (done < n)
+        {
+            int r;
+
+            do
+            {
+                r = sem_wait(&_empty_sem);
+
+                if (r == -1 && errno != EINTR)
+                {
+                    Exception e;
+                    e.what(errno, "tsemfifo<T>::emplace_n()");
+                    throw e;
+                }
+            }
+            while (r == -1 && errno != EDEADLK);
+
+            if (_release.wait(true, 0))
+            {
+                break;
+            }
+
+            size_t k = 1 + _trywait_n(&_empty_sem, n - done - 1);
+            auto f = [&fill, done](T &slot, size_t i) { fill(slot, done + i); };
+            _emplace_n(k, f);
+            done += k;
+        }
+
+        return done;
+    }
+
+/**
+ * Puts as many of 'n' objects as there is room for, without blocking.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return The number of objects put, counting from the first.
+ *
+ */
+
+    template<class T>
+    size_t matrix::tsemfifo<T>::try_put_n(T *objs, size_t n)
+    {
+        return try_emplace_n(n, [objs](T &slot, size_t i) { slot = objs[i]; });
+    }
+
+/**
+ * Places as many of 'n' new values as there is room for, without
+ * blocking. See emplace_n().
+ *
+ * @return The number of values put, counting from the first.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    size_t matrix::tsemfifo<T>::try_emplace_n(size_t n, F fill)
+    {
+        size_t k = _trywait_n(&_empty_sem, n);
+
+        if (k)
+        {
+            _emplace_n(k, fill);
+        }
+
+        return k;
+    }
+
+/**
+ * Puts 'n' objects without blocking, bumping off the oldest entries
+ * as needed to make room. If 'n' exceeds the FIFO's capacity only
+ * the newest objects are kept.
+ *
+ * @param objs: The objects to put (copy) into the buffer.
+ *
+ * @param n: How many.
+ *
+ * @return The number of objects, old or new, dropped.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::tsemfifo<T>::put_n_no_block(T *objs, size_t n)
+    {
+        return emplace_n_no_block(n, [objs](T &slot, size_t i) { slot = objs[i]; });
+    }
+
+/**
+ * The emplace() counterpart of put_n_no_block(). See emplace_n().
+ *
+ * @return The number of values, old or new, dropped.
+ *
+ */
+
+    template<class T>
+    template<typename F>
+    unsigned int matrix::tsemfifo<T>::emplace_n_no_block(size_t n, F fill)
+    {
+        unsigned int flushed(0);
+        size_t first = 0;
+
+        if (n > _buf_len)
+        {
+            flushed = n - _buf_len;
+            first = flushed;
+            n = _buf_len;
+        }
+
+        size_t done = 0;
+        auto f = [&fill, &first, &done](T &slot, size_t i) { fill(slot, first + done + i); };
+
+        done += try_emplace_n(n, f);
+
+        while (done < n)
+        {
+            unsigned int drop = n - done;
+
+            // Nothing to bump off: the consumer holds the free slots
+            // (see get_ref()), so the rest of the new values go.
+            if (size() == 0)
+            {
+                flushed += drop;
+                break;
+            }
+
+            flush(drop);
+            flushed += drop;
+            done += try_emplace_n(n - done, f);
+        }
+
+        return flushed;
+    }
+
 /**
  * This private helper function actually does the manipulatio of the
  * FIFO to retrieve an object for get() and try_get() once these have
@@ -613,7 +1003,7 @@ namespace matrix
         matrix::ThreadLock<matrix::Mutex> l(_critical_section);
 
         l.lock();
-        obj = _buffer[_head];
+        obj = std::move(_buffer[_head]);
 
         if (_head < (_buf_len - 1))
         {
@@ -656,20 +1046,23 @@ namespace matrix
     template<class T>
     bool matrix::tsemfifo<T>::get(T &obj)
     {
-        int r;
+        int r = 0;
 
-        do
+        if (!_spin_full(-1))
         {
-            r = sem_wait(&_full_sem);
-
-            if (r == -1 && errno != EINTR)
+            do
             {
-                Exception e;
-                e.what(errno, "tsemfifo<T>::get()");
-                throw e;
+                r = sem_wait(&_full_sem);
+
+                if (r == -1 && errno != EINTR)
+                {
+                    Exception e;
+                    e.what(errno, "tsemfifo<T>::get()");
+                    throw e;
+                }
             }
+            while (r == -1 && errno != EDEADLK);
         }
-        while (r == -1 && errno != EDEADLK);
 
         if (_release.wait(true, 0))
         {
@@ -733,7 +1126,7 @@ namespace matrix
 
         Time::time2timespec(Time::getUTC(CLOCK_REALTIME) + time_out, ts);
 
-        if (sem_timedwait(&_full_sem, &ts) == -1)
+        if (!_spin_full(time_out) && sem_timedwait(&_full_sem, &ts) == -1)
         {
             if (errno == ETIMEDOUT)
             {
@@ -750,6 +1143,345 @@ namespace matrix
     }
 
 
+/**
+ * This private helper removes 'n' objects from the head of the FIFO
+ * under one lock, once the caller has taken 'n' counts of
+ * '_full_sem'.
+ *
+ * @param objs: where the FIFO objects are copied to.
+ *
+ * @param n: How many.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::_get_n(T *objs, size_t n)
+    {
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+        l.lock();
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            objs[i] = std::move(_buffer[_head]);
+            _head = (_head < (_buf_len - 1)) ? _head + 1 : 0;
+        }
+
+        _objects -= n;
+        l.unlock();
+
+        if (!_objects)               // Was not empty, now empty.  Set empty event.
+        {
+            _empty.broadcast(true);
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (sem_post(&_empty_sem) == -1)
+            {
+                Exception e;
+                e.what(errno, "tsemfifo<T>::_get_n()");
+                throw e;
+            }
+        }
+    }
+
+/**
+ * Gets up to 'max' values out of the head of the FIFO. Waits for the
+ * first one as specified by 'time_out', then takes as many more as
+ * are already there, up to 'max', without waiting.
+ *
+ * @param objs: where the FIFO objects are copied to. Must have room
+ * for 'max' objects.
+ *
+ * @param max: The most objects to get.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If negative (the default), wait indefinitely; if
+ * 0, don't wait at all.
+ *
+ * @return The number of objects copied to 'objs'. 0 means the wait
+ * timed out, or the FIFO was released.
+ *
+ */
+
+    template<class T>
+    size_t matrix::tsemfifo<T>::get_n(T *objs, size_t max, Time::Time_t time_out)
+    {
+        if (max == 0)
+        {
+            return 0;
+        }
+
+        // Time_t is unsigned: the default of -1 comes in as its
+        // largest value.
+        if (static_cast<int64_t>(time_out) < 0)
+        {
+            int r;
+
+            if (!_spin_full(time_out))
+            {
+                do
+                {
+                    r = sem_wait(&_full_sem);
+
+                    if (r == -1 && errno != EINTR)
+                    {
+                        Exception e;
+                        e.what(errno, "tsemfifo<T>::get_n()");
+                        throw e;
+                    }
+                }
+                while (r == -1 && errno != EDEADLK);
+            }
+
+            if (_release.wait(true, 0))
+            {
+                return 0;
+            }
+        }
+        else if (time_out == 0)
+        {
+            if (_trywait_n(&_full_sem, 1) == 0)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            timespec ts;
+
+            Time::time2timespec(Time::getUTC(CLOCK_REALTIME) + time_out, ts);
+
+            if (!_spin_full(time_out) && sem_timedwait(&_full_sem, &ts) == -1)
+            {
+                if (errno == ETIMEDOUT)
+                {
+                    return 0;
+                }
+
+                Exception e;
+                e.what(errno, "tsemfifo<T>::get_n()");
+                throw e;
+            }
+        }
+
+        size_t k = 1 + _trywait_n(&_full_sem, max - 1);
+        _get_n(objs, k);
+        return k;
+    }
+
+/**
+ * This private helper spins on '_full_sem' as the wait strategy
+ * directs, taking a count of it if one turns up. The spin only reads
+ * the semaphore's value, so it does not bounce the cache line with
+ * the producer until there is something to take.
+ *
+ * @param time_out: nano seconds to wait, negative to wait indefinitely.
+ *
+ * @return true if a count was taken, false if the caller must wait
+ * for one the usual way.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::_spin_full(Time::Time_t time_out)
+    {
+        return _waits.spin([this]()
+                           {
+                               int v;
+                               sem_getvalue(&_full_sem, &v);
+                               return v > 0 && sem_trywait(&_full_sem) == 0;
+                           }, time_out);
+    }
+
+/**
+ * This private helper takes one count of '_full_sem', waiting for it
+ * as directed by 'time_out'.
+ *
+ * @param time_out: nano seconds to wait. If 0, don't wait at all; if
+ * negative, wait indefinitely.
+ *
+ * @return true if there is now an object to get, false if the wait
+ * timed out or the FIFO was released.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::_wait_full(Time::Time_t time_out)
+    {
+        if (time_out == 0)
+        {
+            return _trywait_n(&_full_sem, 1) == 1;
+        }
+
+        if (static_cast<int64_t>(time_out) < 0)
+        {
+            int r;
+
+            if (!_spin_full(time_out))
+            {
+                do
+                {
+                    r = sem_wait(&_full_sem);
+
+                    if (r == -1 && errno != EINTR)
+                    {
+                        Exception e;
+                        e.what(errno, "tsemfifo<T>::_wait_full()");
+                        throw e;
+                    }
+                }
+                while (r == -1 && errno != EDEADLK);
+            }
+
+            return !_release.wait(true, 0);
+        }
+
+        timespec ts;
+
+        Time::time2timespec(Time::getUTC(CLOCK_REALTIME) + time_out, ts);
+
+        if (!_spin_full(time_out) && sem_timedwait(&_full_sem, &ts) == -1)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                return false;
+            }
+
+            Exception e;
+            e.what(errno, "tsemfifo<T>::_wait_full()");
+            throw e;
+        }
+
+        return true;
+    }
+
+/**
+ * Gets the newest value in the FIFO, discarding any older ones, all
+ * under one lock. For a consumer that only wants the current value
+ * this replaces a 'flush(-1)' followed by a 'get()', between which
+ * more values may arrive.
+ *
+ * @param obj: object to which the newest value will be copied to.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If 0, don't wait at all; if negative, wait
+ * indefinitely.
+ *
+ * @param skipped: Set to the number of older values discarded.
+ *
+ * @return true if there was a value, false if the wait timed out or
+ * the FIFO was released.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::get_latest(T &obj, Time::Time_t time_out, size_t &skipped)
+    {
+        skipped = 0;
+
+        if (!_wait_full(time_out))
+        {
+            return false;
+        }
+
+        size_t k = 1 + _trywait_n(&_full_sem, _buf_len);
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+        l.lock();
+        _head = (_head + k - 1) % _buf_len;
+        obj = std::move(_buffer[_head]);
+        _head = (_head < (_buf_len - 1)) ? _head + 1 : 0;
+        _objects -= k;
+        l.unlock();
+
+        if (!_objects)               // Was not empty, now empty.  Set empty event.
+        {
+            _empty.broadcast(true);
+        }
+
+        for (size_t i = 0; i < k; ++i)
+        {
+            if (sem_post(&_empty_sem) == -1)
+            {
+                Exception e;
+                e.what(errno, "tsemfifo<T>::get_latest()");
+                throw e;
+            }
+        }
+
+        skipped = k - 1;
+        return true;
+    }
+
+/**
+ * Takes the value at the head of the FIFO without copying it out:
+ * returns a pointer to it in its slot. The slot is not reused until
+ * release_ref() is called, so the caller may read (or swap out) the
+ * value in place in the meantime:
+ *
+ *     GenericBuffer *buf = fifo.get_ref(1000000);
+ *
+ *     if (buf)
+ *     {
+ *         fwrite(buf->data(), 1, buf->size(), f);
+ *         fifo.release_ref();
+ *     }
+ *
+ * While a reference is held the FIFO has one less free slot. Each
+ * get_ref() must be matched by a release_ref() before the next one,
+ * and before the FIFO is flushed.
+ *
+ * @param time_out: The time, in nano seconds, to wait for the FIFO to
+ * become not empty. If 0, don't wait at all; if negative, wait
+ * indefinitely.
+ *
+ * @return A pointer to the value, or nullptr if the wait timed out.
+ *
+ */
+
+    template<class T>
+    T *matrix::tsemfifo<T>::get_ref(Time::Time_t time_out)
+    {
+        if (!_wait_full(time_out))
+        {
+            return nullptr;
+        }
+
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+        l.lock();
+        T *obj = &_buffer[_head];
+        _head = (_head < (_buf_len - 1)) ? _head + 1 : 0;
+        --_objects;
+        l.unlock();
+
+        if (!_objects)               // Was not empty, now empty.  Set empty event.
+        {
+            _empty.broadcast(true);
+        }
+
+        return obj;
+    }
+
+/**
+ * Gives back the slot of the value taken by get_ref(), so that it may
+ * be filled again.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::release_ref()
+    {
+        if (sem_post(&_empty_sem) == -1)
+        {
+            Exception e;
+            e.what(errno, "tsemfifo<T>::release_ref()");
+            throw e;
+        }
+    }
+
 /**
  * If any thread is waiting on get() or put(), this will release them.
  * The queue should not be used after this call unless the next call is
@@ -822,6 +1554,21 @@ namespace matrix
         l.lock();
         _notifier = n;
     }
+
+/**
+ * Sets how the consumer waits when the FIFO is empty. This should be
+ * done before the consumer starts, as the strategy is read without a
+ * lock.
+ *
+ * @param w: The wait_strategy. The default is wait_strategy::block().
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::set_wait_strategy(wait_strategy w)
+    {
+        _waits = w;
+    }
 };
 
 #endif  // _MATRIX_TSEMFIFO_H_
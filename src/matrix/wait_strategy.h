@@ -0,0 +1,206 @@
+/*******************************************************************
+ *  wait_strategy.h - How a consumer waits on an empty FIFO: by
+ *  blocking, by spinning a while first, or by busy polling.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_MATRIX_WAIT_STRATEGY_H_)
+#define _MATRIX_WAIT_STRATEGY_H_
+
+#include "matrix/Time.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+namespace matrix
+{
+/**
+ * Tells the CPU that the caller is spinning, so that it may save power
+ * and give way to a hyperthread sibling ('pause' on x86, 'yield' on
+ * ARM).
+ *
+ */
+
+    inline void cpu_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield" ::: "memory");
+#else
+        asm volatile("" ::: "memory");
+#endif
+    }
+
+/**
+ * Pins the calling thread to one CPU. Together with a busy polling
+ * wait_strategy this gives a consumer a core of its own; call it first
+ * thing in the consumer's thread, or from the hook given to
+ * ThreadBase::set_thread_create_hook() if every thread created is to
+ * run there.
+ *
+ * @param cpu: The CPU number.
+ *
+ * @return true if the thread is now pinned, false otherwise.
+ *
+ */
+
+    inline bool pin_this_thread(int cpu)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+    }
+
+/**
+ * \class wait_strategy
+ *
+ * How 'get()', 'timed_get()' and their relatives wait when the FIFO is
+ * empty:
+ *
+ *  - BLOCK (the default) sleeps in the kernel at once. This costs no
+ *    CPU, but each wakeup costs the producer a system call and the
+ *    consumer a few microseconds of scheduling latency.
+ *
+ *  - SPIN_THEN_BLOCK polls the FIFO up to 'spins' times, with a
+ *    'pause' in between, before going to sleep. At high rates the
+ *    next value usually arrives while spinning, and then neither side
+ *    enters the kernel.
+ *
+ *  - BUSY_POLL never sleeps. It trades a core for the lowest latency,
+ *    and is best paired with a consumer thread pinned to a core of its
+ *    own (see 'pin_this_thread()').
+ *
+ * Time-outs are honored in every case; a busy poll looks at the clock
+ * every 'CLOCK_CHECK' spins.
+ *
+ *     DataSink<double> sink(km_urn, 100);
+ *     sink.set_wait_strategy(wait_strategy::spin_then_block(2000));
+ *
+ */
+
+    struct wait_strategy
+    {
+        enum mode
+        {
+            BLOCK,
+            SPIN_THEN_BLOCK,
+            BUSY_POLL
+        };
+
+        enum
+        {
+            DEFAULT_SPINS = 1000,
+            CLOCK_CHECK = 64
+        };
+
+        mode how;
+        unsigned int spins;
+
+        wait_strategy(mode m = BLOCK, unsigned int s = DEFAULT_SPINS)
+            : how(m),
+              spins(s)
+        {
+        }
+
+        static wait_strategy block()
+        {
+            return wait_strategy(BLOCK, 0);
+        }
+
+        static wait_strategy spin_then_block(unsigned int s = DEFAULT_SPINS)
+        {
+            return wait_strategy(SPIN_THEN_BLOCK, s);
+        }
+
+        static wait_strategy busy_poll()
+        {
+            return wait_strategy(BUSY_POLL, 0);
+        }
+
+/**
+ * Spins on 'ready' as the strategy directs. A FIFO calls this before
+ * it blocks, and blocks only if this returns false and the strategy
+ * is not BUSY_POLL.
+ *
+ * @param ready: A callable returning true once the wait is over. It
+ * should be cheap, a load or two.
+ *
+ * @param time_out: nanoseconds to wait, negative to wait
+ * indefinitely. Only a busy poll waits that long.
+ *
+ * @return true if 'ready' returned true, false otherwise.
+ *
+ */
+
+        template<typename F>
+        bool spin(F ready, Time::Time_t time_out) const
+        {
+            if (how == BLOCK)
+            {
+                return false;
+            }
+
+            if (how == SPIN_THEN_BLOCK)
+            {
+                for (unsigned int i = 0; i < spins; ++i)
+                {
+                    if (ready())
+                    {
+                        return true;
+                    }
+
+                    cpu_relax();
+                }
+
+                return ready();
+            }
+
+            bool forever = static_cast<int64_t>(time_out) < 0;
+            Time::Time_t deadline = forever ? 0 : Time::getUTC() + time_out;
+
+            for (unsigned int i = 1; ; ++i)
+            {
+                if (ready())
+                {
+                    return true;
+                }
+
+                if (!forever && i % CLOCK_CHECK == 0 && Time::getUTC() >= deadline)
+                {
+                    return ready();
+                }
+
+                cpu_relax();
+            }
+        }
+    };
+
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*******************************************************************
+ *  yaml_msgpack.h - MessagePack encoding of YAML nodes and
+ *  yaml_results, the Keymaster's binary wire format.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_YAML_MSGPACK_H_)
+#define _YAML_MSGPACK_H_
+
+#include "matrix/yaml_util.h"
+
+#include <msgpack.hpp>
+#include <string>
+#include <yaml-cpp/yaml.h>
+
+namespace mxutils
+{
+    /**
+     * Encodes YAML nodes as MessagePack, and back, so that the
+     * Keymaster and its clients need not emit and parse YAML text for
+     * every request, reply and publication.
+     *
+     * Maps become msgpack maps, sequences arrays, and null nodes nil.
+     * Scalars are sent as strings, exactly as the YAML text would
+     * carry them, so that 'as<T>()' on the decoded node behaves as it
+     * does on one loaded from YAML. When decoding, msgpack booleans,
+     * integers and floats (from a client that sends native types) are
+     * turned into the equivalent scalars.
+     *
+     * Example:
+     *
+     *     std::string buf = to_msgpack(YAML::Load("{a: 1, b: [x, y]}"));
+     *     YAML::Node n = node_from_msgpack(buf);
+     *     int a = n["a"].as<int>();
+     *
+     */
+
+    std::string to_msgpack(const YAML::Node &n);
+    YAML::Node node_from_msgpack(const std::string &buf);
+
+    std::string to_msgpack(const yaml_result &yr);
+    std::string to_msgpack(const yaml_result &yr, const std::string &packed_node);
+    bool result_from_msgpack(const std::string &buf, yaml_result &yr);
+
+    bool msgpack_scalar(const msgpack::object &o, std::string &s);
+}
+
+#endif
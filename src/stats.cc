@@ -0,0 +1,288 @@
+/*******************************************************************
+ *  stats.cc - Low overhead counters and latency histograms for the
+ *  DataSources and DataSinks, and a reporter that publishes them to
+ *  the Keymaster.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/stats.h"
+#include "matrix/Keymaster.h"
+#include "matrix/Thread.h"
+#include "matrix/TCondition.h"
+#include "matrix/ThreadLock.h"
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+using namespace std;
+
+namespace matrix
+{
+/**
+ * Summarizes the values recorded since the last call, and clears the
+ * histogram. Values recorded while this runs are counted in this
+ * summary or the next, never lost.
+ *
+ * @return The number of values, their median, 99th percentile and
+ * maximum, in nanoseconds.
+ *
+ */
+
+    latency_histogram::summary latency_histogram::take()
+    {
+        static thread_local uint64_t counts[BUCKETS];
+        summary s = {0, 0, 0, 0};
+
+        for (size_t i = 0; i < BUCKETS; ++i)
+        {
+            counts[i] = _counts[i].exchange(0, std::memory_order_relaxed);
+            s.count += counts[i];
+        }
+
+        uint64_t seen = 0;
+        uint64_t p50_at = (s.count + 1) / 2;
+        uint64_t p99_at = s.count - s.count / 100;
+
+        for (size_t i = 0; i < BUCKETS; ++i)
+        {
+            if (counts[i] == 0)
+            {
+                continue;
+            }
+
+            if (seen < p50_at && seen + counts[i] >= p50_at)
+            {
+                s.p50 = _value(i);
+            }
+
+            if (seen < p99_at && seen + counts[i] >= p99_at)
+            {
+                s.p99 = _value(i);
+            }
+
+            seen += counts[i];
+            s.max = _value(i);
+        }
+
+        return s;
+    }
+
+/**
+ * Returns a value representative of bucket 'i': its middle.
+ *
+ */
+
+    uint64_t latency_histogram::_value(size_t i)
+    {
+        if (i < SUB_BUCKETS)
+        {
+            return i;
+        }
+
+        size_t e = i / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t width = 1ULL << (e - SUB_BITS);
+        return ((SUB_BUCKETS + i % SUB_BUCKETS) << (e - SUB_BITS)) + width / 2;
+    }
+
+/**
+ * Converts a summary to a YAML map, the durations in microseconds.
+ *
+ */
+
+    YAML::Node latency_histogram::to_yaml(const summary &s)
+    {
+        YAML::Node n;
+        n["count"] = s.count;
+        n["p50_us"] = s.p50 / 1000.0;
+        n["p99_us"] = s.p99 / 1000.0;
+        n["max_us"] = s.max / 1000.0;
+        return n;
+    }
+
+    namespace
+    {
+        class reporter
+        {
+        public:
+
+            static reporter &instance()
+            {
+                static reporter r;
+                return r;
+            }
+
+            reporter()
+                : interval(Time::TM_ONE_SEC),
+                  next_id(0),
+                  active(false),
+                  quit(false),
+                  thread(this, &reporter::run)
+            {
+            }
+
+            ~reporter()
+            {
+                quit.signal(true);
+                thread.stop_without_cancel();
+            }
+
+            // The thread ends by itself once there is nothing left to
+            // report; 'active' tells whether it has, so that it can be
+            // reaped and started again here.
+            int add(string km_urn, string key, stats_reporter::report_fn f)
+            {
+                ThreadLock<Mutex> l(lock);
+                l.lock();
+                int id = next_id++;
+                entries[id] = make_tuple(km_urn, key, f);
+
+                if (!active)
+                {
+                    thread.stop_without_cancel();
+                    quit.set_value(false);
+                    active = true;
+                    thread.start("stats_reporter");
+                }
+
+                return id;
+            }
+
+            void remove(int id)
+            {
+                ThreadLock<Mutex> l(lock);
+                l.lock();
+                entries.erase(id);
+            }
+
+            // Calls the report functions with the lock held, so that
+            // 'remove()' waits for one that is running; the puts,
+            // which may be slow, are done after it is released.
+            void run()
+            {
+                map<string, shared_ptr<Keymaster> > keymasters;
+
+                while (!quit.wait(true, (int)(interval / 1000)))
+                {
+                    vector<tuple<string, string, YAML::Node> > reports;
+                    ThreadLock<Mutex> l(lock);
+                    l.lock();
+
+                    if (entries.empty())
+                    {
+                        active = false;
+                        break;
+                    }
+
+                    for (auto &e : entries)
+                    {
+                        reports.push_back(make_tuple(get<0>(e.second), get<1>(e.second),
+                                                     get<2>(e.second)()));
+                    }
+
+                    l.unlock();
+
+                    for (auto &r : reports)
+                    {
+                        try
+                        {
+                            shared_ptr<Keymaster> &km = keymasters[get<0>(r)];
+
+                            if (!km)
+                            {
+                                km.reset(new Keymaster(get<0>(r)));
+                            }
+
+                            km->put(get<1>(r), get<2>(r), true);
+                        }
+                        catch (exception &e)
+                        {
+                            // the Keymaster may be gone; try again next time.
+                            keymasters.erase(get<0>(r));
+                        }
+                    }
+                }
+            }
+
+            std::atomic<Time::Time_t> interval;
+            int next_id;
+            bool active;
+            Mutex lock;
+            map<int, tuple<string, string, stats_reporter::report_fn> > entries;
+            TCondition<bool> quit;
+            Thread<reporter> thread;
+        };
+    }
+
+/**
+ * Registers a function that reports statistics, to be put to the
+ * Keymaster at 'km_urn' under 'key' every 'interval()'.
+ *
+ * @param km_urn: The Keymaster to report to.
+ * @param key: The key to report under. Created if need be.
+ * @param f: The function. It is called from the reporter's thread.
+ *
+ * @return An id, to be given to 'remove()'.
+ *
+ */
+
+    int stats_reporter::add(std::string km_urn, std::string key, report_fn f)
+    {
+        return reporter::instance().add(km_urn, key, f);
+    }
+
+/**
+ * Unregisters a function registered with 'add()'. Once this returns
+ * the function will not be called again.
+ *
+ * @param id: The id returned by 'add()'.
+ *
+ */
+
+    void stats_reporter::remove(int id)
+    {
+        reporter::instance().remove(id);
+    }
+
+/**
+ * Sets how often statistics are reported. Takes effect after the
+ * current interval.
+ *
+ * @param interval: The interval, in nanoseconds.
+ *
+ */
+
+    void stats_reporter::set_interval(Time::Time_t interval)
+    {
+        reporter::instance().interval = interval;
+    }
+
+    Time::Time_t stats_reporter::interval()
+    {
+        return reporter::instance().interval;
+    }
+}
@@ -0,0 +1,323 @@
+/*******************************************************************
+ *  yaml_msgpack.cc - MessagePack encoding of YAML nodes and
+ *  yaml_results, the Keymaster's binary wire format.
+ *
+ *  Copyright (C) 2016 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/yaml_msgpack.h"
+
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+using namespace std;
+
+namespace mxutils
+{
+/**
+ * Gives the text a YAML scalar would hold for a MessagePack scalar:
+ * the string itself, or a boolean or number written out.
+ *
+ * @param o: The MessagePack object.
+ *
+ * @param s: Set to the text, if 'o' is a scalar.
+ *
+ * @return true if 'o' is a scalar, false if it is nil, an array or a
+ * map.
+ *
+ */
+
+    bool msgpack_scalar(const msgpack::object &o, string &s)
+    {
+        ostringstream os;
+
+        switch (o.type)
+        {
+        case msgpack::type::STR:
+            s.assign(o.via.str.ptr, o.via.str.size);
+            return true;
+        case msgpack::type::BIN:
+            s.assign(o.via.bin.ptr, o.via.bin.size);
+            return true;
+        case msgpack::type::BOOLEAN:
+            s = o.via.boolean ? "true" : "false";
+            return true;
+        case msgpack::type::POSITIVE_INTEGER:
+            s = to_string(o.via.u64);
+            return true;
+        case msgpack::type::NEGATIVE_INTEGER:
+            s = to_string(o.via.i64);
+            return true;
+        case msgpack::type::FLOAT32:
+        case msgpack::type::FLOAT64:
+            os << setprecision(numeric_limits<double>::max_digits10) << o.via.f64;
+            s = os.str();
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    namespace
+    {
+        typedef msgpack::packer<msgpack::sbuffer> packer_t;
+
+        void pack_string(packer_t &pk, const string &s)
+        {
+            pk.pack_str(s.size());
+            pk.pack_str_body(s.data(), s.size());
+        }
+
+        void pack_node(packer_t &pk, const YAML::Node &n)
+        {
+            switch (n.Type())
+            {
+            case YAML::NodeType::Scalar:
+                pack_string(pk, n.Scalar());
+                break;
+            case YAML::NodeType::Sequence:
+                pk.pack_array(n.size());
+
+                for (YAML::const_iterator i = n.begin(); i != n.end(); ++i)
+                {
+                    pack_node(pk, *i);
+                }
+
+                break;
+            case YAML::NodeType::Map:
+                pk.pack_map(n.size());
+
+                for (YAML::const_iterator i = n.begin(); i != n.end(); ++i)
+                {
+                    pack_node(pk, i->first);
+                    pack_node(pk, i->second);
+                }
+
+                break;
+            default:
+                pk.pack_nil();
+                break;
+            }
+        }
+
+        YAML::Node unpack_node(const msgpack::object &o)
+        {
+            YAML::Node n;
+            string s;
+
+            if (msgpack_scalar(o, s))
+            {
+                return YAML::Node(s);
+            }
+
+            switch (o.type)
+            {
+            case msgpack::type::ARRAY:
+                for (uint32_t i = 0; i < o.via.array.size; ++i)
+                {
+                    n.push_back(unpack_node(o.via.array.ptr[i]));
+                }
+
+                // an empty array is still a sequence.
+                if (o.via.array.size == 0)
+                {
+                    n = YAML::Node(YAML::NodeType::Sequence);
+                }
+
+                break;
+            case msgpack::type::MAP:
+                n = YAML::Node(YAML::NodeType::Map);
+
+                for (uint32_t i = 0; i < o.via.map.size; ++i)
+                {
+                    const msgpack::object_kv &kv = o.via.map.ptr[i];
+
+                    if (msgpack_scalar(kv.key, s))
+                    {
+                        n[s] = unpack_node(kv.val);
+                    }
+                    else
+                    {
+                        n[unpack_node(kv.key)] = unpack_node(kv.val);
+                    }
+                }
+
+                break;
+            default:
+                break;
+            }
+
+            return n;
+        }
+    }
+
+/**
+ * Encodes a YAML node as MessagePack.
+ *
+ * @param n: The node.
+ *
+ * @return A string holding the encoded node.
+ *
+ */
+
+    string to_msgpack(const YAML::Node &n)
+    {
+        msgpack::sbuffer sb;
+        packer_t pk(sb);
+
+        pack_node(pk, n);
+        return string(sb.data(), sb.size());
+    }
+
+/**
+ * Decodes a YAML node encoded by 'to_msgpack()', or any MessagePack
+ * value.
+ *
+ * @param buf: The encoded node.
+ *
+ * @return The node. Throws msgpack::unpack_error (a
+ * std::runtime_error) if 'buf' is not MessagePack.
+ *
+ */
+
+    YAML::Node node_from_msgpack(const string &buf)
+    {
+        msgpack::object_handle oh = msgpack::unpack(buf.data(), buf.size());
+        return unpack_node(oh.get());
+    }
+
+/**
+ * Encodes a `yaml_result` as a MessagePack map with the same four
+ * fields as its YAML form: result, key, err and node.
+ *
+ * @param yr: The `yaml_result`.
+ *
+ * @return A string holding the encoded result.
+ *
+ */
+
+    string to_msgpack(const yaml_result &yr)
+    {
+        return to_msgpack(yr, to_msgpack(yr.node));
+    }
+
+/**
+ * Encodes a `yaml_result` whose node is already encoded; its own
+ * 'node' is ignored. MessagePack values simply follow one another, so
+ * the node's encoding is copied in as it is.
+ *
+ * @param yr: The `yaml_result`.
+ *
+ * @param packed_node: The node, as MessagePack.
+ *
+ * @return A string holding the encoded result.
+ *
+ */
+
+    string to_msgpack(const yaml_result &yr, const string &packed_node)
+    {
+        msgpack::sbuffer sb;
+        packer_t pk(sb);
+
+        pk.pack_map(4);
+        pack_string(pk, "result");
+        pk.pack(yr.result);
+        pack_string(pk, "key");
+        pack_string(pk, yr.key);
+        pack_string(pk, "err");
+        pack_string(pk, yr.err);
+        pack_string(pk, "node");
+        sb.write(packed_node.data(), packed_node.size());
+        return string(sb.data(), sb.size());
+    }
+
+/**
+ * Decodes a `yaml_result` encoded by 'to_msgpack()'.
+ *
+ * @param buf: The encoded result.
+ *
+ * @param yr: The `yaml_result`, set if 'buf' holds one.
+ *
+ * @return true if 'buf' held an encoded `yaml_result`, false
+ * otherwise. Anything else, such as a text reply from a server that
+ * does not speak MessagePack, gives false.
+ *
+ */
+
+    bool result_from_msgpack(const string &buf, yaml_result &yr)
+    {
+        try
+        {
+            msgpack::object_handle oh = msgpack::unpack(buf.data(), buf.size());
+            const msgpack::object &o = oh.get();
+            int found = 0;
+
+            if (o.type != msgpack::type::MAP)
+            {
+                return false;
+            }
+
+            for (uint32_t i = 0; i < o.via.map.size; ++i)
+            {
+                const msgpack::object_kv &kv = o.via.map.ptr[i];
+                string field, val;
+
+                if (kv.key.type != msgpack::type::STR)
+                {
+                    continue;
+                }
+
+                field.assign(kv.key.via.str.ptr, kv.key.via.str.size);
+
+                if (field == "result" && kv.val.type == msgpack::type::BOOLEAN)
+                {
+                    yr.result = kv.val.via.boolean;
+                    ++found;
+                }
+                else if (field == "key" && msgpack_scalar(kv.val, val))
+                {
+                    yr.key = val;
+                    ++found;
+                }
+                else if (field == "err" && msgpack_scalar(kv.val, val))
+                {
+                    yr.err = val;
+                    ++found;
+                }
+                else if (field == "node")
+                {
+                    yr.node = unpack_node(kv.val);
+                    ++found;
+                }
+            }
+
+            return found == 4;
+        }
+        catch (std::exception &e)
+        {
+            return false;
+        }
+    }
+}
@@ -27,6 +27,14 @@
 
 #include "TSemfifoTest.h"
 #include "matrix/tsemfifo.h"
+#include "matrix/spscfifo.h"
+#include "matrix/latestfifo.h"
+#include "matrix/EventPoller.h"
+#include <thread>
+#include <unistd.h>
+
+#include <thread>
+#include <unistd.h>
 
 using namespace std;
 using namespace Time;
@@ -156,3 +164,397 @@ void TSemfifoTest::test_flush()
     fifo.flush(100);
     CPPUNIT_ASSERT(fifo.size() == 0);
 }
+
+void TSemfifoTest::test_batch()
+{
+    int in[25], out[25];
+    tsemfifo<int> fifo(10);
+
+    for (int i = 0; i < 25; ++i)
+    {
+        in[i] = i;
+    }
+
+    // only 10 fit.
+    CPPUNIT_ASSERT(fifo.try_put_n(in, 25) == 10);
+    CPPUNIT_ASSERT(fifo.size() == 10);
+    CPPUNIT_ASSERT(fifo.get_n(out, 4, 0) == 4);
+    CPPUNIT_ASSERT(out[0] == 0 && out[3] == 3);
+    CPPUNIT_ASSERT(fifo.get_n(out, 25, 0) == 6);
+    CPPUNIT_ASSERT(out[5] == 9);
+
+    // nothing there: times out.
+    CPPUNIT_ASSERT(fifo.get_n(out, 25, 1000000) == 0);
+
+    // too many for the fifo: only the newest 10 are kept.
+    CPPUNIT_ASSERT(fifo.put_n_no_block(in, 25) == 15);
+    CPPUNIT_ASSERT(fifo.size() == 10);
+    CPPUNIT_ASSERT(fifo.get_n(out, 25) == 10);
+    CPPUNIT_ASSERT(out[0] == 15 && out[9] == 24);
+
+    // bumps off the 3 oldest to make room.
+    CPPUNIT_ASSERT(fifo.put_n(in, 8) == 8);
+    CPPUNIT_ASSERT(fifo.put_n_no_block(in + 8, 5) == 3);
+    CPPUNIT_ASSERT(fifo.get_n(out, 25) == 10);
+    CPPUNIT_ASSERT(out[0] == 3 && out[9] == 12);
+
+    // with the default time-out, waits for something to come.
+    std::thread producer([&fifo]() {int v = 42; usleep(10000); fifo.put_no_block(v);});
+    Time_t start = getUTC();
+    CPPUNIT_ASSERT(fifo.get_n(out, 25) == 1);
+    CPPUNIT_ASSERT(out[0] == 42);
+    CPPUNIT_ASSERT(getUTC() - start >= 5000000);
+    producer.join();
+}
+
+/**
+ * Tests the lock-free spscfifo: it holds exactly what was asked for
+ * even though its storage is a power of two, drops the newest values
+ * when a non-blocking put overflows it, and passes values in order
+ * from one thread to another when both sides block.
+ *
+ */
+
+void TSemfifoTest::test_spscfifo()
+{
+    int in[25], out[25];
+    spscfifo<int> fifo(10);
+
+    for (int i = 0; i < 25; ++i)
+    {
+        in[i] = i;
+    }
+
+    CPPUNIT_ASSERT(fifo.capacity() == 10);
+    CPPUNIT_ASSERT(fifo.try_put_n(in, 25) == 10);
+    CPPUNIT_ASSERT(fifo.size() == 10);
+    CPPUNIT_ASSERT(!fifo.try_put(in[0]));
+    CPPUNIT_ASSERT(fifo.get_n(out, 4, 0) == 4);
+    CPPUNIT_ASSERT(out[0] == 0 && out[3] == 3);
+    CPPUNIT_ASSERT(fifo.flush(-2) == 2);
+    CPPUNIT_ASSERT(fifo.get_n(out, 25, 0) == 2);
+    CPPUNIT_ASSERT(out[0] == 8 && out[1] == 9);
+
+    // nothing there: times out.
+    CPPUNIT_ASSERT(!fifo.timed_get(out[0], 1000000));
+
+    // too many for the fifo: the newest 15 are dropped.
+    CPPUNIT_ASSERT(fifo.put_n_no_block(in, 25) == 15);
+    CPPUNIT_ASSERT(fifo.put_no_block(in[0]) == 1);
+    CPPUNIT_ASSERT(fifo.get_n(out, 25) == 10);
+    CPPUNIT_ASSERT(out[0] == 0 && out[9] == 9);
+
+    // a producer thread that must wait for the consumer.
+    const int N = 100000;
+    std::thread producer([&fifo]()
+                         {
+                             for (int i = 0; i < N; ++i)
+                             {
+                                 fifo.put(i);
+                             }
+                         });
+
+    int expected = 0;
+    bool in_order = true;
+
+    while (expected < N)
+    {
+        size_t n = fifo.get_n(out, 25);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            in_order = in_order && (out[i] == expected++);
+        }
+    }
+
+    producer.join();
+    CPPUNIT_ASSERT(in_order);
+    CPPUNIT_ASSERT(fifo.size() == 0);
+}
+
+/**
+ * Tests the in-place paths: 'emplace()' writes straight into a slot
+ * (reusing the string already there), 'put(T &&)' moves, and
+ * 'get_ref()' / 'release_ref()' read a value where it sits, holding
+ * its slot until it is released.
+ *
+ */
+
+template <typename Q>
+static void in_place(Q &fifo)
+{
+    string s("moved"), *ref;
+
+    CPPUNIT_ASSERT(fifo.emplace([](string &slot) { slot.assign("filled"); }));
+    CPPUNIT_ASSERT(fifo.put(std::move(s)));
+    CPPUNIT_ASSERT(fifo.size() == 2);
+
+    // nothing there: times out.
+    Q empty(2);
+    CPPUNIT_ASSERT(empty.get_ref(1000000) == nullptr);
+
+    ref = fifo.get_ref(0);
+    CPPUNIT_ASSERT(ref && *ref == "filled");
+    // its slot is still taken: only one more fits.
+    CPPUNIT_ASSERT(fifo.emplace_no_block([](string &slot) { slot.assign("a"); }) == 0);
+    CPPUNIT_ASSERT(!fifo.try_emplace([](string &slot) { slot.assign("b"); }));
+    fifo.release_ref();
+
+    ref = fifo.get_ref(1000000);
+    CPPUNIT_ASSERT(ref && *ref == "moved");
+    fifo.release_ref();
+
+    CPPUNIT_ASSERT(fifo.emplace_n(2, [](string &slot, size_t i) { slot.assign(1, 'x' + i); }) == 2);
+    string out[3];
+    CPPUNIT_ASSERT(fifo.get_n(out, 3, 0) == 3);
+    CPPUNIT_ASSERT(out[0] == "a" && out[1] == "x" && out[2] == "y");
+}
+
+void TSemfifoTest::test_in_place()
+{
+    tsemfifo<string> fifo(3);
+    spscfifo<string> sfifo(3);
+
+    in_place(fifo);
+    in_place(sfifo);
+}
+
+/**
+ * Tests latestfifo, which overwrites its oldest values rather than
+ * filling up, and 'get_latest()', which skips to the newest value.
+ *
+ */
+
+void TSemfifoTest::test_latest()
+{
+    int in[25], out[25], val;
+    size_t skipped;
+    latestfifo<int> fifo(10);
+
+    for (int i = 0; i < 25; ++i)
+    {
+        in[i] = i;
+    }
+
+    // a full latestfifo still takes values, overwriting the oldest.
+    CPPUNIT_ASSERT(fifo.put_n_no_block(in, 8) == 0);
+    CPPUNIT_ASSERT(fifo.put_n_no_block(in + 8, 5) == 3);
+    CPPUNIT_ASSERT(fifo.put_no_block(in[13]) == 1);
+    CPPUNIT_ASSERT(fifo.size() == 10);
+    CPPUNIT_ASSERT(fifo.get_n(out, 2, 0) == 2);
+    CPPUNIT_ASSERT(out[0] == 4 && out[1] == 5);
+
+    CPPUNIT_ASSERT(fifo.get_latest(val, 0, skipped));
+    CPPUNIT_ASSERT(val == 13 && skipped == 7);
+    CPPUNIT_ASSERT(fifo.size() == 0);
+    CPPUNIT_ASSERT(!fifo.get_latest(val, 1000000, skipped));
+
+    // too many for the fifo: only the newest 10 are kept.
+    CPPUNIT_ASSERT(fifo.put_n_no_block(in, 25) == 15);
+    CPPUNIT_ASSERT(fifo.get_n(out, 25) == 10);
+    CPPUNIT_ASSERT(out[0] == 15 && out[9] == 24);
+
+    // a held value is left alone while the others are overwritten.
+    latestfifo<int> one(1);
+    int *ref;
+
+    one.put(in[1]);
+    ref = one.get_ref(0);
+    CPPUNIT_ASSERT(ref && *ref == 1);
+    CPPUNIT_ASSERT(one.put_no_block(in[2]) == 0);
+    CPPUNIT_ASSERT(one.put_no_block(in[3]) == 1);
+    CPPUNIT_ASSERT(*ref == 1);
+    one.release_ref();
+    CPPUNIT_ASSERT(one.get(val) && val == 3);
+
+    // tsemfifo does the same in one step.
+    tsemfifo<int> tfifo(10);
+
+    tfifo.put_n(in, 6);
+    CPPUNIT_ASSERT(tfifo.get_latest(val, 0, skipped));
+    CPPUNIT_ASSERT(val == 5 && skipped == 5);
+    CPPUNIT_ASSERT(tfifo.size() == 0);
+    CPPUNIT_ASSERT(tfifo.try_put_n(in, 25) == 10);
+
+    // and so does spscfifo.
+    spscfifo<int> sfifo(10);
+
+    sfifo.put_n(in, 6);
+    CPPUNIT_ASSERT(sfifo.get_latest(val, 0, skipped));
+    CPPUNIT_ASSERT(val == 5 && skipped == 5);
+    CPPUNIT_ASSERT(sfifo.size() == 0);
+}
+
+// Stands in for a DataSink, which would need a Keymaster and a source.
+struct fifo_sink : public DataSinkBase
+{
+    fifo_sink() : fifo(10) {}
+
+    size_t items() {return fifo.size();}
+    void set_notifier(std::shared_ptr<fifo_notifier> n) {fifo.set_notifier(n);}
+    std::string current_source_urn() {return "";}
+    std::string current_source_key() {return "";}
+    void disconnect() {}
+    void connect(std::string, std::string, std::string) {}
+    bool connected() {return true;}
+
+    tsemfifo<int> fifo;
+};
+
+/**
+ * Tests that EventPoller reports only the ready sources, keeps
+ * reporting a LEVEL sink until it is drained, reports an EDGE sink
+ * once per arrival, and waits on plain file descriptors.
+ *
+ */
+
+void TSemfifoTest::test_event_poller()
+{
+    fifo_sink a, b, c;
+    EventPoller p;
+    vector<int> ready;
+    int pipefd[2];
+    int i;
+
+    CPPUNIT_ASSERT(pipe(pipefd) == 0);
+    int a_tok = p.add(&a);
+    int b_tok = p.add(&b, EventPoller::EDGE);
+    int c_tok = p.add(&c);
+    int f_tok = p.add_fd(pipefd[0]);
+
+    // nothing ready: times out, and not much later than asked.
+    Time_t start = getUTC();
+    CPPUNIT_ASSERT(p.wait(ready, 20000) == 0);
+    Time_t elapsed = getUTC() - start;
+    CPPUNIT_ASSERT(elapsed >= 19000000 && elapsed < 200000000);
+
+    i = 1;
+    a.fifo.put(i);
+    a.fifo.put(i);
+    b.fifo.put(i);
+    CPPUNIT_ASSERT(p.wait(ready, 100000) == 2);
+    CPPUNIT_ASSERT(find(ready.begin(), ready.end(), a_tok) != ready.end());
+    CPPUNIT_ASSERT(find(ready.begin(), ready.end(), b_tok) != ready.end());
+    CPPUNIT_ASSERT(find(ready.begin(), ready.end(), c_tok) == ready.end());
+
+    // 'a' still has data (LEVEL); 'b' has no new data (EDGE).
+    a.fifo.get(i);
+    CPPUNIT_ASSERT(p.wait(ready, 0) == 1);
+    CPPUNIT_ASSERT(ready[0] == a_tok);
+    a.fifo.get(i);
+    CPPUNIT_ASSERT(p.wait(ready, 0) == 0);
+
+    b.fifo.put(i);
+    CPPUNIT_ASSERT(p.wait(ready, 0) == 1);
+    CPPUNIT_ASSERT(ready[0] == b_tok);
+
+    // woken from another thread.
+    thread t([&c]() {usleep(10000); int v = 3; c.fifo.put(v);});
+    CPPUNIT_ASSERT(p.wait(ready, 1000000) == 1);
+    CPPUNIT_ASSERT(ready[0] == c_tok);
+    t.join();
+
+    char ch = 'x';
+    CPPUNIT_ASSERT(write(pipefd[1], &ch, 1) == 1);
+    c.fifo.flush();
+    CPPUNIT_ASSERT(p.wait(ready, 0) == 1);
+    CPPUNIT_ASSERT(ready[0] == f_tok);
+
+    CPPUNIT_ASSERT(p.remove(f_tok));
+    CPPUNIT_ASSERT(!p.remove(f_tok));
+    CPPUNIT_ASSERT(p.wait(ready, 0) == 0);
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+/**
+ * Tests each wait strategy with each FIFO: values handed over by
+ * another thread all arrive, in order, through every kind of get,
+ * and a timed get on an empty FIFO still times out.
+ *
+ */
+
+template <typename Q>
+static void wait_strategies(wait_strategy w)
+{
+    const int N = 20000;
+    Q fifo(16);
+    int val = -1;
+
+    fifo.set_wait_strategy(w);
+
+    Time_t start = getUTC();
+    CPPUNIT_ASSERT(!fifo.timed_get(val, 2000000));
+    CPPUNIT_ASSERT(getUTC() - start >= 2000000);
+
+    std::thread producer([&fifo]()
+                         {
+                             for (int i = 0; i < N; ++i)
+                             {
+                                 fifo.put(i);
+
+                                 if (i % 1000 == 0)
+                                 {
+                                     usleep(100);
+                                 }
+                             }
+                         });
+
+    int expected = 0, out[8];
+    bool in_order = true;
+
+    while (expected < N)
+    {
+        switch (expected % 3)
+        {
+        case 0:
+            fifo.get(val);
+            in_order = in_order && (val == expected++);
+            break;
+        case 1:
+            if (fifo.timed_get(val, 100000000))
+            {
+                in_order = in_order && (val == expected++);
+            }
+            break;
+        default:
+            size_t n = fifo.get_n(out, 8);
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                in_order = in_order && (out[i] == expected++);
+            }
+        }
+    }
+
+    producer.join();
+    CPPUNIT_ASSERT(in_order);
+}
+
+void TSemfifoTest::test_wait_strategy()
+{
+    wait_strategy ws[] = {wait_strategy::block(),
+                          wait_strategy::spin_then_block(500),
+                          wait_strategy::busy_poll()};
+
+    for (auto w : ws)
+    {
+        wait_strategies<tsemfifo<int> >(w);
+        wait_strategies<spscfifo<int> >(w);
+    }
+
+    // a latestfifo may overwrite values, so only check that it wakes
+    // for each strategy, and times out.
+    for (auto w : ws)
+    {
+        latestfifo<int> fifo(1);
+        int val = -1;
+
+        fifo.set_wait_strategy(w);
+        CPPUNIT_ASSERT(!fifo.timed_get(val, 1000000));
+        std::thread producer([&fifo]() {usleep(1000); fifo.put_no_block(42);});
+        CPPUNIT_ASSERT(fifo.timed_get(val, 1000000000));
+        CPPUNIT_ASSERT(val == 42);
+        producer.join();
+    }
+}
@@ -36,12 +36,24 @@ class TSemfifoTest : public CppUnit::TestCase
     CPPUNIT_TEST(test_size);
     CPPUNIT_TEST(test_get);
     CPPUNIT_TEST(test_flush);
+    CPPUNIT_TEST(test_batch);
+    CPPUNIT_TEST(test_spscfifo);
+    CPPUNIT_TEST(test_in_place);
+    CPPUNIT_TEST(test_latest);
+    CPPUNIT_TEST(test_event_poller);
+    CPPUNIT_TEST(test_wait_strategy);
     CPPUNIT_TEST_SUITE_END();
     
     public:
     void test_size();
     void test_get();
     void test_flush();
+    void test_batch();
+    void test_spscfifo();
+    void test_in_place();
+    void test_latest();
+    void test_event_poller();
+    void test_wait_strategy();
 
 };
 
@@ -37,6 +37,7 @@
 #include "TransportTest.h"
 #include "matrix/TCondition.h"
 #include "matrix/DataInterface.h"
+#include "matrix/MergedSink.h"
 
 using namespace std;
 using namespace mxutils;
@@ -206,3 +207,492 @@ void TransportTest::test_rtinproc_publish()
 {
     do_the_transaction("rtinproc");
 }
+
+void TransportTest::test_shm_publish()
+{
+    do_the_transaction("shm");
+}
+
+void TransportTest::test_udpm_publish()
+{
+    // on the loopback interface, so the test needs no multicast route.
+    do_the_transaction("udpm://127.0.0.1;239.192.7.7:XXXXX");
+}
+
+void TransportTest::test_rawtcp_publish()
+{
+    do_the_transaction("rawtcp");
+}
+
+void TransportTest::test_rawtcp_reconnect()
+{
+    vector<string> tr = {"rawtcp"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.SendTimeout", 50, true);
+
+    shared_ptr<DataSource<string> > ssource(new DataSource<string>(km_urn, "moby_dick", "lines"));
+    // a blocking sink with room for 1 sample stalls its reader thread
+    // as soon as a second sample arrives.
+    shared_ptr<DataSink<string, select_only> > ssink((new DataSink<string, select_only>(km_urn, 1, true)));
+
+    ssink->connect("moby_dick", "lines");
+    do_nanosleep(0, 1000000);
+
+    // with the reader stalled, the socket's buffers fill up, and a
+    // send times out: the server drops the client.
+    string big(8 << 20, 'x');
+    bool dropped = false;
+
+    for (int i = 0; i < 20 && !dropped; ++i)
+    {
+        dropped = !ssource->publish(big);
+    }
+
+    CPPUNIT_ASSERT(dropped);
+
+    // unstalled, the client finds the connection gone, and reconnects.
+    string s_recv;
+
+    while (ssink->timed_get(s_recv, 100000000))
+    {
+    }
+
+    string s_sent = "Call me Ishmael.";
+    bool received = false;
+
+    for (int i = 0; i < 100 && !received; ++i)
+    {
+        ssource->publish(s_sent);
+        received = ssink->timed_get(s_recv, 10000000) && s_recv == s_sent;
+    }
+
+    CPPUNIT_ASSERT(received);
+    // at least the frame that timed out never arrived.
+    CPPUNIT_ASSERT(ssink->lost_items() > 0);
+    ssink->disconnect();
+}
+
+void TransportTest::test_loan_commit()
+{
+    vector<string> transports = {"rtinproc", "inproc", "shm"};
+
+    for (auto transport: transports)
+    {
+        double d_recv = 0.0;
+        vector<string> tr = {transport};
+        _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+        shared_ptr<DataSource<double> > dsource(new DataSource<double>(km_urn, "moby_dick", "lines"));
+        shared_ptr<DataSink<double, select_only> > dsink((new DataSink<double, select_only>(km_urn)));
+
+        dsink->connect("moby_dick", "lines");
+        do_nanosleep(0, 1000000);
+
+        double *d = dsource->loan();
+        CPPUNIT_ASSERT(d != NULL);
+        *d = 2.71828;
+        CPPUNIT_ASSERT(dsource->commit());
+
+        int i = 0;
+
+        while (!dsink->try_get(d_recv))
+        {
+            do_nanosleep(0, 100000);
+
+            if (i++ == 100)
+            {
+                break;
+            }
+        }
+
+        CPPUNIT_ASSERT(i < 100);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(2.71828, d_recv, 0.000001);
+        dsink->disconnect();
+    }
+}
+
+void TransportTest::test_coalesce()
+{
+    vector<string> tr = {"inproc"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.Coalesce",
+             YAML::Load("{MaxSamples: 4, MaxLatency: 0.001}"), true);
+
+    shared_ptr<DataSource<double> > dsource(new DataSource<double>(km_urn, "moby_dick", "lines"));
+    shared_ptr<DataSink<double, select_only> > dsink((new DataSink<double, select_only>(km_urn, 20)));
+
+    dsink->connect("moby_dick", "lines");
+    do_nanosleep(0, 1000000);
+
+    // two full batches of 4 go out at once; the last 2 samples go out
+    // when the flusher finds them older than 'MaxLatency'.
+    for (int i = 0; i < 10; ++i)
+    {
+        double d = i * 1.5;
+        CPPUNIT_ASSERT(dsource->publish(d));
+    }
+
+    for (int i = 0; i < 10; ++i)
+    {
+        double d_recv = -1.0;
+        CPPUNIT_ASSERT(dsink->timed_get(d_recv, 100000000));
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(i * 1.5, d_recv, 0.000001);
+    }
+
+    dsink->disconnect();
+}
+
+void TransportTest::test_backpressure()
+{
+    vector<string> tr = {"shm"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.Slots", 4, true);
+    _km->put("components.moby_dick.Transports.A.Backpressure",
+             YAML::Load("{Policy: drop_newest}"), true);
+
+    shared_ptr<DataSource<double> > dsource(new DataSource<double>(km_urn, "moby_dick", "lines"));
+    // a blocking sink with room for 1 sample stalls its reader thread
+    // as soon as a second sample arrives.
+    shared_ptr<DataSink<double, select_only> > dsink((new DataSink<double, select_only>(km_urn, 1, true)));
+
+    dsink->connect("moby_dick", "lines");
+    do_nanosleep(0, 1000000);
+
+    double d = 1.0;
+    CPPUNIT_ASSERT(dsource->publish(d));
+    CPPUNIT_ASSERT(dsource->publish(d));
+    do_nanosleep(0, 10000000);
+
+    // the stalled reader has 1 unread sample; 3 more fill the ring.
+    size_t refused = 0;
+
+    for (int i = 0; i < 10; ++i)
+    {
+        if (!dsource->publish(d))
+        {
+            ++refused;
+        }
+    }
+
+    CPPUNIT_ASSERT_EQUAL((size_t)7, refused);
+
+    vector<TransportServer::subscriber_stats> stats = dsource->subscribers();
+    CPPUNIT_ASSERT_EQUAL((size_t)1, stats.size());
+    CPPUNIT_ASSERT_EQUAL((size_t)4, stats[0].depth);
+    CPPUNIT_ASSERT_EQUAL(refused, stats[0].dropped);
+
+    // nothing kept in the ring was lost.
+    size_t received = 0;
+    double d_recv;
+
+    while (dsink->timed_get(d_recv, 100000000))
+    {
+        ++received;
+    }
+
+    CPPUNIT_ASSERT_EQUAL((size_t)5, received);
+    dsink->disconnect();
+}
+
+void TransportTest::test_shm_loan_wrap()
+{
+    vector<string> tr = {"shm"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.Slots", 4, true);
+    _km->put("components.moby_dick.Sources.words", "A", true);
+
+    shared_ptr<DataSource<double> > lines(new DataSource<double>(km_urn, "moby_dick", "lines"));
+    shared_ptr<DataSource<double> > words(new DataSource<double>(km_urn, "moby_dick", "words"));
+    shared_ptr<DataSink<double, select_only> > lines_sink((new DataSink<double, select_only>(km_urn, 20)));
+    shared_ptr<DataSink<double, select_only> > words_sink((new DataSink<double, select_only>(km_urn, 20)));
+
+    lines_sink->connect("moby_dick", "lines");
+    words_sink->connect("moby_dick", "words");
+    do_nanosleep(0, 1000000);
+
+    double *d = lines->loan();
+    CPPUNIT_ASSERT(d != NULL);
+    *d = 2.71828;
+
+    // the ring wraps twice while the loan is out. Readers must not
+    // stall on the loan, and the loaned sample must not be overwritten.
+    for (int i = 0; i < 10; ++i)
+    {
+        double w = i * 1.5;
+        CPPUNIT_ASSERT(words->publish(w));
+        do_nanosleep(0, 1000000);
+    }
+
+    for (int i = 0; i < 10; ++i)
+    {
+        double d_recv = -1.0;
+        CPPUNIT_ASSERT(words_sink->timed_get(d_recv, 100000000));
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(i * 1.5, d_recv, 0.000001);
+    }
+
+    CPPUNIT_ASSERT(lines->commit());
+
+    double d_recv = 0.0;
+    CPPUNIT_ASSERT(lines_sink->timed_get(d_recv, 100000000));
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.71828, d_recv, 0.000001);
+
+    // loaning again before a commit gives back the same buffer, and
+    // a commit is published however long the loan was out.
+    d = lines->loan();
+    CPPUNIT_ASSERT(d != NULL);
+    *d = 3.14159;
+    CPPUNIT_ASSERT(lines->loan() == d);
+    do_nanosleep(0, 20000000);
+    CPPUNIT_ASSERT(lines->commit());
+    CPPUNIT_ASSERT(lines_sink->timed_get(d_recv, 100000000));
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(3.14159, d_recv, 0.000001);
+
+    lines_sink->disconnect();
+    words_sink->disconnect();
+}
+
+void TransportTest::test_handler()
+{
+    vector<string> tr = {"inproc"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+    shared_ptr<DataSource<double> > dsource(new DataSource<double>(km_urn, "moby_dick", "lines"));
+    shared_ptr<DataSink<double, select_only> > dsink((new DataSink<double, select_only>(km_urn)));
+    TCondition<int> received(0);
+    int count = 0;
+    double sum = 0.0;
+
+    // runs on the transport's thread; nothing goes into the ring buffer.
+    dsink->set_handler([&](const double &v)
+                       {
+                           sum += v;
+                           received.signal(++count);
+                       });
+    dsink->connect("moby_dick", "lines");
+    CPPUNIT_ASSERT_THROW(dsink->set_handler(nullptr), MatrixException);
+    do_nanosleep(0, 1000000);
+
+    for (int i = 1; i <= 4; ++i)
+    {
+        double d = i;
+        CPPUNIT_ASSERT(dsource->publish(d));
+    }
+
+    CPPUNIT_ASSERT(received.wait(4, 100000));
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(10.0, sum, 0.000001);
+    CPPUNIT_ASSERT_EQUAL((size_t)0, dsink->items());
+    dsink->disconnect();
+}
+
+void TransportTest::test_data_view()
+{
+    // zmq hands its message over; rtinproc's values are copied.
+    for (auto transport : {"tcp", "rtinproc"})
+    {
+        vector<string> tr = {transport};
+        _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+        shared_ptr<DataSource<GenericBuffer> > source(
+            new DataSource<GenericBuffer>(km_urn, "moby_dick", "lines"));
+        shared_ptr<DataSink<data_view<float>, select_only> > sink(
+            new DataSink<data_view<float>, select_only>(km_urn));
+
+        sink->connect("moby_dick", "lines");
+        do_nanosleep(0, 1000000);
+
+        // spectra of different lengths
+        for (size_t len = 1; len <= 3; ++len)
+        {
+            GenericBuffer buf;
+            buf.resize(len * 256 * sizeof(float));
+
+            for (size_t i = 0; i < len * 256; ++i)
+            {
+                ((float *)buf.data())[i] = len + i;
+            }
+
+            source->publish(buf);
+        }
+
+        // views stay valid while later values arrive, and after the
+        // sink is gone.
+        vector<data_view<float> > views(3);
+
+        for (size_t len = 1; len <= 3; ++len)
+        {
+            CPPUNIT_ASSERT(sink->timed_get(views[len - 1], 100000000));
+        }
+
+        sink->disconnect();
+        sink.reset();
+
+        for (size_t len = 1; len <= 3; ++len)
+        {
+            data_view<float> &v = views[len - 1];
+            CPPUNIT_ASSERT_EQUAL(len * 256, v.size());
+            CPPUNIT_ASSERT_DOUBLES_EQUAL((double)len, v[0], 0.000001);
+            CPPUNIT_ASSERT_DOUBLES_EQUAL((double)(len + v.size() - 1), *(v.end() - 1), 0.000001);
+        }
+    }
+}
+
+void TransportTest::test_headers()
+{
+    for (auto transport : {"inproc", "rtinproc"})
+    {
+        vector<string> tr = {transport};
+        _km->put("components.moby_dick.Transports.A.Specified", tr);
+        _km->put("components.moby_dick.Transports.A.Header", true, true);
+
+        shared_ptr<DataSource<double> > dsource(new DataSource<double>(km_urn, "moby_dick", "lines"));
+        shared_ptr<DataSink<double, select_only> > dsink((new DataSink<double, select_only>(km_urn, 20)));
+
+        dsink->connect("moby_dick", "lines");
+        CPPUNIT_ASSERT(dsink->headers());
+        do_nanosleep(0, 1000000);
+
+        double vals[8] = {0.0, 1.5, 3.0, 4.5, 6.0, 7.5, 9.0, 10.5};
+
+        for (int i = 0; i < 5; ++i)
+        {
+            CPPUNIT_ASSERT(dsource->publish(vals[i]));
+        }
+
+        CPPUNIT_ASSERT(dsource->publish_n(vals + 5, 3));
+
+        // the payload arrives unchanged, headers stripped.
+        for (int i = 0; i < 8; ++i)
+        {
+            double d_recv = -1.0;
+            CPPUNIT_ASSERT(dsink->timed_get(d_recv, 100000000));
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(vals[i], d_recv, 0.000001);
+        }
+
+        header_stats st = dsink->sample_stats();
+        CPPUNIT_ASSERT_EQUAL((size_t)8, st.received);
+        CPPUNIT_ASSERT_EQUAL((size_t)0, st.gaps);
+        CPPUNIT_ASSERT_EQUAL((uint64_t)7, st.last.seq);
+        CPPUNIT_ASSERT(st.last.published > 0);
+        CPPUNIT_ASSERT(st.max_latency >= st.mean_latency());
+        dsink->disconnect();
+    }
+}
+
+void TransportTest::test_stats()
+{
+    vector<string> tr = {"inproc"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    Time::Time_t interval = stats_reporter::interval();
+    stats_reporter::set_interval(50000000);  // 50 mS
+
+    {
+        shared_ptr<DataSource<double> > dsource(new DataSource<double>(km_urn, "moby_dick", "lines"));
+        shared_ptr<DataSink<double, select_only> > dsink((new DataSink<double, select_only>(km_urn, 20)));
+        yaml_result src, snk;
+
+        // off unless asked for.
+        do_nanosleep(0, 100000000);
+        CPPUNIT_ASSERT(!_km->get("components.moby_dick.stats.Sources.lines", src));
+
+        dsource->set_stats_key("components.moby_dick.stats.Sources.lines");
+        dsink->set_stats_key("components.moby_dick.stats.Sinks.lines_in");
+        dsink->connect("moby_dick", "lines");
+        do_nanosleep(0, 1000000);
+
+        for (int i = 0; i < 10; ++i)
+        {
+            double d = i;
+            CPPUNIT_ASSERT(dsource->publish(d));
+        }
+
+        for (int i = 0; i < 10; ++i)
+        {
+            double d_recv;
+            CPPUNIT_ASSERT(dsink->timed_get(d_recv, 100000000));
+        }
+
+        // the reporter may still be sleeping out the old interval.
+        bool reported = false;
+
+        for (int i = 0; i < 40 && !reported; ++i)
+        {
+            do_nanosleep(0, 50000000);
+            reported = _km->get("components.moby_dick.stats.Sources.lines", src)
+                && _km->get("components.moby_dick.stats.Sinks.lines_in", snk)
+                && src.node["published"].as<uint64_t>() == 10
+                && snk.node["received"].as<uint64_t>() == 10;
+        }
+
+        CPPUNIT_ASSERT(reported);
+        CPPUNIT_ASSERT_EQUAL((uint64_t)0, src.node["refused"].as<uint64_t>());
+        CPPUNIT_ASSERT(src.node["publish_time"]["p99_us"]);
+        CPPUNIT_ASSERT_EQUAL((size_t)0, snk.node["depth"].as<size_t>());
+        CPPUNIT_ASSERT_EQUAL((size_t)0, snk.node["lost"].as<size_t>());
+        CPPUNIT_ASSERT(snk.node["queue_wait"]["count"]);
+        dsink->disconnect();
+    }
+
+    stats_reporter::set_interval(interval);
+}
+
+void TransportTest::test_merged_sink()
+{
+    vector<string> tr = {"inproc"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.Header", true, true);
+    _km->put("components.moby_dick.Sources.chapters", "A", true);
+
+    shared_ptr<DataSource<double> > lines(new DataSource<double>(km_urn, "moby_dick", "lines"));
+    shared_ptr<DataSource<double> > chapters(new DataSource<double>(km_urn, "moby_dick", "chapters"));
+    MergedSink<double, select_only> merged(km_urn, 4, 200000000);  // 200 mS window
+
+    merged.connect("moby_dick", "lines");
+    merged.connect("moby_dick", "chapters");
+    CPPUNIT_ASSERT_EQUAL((size_t)2, merged.inputs());
+    CPPUNIT_ASSERT(merged.input(1).headers());
+    do_nanosleep(0, 1000000);
+
+    // even values from 'lines', odd from 'chapters': one stream, in
+    // order of publication, each tagged with its input.
+    for (int i = 0; i < 4; ++i)
+    {
+        double d = i;
+        CPPUNIT_ASSERT((i % 2 ? chapters : lines)->publish(d));
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        double d_recv = -1.0;
+        size_t input = 2;
+        CPPUNIT_ASSERT(merged.timed_get(d_recv, 1000000000, &input));
+        CPPUNIT_ASSERT_DOUBLES_EQUAL((double)i, d_recv, 0.000001);
+        CPPUNIT_ASSERT_EQUAL((size_t)(i % 2), input);
+    }
+
+    // nothing more; and a value is held for the window: it has
+    // arrived, but is not ready yet.
+    double d_recv;
+    CPPUNIT_ASSERT(!merged.try_get(d_recv));
+    double d = 42.0;
+    CPPUNIT_ASSERT(lines->publish(d));
+    do_nanosleep(0, 10000000);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, merged.items());
+    CPPUNIT_ASSERT(!merged.try_get(d_recv));
+    CPPUNIT_ASSERT(merged.timed_get(d_recv, 1000000000));
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(42.0, d_recv, 0.000001);
+
+    // a full queue drops the oldest.
+    for (int i = 0; i < 10; ++i)
+    {
+        double d = i;
+        CPPUNIT_ASSERT(lines->publish(d));
+    }
+
+    do_nanosleep(0, 10000000);
+    CPPUNIT_ASSERT_EQUAL((size_t)4, merged.items());
+    CPPUNIT_ASSERT_EQUAL((size_t)6, merged.lost_items());
+    CPPUNIT_ASSERT(merged.try_get(d_recv));
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(6.0, d_recv, 0.000001);
+    CPPUNIT_ASSERT_EQUAL((size_t)0, merged.late_items());
+    merged.disconnect();
+}
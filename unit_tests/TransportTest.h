@@ -44,6 +44,19 @@ class TransportTest : public CppUnit::TestCase
     CPPUNIT_TEST(test_ipc_publish);
     CPPUNIT_TEST(test_tcp_publish);
     CPPUNIT_TEST(test_rtinproc_publish);
+    CPPUNIT_TEST(test_shm_publish);
+    CPPUNIT_TEST(test_udpm_publish);
+    CPPUNIT_TEST(test_rawtcp_publish);
+    CPPUNIT_TEST(test_rawtcp_reconnect);
+    CPPUNIT_TEST(test_loan_commit);
+    CPPUNIT_TEST(test_coalesce);
+    CPPUNIT_TEST(test_backpressure);
+    CPPUNIT_TEST(test_shm_loan_wrap);
+    CPPUNIT_TEST(test_handler);
+    CPPUNIT_TEST(test_data_view);
+    CPPUNIT_TEST(test_headers);
+    CPPUNIT_TEST(test_stats);
+    CPPUNIT_TEST(test_merged_sink);
     CPPUNIT_TEST_SUITE_END();
 
     std::shared_ptr<matrix::KeymasterServer> _kms;
@@ -61,6 +74,19 @@ public:
     void test_ipc_publish();
     void test_tcp_publish();
     void test_rtinproc_publish();
+    void test_shm_publish();
+    void test_udpm_publish();
+    void test_rawtcp_publish();
+    void test_rawtcp_reconnect();
+    void test_loan_commit();
+    void test_coalesce();
+    void test_backpressure();
+    void test_shm_loan_wrap();
+    void test_handler();
+    void test_data_view();
+    void test_headers();
+    void test_stats();
+    void test_merged_sink();
 };
 
 #endif
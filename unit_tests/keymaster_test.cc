@@ -25,8 +25,10 @@
  *
  *******************************************************************/
 
+#include <atomic>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <yaml-cpp/yaml.h>
 #include <boost/shared_ptr.hpp>
@@ -108,6 +110,16 @@ void KeymasterTest::test_keymaster()
     CPPUNIT_ASSERT(r.result);
     CPPUNIT_ASSERT(r.key == "components.nettask.source");
     CPPUNIT_ASSERT(r.err.empty());
+
+    // several values in one request: all are put, or none is.
+    YAML::Node batch;
+    batch["components.nettask.source.ID"] = 1234;
+    batch["components.nettask.source.Name"] = "nettask";
+    CPPUNIT_ASSERT(!km.put_many(batch));
+    CPPUNIT_ASSERT_THROW(km.get("components.nettask.source.ID"), KeymasterException);
+    CPPUNIT_ASSERT(km.put_many(batch, true));
+    CPPUNIT_ASSERT(km.get_as<int>("components.nettask.source.ID") == 1234);
+    CPPUNIT_ASSERT(km.get_as<string>("components.nettask.source.Name") == "nettask");
 }
 
 template <typename T>
@@ -196,3 +208,214 @@ void KeymasterTest::test_keymaster_publisher()
     cout << "Testing publisher" << endl;
     CPPUNIT_ASSERT(foo.get_data(5) == 5);
 }
+
+// Takes the whole subtree, as a callback written before the server
+// published deltas would.
+struct SubtreeCallback : public KeymasterCallbackBase
+{
+    SubtreeCallback()
+    : id(0),
+      name("")
+    {}
+
+    TCondition<int> id;
+    TCondition<string> name;
+
+private:
+    void _call(string key, YAML::Node val)
+    {
+        if (val["source"] && val["source"]["name"])
+        {
+            name.signal(val["source"]["name"].as<string>());
+        }
+
+        if (val["source"] && val["source"]["ID"])
+        {
+            id.signal(val["source"]["ID"].as<int>());
+        }
+    }
+};
+
+// Takes the deltas themselves.
+struct DeltaCallback : public KeymasterCallbackBase
+{
+    DeltaCallback()
+    : id(0),
+      deletes(0)
+    {}
+
+    TCondition<int> id;
+    TCondition<int> deletes;
+    string changed;
+
+private:
+    void _call(string key, YAML::Node val)
+    {
+    }
+
+    bool _call_delta(string key, string chg, YAML::Node val, bool deleted)
+    {
+        changed = chg;
+
+        if (deleted)
+        {
+            deletes.signal(deletes.value() + 1);
+        }
+        else
+        {
+            id.signal(val.as<int>());
+        }
+
+        return true;
+    }
+};
+
+void KeymasterTest::test_keymaster_deltas()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        km_server.reset(new KeymasterServer("test.yaml"));
+        km_server->run();
+        );
+
+    Keymaster km(keymaster_url);
+    SubtreeCallback subtree_cb;
+    DeltaCallback delta_cb;
+
+    km.subscribe("components.nettask", &subtree_cb);
+    km.subscribe("components", &delta_cb);
+    Time::thread_delay(1000000); // 1mS; allow things to sync
+
+    // Only 'components.nettask.source.ID' is published; the subscriber
+    // to 'components.nettask' still gets its whole, updated subtree.
+    km.put("components.nettask.source.ID", 1234, true);
+    CPPUNIT_ASSERT(subtree_cb.id.wait(1234, 100000));
+    CPPUNIT_ASSERT(delta_cb.id.wait(1234, 100000));
+    CPPUNIT_ASSERT(delta_cb.changed == "components.nettask.source.ID");
+
+    // again, now that the client's copy of the subtree is patched.
+    km.put("components.nettask.source.ID", 5678);
+    CPPUNIT_ASSERT(subtree_cb.id.wait(5678, 100000));
+    CPPUNIT_ASSERT(delta_cb.id.wait(5678, 100000));
+
+    km.del("components.nettask.source.ID");
+    CPPUNIT_ASSERT(delta_cb.deletes.wait(1, 100000));
+    CPPUNIT_ASSERT(delta_cb.changed == "components.nettask.source.ID");
+
+    // A put above the subscribed key is not published to it, so the
+    // next change below it does not follow from its copy: the subtree
+    // is fetched again, and given whole.
+    YAML::Node components = km.get("components");
+    components["nettask"]["source"]["name"] = "replaced";
+    km.put("components", components);
+    km.put("components.nettask.source.ID", 42);
+    CPPUNIT_ASSERT(subtree_cb.id.wait(42, 100000));
+    CPPUNIT_ASSERT(subtree_cb.name.wait(string("replaced"), 100000));
+}
+
+void KeymasterTest::test_keymaster_concurrent_requests()
+{
+    // GETs of 'test.big' are held in the server until 'release'.
+    std::atomic<int> held(0);
+    TCondition<bool> release(false);
+    boost::shared_ptr<KeymasterServer> km_server;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        km_server.reset(new KeymasterServer("test.yaml"));
+        km_server->set_get_hook([&held, &release](string key)
+        {
+            if (key == "test.big")
+            {
+                ++held;
+                release.wait(true, 4000000);
+            }
+        });
+        km_server->run();
+        );
+
+    // Several clients GET the whole tree while another PUTs; the GETs
+    // are served concurrently, and the PUTs one at a time, in order.
+    std::atomic<int> failures(0);
+    vector<std::thread> readers;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        readers.emplace_back([&failures]()
+        {
+            Keymaster km(keymaster_url);
+
+            for (int j = 0; j < 50; ++j)
+            {
+                try
+                {
+                    km.get("Root");
+                }
+                catch (KeymasterException &e)
+                {
+                    ++failures;
+                }
+            }
+        });
+    }
+
+    Keymaster km(keymaster_url);
+
+    for (int i = 0; i < 50; ++i)
+    {
+        CPPUNIT_ASSERT(km.put("test.counter", i, true));
+    }
+
+    for (auto &t : readers)
+    {
+        t.join();
+    }
+
+    CPPUNIT_ASSERT(failures == 0);
+    CPPUNIT_ASSERT(km.get_as<int>("test.counter") == 49);
+
+    // A GET and a PUT made while two readers are held busy are served
+    // by a free reader and the writer, while the held GETs are still
+    // outstanding.
+    CPPUNIT_ASSERT(km.put("test.big", "Call me Ishmael.", true));
+
+    std::atomic<int> big_done(0);
+    vector<std::thread> hogs;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        hogs.emplace_back([&big_done]()
+        {
+            try
+            {
+                Keymaster km(keymaster_url);
+
+                if (km.get_as<string>("test.big") == "Call me Ishmael.")
+                {
+                    ++big_done;
+                }
+            }
+            catch (KeymasterException &e)
+            {
+            }
+        });
+    }
+
+    for (int i = 0; i < 4000 && held < 2; ++i)
+    {
+        do_nanosleep(0, 1000000);
+    }
+
+    CPPUNIT_ASSERT(held == 2);
+    CPPUNIT_ASSERT(km.get_as<int>("test.counter") == 49);
+    CPPUNIT_ASSERT(km.put("test.counter", 50));
+    CPPUNIT_ASSERT(big_done == 0);
+    release.signal(true);
+
+    for (auto &t : hogs)
+    {
+        t.join();
+    }
+
+    CPPUNIT_ASSERT(big_done == 2);
+}
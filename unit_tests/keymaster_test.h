@@ -35,12 +35,16 @@ class KeymasterTest : public CppUnit::TestCase
     CPPUNIT_TEST_SUITE(KeymasterTest);
     CPPUNIT_TEST(test_keymaster);
     CPPUNIT_TEST(test_keymaster_publisher);
+    CPPUNIT_TEST(test_keymaster_deltas);
+    CPPUNIT_TEST(test_keymaster_concurrent_requests);
 
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void test_keymaster();
     void test_keymaster_publisher();
+    void test_keymaster_deltas();
+    void test_keymaster_concurrent_requests();
 };
 
 #endif
@@ -27,12 +27,15 @@
 
 #include "utility_test.h"
 #include "matrix/yaml_util.h"
+#include "matrix/yaml_msgpack.h"
+#include "matrix/km_tree.h"
 
 #include <iostream>
 
 
 using namespace std;
 using namespace mxutils;
+using matrix::km_tree;
 
 YAML::Node create_sample_yaml_node()
 {
@@ -162,3 +165,140 @@ void UtilityTest::test_delete_yaml_node()
     // this node should be gone now
     CPPUNIT_ASSERT(!node["components"]["foocomponent"]["sources"]);
 }
+
+void UtilityTest::test_yaml_msgpack()
+{
+    YAML::Node node = create_sample_yaml_node();
+    node["components"]["foocomponent"]["empty"] = YAML::Node(YAML::NodeType::Sequence);
+    node["components"]["foocomponent"]["nothing"] = YAML::Node();
+
+    // a node survives the trip unchanged.
+    YAML::Node n = node_from_msgpack(to_msgpack(node));
+    YAML::Node foo = n["components"]["foocomponent"];
+    CPPUNIT_ASSERT(foo["ID"].as<int>() == 0x1234);
+    CPPUNIT_ASSERT(foo["sources"]["B"].as<vector<string> >()
+                   == node["components"]["foocomponent"]["sources"]["B"].as<vector<string> >());
+    CPPUNIT_ASSERT(foo["empty"].IsSequence() && foo["empty"].size() == 0);
+    CPPUNIT_ASSERT(foo["nothing"].IsNull());
+
+    // and so does a yaml_result.
+    yaml_result r = get_yaml_node(node, "components.foocomponent.ID");
+    yaml_result d(false);
+    CPPUNIT_ASSERT(result_from_msgpack(to_msgpack(r), d));
+    CPPUNIT_ASSERT(d.result);
+    CPPUNIT_ASSERT(d.key == "components.foocomponent.ID");
+    CPPUNIT_ASSERT(d.err.empty());
+    CPPUNIT_ASSERT(d.node.as<int>() == 0x1234);
+
+    // a text reply, as from a server that only speaks YAML, is not one.
+    CPPUNIT_ASSERT(!result_from_msgpack("Unknown request 'GET/msgpack", d));
+}
+
+void UtilityTest::test_km_tree()
+{
+    km_tree tree(create_sample_yaml_node());
+    km_tree::result r;
+
+    // gets, puts and deletes give what the yaml_util functions give.
+    r = tree.get("components.foocomponent.ID");
+    CPPUNIT_ASSERT(r.result);
+    CPPUNIT_ASSERT(r.key == "components.foocomponent.ID");
+    CPPUNIT_ASSERT(km_tree::to_yaml(r.node).as<int>() == 0x1234);
+
+    r = tree.get("components.faocomponent.ID");
+    CPPUNIT_ASSERT(!r.result);
+    CPPUNIT_ASSERT(r.key == "components");
+    CPPUNIT_ASSERT(!r.err.empty());
+
+    r = tree.put("components.bar.baz", YAML::Node(1));
+    CPPUNIT_ASSERT(!r.result);
+    CPPUNIT_ASSERT(r.key == "components");
+
+    r = tree.put("components.bar.baz", YAML::Node(1), true);
+    CPPUNIT_ASSERT(r.result);
+    CPPUNIT_ASSERT(r.key == "components.bar.baz");
+
+    // a scalar can't have keys.
+    r = tree.put("components.bar.baz.quux", YAML::Node(2), true);
+    CPPUNIT_ASSERT(!r.result);
+    CPPUNIT_ASSERT(r.key == "components.bar.baz");
+
+    // what was taken from the tree is a snapshot: it doesn't change,
+    // and shares what didn't change with the tree.
+    km_tree::node_ptr before = tree.get("components").node;
+    km_tree::node_ptr bar = tree.get("components.bar").node;
+    tree.put("components.foocomponent.ID", YAML::Node(5678));
+    CPPUNIT_ASSERT(tree.get("components.foocomponent.ID").node->scalar == "5678");
+    CPPUNIT_ASSERT(km_tree::to_yaml(before)["foocomponent"]["ID"].as<int>() == 0x1234);
+    CPPUNIT_ASSERT(tree.get("components.bar").node == bar);
+
+    r = tree.del("components.foocomponent.sources");
+    CPPUNIT_ASSERT(r.result);
+    CPPUNIT_ASSERT(r.key == "components.foocomponent");
+    CPPUNIT_ASSERT(!tree.get("components.foocomponent.sources").result);
+    CPPUNIT_ASSERT(!tree.del("components.foocomponent.sources").result);
+
+    // a batch is put whole, or not at all.
+    vector<pair<string, km_tree::node_ptr> > batch;
+    batch.push_back(make_pair("components.bar.baz", km_tree::from_yaml(YAML::Node(3))));
+    batch.push_back(make_pair("components.bar.new", km_tree::from_yaml(YAML::Node(4))));
+    r = tree.put_many(batch);
+    CPPUNIT_ASSERT(!r.result);
+    CPPUNIT_ASSERT(r.key == "components.bar");
+    CPPUNIT_ASSERT(tree.get("components.bar.baz").node->scalar == "1");
+    r = tree.put_many(batch, true);
+    CPPUNIT_ASSERT(r.result);
+    CPPUNIT_ASSERT(r.key == "components.bar.new");
+    CPPUNIT_ASSERT(tree.get("components.bar.baz").node->scalar == "3");
+    CPPUNIT_ASSERT(tree.get("components.bar.new").node->scalar == "4");
+    tree.put("components.bar.baz", YAML::Node(1));
+    tree.del("components.bar.new");
+
+    // keys are freed with the last node that uses them.
+    size_t keys = km_tree::key_count();
+    YAML::Node only_here;
+
+    for (int i = 0; i < 10; ++i)
+    {
+        only_here["only_here_" + to_string(i)] = i;
+    }
+
+    CPPUNIT_ASSERT(tree.put("components.only_here", only_here, true).result);
+    CPPUNIT_ASSERT(km_tree::key_count() == keys + 11);
+    CPPUNIT_ASSERT(tree.del("components.only_here").result);
+    CPPUNIT_ASSERT(km_tree::key_count() == keys);
+
+    // each change is numbered, and the nodes on its path take its
+    // number; a result has the numbers they had before.
+    uint64_t v = tree.get("").node->version;
+    uint64_t bar_v = tree.get("components.bar").node->version;
+    r = tree.put("components.bar.baz", YAML::Node(2));
+    CPPUNIT_ASSERT(r.version == v + 1);
+    CPPUNIT_ASSERT(r.versions.size() == 4);
+    CPPUNIT_ASSERT(r.versions[0] == v);
+    CPPUNIT_ASSERT(r.versions[2] == bar_v);
+    CPPUNIT_ASSERT(tree.get("").node->version == v + 1);
+    CPPUNIT_ASSERT(tree.get("components.bar").node->version == v + 1);
+    CPPUNIT_ASSERT(tree.get("components.bar.baz").node->version == v + 1);
+    CPPUNIT_ASSERT(tree.get("components.foocomponent").node->version < v + 1);
+
+    vector<km_tree::result> each;
+    batch.clear();
+    batch.push_back(make_pair("components.bar.baz", km_tree::from_yaml(YAML::Node(1))));
+    batch.push_back(make_pair("components.bar.new", km_tree::from_yaml(YAML::Node(4))));
+    CPPUNIT_ASSERT(tree.put_many(batch, true, &each).result);
+    CPPUNIT_ASSERT(each.size() == 2);
+    CPPUNIT_ASSERT(each[1].version == v + 3);
+    CPPUNIT_ASSERT(each[1].versions[2] == v + 2);
+    CPPUNIT_ASSERT(each[1].versions[3] == 0);
+
+    r = tree.del("components.bar.new");
+    CPPUNIT_ASSERT(r.version == v + 4);
+    CPPUNIT_ASSERT(r.versions[3] == v + 3);
+    CPPUNIT_ASSERT(tree.get("components.bar").node->version == v + 4);
+
+    // the whole tree converts back to YAML.
+    YAML::Node n = km_tree::to_yaml(tree.get("").node);
+    CPPUNIT_ASSERT(n["components"]["bar"]["baz"].as<int>() == 1);
+    CPPUNIT_ASSERT(!n["components"]["foocomponent"]["sources"]);
+}
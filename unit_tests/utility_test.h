@@ -36,6 +36,8 @@ class UtilityTest : public CppUnit::TestCase
     CPPUNIT_TEST(test_get_yaml_node);
     CPPUNIT_TEST(test_put_yaml_node);
     CPPUNIT_TEST(test_delete_yaml_node);
+    CPPUNIT_TEST(test_yaml_msgpack);
+    CPPUNIT_TEST(test_km_tree);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -43,6 +45,8 @@ public:
     void test_get_yaml_node();
     void test_put_yaml_node();
     void test_delete_yaml_node();
+    void test_yaml_msgpack();
+    void test_km_tree();
 };
 
 #endif